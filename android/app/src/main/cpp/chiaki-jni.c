@@ -193,6 +193,10 @@ static void android_chiaki_event_cb(ChiakiEvent *event, void *user)
 			free(reason_str);
 			break;
 		}
+		case CHIAKI_EVENT_STARTUP_REPORT: // already written to the log by the lib
+		case CHIAKI_EVENT_VIDEO_PROFILES: // MediaCodec reconfigures from the header sample
+		case CHIAKI_EVENT_VIDEO_PROFILE_SWITCH:
+			break;
 	}
 
 	(*global_vm)->DetachCurrentThread(global_vm);
@@ -254,6 +258,23 @@ JNIEXPORT void JNICALL JNI_FCN(sessionCreate)(JNIEnv *env, jobject obj, jobject
 	connect_info.video_profile.max_fps = (unsigned int)E->GetIntField(env, connect_video_profile_obj, E->GetFieldID(env, connect_video_profile_class, "maxFPS", "I"));
 	connect_info.video_profile.bitrate = (unsigned int)E->GetIntField(env, connect_video_profile_obj, E->GetFieldID(env, connect_video_profile_class, "bitrate", "I"));
 
+	connect_info.reactor = NULL;
+	connect_info.fec_pool = NULL;
+	connect_info.receive_pipeline_workers = 0;
+	memset(&connect_info.socket_tuning, 0, sizeof(connect_info.socket_tuning));
+	connect_info.allocator = NULL;
+	memset(&connect_info.network_cache, 0, sizeof(connect_info.network_cache));
+	jobject network_cache_obj = E->GetObjectField(env, connect_info_obj, E->GetFieldID(env, connect_info_class, "networkCache", "L"BASE_PACKAGE"/NetworkCache;"));
+	if(network_cache_obj)
+	{
+		jclass network_cache_class = E->GetObjectClass(env, network_cache_obj);
+		connect_info.network_cache.valid = true;
+		connect_info.network_cache.mtu_in = (uint32_t)E->GetIntField(env, network_cache_obj, E->GetFieldID(env, network_cache_class, "mtuIn", "I"));
+		connect_info.network_cache.mtu_out = (uint32_t)E->GetIntField(env, network_cache_obj, E->GetFieldID(env, network_cache_class, "mtuOut", "I"));
+		connect_info.network_cache.rtt_us = (uint64_t)E->GetLongField(env, network_cache_obj, E->GetFieldID(env, network_cache_class, "rttUs", "J"));
+		connect_info.network_cache.network_id = (uint64_t)E->GetLongField(env, network_cache_obj, E->GetFieldID(env, network_cache_class, "networkId", "J"));
+	}
+
 	session = CHIAKI_NEW(AndroidChiakiSession);
 	if(!session)
 	{
@@ -368,6 +389,17 @@ JNIEXPORT jint JNICALL JNI_FCN(sessionJoin)(JNIEnv *env, jobject obj, jlong ptr)
 	return chiaki_session_join(&session->session);
 }
 
+JNIEXPORT jobject JNICALL JNI_FCN(sessionGetNetworkCache)(JNIEnv *env, jobject obj, jlong ptr)
+{
+	AndroidChiakiSession *session = (AndroidChiakiSession *)ptr;
+	ChiakiNetworkCache *cache = &session->session.network_cache;
+	if(!cache->valid)
+		return NULL;
+	jclass cache_class = E->FindClass(env, BASE_PACKAGE"/NetworkCache");
+	jmethodID cache_ctor = E->GetMethodID(env, cache_class, "<init>", "(IIJJ)V");
+	return E->NewObject(env, cache_class, cache_ctor, (jint)cache->mtu_in, (jint)cache->mtu_out, (jlong)cache->rtt_us, (jlong)cache->network_id);
+}
+
 JNIEXPORT void JNICALL JNI_FCN(sessionSetSurface)(JNIEnv *env, jobject obj, jlong ptr, jobject surface)
 {
 	AndroidChiakiSession *session = (AndroidChiakiSession *)ptr;
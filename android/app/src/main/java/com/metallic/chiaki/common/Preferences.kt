@@ -23,6 +23,7 @@ import androidx.annotation.StringRes
 import androidx.preference.PreferenceManager
 import com.metallic.chiaki.R
 import com.metallic.chiaki.lib.ConnectVideoProfile
+import com.metallic.chiaki.lib.NetworkCache
 import com.metallic.chiaki.lib.VideoFPSPreset
 import com.metallic.chiaki.lib.VideoResolutionPreset
 import io.reactivex.Observable
@@ -120,4 +121,25 @@ class Preferences(context: Context)
 		else
 			ConnectVideoProfile(it.width, it.height, it.maxFPS, bitrate)
 	}
+
+	private fun networkCacheKey(host: String) = "network_cache_$host"
+
+	fun networkCache(host: String) = sharedPreferences.getString(networkCacheKey(host), null)?.let {
+		val values = it.split(",")
+		if(values.size != 4)
+			return@let null
+		try
+		{
+			NetworkCache(values[0].toInt(), values[1].toInt(), values[2].toLong(), values[3].toLong())
+		}
+		catch(e: NumberFormatException)
+		{
+			null
+		}
+	}
+
+	fun setNetworkCache(host: String, cache: NetworkCache)
+	{
+		sharedPreferences.edit().putString(networkCacheKey(host), "${cache.mtuIn},${cache.mtuOut},${cache.rttUs},${cache.networkId}").apply()
+	}
 }
\ No newline at end of file
@@ -37,12 +37,24 @@ data class ConnectVideoProfile(
 	}
 }
 
+/**
+ * Network test results of a previous session, see ChiakiNetworkCache
+ */
+@Parcelize
+data class NetworkCache(
+	val mtuIn: Int,
+	val mtuOut: Int,
+	val rttUs: Long,
+	val networkId: Long
+): Parcelable
+
 @Parcelize
 data class ConnectInfo(
 	val host: String,
 	val registKey: ByteArray,
 	val morning: ByteArray,
-	val videoProfile: ConnectVideoProfile
+	val videoProfile: ConnectVideoProfile,
+	val networkCache: NetworkCache? = null
 ): Parcelable
 
 private class ChiakiNative
@@ -63,6 +75,7 @@ private class ChiakiNative
 		@JvmStatic external fun sessionStart(ptr: Long): Int
 		@JvmStatic external fun sessionStop(ptr: Long): Int
 		@JvmStatic external fun sessionJoin(ptr: Long): Int
+		@JvmStatic external fun sessionGetNetworkCache(ptr: Long): NetworkCache?
 		@JvmStatic external fun sessionSetSurface(ptr: Long, surface: Surface)
 		@JvmStatic external fun sessionSetControllerState(ptr: Long, controllerState: ControllerState)
 		@JvmStatic external fun sessionSetLoginPin(ptr: Long, pin: String)
@@ -189,6 +202,12 @@ class Session(connectInfo: ConnectInfo, logFile: String?, logVerbose: Boolean)
 	private var nativePtr: Long
 	var eventCallback: ((event: Event) -> Unit)? = null
 
+	/**
+	 * Network test results to be passed to the next session with the same host, available after dispose()
+	 */
+	var networkCache: NetworkCache? = null
+		private set
+
 	init
 	{
 		val result = ChiakiNative.CreateResult(0, 0)
@@ -207,6 +226,7 @@ class Session(connectInfo: ConnectInfo, logFile: String?, logVerbose: Boolean)
 		if(nativePtr == 0L)
 			return
 		ChiakiNative.sessionJoin(nativePtr)
+		networkCache = ChiakiNative.sessionGetNetworkCache(nativePtr)
 		ChiakiNative.sessionFree(nativePtr)
 		nativePtr = 0L
 	}
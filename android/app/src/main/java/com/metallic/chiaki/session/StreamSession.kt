@@ -43,6 +43,12 @@ class StreamSession(val connectInfo: ConnectInfo, val logManager: LogManager, va
 
 	var surfaceTexture: SurfaceTexture? = null
 
+	/**
+	 * Latest network test results, passed on to every new session after pause/resume
+	 */
+	var networkCache: NetworkCache? = connectInfo.networkCache
+		private set
+
 	init
 	{
 		input.controllerStateChangedCallback = {
@@ -54,6 +60,7 @@ class StreamSession(val connectInfo: ConnectInfo, val logManager: LogManager, va
 	{
 		session?.stop()
 		session?.dispose()
+		session?.networkCache?.let { networkCache = it }
 		session = null
 		_state.value = StreamStateIdle
 		//surfaceTexture?.release()
@@ -70,7 +77,7 @@ class StreamSession(val connectInfo: ConnectInfo, val logManager: LogManager, va
 			return
 		try
 		{
-			val session = Session(connectInfo, logManager.createNewFile().file.absolutePath, logVerbose)
+			val session = Session(connectInfo.copy(networkCache = networkCache), logManager.createNewFile().file.absolutePath, logVerbose)
 			_state.value = StreamStateConnecting
 			session.eventCallback = this::eventCallback
 			session.start()
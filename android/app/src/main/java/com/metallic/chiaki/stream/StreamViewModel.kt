@@ -42,6 +42,7 @@ class StreamViewModel(val preferences: Preferences, val logManager: LogManager,
 	{
 		super.onCleared()
 		_session?.shutdown()
+		session.networkCache?.let { preferences.setNetworkCache(connectInfo.host, it) }
 	}
 
 	fun setOnScreenControlsEnabled(enabled: Boolean)
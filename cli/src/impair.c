@@ -0,0 +1,315 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki-cli.h>
+
+#include <chiaki/netimpair.h>
+#include <chiaki/time.h>
+
+#include <argp.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char doc[] =
+	"Forward UDP ports to an upstream host and impair the traffic for testing.\n"
+	"Each port is proxied separately from the listen address to the same port on the upstream host. "
+	"Loss, duplication and reordering are reproducible for a given seed and packet order. "
+	"Stats are printed to stdout as one line per port and direction.";
+
+#define ARG_KEY_LISTEN 'L'
+#define ARG_KEY_UPSTREAM 'u'
+#define ARG_KEY_PORT 'p'
+#define ARG_KEY_DIRECTION 'x'
+#define ARG_KEY_LOSS 'l'
+#define ARG_KEY_BURST 'b'
+#define ARG_KEY_DELAY 'd'
+#define ARG_KEY_JITTER 'j'
+#define ARG_KEY_REORDER 'r'
+#define ARG_KEY_DUPLICATE 'D'
+#define ARG_KEY_RATE 'R'
+#define ARG_KEY_QUEUE 'q'
+#define ARG_KEY_SEED 's'
+#define ARG_KEY_STATS_INTERVAL 'i'
+
+#define PORTS_MAX 8
+
+static struct argp_option options[] = {
+	{ "listen", ARG_KEY_LISTEN, "Addr", 0, "Address to listen on (default 127.0.0.1)", 0 },
+	{ "upstream", ARG_KEY_UPSTREAM, "Host", 0, "Host to forward to", 0 },
+	{ "port", ARG_KEY_PORT, "Port", 0, "UDP port to forward, can be given multiple times (default 9296 and 9297)", 0 },
+	{ "direction", ARG_KEY_DIRECTION, "Dir", 0, "Impair up (client to upstream), down or both (default)", 0 },
+	{ "loss", ARG_KEY_LOSS, "P", 0, "Packet loss probability", 0 },
+	{ "burst", ARG_KEY_BURST, "Enter,Leave[,Loss]", 0, "Gilbert-Elliott burst loss: probabilities to enter and leave the bad state and loss in it (default 1)", 0 },
+	{ "delay", ARG_KEY_DELAY, "ms", 0, "Constant delay", 0 },
+	{ "jitter", ARG_KEY_JITTER, "ms", 0, "Uniform extra delay, keeps the packet order", 0 },
+	{ "reorder", ARG_KEY_REORDER, "P[,ms]", 0, "Probability to hold back a packet by ms (default 10)", 0 },
+	{ "duplicate", ARG_KEY_DUPLICATE, "P", 0, "Packet duplication probability", 0 },
+	{ "rate", ARG_KEY_RATE, "kbit/s", 0, "Bandwidth cap", 0 },
+	{ "queue", ARG_KEY_QUEUE, "Bytes", 0, "Queue size of the bandwidth cap, tail drop beyond (default 262144)", 0 },
+	{ "seed", ARG_KEY_SEED, "Seed", 0, "Random seed (default 0)", 0 },
+	{ "stats-interval", ARG_KEY_STATS_INTERVAL, "Seconds", 0, "Interval of stats output, 0 to disable (default 1)", 0 },
+	{ 0 }
+};
+
+typedef struct arguments
+{
+	const char *listen;
+	const char *upstream;
+	uint16_t ports[PORTS_MAX];
+	size_t ports_count;
+	bool impair_up;
+	bool impair_down;
+	ChiakiNetImpairParams params;
+	uint64_t seed;
+	unsigned long stats_interval;
+} Arguments;
+
+static double parse_probability(struct argp_state *state, const char *arg, char **end)
+{
+	double p = strtod(arg, end);
+	if(*end == arg || p < 0.0 || p > 1.0)
+		argp_error(state, "Invalid probability \"%s\"", arg);
+	return p;
+}
+
+static unsigned long parse_ulong(struct argp_state *state, const char *arg)
+{
+	char *end;
+	unsigned long v = strtoul(arg, &end, 10);
+	if(end == arg || *end)
+		argp_error(state, "Invalid number \"%s\"", arg);
+	return v;
+}
+
+static int parse_opt(int key, char *arg, struct argp_state *state)
+{
+	Arguments *arguments = state->input;
+	ChiakiNetImpairParams *params = &arguments->params;
+	char *end;
+
+	switch(key)
+	{
+		case ARG_KEY_LISTEN:
+			arguments->listen = arg;
+			break;
+		case ARG_KEY_UPSTREAM:
+			arguments->upstream = arg;
+			break;
+		case ARG_KEY_PORT:
+		{
+			unsigned long port = parse_ulong(state, arg);
+			if(!port || port > UINT16_MAX)
+				argp_error(state, "Invalid port \"%s\"", arg);
+			if(arguments->ports_count == PORTS_MAX)
+				argp_error(state, "Too many ports");
+			arguments->ports[arguments->ports_count++] = (uint16_t)port;
+			break;
+		}
+		case ARG_KEY_DIRECTION:
+			if(strcmp(arg, "up") == 0)
+				arguments->impair_down = false;
+			else if(strcmp(arg, "down") == 0)
+				arguments->impair_up = false;
+			else if(strcmp(arg, "both") != 0)
+				argp_error(state, "Invalid direction \"%s\"", arg);
+			break;
+		case ARG_KEY_LOSS:
+			params->loss = parse_probability(state, arg, &end);
+			break;
+		case ARG_KEY_BURST:
+			params->burst_enter = parse_probability(state, arg, &end);
+			if(*end != ',')
+				argp_error(state, "Invalid burst \"%s\"", arg);
+			params->burst_leave = parse_probability(state, end + 1, &end);
+			params->burst_loss = 1.0;
+			if(*end == ',')
+				params->burst_loss = parse_probability(state, end + 1, &end);
+			break;
+		case ARG_KEY_DELAY:
+			params->delay_ms = (uint32_t)parse_ulong(state, arg);
+			break;
+		case ARG_KEY_JITTER:
+			params->jitter_ms = (uint32_t)parse_ulong(state, arg);
+			break;
+		case ARG_KEY_REORDER:
+			params->reorder = parse_probability(state, arg, &end);
+			params->reorder_ms = 10;
+			if(*end == ',')
+				params->reorder_ms = (uint32_t)parse_ulong(state, end + 1);
+			break;
+		case ARG_KEY_DUPLICATE:
+			params->duplicate = parse_probability(state, arg, &end);
+			break;
+		case ARG_KEY_RATE:
+			params->rate_kbps = (uint32_t)parse_ulong(state, arg);
+			break;
+		case ARG_KEY_QUEUE:
+			params->queue_bytes_max = parse_ulong(state, arg);
+			break;
+		case ARG_KEY_SEED:
+			arguments->seed = strtoull(arg, NULL, 0);
+			break;
+		case ARG_KEY_STATS_INTERVAL:
+			arguments->stats_interval = parse_ulong(state, arg);
+			break;
+		case ARGP_KEY_ARG:
+			argp_usage(state);
+			break;
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+static struct argp argp = { options, parse_opt, 0, doc, 0, 0, 0 };
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void impair_signal_handler(int sig)
+{
+	stop_requested = 1;
+}
+
+static bool resolve(ChiakiLog *log, const char *host, uint16_t port, struct sockaddr_storage *addr, socklen_t *addr_len)
+{
+	struct addrinfo hints = { 0 };
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+	char port_str[6];
+	snprintf(port_str, sizeof(port_str), "%u", (unsigned int)port);
+
+	struct addrinfo *addrinfos;
+	if(getaddrinfo(host, port_str, &hints, &addrinfos) != 0 || !addrinfos)
+	{
+		CHIAKI_LOGE(log, "Failed to resolve \"%s\"", host);
+		return false;
+	}
+	memcpy(addr, addrinfos->ai_addr, addrinfos->ai_addrlen);
+	*addr_len = addrinfos->ai_addrlen;
+	freeaddrinfo(addrinfos);
+	return true;
+}
+
+static void impair_print_stats(uint16_t port, const char *dir, ChiakiNetImpairStats *stats, ChiakiNetImpairStats *prev, uint64_t interval_us)
+{
+	double secs = (double)interval_us / 1000000.0;
+	printf("port=%u dir=%s in=%llu lost=%llu lost_burst=%llu dropped_queue=%llu reordered=%llu duplicated=%llu out=%llu "
+			"in_kbps=%.1f out_kbps=%.1f\n",
+			(unsigned int)port, dir,
+			(unsigned long long)stats->packets_in,
+			(unsigned long long)stats->packets_lost,
+			(unsigned long long)stats->packets_lost_burst,
+			(unsigned long long)stats->packets_dropped_queue,
+			(unsigned long long)stats->packets_reordered,
+			(unsigned long long)stats->packets_duplicated,
+			(unsigned long long)stats->packets_out,
+			(double)(stats->bytes_in - prev->bytes_in) * 8.0 / secs / 1000.0,
+			(double)(stats->bytes_out - prev->bytes_out) * 8.0 / secs / 1000.0);
+	*prev = *stats;
+}
+
+CHIAKI_EXPORT int chiaki_cli_cmd_impair(ChiakiLog *log, int argc, char *argv[])
+{
+	Arguments arguments = { 0 };
+	arguments.listen = "127.0.0.1";
+	arguments.impair_up = true;
+	arguments.impair_down = true;
+	arguments.stats_interval = 1;
+	chiaki_net_impair_params_default(&arguments.params);
+	error_t argp_r = argp_parse(&argp, argc, argv, ARGP_IN_ORDER, NULL, &arguments);
+	if(argp_r != 0)
+		return 1;
+
+	if(!arguments.upstream)
+	{
+		fprintf(stderr, "No upstream specified, see --help.\n");
+		return 1;
+	}
+	if(!arguments.ports_count)
+	{
+		arguments.ports[arguments.ports_count++] = 9296;
+		arguments.ports[arguments.ports_count++] = 9297;
+	}
+
+	ChiakiNetImpairParams params_none;
+	chiaki_net_impair_params_default(&params_none);
+	const ChiakiNetImpairParams *params_up = arguments.impair_up ? &arguments.params : &params_none;
+	const ChiakiNetImpairParams *params_down = arguments.impair_down ? &arguments.params : &params_none;
+
+	ChiakiNetImpairProxy proxies[PORTS_MAX];
+	ChiakiNetImpairStats stats_prev[PORTS_MAX][2];
+	memset(stats_prev, 0, sizeof(stats_prev));
+	size_t proxies_count = 0;
+	int ret = 1;
+	for(; proxies_count<arguments.ports_count; proxies_count++)
+	{
+		uint16_t port = arguments.ports[proxies_count];
+		struct sockaddr_storage listen_addr, upstream_addr;
+		socklen_t listen_addr_len, upstream_addr_len;
+		if(!resolve(log, arguments.listen, port, &listen_addr, &listen_addr_len)
+			|| !resolve(log, arguments.upstream, port, &upstream_addr, &upstream_addr_len))
+			goto cleanup;
+
+		// every port gets its own stream of decisions
+		ChiakiErrorCode err = chiaki_net_impair_proxy_init(&proxies[proxies_count],
+				(struct sockaddr *)&listen_addr, listen_addr_len,
+				(struct sockaddr *)&upstream_addr, upstream_addr_len,
+				params_up, params_down, arguments.seed + proxies_count, log);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(log, "Failed to start proxy for port %u", (unsigned int)port);
+			goto cleanup;
+		}
+		CHIAKI_LOGI(log, "Forwarding %s:%u to %s:%u", arguments.listen, (unsigned int)port, arguments.upstream, (unsigned int)port);
+	}
+
+	signal(SIGINT, impair_signal_handler);
+	signal(SIGTERM, impair_signal_handler);
+
+	uint64_t stats_interval_us = arguments.stats_interval * 1000000;
+	uint64_t stats_last_us = chiaki_time_now_monotonic_us();
+	while(!stop_requested)
+	{
+		usleep(100000);
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		if(!stats_interval_us || now_us - stats_last_us < stats_interval_us)
+			continue;
+		for(size_t i=0; i<proxies_count; i++)
+		{
+			ChiakiNetImpairStats stats;
+			chiaki_net_impair_proxy_get_stats(&proxies[i], CHIAKI_NET_IMPAIR_DIR_UP, &stats);
+			impair_print_stats(arguments.ports[i], "up", &stats, &stats_prev[i][CHIAKI_NET_IMPAIR_DIR_UP], now_us - stats_last_us);
+			chiaki_net_impair_proxy_get_stats(&proxies[i], CHIAKI_NET_IMPAIR_DIR_DOWN, &stats);
+			impair_print_stats(arguments.ports[i], "down", &stats, &stats_prev[i][CHIAKI_NET_IMPAIR_DIR_DOWN], now_us - stats_last_us);
+		}
+		fflush(stdout);
+		stats_last_us = now_us;
+	}
+	ret = 0;
+
+cleanup:
+	for(size_t i=0; i<proxies_count; i++)
+		chiaki_net_impair_proxy_fini(&proxies[i]);
+	return ret;
+}
@@ -0,0 +1,759 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki-cli.h>
+
+#include <chiaki/session.h>
+#include <chiaki/base64.h>
+#include <chiaki/thread.h>
+#include <chiaki/time.h>
+#include <chiaki/ffmpegdecoder.h>
+
+#include <argp.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char doc[] =
+	"Run a headless stream session and capture it without re-encoding.\n"
+	"Video is written as raw H.264 (Annex B), audio as Ogg Opus. Use - for stdout.\n"
+	"Exits with 0 only if the stream was stopped locally, otherwise with 1.";
+
+#define ARG_KEY_HOST 'h'
+#define ARG_KEY_REGISTKEY 'r'
+#define ARG_KEY_MORNING 'm'
+#define ARG_KEY_PIN 'p'
+#define ARG_KEY_VIDEO_OUT 'o'
+#define ARG_KEY_AUDIO_OUT 'a'
+#define ARG_KEY_RESOLUTION 'R'
+#define ARG_KEY_FPS 'f'
+#define ARG_KEY_STATS_INTERVAL 's'
+#define ARG_KEY_DECODE 'd'
+#define ARG_KEY_FEC_THREADS 'F'
+#define ARG_KEY_RECEIVE_THREADS 'P'
+#define ARG_KEY_RX_TIMESTAMPS 'T'
+#define ARG_KEY_RCVBUF 'B'
+#define ARG_KEY_BUSY_POLL 'U'
+#define ARG_KEY_REACTOR_THREADS 'E'
+
+static struct argp_option options[] = {
+	{ "host", ARG_KEY_HOST, "Host", 0, "Host to connect to", 0 },
+	{ "registkey", ARG_KEY_REGISTKEY, "RegistKey", 0, "PS4 registration key", 0 },
+	{ "morning", ARG_KEY_MORNING, "Morning", 0, "PS4 RP key, base64 encoded", 0 },
+	{ "pin", ARG_KEY_PIN, "PIN", 0, "Login PIN, if the PS4 asks for one", 0 },
+	{ "video-out", ARG_KEY_VIDEO_OUT, "File", 0, "Write the H.264 elementary stream to this file", 0 },
+	{ "audio-out", ARG_KEY_AUDIO_OUT, "File", 0, "Write the Opus stream to this file as Ogg", 0 },
+	{ "resolution", ARG_KEY_RESOLUTION, "Height", 0, "Resolution: 360, 540, 720 (default) or 1080", 0 },
+	{ "fps", ARG_KEY_FPS, "FPS", 0, "Frame rate: 30 or 60 (default)", 0 },
+	{ "stats-interval", ARG_KEY_STATS_INTERVAL, "Seconds", 0, "Interval of stats output, 0 to disable (default 1)", 0 },
+	{ "fec-threads", ARG_KEY_FEC_THREADS, "Count", 0, "Additional threads for recovering large frames with FEC (default 0)", 0 },
+	{ "receive-threads", ARG_KEY_RECEIVE_THREADS, "Count", 0, "Threads for verifying and decrypting received packets, 0 to do it on the receiving thread (default 0)", 0 },
+	{ "rx-timestamps", ARG_KEY_RX_TIMESTAMPS, NULL, 0, "Let the kernel timestamp received packets, so the jitter stats reflect the network", 0 },
+	{ "rcvbuf", ARG_KEY_RCVBUF, "Bytes", 0, "Socket receive buffer size, or auto to size it from the bitrate (default: 102400)", 0 },
+	{ "busy-poll", ARG_KEY_BUSY_POLL, "Microseconds", 0, "Busy poll the socket for incoming packets (SO_BUSY_POLL, default 0)", 0 },
+	{ "reactor-threads", ARG_KEY_REACTOR_THREADS, "Count", 0, "Receive the stream on a shared event loop with this many threads instead of a thread of its own, Linux only, replaces --receive-threads (default 0)", 0 },
+#if CHIAKI_LIB_ENABLE_FFMPEG
+	{ "decode", ARG_KEY_DECODE, "Threading", OPTION_ARG_OPTIONAL, "Also decode the video and report decode stats, threading: none, slice (default) or frame", 0 },
+#endif
+	{ 0 }
+};
+
+typedef struct arguments
+{
+	const char *host;
+	const char *registkey;
+	const char *morning;
+	const char *pin;
+	const char *video_out;
+	const char *audio_out;
+	ChiakiVideoResolutionPreset resolution;
+	ChiakiVideoFPSPreset fps;
+	unsigned long stats_interval;
+	unsigned long fec_threads;
+	unsigned long receive_threads;
+	unsigned long reactor_threads;
+	ChiakiTakionSocketTuning socket_tuning;
+#if CHIAKI_LIB_ENABLE_FFMPEG
+	bool decode;
+	ChiakiFfmpegDecoderThreading decode_threading;
+#endif
+} Arguments;
+
+static int parse_opt(int key, char *arg, struct argp_state *state)
+{
+	Arguments *arguments = state->input;
+
+	switch(key)
+	{
+		case ARG_KEY_HOST:
+			arguments->host = arg;
+			break;
+		case ARG_KEY_REGISTKEY:
+			arguments->registkey = arg;
+			break;
+		case ARG_KEY_MORNING:
+			arguments->morning = arg;
+			break;
+		case ARG_KEY_PIN:
+			arguments->pin = arg;
+			break;
+		case ARG_KEY_VIDEO_OUT:
+			arguments->video_out = arg;
+			break;
+		case ARG_KEY_AUDIO_OUT:
+			arguments->audio_out = arg;
+			break;
+		case ARG_KEY_RESOLUTION:
+			if(strcmp(arg, "360") == 0)
+				arguments->resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_360p;
+			else if(strcmp(arg, "540") == 0)
+				arguments->resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_540p;
+			else if(strcmp(arg, "720") == 0)
+				arguments->resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_720p;
+			else if(strcmp(arg, "1080") == 0)
+				arguments->resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_1080p;
+			else
+				argp_error(state, "Invalid resolution \"%s\"", arg);
+			break;
+		case ARG_KEY_FPS:
+			if(strcmp(arg, "30") == 0)
+				arguments->fps = CHIAKI_VIDEO_FPS_PRESET_30;
+			else if(strcmp(arg, "60") == 0)
+				arguments->fps = CHIAKI_VIDEO_FPS_PRESET_60;
+			else
+				argp_error(state, "Invalid fps \"%s\"", arg);
+			break;
+		case ARG_KEY_STATS_INTERVAL:
+			arguments->stats_interval = strtoul(arg, NULL, 10);
+			break;
+		case ARG_KEY_FEC_THREADS:
+			arguments->fec_threads = strtoul(arg, NULL, 10);
+			break;
+		case ARG_KEY_RECEIVE_THREADS:
+			arguments->receive_threads = strtoul(arg, NULL, 10);
+			if(arguments->receive_threads > CHIAKI_TAKION_PIPELINE_CRYPTO_WORKERS_MAX)
+				argp_error(state, "At most %d receive threads are supported", CHIAKI_TAKION_PIPELINE_CRYPTO_WORKERS_MAX);
+			break;
+		case ARG_KEY_REACTOR_THREADS:
+			arguments->reactor_threads = strtoul(arg, NULL, 10);
+			break;
+		case ARG_KEY_RX_TIMESTAMPS:
+			arguments->socket_tuning.rx_timestamps = true;
+			break;
+		case ARG_KEY_RCVBUF:
+			if(strcmp(arg, "auto") == 0)
+				arguments->socket_tuning.rcvbuf_size = CHIAKI_TAKION_RCVBUF_SIZE_AUTO;
+			else
+				arguments->socket_tuning.rcvbuf_size = strtoul(arg, NULL, 10);
+			break;
+		case ARG_KEY_BUSY_POLL:
+			arguments->socket_tuning.busy_poll_us = (unsigned int)strtoul(arg, NULL, 10);
+			break;
+#if CHIAKI_LIB_ENABLE_FFMPEG
+		case ARG_KEY_DECODE:
+			arguments->decode = true;
+			if(!arg || strcmp(arg, "slice") == 0)
+				arguments->decode_threading = CHIAKI_FFMPEG_DECODER_THREADING_SLICE;
+			else if(strcmp(arg, "none") == 0)
+				arguments->decode_threading = CHIAKI_FFMPEG_DECODER_THREADING_NONE;
+			else if(strcmp(arg, "frame") == 0)
+				arguments->decode_threading = CHIAKI_FFMPEG_DECODER_THREADING_FRAME;
+			else
+				argp_error(state, "Invalid decode threading \"%s\"", arg);
+			break;
+#endif
+		case ARGP_KEY_ARG:
+			argp_usage(state);
+			break;
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+
+	return 0;
+}
+
+static struct argp argp = { options, parse_opt, 0, doc, 0, 0, 0 };
+
+#define OGG_PAGE_PACKET_SIZE_MAX (255 * 255 - 1)
+
+/**
+ * Minimal Ogg Opus writer, one packet per page.
+ * Each packet is held back until the next one arrives, so the last one can be flagged as end of stream.
+ */
+typedef struct ogg_opus_writer_t
+{
+	FILE *file;
+	uint32_t serial;
+	uint32_t page_seq;
+	uint64_t granule;
+	uint32_t granule_per_frame; // in 48kHz samples
+	bool header_written;
+	bool pending;
+	size_t pending_size;
+	uint8_t pending_buf[OGG_PAGE_PACKET_SIZE_MAX];
+} OggOpusWriter;
+
+static uint32_t ogg_crc_table[0x100];
+
+static void ogg_crc_init()
+{
+	for(uint32_t i=0; i<0x100; i++)
+	{
+		uint32_t r = i << 24;
+		for(int j=0; j<8; j++)
+			r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : (r << 1);
+		ogg_crc_table[i] = r;
+	}
+}
+
+static uint32_t ogg_crc_update(uint32_t crc, const uint8_t *buf, size_t buf_size)
+{
+	for(size_t i=0; i<buf_size; i++)
+		crc = (crc << 8) ^ ogg_crc_table[((crc >> 24) ^ buf[i]) & 0xff];
+	return crc;
+}
+
+static void write_le16(uint8_t *buf, uint16_t v) { buf[0] = v & 0xff; buf[1] = v >> 8; }
+static void write_le32(uint8_t *buf, uint32_t v) { write_le16(buf, v & 0xffff); write_le16(buf + 2, v >> 16); }
+static void write_le64(uint8_t *buf, uint64_t v) { write_le32(buf, v & 0xffffffff); write_le32(buf + 4, v >> 32); }
+
+/**
+ * @param packet NULL for a page without any packet
+ */
+static bool ogg_opus_writer_page(OggOpusWriter *writer, uint8_t header_type, const uint8_t *packet, size_t packet_size)
+{
+	size_t segments = packet ? packet_size / 255 + 1 : 0;
+	if(segments > 255)
+		return false;
+
+	uint8_t header[27 + 255];
+	memcpy(header, "OggS", 4);
+	header[4] = 0; // version
+	header[5] = header_type;
+	write_le64(header + 6, writer->granule);
+	write_le32(header + 14, writer->serial);
+	write_le32(header + 18, writer->page_seq++);
+	write_le32(header + 22, 0); // crc
+	header[26] = (uint8_t)segments;
+	if(segments)
+	{
+		memset(header + 27, 255, segments - 1);
+		header[27 + segments - 1] = (uint8_t)(packet_size % 255);
+	}
+	else
+		packet_size = 0;
+
+	size_t header_size = 27 + segments;
+	uint32_t crc = ogg_crc_update(0, header, header_size);
+	if(packet_size)
+		crc = ogg_crc_update(crc, packet, packet_size);
+	write_le32(header + 22, crc);
+
+	return fwrite(header, 1, header_size, writer->file) == header_size
+		&& (!packet_size || fwrite(packet, 1, packet_size, writer->file) == packet_size);
+}
+
+static bool ogg_opus_writer_header(OggOpusWriter *writer, ChiakiAudioHeader *audio_header)
+{
+	if(writer->header_written)
+		return true;
+	writer->header_written = true;
+	writer->granule_per_frame = audio_header->rate ? audio_header->frame_size * 48000 / audio_header->rate : audio_header->frame_size;
+
+	uint8_t head[19];
+	memcpy(head, "OpusHead", 8);
+	head[8] = 1; // version
+	head[9] = audio_header->channels;
+	write_le16(head + 10, 0); // pre-skip
+	write_le32(head + 12, audio_header->rate);
+	write_le16(head + 16, 0); // output gain
+	head[18] = 0; // channel mapping family, mono or stereo
+	if(!ogg_opus_writer_page(writer, 0x02, head, sizeof(head)))
+		return false;
+
+	static const char vendor[] = "chiaki";
+	uint8_t tags[8 + 4 + sizeof(vendor) - 1 + 4];
+	memcpy(tags, "OpusTags", 8);
+	write_le32(tags + 8, sizeof(vendor) - 1);
+	memcpy(tags + 12, vendor, sizeof(vendor) - 1);
+	write_le32(tags + 12 + sizeof(vendor) - 1, 0); // user comments
+	return ogg_opus_writer_page(writer, 0, tags, sizeof(tags));
+}
+
+static bool ogg_opus_writer_flush(OggOpusWriter *writer, uint8_t header_type)
+{
+	if(!writer->pending)
+		return true;
+	writer->pending = false;
+	writer->granule += writer->granule_per_frame;
+	return ogg_opus_writer_page(writer, header_type, writer->pending_buf, writer->pending_size);
+}
+
+static bool ogg_opus_writer_packet(OggOpusWriter *writer, uint8_t *buf, size_t buf_size)
+{
+	if(!writer->header_written || buf_size > sizeof(writer->pending_buf))
+		return false;
+	if(!ogg_opus_writer_flush(writer, 0))
+		return false;
+	memcpy(writer->pending_buf, buf, buf_size);
+	writer->pending_size = buf_size;
+	writer->pending = true;
+	return true;
+}
+
+/**
+ * Write the held back packet on the end of stream page, or an empty one if there was none.
+ */
+static bool ogg_opus_writer_finish(OggOpusWriter *writer)
+{
+	if(!writer->header_written)
+		return true;
+	if(!writer->pending)
+		return ogg_opus_writer_page(writer, 0x04, NULL, 0);
+	return ogg_opus_writer_flush(writer, 0x04);
+}
+
+typedef struct stream_context_t
+{
+	ChiakiLog *log;
+	ChiakiSession session;
+	FILE *video_file;
+	OggOpusWriter audio_writer;
+#if CHIAKI_LIB_ENABLE_FFMPEG
+	bool decode;
+	ChiakiFfmpegDecoder decoder;
+	ChiakiFfmpegDecoderStats decoder_stats_prev;
+#endif
+	bool fec_pool_enabled;
+	ChiakiFecPool fec_pool;
+	bool reactor_enabled;
+	ChiakiReactor reactor;
+
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool quit;
+	ChiakiQuitReason quit_reason;
+	bool login_failed;
+	bool login_pin_requested;
+	bool login_pin_incorrect;
+	uint64_t frame_last_us;
+	uint64_t frame_gap_max_us; // since the last stats output
+} StreamContext;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void stream_signal_handler(int sig)
+{
+	(void)sig;
+	stop_requested = 1;
+}
+
+static void stream_close_out(FILE *f)
+{
+	if(f != stdout)
+		fclose(f);
+}
+
+static void stream_event_cb(ChiakiEvent *event, void *user)
+{
+	StreamContext *ctx = user;
+	switch(event->type)
+	{
+		case CHIAKI_EVENT_CONNECTED:
+			// measured once by Senkusha before connecting, it is not updated during the stream
+			CHIAKI_LOGI(ctx->log, "Stream connected, RTT at connect %.1f ms", (double)ctx->session.rtt_us / 1000.0);
+			break;
+		case CHIAKI_EVENT_LOGIN_PIN_REQUEST:
+			// chiaki_session_set_login_pin() must not be called from here
+			chiaki_mutex_lock(&ctx->mutex);
+			ctx->login_pin_requested = true;
+			ctx->login_pin_incorrect = event->login_pin_request.pin_incorrect;
+			chiaki_cond_signal(&ctx->cond);
+			chiaki_mutex_unlock(&ctx->mutex);
+			break;
+		case CHIAKI_EVENT_QUIT:
+			CHIAKI_LOGI(ctx->log, "Stream quit: %s%s%s", chiaki_quit_reason_string(event->quit.reason),
+					event->quit.reason_str ? ", " : "", event->quit.reason_str ? event->quit.reason_str : "");
+			chiaki_mutex_lock(&ctx->mutex);
+			ctx->quit = true;
+			ctx->quit_reason = event->quit.reason;
+			chiaki_cond_signal(&ctx->cond);
+			chiaki_mutex_unlock(&ctx->mutex);
+			break;
+		default:
+			break;
+	}
+}
+
+static bool stream_video_cb(ChiakiVideoFrame *frame, void *user)
+{
+	StreamContext *ctx = user;
+
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	chiaki_mutex_lock(&ctx->mutex);
+	if(ctx->frame_last_us && now_us - ctx->frame_last_us > ctx->frame_gap_max_us)
+		ctx->frame_gap_max_us = now_us - ctx->frame_last_us;
+	ctx->frame_last_us = now_us;
+	chiaki_mutex_unlock(&ctx->mutex);
+
+	// written straight from the receive buffer, the file is unbuffered
+	if(ctx->video_file && fwrite(frame->buf, 1, frame->buf_size, ctx->video_file) != frame->buf_size)
+	{
+		CHIAKI_LOGE(ctx->log, "Failed to write video, stopping video output");
+		stream_close_out(ctx->video_file);
+		ctx->video_file = NULL;
+	}
+#if CHIAKI_LIB_ENABLE_FFMPEG
+	if(ctx->decode)
+		return chiaki_ffmpeg_decoder_video_frame_cb(frame, &ctx->decoder);
+#endif
+	return true;
+}
+
+static void stream_audio_header_cb(ChiakiAudioHeader *header, void *user)
+{
+	StreamContext *ctx = user;
+	if(ctx->audio_writer.file && !ogg_opus_writer_header(&ctx->audio_writer, header))
+	{
+		CHIAKI_LOGE(ctx->log, "Failed to write audio header, stopping audio output");
+		stream_close_out(ctx->audio_writer.file);
+		ctx->audio_writer.file = NULL;
+	}
+}
+
+static void stream_audio_frame_cb(uint8_t *buf, size_t buf_size, void *user)
+{
+	StreamContext *ctx = user;
+	if(ctx->audio_writer.file && !ogg_opus_writer_packet(&ctx->audio_writer, buf, buf_size))
+	{
+		CHIAKI_LOGE(ctx->log, "Failed to write audio, stopping audio output");
+		stream_close_out(ctx->audio_writer.file);
+		ctx->audio_writer.file = NULL;
+	}
+}
+
+static void stream_print_mem_stats(StreamContext *ctx)
+{
+	ChiakiMemStats stats;
+	chiaki_session_get_mem_stats(&ctx->session, &stats);
+	CHIAKI_LOGI(ctx->log, "Session memory: %.1f KiB now, %.1f KiB peak",
+			(double)stats.total_current / 1024.0, (double)stats.total_peak / 1024.0);
+	for(int i=0; i<CHIAKI_MEM_TAG_COUNT; i++)
+	{
+		if(!stats.peak[i])
+			continue;
+		CHIAKI_LOGI(ctx->log, "  %-14s %9.1f KiB peak", chiaki_mem_tag_string((ChiakiMemTag)i), (double)stats.peak[i] / 1024.0);
+	}
+}
+
+static void stream_print_stats(StreamContext *ctx, ChiakiStreamStats *prev, uint64_t interval_us)
+{
+	ChiakiStreamStats stats;
+	chiaki_session_get_stream_stats(&ctx->session, &stats);
+
+	chiaki_mutex_lock(&ctx->mutex);
+	uint64_t frame_gap_max_us = ctx->frame_gap_max_us;
+	ctx->frame_gap_max_us = 0;
+	chiaki_mutex_unlock(&ctx->mutex);
+
+	double secs = (double)interval_us / 1000000.0;
+	CHIAKI_LOGI(ctx->log, "Video: %.2f Mbit/s, %.1f fps, %llu lost, %llu FEC recovered, max frame gap %.1f ms, "
+			"jitter %.2f ms, spread %.2f ms | Audio: %.1f kbit/s, %llu lost",
+			(double)(stats.video_bytes - prev->video_bytes) * 8.0 / secs / 1000000.0,
+			(double)(stats.video_frames - prev->video_frames) / secs,
+			(unsigned long long)(stats.video_frames_lost - prev->video_frames_lost),
+			(unsigned long long)(stats.video_frames_fec_recovered - prev->video_frames_fec_recovered),
+			(double)frame_gap_max_us / 1000.0,
+			(double)stats.video_frame_jitter_us / 1000.0,
+			(double)stats.video_frame_spread_us / 1000.0,
+			(double)(stats.audio_bytes - prev->audio_bytes) * 8.0 / secs / 1000.0,
+			(unsigned long long)(stats.audio_frames_lost - prev->audio_frames_lost));
+
+	*prev = stats;
+
+#if CHIAKI_LIB_ENABLE_FFMPEG
+	if(!ctx->decode)
+		return;
+	ChiakiFfmpegDecoderStats decoder_stats;
+	chiaki_ffmpeg_decoder_get_stats(&ctx->decoder, &decoder_stats);
+	ChiakiFfmpegDecoderStats *decoder_prev = &ctx->decoder_stats_prev;
+	uint64_t frames = decoder_stats.frames - decoder_prev->frames;
+	uint64_t samples = decoder_stats.samples - decoder_prev->samples;
+	CHIAKI_LOGI(ctx->log, "Decode: %.1f fps, %.2f ms avg / %.2f ms max total decode time, %.2f ms avg latency, "
+			"%llu samples dropped, %llu frames dropped, %llu errors",
+			(double)frames / secs,
+			samples ? (double)(decoder_stats.decode_us_sum - decoder_prev->decode_us_sum) / samples / 1000.0 : 0.0,
+			(double)decoder_stats.decode_us_max / 1000.0,
+			frames ? (double)(decoder_stats.latency_us_sum - decoder_prev->latency_us_sum) / frames / 1000.0 : 0.0,
+			(unsigned long long)(decoder_stats.samples_dropped - decoder_prev->samples_dropped),
+			(unsigned long long)(decoder_stats.frames_dropped - decoder_prev->frames_dropped),
+			(unsigned long long)(decoder_stats.decode_errors - decoder_prev->decode_errors));
+	*decoder_prev = decoder_stats;
+#endif
+}
+
+static FILE *stream_open_out(const char *path)
+{
+	FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+	if(!f)
+		return NULL;
+	// no intermediate copy into a stdio buffer, every frame is one write
+	setvbuf(f, NULL, _IONBF, 0);
+	return f;
+}
+
+CHIAKI_EXPORT int chiaki_cli_cmd_stream(ChiakiLog *log, int argc, char *argv[])
+{
+	Arguments arguments = { 0 };
+	arguments.resolution = CHIAKI_VIDEO_RESOLUTION_PRESET_720p;
+	arguments.fps = CHIAKI_VIDEO_FPS_PRESET_60;
+	arguments.stats_interval = 1;
+	error_t argp_r = argp_parse(&argp, argc, argv, ARGP_IN_ORDER, NULL, &arguments);
+	if(argp_r != 0)
+		return 1;
+
+	if(!arguments.host)
+	{
+		fprintf(stderr, "No host specified, see --help.\n");
+		return 1;
+	}
+	if(!arguments.registkey)
+	{
+		fprintf(stderr, "No registration key specified, see --help.\n");
+		return 1;
+	}
+	if(!arguments.morning)
+	{
+		fprintf(stderr, "No morning specified, see --help.\n");
+		return 1;
+	}
+
+	ChiakiConnectInfo connect_info;
+	memset(&connect_info, 0, sizeof(connect_info));
+	connect_info.host = arguments.host;
+
+	if(strlen(arguments.registkey) > sizeof(connect_info.regist_key))
+	{
+		fprintf(stderr, "Given registkey is too long.\n");
+		return 1;
+	}
+	memcpy(connect_info.regist_key, arguments.registkey, strlen(arguments.registkey));
+
+	size_t morning_size = sizeof(connect_info.morning);
+	ChiakiErrorCode err = chiaki_base64_decode(arguments.morning, strlen(arguments.morning), connect_info.morning, &morning_size);
+	if(err != CHIAKI_ERR_SUCCESS || morning_size != sizeof(connect_info.morning))
+	{
+		fprintf(stderr, "Given morning is invalid, must be %zu bytes encoded as base64.\n", sizeof(connect_info.morning));
+		return 1;
+	}
+
+	chiaki_connect_video_profile_preset(&connect_info.video_profile, arguments.resolution, arguments.fps);
+	connect_info.network_cache.valid = false;
+	connect_info.reactor = NULL;
+	connect_info.fec_pool = NULL;
+	connect_info.receive_pipeline_workers = arguments.receive_threads;
+	connect_info.socket_tuning = arguments.socket_tuning;
+	connect_info.allocator = NULL;
+
+	err = chiaki_lib_init();
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(log, "Chiaki lib init failed: %s", chiaki_error_string(err));
+		return 1;
+	}
+
+	static StreamContext ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.log = log;
+	ogg_crc_init();
+	ctx.audio_writer.serial = (uint32_t)chiaki_time_now_monotonic_us();
+
+	int ret = 1;
+	if(arguments.video_out)
+	{
+		ctx.video_file = stream_open_out(arguments.video_out);
+		if(!ctx.video_file)
+		{
+			CHIAKI_LOGE(log, "Failed to open video output %s", arguments.video_out);
+			return 1;
+		}
+	}
+	if(arguments.audio_out)
+	{
+		ctx.audio_writer.file = stream_open_out(arguments.audio_out);
+		if(!ctx.audio_writer.file)
+		{
+			CHIAKI_LOGE(log, "Failed to open audio output %s", arguments.audio_out);
+			goto error_video_file;
+		}
+	}
+
+#if CHIAKI_LIB_ENABLE_FFMPEG
+	if(arguments.decode)
+	{
+		ChiakiFfmpegDecoderOptions decoder_options;
+		chiaki_ffmpeg_decoder_options_default(&decoder_options);
+		decoder_options.threading = arguments.decode_threading;
+		// without a frame callback, decoded frames go straight back to the pool
+		err = chiaki_ffmpeg_decoder_init(&ctx.decoder, &decoder_options, NULL, NULL, log);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(log, "FFmpeg Decoder init failed: %s", chiaki_error_string(err));
+			goto error_decoder;
+		}
+		ctx.decode = true;
+	}
+#endif
+
+	err = chiaki_mutex_init(&ctx.mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_decoder;
+	err = chiaki_cond_init(&ctx.cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	if(arguments.fec_threads)
+	{
+		err = chiaki_fec_pool_init(&ctx.fec_pool, arguments.fec_threads, log);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(log, "FEC pool init failed: %s", chiaki_error_string(err));
+			goto error_cond;
+		}
+		ctx.fec_pool_enabled = true;
+		connect_info.fec_pool = &ctx.fec_pool;
+	}
+
+	if(arguments.reactor_threads)
+	{
+		err = chiaki_reactor_init(&ctx.reactor, log, arguments.reactor_threads);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(log, "Reactor init failed: %s", chiaki_error_string(err));
+			goto error_fec_pool;
+		}
+		ctx.reactor_enabled = true;
+		connect_info.reactor = &ctx.reactor;
+	}
+
+	err = chiaki_session_init(&ctx.session, &connect_info, log);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(log, "Session init failed: %s", chiaki_error_string(err));
+		goto error_reactor;
+	}
+
+	ChiakiAudioSink audio_sink;
+	audio_sink.user = &ctx;
+	audio_sink.header_cb = stream_audio_header_cb;
+	audio_sink.frame_cb = stream_audio_frame_cb;
+	chiaki_session_set_audio_sink(&ctx.session, &audio_sink);
+	chiaki_session_set_video_frame_cb(&ctx.session, stream_video_cb, &ctx);
+	chiaki_session_set_event_cb(&ctx.session, stream_event_cb, &ctx);
+
+	signal(SIGINT, stream_signal_handler);
+	signal(SIGTERM, stream_signal_handler);
+
+	err = chiaki_session_start(&ctx.session);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(log, "Session start failed: %s", chiaki_error_string(err));
+		goto error_session;
+	}
+
+	ChiakiStreamStats stats_prev = { 0 };
+	uint64_t stats_interval_us = arguments.stats_interval * 1000000;
+	uint64_t stats_last_us = chiaki_time_now_monotonic_us();
+	bool stopping = false;
+
+	chiaki_mutex_lock(&ctx.mutex);
+	while(!ctx.quit)
+	{
+		chiaki_cond_timedwait(&ctx.cond, &ctx.mutex, 100);
+
+		if(stop_requested && !stopping)
+		{
+			CHIAKI_LOGI(log, "Stopping stream");
+			stopping = true;
+			chiaki_session_stop(&ctx.session);
+		}
+
+		if(ctx.login_pin_requested)
+		{
+			ctx.login_pin_requested = false;
+			if(!arguments.pin || ctx.login_pin_incorrect)
+			{
+				CHIAKI_LOGE(log, ctx.login_pin_incorrect ? "Login PIN was incorrect" : "Login PIN requested, but none given");
+				ctx.login_failed = true;
+				chiaki_session_stop(&ctx.session);
+			}
+			else
+			{
+				chiaki_mutex_unlock(&ctx.mutex);
+				chiaki_session_set_login_pin(&ctx.session, (const uint8_t *)arguments.pin, strlen(arguments.pin));
+				chiaki_mutex_lock(&ctx.mutex);
+			}
+		}
+
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		if(stats_interval_us && now_us - stats_last_us >= stats_interval_us)
+		{
+			chiaki_mutex_unlock(&ctx.mutex);
+			stream_print_stats(&ctx, &stats_prev, now_us - stats_last_us);
+			chiaki_mutex_lock(&ctx.mutex);
+			stats_last_us = now_us;
+		}
+	}
+	// only a stop we asked for is a clean exit, like the GUI treats it
+	ret = ctx.quit_reason == CHIAKI_QUIT_REASON_STOPPED && !ctx.login_failed ? 0 : 1;
+	chiaki_mutex_unlock(&ctx.mutex);
+
+	chiaki_session_join(&ctx.session);
+	if(stats_interval_us)
+		stream_print_mem_stats(&ctx);
+
+error_session:
+	chiaki_session_fini(&ctx.session);
+error_reactor:
+	if(ctx.reactor_enabled)
+		chiaki_reactor_fini(&ctx.reactor);
+error_fec_pool:
+	if(ctx.fec_pool_enabled)
+		chiaki_fec_pool_fini(&ctx.fec_pool);
+error_cond:
+	chiaki_cond_fini(&ctx.cond);
+error_mutex:
+	chiaki_mutex_fini(&ctx.mutex);
+error_decoder:
+#if CHIAKI_LIB_ENABLE_FFMPEG
+	if(ctx.decode)
+		chiaki_ffmpeg_decoder_fini(&ctx.decoder);
+#endif
+	if(ctx.audio_writer.file)
+	{
+		// the session is gone, so no more audio can arrive
+		if(!ogg_opus_writer_finish(&ctx.audio_writer))
+			CHIAKI_LOGE(log, "Failed to write audio end of stream");
+		stream_close_out(ctx.audio_writer.file);
+	}
+error_video_file:
+	if(ctx.video_file)
+		stream_close_out(ctx.video_file);
+	return ret;
+}
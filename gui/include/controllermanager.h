@@ -23,6 +23,8 @@
 #include <QObject>
 #include <QSet>
 #include <QMap>
+#include <QMutex>
+#include <QMetaType>
 #include <QString>
 
 #ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
@@ -30,25 +32,35 @@
 #endif
 
 class Controller;
+class ControllerManagerEventThread;
 
 class ControllerManager : public QObject
 {
 	Q_OBJECT
 
 	friend class Controller;
+	friend class ControllerManagerEventThread;
 
 	private:
 #ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
 		QSet<SDL_JoystickID> available_controllers;
 #endif
+		/**
+		 * Owns SDL: init, event pumping and all SDL_GameController calls happen on this thread only
+		 */
+		ControllerManagerEventThread *event_thread;
+
+		/**
+		 * Guards open_controllers and the cached state of each Controller, which are accessed from the event thread
+		 */
+		QMutex open_controllers_mutex;
 		QMap<int, Controller *> open_controllers;
 
 		void ControllerClosed(Controller *controller);
 
 	private slots:
-		void UpdateAvailableControllers();
-		void HandleEvents();
-		void ControllerEvent(int device_id);
+		void SetAvailableControllers(QList<int> controllers);
+		void InitFailed(QString err);
 
 	public:
 		static ControllerManager *GetInstance();
@@ -68,18 +80,18 @@ class Controller : public QObject
 	Q_OBJECT
 
 	friend class ControllerManager;
+	friend class ControllerManagerEventThread;
 
 	private:
 		Controller(int device_id, ControllerManager *manager);
 
-		void UpdateState();
-
 		ControllerManager *manager;
 		int id;
 
-#ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
-		SDL_GameController *controller;
-#endif
+		// written by the event thread, guarded by manager->open_controllers_mutex
+		bool connected;
+		QString name;
+		ChiakiControllerState state;
 
 	public:
 		~Controller();
@@ -90,7 +102,16 @@ class Controller : public QObject
 		ChiakiControllerState GetState();
 
 	signals:
-		void StateChanged();
+		/**
+		 * Emitted from the event thread of the ControllerManager.
+		 * Receivers on other threads get it queued. Receivers connected with Qt::DirectConnection
+		 * run on the event thread and must neither call into SDL nor into this Controller.
+		 *
+		 * @param timestamp_us monotonic time in microseconds when the input was received
+		 */
+		void StateChanged(ChiakiControllerState state, uint64_t timestamp_us);
 };
 
+Q_DECLARE_METATYPE(ChiakiControllerState)
+
 #endif // CHIAKI_CONTROLLERMANAGER_H
@@ -25,6 +25,8 @@
 #include <QObject>
 #include <QList>
 
+#include <memory>
+
 struct DiscoveryHost
 {
 	ChiakiDiscoveryHostState state;
@@ -37,6 +39,7 @@ struct DiscoveryHost
 };
 
 Q_DECLARE_METATYPE(DiscoveryHost)
+Q_DECLARE_METATYPE(ChiakiDiscoveryServiceHostEvent)
 
 class DiscoveryManager : public QObject
 {
@@ -48,15 +51,20 @@ class DiscoveryManager : public QObject
 		ChiakiLog log;
 		ChiakiDiscoveryService service;
 		bool service_active;
+		std::shared_ptr<ChiakiReactor> reactor;
 		QList<DiscoveryHost> hosts;
 
 	private slots:
-		void DiscoveryServiceHosts(QList<DiscoveryHost> hosts);
+		void DiscoveryServiceHostEvent(ChiakiDiscoveryServiceHostEvent event, DiscoveryHost host);
 
 	public:
 		explicit DiscoveryManager(QObject *parent = nullptr);
 		~DiscoveryManager();
 
+		/**
+		 * Receive on reactor instead of a thread of its own, applies the next time the discovery is activated.
+		 */
+		void SetReactor(std::shared_ptr<ChiakiReactor> reactor) { this->reactor = reactor; }
 		void SetActive(bool active);
 
 		void SendWakeup(const QString &host, const QByteArray &regist_key);
@@ -20,6 +20,8 @@
 
 #include <QMainWindow>
 
+#include <memory>
+
 #include "discoverymanager.h"
 #include "host.h"
 
@@ -45,6 +47,7 @@ class MainWindow : public QMainWindow
 
 	private:
 		Settings *settings;
+		std::shared_ptr<ChiakiReactor> reactor;
 
 		QIcon discover_action_icon;
 		QIcon discover_action_off_icon;
@@ -73,7 +76,7 @@ class MainWindow : public QMainWindow
 		void UpdateServerWidgets();
 
 	public:
-		explicit MainWindow(Settings *settings, QWidget *parent = nullptr);
+		explicit MainWindow(Settings *settings, std::shared_ptr<ChiakiReactor> reactor = nullptr, QWidget *parent = nullptr);
 		~MainWindow() override;
 };
 
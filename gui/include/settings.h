@@ -61,6 +61,12 @@ class Settings : public QObject
 		bool GetDiscoveryEnabled() const		{ return settings.value("settings/auto_discovery", true).toBool(); }
 		void SetDiscoveryEnabled(bool enabled)	{ settings.setValue("settings/auto_discovery", enabled); }
 
+		/**
+		 * Receive all streams and the discovery on one shared ChiakiReactor instead of a thread each, read at startup.
+		 */
+		bool GetReactorEnabled() const			{ return settings.value("settings/reactor", false).toBool(); }
+		void SetReactorEnabled(bool enabled)	{ settings.setValue("settings/reactor", enabled); }
+
 		bool GetLogVerbose() const 				{ return settings.value("settings/log_verbose", false).toBool(); }
 		void SetLogVerbose(bool enabled)		{ settings.setValue("settings/log_verbose", enabled); }
 		uint32_t GetLogLevelMask();
@@ -95,6 +101,12 @@ class Settings : public QObject
 
 		ChiakiConnectVideoProfile GetVideoProfile();
 
+		/**
+		 * Network test results of the last session with host, valid is false if there are none.
+		 */
+		ChiakiNetworkCache GetNetworkCache(const QString &host);
+		void SetNetworkCache(const QString &host, const ChiakiNetworkCache &cache);
+
 		QList<RegisteredHost> GetRegisteredHosts() const			{ return registered_hosts.values(); }
 		void AddRegisteredHost(const RegisteredHost &host);
 		void RemoveRegisteredHost(const HostMAC &mac);
@@ -40,6 +40,7 @@ class SettingsDialog : public QDialog
 		QLineEdit *bitrate_edit;
 		QLineEdit *audio_buffer_size_edit;
 		QComboBox *hardware_decode_combo_box;
+		QCheckBox *reactor_check_box;
 
 		QListWidget *registered_hosts_list_widget;
 		QPushButton *delete_registered_host_button;
@@ -54,6 +55,7 @@ class SettingsDialog : public QDialog
 		void BitrateEdited();
 		void AudioBufferSizeEdited();
 		void HardwareDecodeEngineSelected();
+		void ReactorChanged();
 
 		void UpdateRegisteredHosts();
 		void UpdateRegisteredHostsButtons();
@@ -20,6 +20,7 @@
 
 #include <chiaki/session.h>
 #include <chiaki/opusdecoder.h>
+#include <chiaki/audioresampler.h>
 
 #if CHIAKI_GUI_ENABLE_SETSU
 #include <setsu.h>
@@ -33,12 +34,18 @@
 #include <QObject>
 #include <QImage>
 #include <QMouseEvent>
-#include <QTimer>
+#include <QMutex>
+
+#include <memory>
+#include <vector>
 
 class QAudioOutput;
 class QIODevice;
 class QKeyEvent;
 class Settings;
+#if CHIAKI_GUI_ENABLE_SETSU
+class StreamSessionSetsuThread;
+#endif
 
 class ChiakiException: public Exception
 {
@@ -48,6 +55,7 @@ class ChiakiException: public Exception
 
 struct StreamSessionConnectInfo
 {
+	Settings *settings;
 	QMap<Qt::Key, int> key_map;
 	HardwareDecodeEngine hw_decode_engine;
 	uint32_t log_level_mask;
@@ -57,6 +65,8 @@ struct StreamSessionConnectInfo
 	QByteArray morning;
 	ChiakiConnectVideoProfile video_profile;
 	unsigned int audio_buffer_size;
+	ChiakiNetworkCache network_cache;
+	std::shared_ptr<ChiakiReactor> reactor; // optional, shared with other sessions and the discovery
 
 	StreamSessionConnectInfo(Settings *settings, QString host, QByteArray regist_key, QByteArray morning);
 };
@@ -69,26 +79,46 @@ class StreamSession : public QObject
 
 	private:
 		SessionLog log;
+		std::shared_ptr<ChiakiReactor> reactor; // kept alive until the session is gone
 		ChiakiSession session;
 		ChiakiOpusDecoder opus_decoder;
 
 		Controller *controller;
 #if CHIAKI_GUI_ENABLE_SETSU
 		Setsu *setsu;
+		StreamSessionSetsuThread *setsu_thread;
 		QMap<QPair<QString, SetsuTrackingId>, uint8_t> setsu_ids;
-		ChiakiControllerState setsu_state;
+		bool setsu_dirty;
 #endif
 
+		/**
+		 * Input arrives from the gui thread (keyboard), the ControllerManager's event thread
+		 * and the setsu thread. input_mutex guards the states of all sources and the latency stats.
+		 */
+		QMutex input_mutex;
+		ChiakiControllerState controller_state;
+#if CHIAKI_GUI_ENABLE_SETSU
+		ChiakiControllerState setsu_state;
+#endif
 		ChiakiControllerState keyboard_state;
+		uint64_t input_latency_sum_us;
+		uint64_t input_latency_max_us;
+		uint64_t input_latency_count;
 
 		VideoDecoder video_decoder;
 
 		unsigned int audio_buffer_size;
 		QAudioOutput *audio_output;
 		QIODevice *audio_io;
+		unsigned int audio_channels;
+		ChiakiAudioResampler audio_resampler;
+		std::vector<int16_t> audio_resampler_buf;
 
 		QMap<Qt::Key, int> key_map;
 
+		Settings *settings;
+		QString host;
+
 		void PushAudioFrame(int16_t *buf, size_t samples_count);
 		void PushVideoSample(uint8_t *buf, size_t buf_size);
 		void Event(ChiakiEvent *event);
@@ -96,6 +126,14 @@ class StreamSession : public QObject
 		void HandleSetsuEvent(SetsuEvent *event);
 #endif
 
+		/**
+		 * Merge the states of all input sources and forward them to the session.
+		 * May be called from any thread, but not while holding input_mutex.
+		 *
+		 * @param timestamp_us monotonic time when the input that caused this update was received
+		 */
+		void SendFeedbackState(uint64_t timestamp_us);
+
 	private slots:
 		void InitAudio(unsigned int channels, unsigned int rate);
 
@@ -121,7 +159,6 @@ class StreamSession : public QObject
 
 	private slots:
 		void UpdateGamepads();
-		void SendFeedbackState();
 };
 
 Q_DECLARE_METATYPE(ChiakiQuitReason)
@@ -19,6 +19,7 @@
 #define CHIAKI_VIDEODECODER_H
 
 #include <chiaki/log.h>
+#include <chiaki/video.h>
 
 #include "exception.h"
 
@@ -32,6 +33,7 @@ extern "C"
 }
 
 #include <cstdint>
+#include <vector>
 
 
 typedef enum {
@@ -63,6 +65,13 @@ class VideoDecoder: public QObject
 		VideoDecoder(HardwareDecodeEngine hw_decode_engine, ChiakiLog *log);
 		~VideoDecoder();
 
+		/**
+		 * Open one codec context per profile and configure each with the profile's header,
+		 * so switching profiles later does not have to wait for a context to be opened.
+		 */
+		void SetProfiles(const ChiakiVideoProfile *profiles, size_t profiles_count);
+		void SwitchProfile(size_t profile_index);
+
 		void PushFrame(uint8_t *buf, size_t buf_size);
 		AVFrame *PullFrame();
 		AVFrame *GetFromHardware(AVFrame *hw_frame);
@@ -81,10 +90,17 @@ class VideoDecoder: public QObject
 		QMutex mutex;
 
 		AVCodec *codec;
-		AVCodecContext *codec_context;
+		AVCodecContext *codec_context; // used until profiles are known or if opening them failed
+		std::vector<AVCodecContext *> profile_codec_contexts;
+		AVCodecContext *active_codec_context;
+		AVFrame *drained_frame; // last frame left in the previous context on a profile switch
 
 		enum AVPixelFormat hw_pix_fmt;
 		AVBufferRef *hw_device_ctx;
+
+		AVCodecContext *CreateCodecContext();
+		void FreeProfileCodecContexts();
+		void DrainActiveCodecContext();
 };
 
 #endif // CHIAKI_VIDEODECODER_H
@@ -17,10 +17,13 @@
 
 #include <controllermanager.h>
 
+#include <chiaki/time.h>
+
 #include <QCoreApplication>
 #include <QMessageBox>
 #include <QByteArray>
-#include <QTimer>
+#include <QThread>
+#include <QWaitCondition>
 
 #ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
 #include <SDL.h>
@@ -28,155 +31,435 @@
 
 static ControllerManager *instance = nullptr;
 
-#define UPDATE_INTERVAL_MS 4
+// only bounds how long it takes to notice that the thread should stop
+#define EVENT_WAIT_TIMEOUT_MS 100
 
-ControllerManager *ControllerManager::GetInstance()
+/**
+ * Runs SDL outside of the Qt event loop, so controller input is neither delayed
+ * by a polling interval nor by the load of the GUI thread.
+ *
+ * SDL requires its event and joystick subsystems to be used from the thread that initialized them,
+ * so everything touching SDL happens here. Other threads only post commands and receive
+ * the results through queued invocations or Controller::StateChanged.
+ */
+class ControllerManagerEventThread : public QThread
 {
-	if(!instance)
-		instance = new ControllerManager(qApp);
-	return instance;
-}
+	private:
+		enum class CommandType { Open, Close };
+		struct Command
+		{
+			CommandType type;
+			int device_id;
+		};
 
-ControllerManager::ControllerManager(QObject *parent)
-	: QObject(parent)
+		ControllerManager *manager;
+
+		QMutex commands_mutex;
+		QWaitCondition commands_cond;
+		QList<Command> commands;
+		uint64_t commands_pushed;
+		uint64_t commands_done;
+		bool sdl_running;
+#ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
+		Uint32 wakeup_event_type;
+
+		// only accessed from this thread
+		QMap<int, SDL_GameController *> sdl_controllers;
+		QList<int> available_controllers;
+
+		static ChiakiControllerState ReadState(SDL_GameController *controller);
+		void UpdateAvailableControllers();
+		void UpdateConnected();
+		void ControllerEvent(int device_id, uint64_t timestamp_us);
+		void OpenSDLController(int device_id);
+		void CloseSDLController(int device_id);
+		void HandleEvent(const SDL_Event &event);
+		void ProcessCommands();
+		void Wakeup();
+#endif
+
+		/**
+		 * @param wait block until the command was executed
+		 */
+		void PushCommand(CommandType type, int device_id, bool wait);
+
+	protected:
+		void run() override;
+
+	public:
+		ControllerManagerEventThread(ControllerManager *manager)
+			: QThread(manager),
+			manager(manager),
+			commands_pushed(0),
+			commands_done(0),
+			sdl_running(true)
+#ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
+			, wakeup_event_type((Uint32)-1)
+#endif
+		{}
+
+		void OpenController(int device_id)	{ PushCommand(CommandType::Open, device_id, true); }
+		void CloseController(int device_id)	{ PushCommand(CommandType::Close, device_id, false); }
+};
+
+void ControllerManagerEventThread::PushCommand(CommandType type, int device_id, bool wait)
 {
 #ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
+	QMutexLocker locker(&commands_mutex);
+	if(!sdl_running)
+		return;
+	commands.append({ type, device_id });
+	uint64_t seq = ++commands_pushed;
+	locker.unlock();
+	Wakeup();
+	if(!wait)
+		return;
+	locker.relock();
+	while(sdl_running && commands_done < seq)
+		commands_cond.wait(&commands_mutex);
+#else
+	(void)type;
+	(void)device_id;
+	(void)wait;
+#endif
+}
+
+#ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
+void ControllerManagerEventThread::Wakeup()
+{
+	Uint32 type;
+	{
+		QMutexLocker locker(&commands_mutex);
+		type = wakeup_event_type;
+	}
+	// before SDL is initialized, the commands are picked up right after init anyway
+	if(type == (Uint32)-1)
+		return;
+	SDL_Event event = {};
+	event.type = type;
+	SDL_PushEvent(&event);
+}
+
+void ControllerManagerEventThread::run()
+{
 	SDL_SetMainReady();
 	if(SDL_Init(SDL_INIT_GAMECONTROLLER) < 0)
 	{
 		const char *err = SDL_GetError();
-		QMessageBox::critical(nullptr, "SDL Init", tr("Failed to initialized SDL Gamecontroller: %1").arg(err ? err : ""));
+		QString msg = err ? err : "";
+		QMetaObject::invokeMethod(manager, "InitFailed", Qt::QueuedConnection, Q_ARG(QString, msg));
+		QMutexLocker locker(&commands_mutex);
+		sdl_running = false;
+		commands_cond.wakeAll();
+		return;
 	}
 
-	auto timer = new QTimer(this);
-	connect(timer, &QTimer::timeout, this, &ControllerManager::HandleEvents);
-	timer->start(UPDATE_INTERVAL_MS);
-#endif
+	{
+		QMutexLocker locker(&commands_mutex);
+		wakeup_event_type = SDL_RegisterEvents(1);
+	}
 
 	UpdateAvailableControllers();
+	ProcessCommands();
+
+	while(!isInterruptionRequested())
+	{
+		SDL_Event event;
+		if(SDL_WaitEventTimeout(&event, EVENT_WAIT_TIMEOUT_MS))
+		{
+			HandleEvent(event);
+			while(SDL_PollEvent(&event))
+				HandleEvent(event);
+		}
+		ProcessCommands();
+	}
+
+	{
+		QMutexLocker locker(&commands_mutex);
+		sdl_running = false;
+		wakeup_event_type = (Uint32)-1;
+		commands.clear();
+		commands_cond.wakeAll();
+	}
+	for(SDL_GameController *controller : sdl_controllers)
+		SDL_GameControllerClose(controller);
+	sdl_controllers.clear();
+	SDL_Quit();
 }
 
-ControllerManager::~ControllerManager()
+void ControllerManagerEventThread::HandleEvent(const SDL_Event &event)
 {
-#ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
-	SDL_Quit();
-#endif
+	uint64_t timestamp_us = chiaki_time_now_monotonic_us();
+	switch(event.type)
+	{
+		case SDL_JOYDEVICEADDED:
+		case SDL_JOYDEVICEREMOVED:
+			UpdateConnected();
+			UpdateAvailableControllers();
+			break;
+		case SDL_CONTROLLERBUTTONUP:
+		case SDL_CONTROLLERBUTTONDOWN:
+			ControllerEvent(event.cbutton.which, timestamp_us);
+			break;
+		case SDL_CONTROLLERAXISMOTION:
+			ControllerEvent(event.caxis.which, timestamp_us);
+			break;
+	}
 }
 
-void ControllerManager::UpdateAvailableControllers()
+void ControllerManagerEventThread::ProcessCommands()
 {
-#ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
-	QSet<SDL_JoystickID> current_controllers;
+	QMutexLocker locker(&commands_mutex);
+	while(!commands.isEmpty())
+	{
+		Command command = commands.takeFirst();
+		locker.unlock();
+		switch(command.type)
+		{
+			case CommandType::Open:
+				OpenSDLController(command.device_id);
+				break;
+			case CommandType::Close:
+				CloseSDLController(command.device_id);
+				break;
+		}
+		locker.relock();
+		commands_done++;
+	}
+	commands_cond.wakeAll();
+}
+
+void ControllerManagerEventThread::UpdateAvailableControllers()
+{
+	QList<int> current_controllers;
 	for(int i=0; i<SDL_NumJoysticks(); i++)
 	{
 		if(!SDL_IsGameController(i))
 			continue;
-		current_controllers.insert(SDL_JoystickGetDeviceInstanceID(i));
+		current_controllers.append(SDL_JoystickGetDeviceInstanceID(i));
 	}
 
 	if(current_controllers != available_controllers)
 	{
 		available_controllers = current_controllers;
-		emit AvailableControllersUpdated();
+		// available_controllers of the manager belong to the gui thread
+		QMetaObject::invokeMethod(manager, "SetAvailableControllers", Qt::QueuedConnection, Q_ARG(QList<int>, current_controllers));
 	}
-#endif
 }
 
-void ControllerManager::HandleEvents()
+void ControllerManagerEventThread::UpdateConnected()
 {
-#ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
-	SDL_Event event;
-	while(SDL_PollEvent(&event))
+	QMutexLocker locker(&manager->open_controllers_mutex);
+	for(auto it=sdl_controllers.begin(); it!=sdl_controllers.end(); it++)
 	{
-		switch(event.type)
+		Controller *controller = manager->open_controllers.value(it.key());
+		if(controller)
+			controller->connected = SDL_GameControllerGetAttached(it.value());
+	}
+}
+
+void ControllerManagerEventThread::OpenSDLController(int device_id)
+{
+	SDL_GameController *sdl_controller = sdl_controllers.value(device_id);
+	if(!sdl_controller)
+	{
+		for(int i=0; i<SDL_NumJoysticks(); i++)
 		{
-			case SDL_JOYDEVICEADDED:
-			case SDL_JOYDEVICEREMOVED:
-				UpdateAvailableControllers();
-				break;
-			case SDL_CONTROLLERBUTTONUP:
-			case SDL_CONTROLLERBUTTONDOWN:
-				ControllerEvent(event.cbutton.which);
-				break;
-			case SDL_CONTROLLERAXISMOTION:
-				ControllerEvent(event.caxis.which);
+			if(SDL_JoystickGetDeviceInstanceID(i) == device_id)
+			{
+				sdl_controller = SDL_GameControllerOpen(i);
 				break;
+			}
 		}
+		if(!sdl_controller)
+			return;
+		sdl_controllers[device_id] = sdl_controller;
 	}
-#endif
+
+	const char *name = SDL_GameControllerName(sdl_controller);
+	ChiakiControllerState state = ReadState(sdl_controller);
+	bool connected = SDL_GameControllerGetAttached(sdl_controller);
+
+	QMutexLocker locker(&manager->open_controllers_mutex);
+	Controller *controller = manager->open_controllers.value(device_id);
+	if(!controller)
+		return;
+	controller->name = name ? name : "";
+	controller->state = state;
+	controller->connected = connected;
 }
 
-void ControllerManager::ControllerEvent(int device_id)
+void ControllerManagerEventThread::CloseSDLController(int device_id)
 {
-	if(!open_controllers.contains(device_id))
+	{
+		// a Controller for the same device may have been opened again in the meantime
+		QMutexLocker locker(&manager->open_controllers_mutex);
+		if(manager->open_controllers.contains(device_id))
+			return;
+	}
+	SDL_GameController *sdl_controller = sdl_controllers.take(device_id);
+	if(sdl_controller)
+		SDL_GameControllerClose(sdl_controller);
+}
+
+void ControllerManagerEventThread::ControllerEvent(int device_id, uint64_t timestamp_us)
+{
+	SDL_GameController *sdl_controller = sdl_controllers.value(device_id);
+	if(!sdl_controller)
+		return;
+	ChiakiControllerState state = ReadState(sdl_controller);
+
+	// held while the signal is emitted, so a Controller can not be destroyed in the meantime
+	QMutexLocker locker(&manager->open_controllers_mutex);
+	Controller *controller = manager->open_controllers.value(device_id);
+	if(!controller)
 		return;
-	open_controllers[device_id]->UpdateState();
+	controller->state = state;
+	emit controller->StateChanged(state, timestamp_us);
 }
 
-QList<int> ControllerManager::GetAvailableControllers()
+ChiakiControllerState ControllerManagerEventThread::ReadState(SDL_GameController *controller)
 {
-#ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
-	return available_controllers.values();
+	ChiakiControllerState state;
+	chiaki_controller_state_set_idle(&state);
+	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_A) ? CHIAKI_CONTROLLER_BUTTON_CROSS : 0;
+	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_B) ? CHIAKI_CONTROLLER_BUTTON_MOON : 0;
+	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_X) ? CHIAKI_CONTROLLER_BUTTON_BOX : 0;
+	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_Y) ? CHIAKI_CONTROLLER_BUTTON_PYRAMID : 0;
+	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_DPAD_LEFT) ? CHIAKI_CONTROLLER_BUTTON_DPAD_LEFT : 0;
+	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_DPAD_RIGHT) ? CHIAKI_CONTROLLER_BUTTON_DPAD_RIGHT : 0;
+	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_DPAD_UP) ? CHIAKI_CONTROLLER_BUTTON_DPAD_UP : 0;
+	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_DPAD_DOWN) ? CHIAKI_CONTROLLER_BUTTON_DPAD_DOWN : 0;
+	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_LEFTSHOULDER) ? CHIAKI_CONTROLLER_BUTTON_L1 : 0;
+	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_RIGHTSHOULDER) ? CHIAKI_CONTROLLER_BUTTON_R1 : 0;
+	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_LEFTSTICK) ? CHIAKI_CONTROLLER_BUTTON_L3 : 0;
+	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_RIGHTSTICK) ? CHIAKI_CONTROLLER_BUTTON_R3 : 0;
+	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_START) ? CHIAKI_CONTROLLER_BUTTON_OPTIONS : 0;
+	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_BACK) ? CHIAKI_CONTROLLER_BUTTON_SHARE : 0;
+	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_GUIDE) ? CHIAKI_CONTROLLER_BUTTON_PS : 0;
+	state.l2_state = (uint8_t)(SDL_GameControllerGetAxis(controller, SDL_CONTROLLER_AXIS_TRIGGERLEFT) >> 7);
+	state.r2_state = (uint8_t)(SDL_GameControllerGetAxis(controller, SDL_CONTROLLER_AXIS_TRIGGERRIGHT) >> 7);
+	state.left_x = SDL_GameControllerGetAxis(controller, SDL_CONTROLLER_AXIS_LEFTX);
+	state.left_y = SDL_GameControllerGetAxis(controller, SDL_CONTROLLER_AXIS_LEFTY);
+	state.right_x = SDL_GameControllerGetAxis(controller, SDL_CONTROLLER_AXIS_RIGHTX);
+	state.right_y = SDL_GameControllerGetAxis(controller, SDL_CONTROLLER_AXIS_RIGHTY);
+	return state;
+}
 #else
-	return {};
+void ControllerManagerEventThread::run()
+{
+}
 #endif
+
+ControllerManager *ControllerManager::GetInstance()
+{
+	if(!instance)
+		instance = new ControllerManager(qApp);
+	return instance;
 }
 
-Controller *ControllerManager::OpenController(int device_id)
+ControllerManager::ControllerManager(QObject *parent)
+	: QObject(parent),
+	event_thread(nullptr)
 {
-	if(open_controllers.contains(device_id))
-		return nullptr;
-	auto controller = new Controller(device_id, this);
-	open_controllers[device_id] = controller;
-	return controller;
+#ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
+	event_thread = new ControllerManagerEventThread(this);
+	event_thread->start();
+#endif
 }
 
-void ControllerManager::ControllerClosed(Controller *controller)
+ControllerManager::~ControllerManager()
 {
-	open_controllers.remove(controller->GetDeviceID());
+#ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
+	event_thread->requestInterruption();
+	event_thread->wait();
+	// before the children are destroyed, remaining Controllers must not post commands anymore
+	delete event_thread;
+	event_thread = nullptr;
+#endif
 }
 
-Controller::Controller(int device_id, ControllerManager *manager) : QObject(manager)
+void ControllerManager::InitFailed(QString err)
 {
-	this->id = device_id;
-	this->manager = manager;
+	QMessageBox::critical(nullptr, "SDL Init", tr("Failed to initialized SDL Gamecontroller: %1").arg(err));
+}
 
+void ControllerManager::SetAvailableControllers(QList<int> controllers)
+{
 #ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
-	controller = nullptr;
-	for(int i=0; i<SDL_NumJoysticks(); i++)
+	QSet<SDL_JoystickID> current_controllers;
+	for(int id : controllers)
+		current_controllers.insert(id);
+
+	if(current_controllers != available_controllers)
 	{
-		if(SDL_JoystickGetDeviceInstanceID(i) == device_id)
-		{
-			controller = SDL_GameControllerOpen(i);
-			break;
-		}
+		available_controllers = current_controllers;
+		emit AvailableControllersUpdated();
 	}
+#else
+	(void)controllers;
 #endif
 }
 
-Controller::~Controller()
+QList<int> ControllerManager::GetAvailableControllers()
 {
 #ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
-	if(controller)
-		SDL_GameControllerClose(controller);
+	return available_controllers.values();
+#else
+	return {};
 #endif
-	manager->ControllerClosed(this);
 }
 
-void Controller::UpdateState()
+Controller *ControllerManager::OpenController(int device_id)
 {
-	emit StateChanged();
+	Controller *controller;
+	{
+		QMutexLocker locker(&open_controllers_mutex);
+		if(open_controllers.contains(device_id))
+			return nullptr;
+		controller = new Controller(device_id, this);
+		open_controllers[device_id] = controller;
+	}
+#ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
+	// fills in name, state and connected
+	event_thread->OpenController(device_id);
+#endif
+	return controller;
 }
 
-bool Controller::IsConnected()
+void ControllerManager::ControllerClosed(Controller *controller)
 {
+	{
+		QMutexLocker locker(&open_controllers_mutex);
+		open_controllers.remove(controller->GetDeviceID());
+	}
 #ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
-	return controller && SDL_GameControllerGetAttached(controller);
-#else
-	return false;
+	if(event_thread)
+		event_thread->CloseController(controller->GetDeviceID());
 #endif
 }
 
+Controller::Controller(int device_id, ControllerManager *manager)
+	: QObject(manager),
+	manager(manager),
+	id(device_id),
+	connected(false)
+{
+	chiaki_controller_state_set_idle(&state);
+}
+
+Controller::~Controller()
+{
+	// first, so no more events are dispatched to this controller
+	manager->ControllerClosed(this);
+}
+
+bool Controller::IsConnected()
+{
+	QMutexLocker locker(&manager->open_controllers_mutex);
+	return connected;
+}
+
 int Controller::GetDeviceID()
 {
 #ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
@@ -188,45 +471,12 @@ int Controller::GetDeviceID()
 
 QString Controller::GetName()
 {
-#ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
-	if(!controller)
-		return QString();
-	return SDL_GameControllerName(controller);
-#else
-	return QString();
-#endif
+	QMutexLocker locker(&manager->open_controllers_mutex);
+	return name;
 }
 
 ChiakiControllerState Controller::GetState()
 {
-	ChiakiControllerState state;
-	chiaki_controller_state_set_idle(&state);
-#ifdef CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
-	if(!controller)
-		return state;
-
-	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_A) ? CHIAKI_CONTROLLER_BUTTON_CROSS : 0;
-	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_B) ? CHIAKI_CONTROLLER_BUTTON_MOON : 0;
-	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_X) ? CHIAKI_CONTROLLER_BUTTON_BOX : 0;
-	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_Y) ? CHIAKI_CONTROLLER_BUTTON_PYRAMID : 0;
-	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_DPAD_LEFT) ? CHIAKI_CONTROLLER_BUTTON_DPAD_LEFT : 0;
-	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_DPAD_RIGHT) ? CHIAKI_CONTROLLER_BUTTON_DPAD_RIGHT : 0;
-	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_DPAD_UP) ? CHIAKI_CONTROLLER_BUTTON_DPAD_UP : 0;
-	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_DPAD_DOWN) ? CHIAKI_CONTROLLER_BUTTON_DPAD_DOWN : 0;
-	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_LEFTSHOULDER) ? CHIAKI_CONTROLLER_BUTTON_L1 : 0;
-	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_RIGHTSHOULDER) ? CHIAKI_CONTROLLER_BUTTON_R1 : 0;
-	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_LEFTSTICK) ? CHIAKI_CONTROLLER_BUTTON_L3 : 0;
-	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_RIGHTSTICK) ? CHIAKI_CONTROLLER_BUTTON_R3 : 0;
-	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_START) ? CHIAKI_CONTROLLER_BUTTON_OPTIONS : 0;
-	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_BACK) ? CHIAKI_CONTROLLER_BUTTON_SHARE : 0;
-	state.buttons |= SDL_GameControllerGetButton(controller, SDL_CONTROLLER_BUTTON_GUIDE) ? CHIAKI_CONTROLLER_BUTTON_PS : 0;
-	state.l2_state = (uint8_t)(SDL_GameControllerGetAxis(controller, SDL_CONTROLLER_AXIS_TRIGGERLEFT) >> 7);
-	state.r2_state = (uint8_t)(SDL_GameControllerGetAxis(controller, SDL_CONTROLLER_AXIS_TRIGGERRIGHT) >> 7);
-	state.left_x = SDL_GameControllerGetAxis(controller, SDL_CONTROLLER_AXIS_LEFTX);
-	state.left_y = SDL_GameControllerGetAxis(controller, SDL_CONTROLLER_AXIS_LEFTY);
-	state.right_x = SDL_GameControllerGetAxis(controller, SDL_CONTROLLER_AXIS_RIGHTX);
-	state.right_y = SDL_GameControllerGetAxis(controller, SDL_CONTROLLER_AXIS_RIGHTY);
-
-#endif
+	QMutexLocker locker(&manager->open_controllers_mutex);
 	return state;
 }
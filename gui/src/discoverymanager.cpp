@@ -18,6 +18,7 @@
 #include <discoverymanager.h>
 #include <exception.h>
 
+#include <algorithm>
 #include <cstring>
 
 #ifdef _WIN32
@@ -41,7 +42,7 @@ HostMAC DiscoveryHost::GetHostMAC() const
 	return HostMAC((uint8_t *)data.constData());
 }
 
-static void DiscoveryServiceHostsCallback(ChiakiDiscoveryHost *hosts, size_t hosts_count, void *user);
+static void DiscoveryServiceHostCallback(ChiakiDiscoveryServiceHostEvent event, ChiakiDiscoveryHost *host, void *user);
 
 DiscoveryManager::DiscoveryManager(QObject *parent) : QObject(parent)
 {
@@ -68,8 +69,15 @@ void DiscoveryManager::SetActive(bool active)
 		options.ping_ms = PING_MS;
 		options.hosts_max = HOSTS_MAX;
 		options.host_drop_pings = DROP_PINGS;
-		options.cb = DiscoveryServiceHostsCallback;
+		options.cb = nullptr;
+		options.host_cb = DiscoveryServiceHostCallback;
 		options.cb_user = this;
+		options.targets = nullptr;
+		options.targets_count = 0;
+		options.sends_per_tick = 0;
+		options.send_tick_us = 0;
+		options.timer_service = nullptr;
+		options.reactor = reactor.get();
 
 		sockaddr_in addr = {};
 		addr.sin_family = AF_INET;
@@ -121,37 +129,50 @@ void DiscoveryManager::SendWakeup(const QString &host, const QByteArray &regist_
 		throw Exception(QString("Failed to send Packet: %1").arg(chiaki_error_string(err)));
 }
 
-void DiscoveryManager::DiscoveryServiceHosts(QList<DiscoveryHost> hosts)
+void DiscoveryManager::DiscoveryServiceHostEvent(ChiakiDiscoveryServiceHostEvent event, DiscoveryHost host)
 {
-	this->hosts = std::move(hosts);
+	if(!service_active)
+		return;
+
+	auto it = std::find_if(hosts.begin(), hosts.end(), [&host](const DiscoveryHost &h) {
+		return h.host_id == host.host_id;
+	});
+
+	switch(event)
+	{
+		case CHIAKI_DISCOVERY_SERVICE_HOST_ADDED:
+		case CHIAKI_DISCOVERY_SERVICE_HOST_CHANGED:
+			if(it != hosts.end())
+				*it = host;
+			else
+				hosts.append(host);
+			break;
+		case CHIAKI_DISCOVERY_SERVICE_HOST_REMOVED:
+			if(it != hosts.end())
+				hosts.erase(it);
+			break;
+	}
 	emit HostsUpdated();
 }
 
 class DiscoveryManagerPrivate
 {
 	public:
-		static void DiscoveryServiceHosts(DiscoveryManager *discovery_manager, const QList<DiscoveryHost> &hosts)
+		static void DiscoveryServiceHostEvent(DiscoveryManager *discovery_manager, ChiakiDiscoveryServiceHostEvent event, const DiscoveryHost &host)
 		{
-			QMetaObject::invokeMethod(discovery_manager, "DiscoveryServiceHosts", Qt::ConnectionType::QueuedConnection, Q_ARG(QList<DiscoveryHost>, hosts));
+			QMetaObject::invokeMethod(discovery_manager, "DiscoveryServiceHostEvent", Qt::ConnectionType::QueuedConnection,
+					Q_ARG(ChiakiDiscoveryServiceHostEvent, event), Q_ARG(DiscoveryHost, host));
 		}
 };
 
-static void DiscoveryServiceHostsCallback(ChiakiDiscoveryHost *hosts, size_t hosts_count, void *user)
+static void DiscoveryServiceHostCallback(ChiakiDiscoveryServiceHostEvent event, ChiakiDiscoveryHost *h, void *user)
 {
-	QList<DiscoveryHost> hosts_list;
-	hosts_list.reserve(hosts_count);
-
-	for(size_t i=0; i<hosts_count; i++)
-	{
-		ChiakiDiscoveryHost *h = hosts + i;
-		DiscoveryHost o = {};
-		o.state = h->state;
-		o.host_request_port = o.host_request_port;
+	DiscoveryHost o = {};
+	o.state = h->state;
+	o.host_request_port = h->host_request_port;
 #define CONVERT_STRING(name) if(h->name) { o.name = QString::fromLocal8Bit(h->name); }
-		CHIAKI_DISCOVERY_HOST_STRING_FOREACH(CONVERT_STRING)
+	CHIAKI_DISCOVERY_HOST_STRING_FOREACH(CONVERT_STRING)
 #undef CONVERT_STRING
-		hosts_list.append(o);
-	}
 
-	DiscoveryManagerPrivate::DiscoveryServiceHosts(reinterpret_cast<DiscoveryManager *>(user), hosts_list);
+	DiscoveryManagerPrivate::DiscoveryServiceHostEvent(reinterpret_cast<DiscoveryManager *>(user), event, o);
 }
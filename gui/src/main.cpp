@@ -45,17 +45,47 @@ static const QMap<QString, CLICommand> cli_commands = {
 };
 #endif
 
+#define REACTOR_THREADS 2
+
 int RunStream(QApplication &app, const StreamSessionConnectInfo &connect_info);
 int RunMain(QApplication &app, Settings *settings);
 
+static ChiakiLog reactor_log;
+
+/**
+ * @return reactor to be shared by all sessions and the discovery, nullptr if disabled or not available
+ */
+static std::shared_ptr<ChiakiReactor> CreateReactor(Settings *settings)
+{
+	if(!settings->GetReactorEnabled())
+		return nullptr;
+	chiaki_log_init(&reactor_log, CHIAKI_LOG_ALL & ~CHIAKI_LOG_VERBOSE, chiaki_log_cb_print, nullptr);
+	auto reactor = new ChiakiReactor;
+	ChiakiErrorCode err = chiaki_reactor_init(reactor, &reactor_log, REACTOR_THREADS);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(&reactor_log, "Failed to create reactor, receiving on separate threads instead: %s", chiaki_error_string(err));
+		delete reactor;
+		return nullptr;
+	}
+	// whoever releases it last has already removed all of its sources
+	return std::shared_ptr<ChiakiReactor>(reactor, [](ChiakiReactor *reactor) {
+		chiaki_reactor_fini(reactor);
+		delete reactor;
+	});
+}
+
 int real_main(int argc, char *argv[])
 {
 	qRegisterMetaType<DiscoveryHost>();
+	qRegisterMetaType<ChiakiDiscoveryServiceHostEvent>();
 	qRegisterMetaType<RegisteredHost>();
 	qRegisterMetaType<HostMAC>();
 	qRegisterMetaType<ChiakiQuitReason>();
 	qRegisterMetaType<ChiakiRegistEventType>();
 	qRegisterMetaType<ChiakiLogLevel>();
+	qRegisterMetaType<ChiakiControllerState>();
+	qRegisterMetaType<QList<int>>();
 
 	QApplication::setOrganizationName("Chiaki");
 	QApplication::setApplicationName("Chiaki");
@@ -134,6 +164,7 @@ int real_main(int argc, char *argv[])
 		}
 
 		StreamSessionConnectInfo connect_info(&settings, host, regist_key, morning);
+		connect_info.reactor = CreateReactor(&settings);
 
 		return RunStream(app, connect_info);
 	}
@@ -164,7 +195,7 @@ int real_main(int argc, char *argv[])
 
 int RunMain(QApplication &app, Settings *settings)
 {
-	MainWindow main_window(settings);
+	MainWindow main_window(settings, CreateReactor(settings));
 	main_window.show();
 	return app.exec();
 }
@@ -87,9 +87,10 @@ class IconEngine : public QIconEngine
 		}
 };
 
-MainWindow::MainWindow(Settings *settings, QWidget *parent)
+MainWindow::MainWindow(Settings *settings, std::shared_ptr<ChiakiReactor> reactor, QWidget *parent)
 	: QMainWindow(parent),
-	settings(settings)
+	settings(settings),
+	reactor(reactor)
 {
 	setWindowTitle(qApp->applicationName());
 
@@ -183,6 +184,7 @@ MainWindow::MainWindow(Settings *settings, QWidget *parent)
 
 	resize(800, 600);
 	
+	discovery_manager.SetReactor(reactor);
 	connect(&discovery_manager, &DiscoveryManager::HostsUpdated, this, &MainWindow::UpdateDisplayServers);
 	connect(settings, &Settings::RegisteredHostsUpdated, this, &MainWindow::UpdateDisplayServers);
 	connect(settings, &Settings::ManualHostsUpdated, this, &MainWindow::UpdateDisplayServers);
@@ -264,6 +266,7 @@ void MainWindow::ServerItemWidgetTriggered()
 
 		QString host = server.GetHostAddr();
 		StreamSessionConnectInfo info(settings, host, server.registered_host.GetRPRegistKey(), server.registered_host.GetRPKey());
+		info.reactor = reactor;
 		new StreamWindow(info);
 	}
 	else
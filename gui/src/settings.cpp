@@ -17,6 +17,7 @@
 
 #include <settings.h>
 #include <QKeySequence>
+#include <QUrl>
 
 #define SETTINGS_VERSION 1
 
@@ -135,6 +136,36 @@ ChiakiConnectVideoProfile Settings::GetVideoProfile()
 	return profile;
 }
 
+static QString NetworkCacheGroup(const QString &host)
+{
+	// host may contain characters that QSettings interprets, e.g. '/'
+	return "network_cache/" + QString::fromLatin1(QUrl::toPercentEncoding(host));
+}
+
+ChiakiNetworkCache Settings::GetNetworkCache(const QString &host)
+{
+	ChiakiNetworkCache cache = {};
+	settings.beginGroup(NetworkCacheGroup(host));
+	cache.valid = settings.value("valid", false).toBool();
+	cache.mtu_in = settings.value("mtu_in", 0).toUInt();
+	cache.mtu_out = settings.value("mtu_out", 0).toUInt();
+	cache.rtt_us = settings.value("rtt_us", 0).toULongLong();
+	cache.network_id = settings.value("network_id", 0).toULongLong();
+	settings.endGroup();
+	return cache;
+}
+
+void Settings::SetNetworkCache(const QString &host, const ChiakiNetworkCache &cache)
+{
+	settings.beginGroup(NetworkCacheGroup(host));
+	settings.setValue("valid", cache.valid);
+	settings.setValue("mtu_in", cache.mtu_in);
+	settings.setValue("mtu_out", cache.mtu_out);
+	settings.setValue("rtt_us", (qulonglong)cache.rtt_us);
+	settings.setValue("network_id", (qulonglong)cache.network_id);
+	settings.endGroup();
+}
+
 void Settings::LoadRegisteredHosts()
 {
 	registered_hosts.clear();
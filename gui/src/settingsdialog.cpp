@@ -147,6 +147,11 @@ SettingsDialog::SettingsDialog(Settings *settings, QWidget *parent) : QDialog(pa
 	audio_buffer_size_edit->setPlaceholderText(tr("Default (%1)").arg(settings->GetAudioBufferSizeDefault()));
 	connect(audio_buffer_size_edit, &QLineEdit::textEdited, this, &SettingsDialog::AudioBufferSizeEdited);
 
+	reactor_check_box = new QCheckBox(this);
+	stream_settings_layout->addRow(tr("Shared Receive Threads:\nLinux only, applies after restart."), reactor_check_box);
+	reactor_check_box->setChecked(settings->GetReactorEnabled());
+	connect(reactor_check_box, &QCheckBox::stateChanged, this, &SettingsDialog::ReactorChanged);
+
 	// Decode Settings
 
 	auto decode_settings = new QGroupBox(tr("Decode Settings"));
@@ -273,6 +278,11 @@ void SettingsDialog::HardwareDecodeEngineSelected()
 	settings->SetHardwareDecodeEngine((HardwareDecodeEngine)hardware_decode_combo_box->currentData().toInt());
 }
 
+void SettingsDialog::ReactorChanged()
+{
+	settings->SetReactorEnabled(reactor_check_box->isChecked());
+}
+
 void SettingsDialog::UpdateBitratePlaceholder()
 {
 	bitrate_edit->setPlaceholderText(tr("Automatic (%1)").arg(settings->GetVideoProfile().bitrate));
@@ -20,17 +20,25 @@
 #include <controllermanager.h>
 
 #include <chiaki/base64.h>
+#include <chiaki/time.h>
 
 #include <QKeyEvent>
 #include <QAudioOutput>
+#include <QThread>
 
 #include <cstring>
 #include <chiaki/session.h>
 
-#define SETSU_UPDATE_INTERVAL_MS 4
+#if CHIAKI_GUI_ENABLE_SETSU
+#include <poll.h>
+
+// only bounds how long it takes to notice that the thread should stop
+#define SETSU_WAIT_TIMEOUT_MS 100
+#endif
 
 StreamSessionConnectInfo::StreamSessionConnectInfo(Settings *settings, QString host, QByteArray regist_key, QByteArray morning)
 {
+	this->settings = settings;
 	key_map = settings->GetControllerMappingForDecoding();
 	hw_decode_engine = settings->GetHardwareDecodeEngine();
 	log_level_mask = settings->GetLogLevelMask();
@@ -40,6 +48,7 @@ StreamSessionConnectInfo::StreamSessionConnectInfo(Settings *settings, QString h
 	this->regist_key = regist_key;
 	this->morning = morning;
 	audio_buffer_size = settings->GetAudioBufferSize();
+	network_cache = settings->GetNetworkCache(host);
 }
 
 static void AudioSettingsCb(uint32_t channels, uint32_t rate, void *user);
@@ -48,17 +57,59 @@ static bool VideoSampleCb(uint8_t *buf, size_t buf_size, void *user);
 static void EventCb(ChiakiEvent *event, void *user);
 #if CHIAKI_GUI_ENABLE_SETSU
 static void SessionSetsuCb(SetsuEvent *event, void *user);
+
+/**
+ * Handles all setsu devices outside of the Qt event loop.
+ * setsu and the setsu-related members of StreamSession are only touched from this thread while it runs.
+ */
+class StreamSessionSetsuThread : public QThread
+{
+	private:
+		StreamSession *session;
+		Setsu *setsu;
+
+	protected:
+		void run() override
+		{
+			struct pollfd pfd = {};
+			pfd.fd = setsu_get_fd(setsu);
+			pfd.events = POLLIN;
+			while(!isInterruptionRequested())
+			{
+				int r = poll(&pfd, 1, SETSU_WAIT_TIMEOUT_MS);
+				if(r > 0)
+					setsu_dispatch(setsu, SessionSetsuCb, session);
+			}
+		}
+
+	public:
+		StreamSessionSetsuThread(StreamSession *session, Setsu *setsu) : QThread(session), session(session), setsu(setsu) {}
+};
 #endif
 
 StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObject *parent)
 	: QObject(parent),
 	log(this, connect_info.log_level_mask, connect_info.log_file),
 	controller(nullptr),
+#if CHIAKI_GUI_ENABLE_SETSU
+	setsu(nullptr),
+	setsu_thread(nullptr),
+	setsu_dirty(false),
+#endif
+	input_latency_sum_us(0),
+	input_latency_max_us(0),
+	input_latency_count(0),
 	video_decoder(connect_info.hw_decode_engine, log.GetChiakiLog()),
 	audio_output(nullptr),
-	audio_io(nullptr)
+	audio_io(nullptr),
+	audio_channels(2)
 {
 	chiaki_opus_decoder_init(&opus_decoder, log.GetChiakiLog());
+	if(chiaki_audio_resampler_init(&audio_resampler, audio_channels) != CHIAKI_ERR_SUCCESS)
+	{
+		chiaki_opus_decoder_fini(&opus_decoder);
+		throw ChiakiException("Audio Resampler Init failed");
+	}
 	audio_buffer_size = connect_info.audio_buffer_size;
 
 	QByteArray host_str = connect_info.host.toUtf8();
@@ -66,6 +117,13 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 	ChiakiConnectInfo chiaki_connect_info;
 	chiaki_connect_info.host = host_str.constData();
 	chiaki_connect_info.video_profile = connect_info.video_profile;
+	chiaki_connect_info.network_cache = connect_info.network_cache;
+	reactor = connect_info.reactor;
+	chiaki_connect_info.reactor = reactor.get();
+	chiaki_connect_info.fec_pool = nullptr;
+	chiaki_connect_info.receive_pipeline_workers = 0;
+	chiaki_connect_info.socket_tuning = {};
+	chiaki_connect_info.allocator = nullptr;
 
 	if(connect_info.regist_key.size() != sizeof(chiaki_connect_info.regist_key))
 		throw ChiakiException("RegistKey invalid");
@@ -75,6 +133,7 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 		throw ChiakiException("Morning invalid");
 	memcpy(chiaki_connect_info.morning, connect_info.morning.constData(), sizeof(chiaki_connect_info.morning));
 
+	chiaki_controller_state_set_idle(&controller_state);
 	chiaki_controller_state_set_idle(&keyboard_state);
 
 	ChiakiErrorCode err = chiaki_session_init(&session, &chiaki_connect_info, log.GetChiakiLog());
@@ -96,28 +155,50 @@ StreamSession::StreamSession(const StreamSessionConnectInfo &connect_info, QObje
 #if CHIAKI_GUI_ENABLE_SETSU
 	chiaki_controller_state_set_idle(&setsu_state);
 	setsu = setsu_new();
-	auto timer = new QTimer(this);
-	connect(timer, &QTimer::timeout, this, [this]{
-		setsu_poll(setsu, SessionSetsuCb, this);
-	});
-	timer->start(SETSU_UPDATE_INTERVAL_MS);
+	if(setsu)
+	{
+		setsu_thread = new StreamSessionSetsuThread(this, setsu);
+		setsu_thread->start();
+	}
 #endif
 
 	key_map = connect_info.key_map;
+	settings = connect_info.settings;
+	host = connect_info.host;
 	UpdateGamepads();
 }
 
 StreamSession::~StreamSession()
 {
-	chiaki_session_join(&session);
-	chiaki_session_fini(&session);
-	chiaki_opus_decoder_fini(&opus_decoder);
+	// stop all input sources first, they call into the session from their own threads
 #if CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
 	delete controller;
+	controller = nullptr;
 #endif
 #if CHIAKI_GUI_ENABLE_SETSU
-	setsu_free(setsu);
+	if(setsu_thread)
+	{
+		setsu_thread->requestInterruption();
+		setsu_thread->wait();
+	}
+	if(setsu)
+		setsu_free(setsu);
 #endif
+
+	if(input_latency_count)
+	{
+		CHIAKI_LOGI(log.GetChiakiLog(), "Input latency from reception to session: avg %llu us, max %llu us over %llu inputs",
+				(unsigned long long)(input_latency_sum_us / input_latency_count),
+				(unsigned long long)input_latency_max_us,
+				(unsigned long long)input_latency_count);
+	}
+
+	chiaki_session_join(&session);
+	if(session.network_cache.valid && settings)
+		settings->SetNetworkCache(host, session.network_cache);
+	chiaki_session_fini(&session);
+	chiaki_opus_decoder_fini(&opus_decoder);
+	chiaki_audio_resampler_fini(&audio_resampler);
 }
 
 void StreamSession::Start()
@@ -143,11 +224,15 @@ void StreamSession::SetLoginPIN(const QString &pin)
 
 void StreamSession::HandleMouseEvent(QMouseEvent *event)
 {
-	if(event->type() == QEvent::MouseButtonPress)
-		keyboard_state.buttons |= CHIAKI_CONTROLLER_BUTTON_TOUCHPAD;
-	else
-		keyboard_state.buttons &= ~CHIAKI_CONTROLLER_BUTTON_TOUCHPAD;
-	SendFeedbackState();
+	uint64_t timestamp_us = chiaki_time_now_monotonic_us();
+	{
+		QMutexLocker locker(&input_mutex);
+		if(event->type() == QEvent::MouseButtonPress)
+			keyboard_state.buttons |= CHIAKI_CONTROLLER_BUTTON_TOUCHPAD;
+		else
+			keyboard_state.buttons &= ~CHIAKI_CONTROLLER_BUTTON_TOUCHPAD;
+	}
+	SendFeedbackState(timestamp_us);
 }
 
 void StreamSession::HandleKeyboardEvent(QKeyEvent *event)
@@ -158,9 +243,12 @@ void StreamSession::HandleKeyboardEvent(QKeyEvent *event)
 	if(event->isAutoRepeat())
 		return;
 
+	uint64_t timestamp_us = chiaki_time_now_monotonic_us();
 	int button = key_map[Qt::Key(event->key())];
 	bool press_event = event->type() == QEvent::Type::KeyPress;
 
+	QMutexLocker locker(&input_mutex);
+
 	switch(button)
 	{
 		case CHIAKI_CONTROLLER_ANALOG_BUTTON_L2:
@@ -201,7 +289,8 @@ void StreamSession::HandleKeyboardEvent(QKeyEvent *event)
 			break;
 	}
 
-	SendFeedbackState();
+	locker.unlock();
+	SendFeedbackState(timestamp_us);
 }
 
 void StreamSession::UpdateGamepads()
@@ -214,6 +303,8 @@ void StreamSession::UpdateGamepads()
 			CHIAKI_LOGI(log.GetChiakiLog(), "Controller %d disconnected", controller->GetDeviceID());
 			delete controller;
 			controller = nullptr;
+			QMutexLocker locker(&input_mutex);
+			chiaki_controller_state_set_idle(&controller_state);
 		}
 		const auto available_controllers = ControllerManager::GetInstance()->GetAvailableControllers();
 		if(!available_controllers.isEmpty())
@@ -225,30 +316,43 @@ void StreamSession::UpdateGamepads()
 				return;
 			}
 			CHIAKI_LOGI(log.GetChiakiLog(), "Controller %d opened: \"%s\"", available_controllers[0], controller->GetName().toLocal8Bit().constData());
-			connect(controller, &Controller::StateChanged, this, &StreamSession::SendFeedbackState);
+			// Direct, so the state goes from the event thread to the session without waiting for the gui thread.
+			// This only touches the input state and the session, never SDL.
+			connect(controller, &Controller::StateChanged, this, [this](ChiakiControllerState state, uint64_t timestamp_us) {
+				{
+					QMutexLocker locker(&input_mutex);
+					controller_state = state;
+				}
+				SendFeedbackState(timestamp_us);
+			}, Qt::DirectConnection);
+
+			ChiakiControllerState state = controller->GetState();
+			QMutexLocker locker(&input_mutex);
+			controller_state = state;
 		}
 	}
 
-	SendFeedbackState();
+	SendFeedbackState(chiaki_time_now_monotonic_us());
 #endif
 }
 
-void StreamSession::SendFeedbackState()
+void StreamSession::SendFeedbackState(uint64_t timestamp_us)
 {
-	ChiakiControllerState state;
-	chiaki_controller_state_set_idle(&state);
-
-#if CHIAKI_GUI_ENABLE_SDL_GAMECONTROLLER
-	if(controller)
-		state = controller->GetState();
-#endif
+	QMutexLocker locker(&input_mutex);
 
+	ChiakiControllerState state = controller_state;
 #if CHIAKI_GUI_ENABLE_SETSU
 	chiaki_controller_state_or(&state, &state, &setsu_state);
 #endif
-
 	chiaki_controller_state_or(&state, &state, &keyboard_state);
 	chiaki_session_set_controller_state(&session, &state);
+
+	uint64_t now = chiaki_time_now_monotonic_us();
+	uint64_t latency = now > timestamp_us ? now - timestamp_us : 0;
+	input_latency_sum_us += latency;
+	if(latency > input_latency_max_us)
+		input_latency_max_us = latency;
+	input_latency_count++;
 }
 
 void StreamSession::InitAudio(unsigned int channels, unsigned int rate)
@@ -257,6 +361,20 @@ void StreamSession::InitAudio(unsigned int channels, unsigned int rate)
 	audio_output = nullptr;
 	audio_io = nullptr;
 
+	if(channels != audio_channels)
+	{
+		chiaki_audio_resampler_fini(&audio_resampler);
+		if(chiaki_audio_resampler_init(&audio_resampler, channels) != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(log.GetChiakiLog(), "Failed to init Audio Resampler for %u channels", channels);
+			chiaki_audio_resampler_init(&audio_resampler, audio_channels);
+			return;
+		}
+		audio_channels = channels;
+	}
+	else
+		chiaki_audio_resampler_reset(&audio_resampler);
+
 	QAudioFormat audio_format;
 	audio_format.setSampleRate(rate);
 	audio_format.setChannelCount(channels);
@@ -286,7 +404,29 @@ void StreamSession::PushAudioFrame(int16_t *buf, size_t samples_count)
 {
 	if(!audio_io)
 		return;
-	audio_io->write((const char *)buf, static_cast<qint64>(samples_count * 2 * 2));
+
+	// The remote clock and the one of the audio device drift apart slowly, so keep the
+	// fill level of the device buffer at half its size by resampling very slightly.
+	size_t frame_size = audio_channels * sizeof(int16_t);
+	size_t buffer_frames = static_cast<size_t>(audio_output->bufferSize()) / frame_size;
+	size_t free_frames = static_cast<size_t>(audio_output->bytesFree()) / frame_size;
+	size_t fill_frames = buffer_frames > free_frames ? buffer_frames - free_frames : 0;
+	chiaki_audio_resampler_update_fill(&audio_resampler, fill_frames, buffer_frames / 2);
+
+	size_t out_frames_max = chiaki_audio_resampler_out_frames_max(&audio_resampler, samples_count);
+	if(audio_resampler_buf.size() < out_frames_max * audio_channels)
+		audio_resampler_buf.resize(out_frames_max * audio_channels);
+
+	size_t out_frames;
+	ChiakiErrorCode err = chiaki_audio_resampler_process(&audio_resampler, buf, samples_count,
+			audio_resampler_buf.data(), out_frames_max, &out_frames);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		// fall back to the unmodified samples
+		audio_io->write((const char *)buf, static_cast<qint64>(samples_count * frame_size));
+		return;
+	}
+	audio_io->write((const char *)audio_resampler_buf.data(), static_cast<qint64>(out_frames * frame_size));
 }
 
 void StreamSession::PushVideoSample(uint8_t *buf, size_t buf_size)
@@ -306,6 +446,14 @@ void StreamSession::Event(ChiakiEvent *event)
 		case CHIAKI_EVENT_LOGIN_PIN_REQUEST:
 			emit LoginPINRequested(event->login_pin_request.pin_incorrect);
 			break;
+		case CHIAKI_EVENT_STARTUP_REPORT: // already written to the log by the lib
+			break;
+		case CHIAKI_EVENT_VIDEO_PROFILES:
+			video_decoder.SetProfiles(event->video_profiles.profiles, event->video_profiles.profiles_count);
+			break;
+		case CHIAKI_EVENT_VIDEO_PROFILE_SWITCH:
+			video_decoder.SwitchProfile(event->video_profile_switch.profile_index);
+			break;
 	}
 }
 
@@ -314,6 +462,8 @@ void StreamSession::HandleSetsuEvent(SetsuEvent *event)
 {
 	if(!setsu)
 		return;
+	bool changed = false;
+	QMutexLocker locker(&input_mutex);
 	switch(event->type)
 	{
 		case SETSU_EVENT_DEVICE_ADDED:
@@ -330,7 +480,7 @@ void StreamSession::HandleSetsuEvent(SetsuEvent *event)
 				else
 					it++;
 			}
-			SendFeedbackState();
+			changed = true;
 			break;
 		case SETSU_EVENT_TOUCH_DOWN:
 			break;
@@ -344,7 +494,7 @@ void StreamSession::HandleSetsuEvent(SetsuEvent *event)
 					break;
 				}
 			}
-			SendFeedbackState();
+			setsu_dirty = true;
 			break;
 		case SETSU_EVENT_TOUCH_POSITION: {
 			QPair<QString, SetsuTrackingId> k =  { setsu_device_get_path(event->dev), event->tracking_id };
@@ -359,16 +509,26 @@ void StreamSession::HandleSetsuEvent(SetsuEvent *event)
 			}
 			else
 				chiaki_controller_state_set_touch_pos(&setsu_state, it.value(), event->x, event->y);
-			SendFeedbackState();
+			setsu_dirty = true;
 			break;
 		}
 		case SETSU_EVENT_BUTTON_DOWN:
 			setsu_state.buttons |= CHIAKI_CONTROLLER_BUTTON_TOUCHPAD;
+			setsu_dirty = true;
 			break;
 		case SETSU_EVENT_BUTTON_UP:
 			setsu_state.buttons &= ~CHIAKI_CONTROLLER_BUTTON_TOUCHPAD;
+			setsu_dirty = true;
+			break;
+		case SETSU_EVENT_SYNC:
+			// send everything from one report of the device at once
+			changed = setsu_dirty;
+			setsu_dirty = false;
 			break;
 	}
+	locker.unlock();
+	if(changed)
+		SendFeedbackState(event->timestamp_us);
 }
 #endif
 
@@ -33,10 +33,6 @@ VideoDecoder::VideoDecoder(HardwareDecodeEngine hw_decode_engine, ChiakiLog *log
 	if(!codec)
 		throw VideoDecoderException("H264 Codec not available");
 
-	codec_context = avcodec_alloc_context3(codec);
-	if(!codec_context)
-		throw VideoDecoderException("Failed to alloc codec context");
-
 	if(hw_decode_engine)
 	{
 		if(!hardware_decode_engine_names.contains(hw_decode_engine))
@@ -62,18 +58,27 @@ VideoDecoder::VideoDecoder(HardwareDecodeEngine hw_decode_engine, ChiakiLog *log
 
 		if(av_hwdevice_ctx_create(&hw_device_ctx, type, NULL, NULL, 0) < 0)
 			throw VideoDecoderException("Failed to create hwdevice context");
-		codec_context->hw_device_ctx = av_buffer_ref(hw_device_ctx);
 	}
 
-	if(avcodec_open2(codec_context, codec, nullptr) < 0)
+	try
 	{
-		avcodec_free_context(&codec_context);
-		throw VideoDecoderException("Failed to open codec context");
+		codec_context = CreateCodecContext();
+	}
+	catch(const VideoDecoderException &)
+	{
+		if(hw_device_ctx)
+			av_buffer_unref(&hw_device_ctx);
+		throw;
 	}
+	active_codec_context = codec_context;
+	drained_frame = nullptr;
 }
 
 VideoDecoder::~VideoDecoder()
 {
+	if(drained_frame)
+		av_frame_free(&drained_frame);
+	FreeProfileCodecContexts();
 	avcodec_close(codec_context);
 	avcodec_free_context(&codec_context);
 	if(hw_device_ctx)
@@ -82,6 +87,132 @@ VideoDecoder::~VideoDecoder()
 	}
 }
 
+AVCodecContext *VideoDecoder::CreateCodecContext()
+{
+	AVCodecContext *context = avcodec_alloc_context3(codec);
+	if(!context)
+		throw VideoDecoderException("Failed to alloc codec context");
+
+	if(hw_device_ctx)
+		context->hw_device_ctx = av_buffer_ref(hw_device_ctx);
+
+	if(avcodec_open2(context, codec, nullptr) < 0)
+	{
+		avcodec_free_context(&context);
+		throw VideoDecoderException("Failed to open codec context");
+	}
+	return context;
+}
+
+void VideoDecoder::FreeProfileCodecContexts()
+{
+	for(AVCodecContext *context : profile_codec_contexts)
+	{
+		avcodec_close(context);
+		avcodec_free_context(&context);
+	}
+	profile_codec_contexts.clear();
+	active_codec_context = codec_context;
+}
+
+void VideoDecoder::SetProfiles(const ChiakiVideoProfile *profiles, size_t profiles_count)
+{
+	QMutexLocker locker(&mutex);
+	FreeProfileCodecContexts();
+
+	for(size_t i=0; i<profiles_count; i++)
+	{
+		AVCodecContext *context;
+		try
+		{
+			context = CreateCodecContext();
+		}
+		catch(const VideoDecoderException &e)
+		{
+			CHIAKI_LOGE(log, "Failed to pre-open codec context for video profile %zu, switching profiles will re-configure a single context: %s",
+					i, e.what());
+			FreeProfileCodecContexts();
+			return;
+		}
+
+		// parsing SPS/PPS here already means the first frame of the profile can be decoded right away
+		AVPacket packet;
+		av_init_packet(&packet);
+		packet.data = profiles[i].header;
+		packet.size = static_cast<int>(profiles[i].header_sz);
+		int r = avcodec_send_packet(context, &packet);
+		if(r != 0)
+		{
+			char errbuf[128];
+			av_make_error_string(errbuf, sizeof(errbuf), r);
+			CHIAKI_LOGW(log, "Failed to push header of video profile %zu: %s", i, errbuf);
+		}
+
+		profile_codec_contexts.push_back(context);
+	}
+
+	CHIAKI_LOGI(log, "Pre-opened codec contexts for %zu video profiles", profiles_count);
+}
+
+void VideoDecoder::SwitchProfile(size_t profile_index)
+{
+	QMutexLocker locker(&mutex);
+	if(profile_index >= profile_codec_contexts.size())
+		return;
+	AVCodecContext *context = profile_codec_contexts[profile_index];
+	if(context == active_codec_context)
+		return;
+	DrainActiveCodecContext();
+	// the context keeps its parameter sets, the next keyframe resets everything else
+	active_codec_context = context;
+	CHIAKI_LOGI(log, "Video decoder switched to codec context of profile %zu", profile_index);
+}
+
+void VideoDecoder::DrainActiveCodecContext()
+{
+	// frames still buffered in the old context would be lost after switching,
+	// only the last one is kept since PullFrame() returns only the very last frame anyway
+	int r = avcodec_send_packet(active_codec_context, nullptr);
+	if(r != 0 && r != AVERROR_EOF)
+	{
+		char errbuf[128];
+		av_make_error_string(errbuf, sizeof(errbuf), r);
+		CHIAKI_LOGW(log, "Failed to start draining codec context: %s", errbuf);
+	}
+
+	while(true)
+	{
+		AVFrame *frame = av_frame_alloc();
+		if(!frame)
+		{
+			CHIAKI_LOGE(log, "Failed to alloc AVFrame");
+			break;
+		}
+		r = avcodec_receive_frame(active_codec_context, frame);
+		if(r != 0)
+		{
+			av_frame_free(&frame);
+			if(r != AVERROR_EOF && r != AVERROR(EAGAIN))
+				CHIAKI_LOGE(log, "Decoding with FFMPEG failed while draining codec context");
+			break;
+		}
+		if(hw_decode_engine)
+		{
+			AVFrame *sw_frame = GetFromHardware(frame);
+			av_frame_free(&frame);
+			if(!sw_frame)
+				continue;
+			frame = sw_frame;
+		}
+		if(drained_frame)
+			av_frame_free(&drained_frame);
+		drained_frame = frame;
+	}
+
+	// leave draining mode so the context can be switched back to later
+	avcodec_flush_buffers(active_codec_context);
+}
+
 void VideoDecoder::PushFrame(uint8_t *buf, size_t buf_size)
 {
 	{
@@ -93,7 +224,7 @@ void VideoDecoder::PushFrame(uint8_t *buf, size_t buf_size)
 		packet.size = buf_size;
 		int r;
 send_packet:
-		r = avcodec_send_packet(codec_context, &packet);
+		r = avcodec_send_packet(active_codec_context, &packet);
 		if(r != 0)
 		{
 			if(r == AVERROR(EAGAIN))
@@ -105,7 +236,7 @@ send_packet:
 					CHIAKI_LOGE(log, "Failed to alloc AVFrame");
 					return;
 				}
-				r = avcodec_receive_frame(codec_context, frame);
+				r = avcodec_receive_frame(active_codec_context, frame);
 				av_frame_free(&frame);
 				if(r != 0)
 				{
@@ -134,7 +265,8 @@ AVFrame *VideoDecoder::PullFrame()
 	// always try to pull as much as possible and return only the very last frame
 	AVFrame *frame_last = nullptr;
 	AVFrame *sw_frame = nullptr;
-	AVFrame *frame = nullptr; 
+	AVFrame *frame = drained_frame; // superseded by any frame of the active context
+	drained_frame = nullptr;
 	while(true)
 	{
 		AVFrame *next_frame;
@@ -151,7 +283,7 @@ AVFrame *VideoDecoder::PullFrame()
 		}
 		frame_last = frame;
 		frame = next_frame;
-		int r = avcodec_receive_frame(codec_context, frame);
+		int r = avcodec_receive_frame(active_codec_context, frame);
 		if(r == 0)
 		{
 			frame = hw_decode_engine ? GetFromHardware(frame) : frame;
@@ -0,0 +1,127 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_AUDIORESAMPLER_H
+#define CHIAKI_AUDIORESAMPLER_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_AUDIO_RESAMPLER_TAPS 16
+#define CHIAKI_AUDIO_RESAMPLER_PHASES 128
+
+/**
+ * Maximum deviation of the resampling ratio from 1.0 that the drift estimator will apply.
+ * 0.5% corresponds to a pitch shift of less than 9 cents.
+ */
+#define CHIAKI_AUDIO_RESAMPLER_RATIO_DEVIATION_MAX 0.005
+
+/**
+ * Fractional resampler with a polyphase windowed-sinc filter meant to compensate for small
+ * clock differences between the remote audio stream and the local output device.
+ *
+ * The ratio is either set manually or driven by feeding the fill level of the output
+ * buffer to chiaki_audio_resampler_update_fill().
+ */
+typedef struct chiaki_audio_resampler_t
+{
+	unsigned int channels;
+
+	/**
+	 * (CHIAKI_AUDIO_RESAMPLER_PHASES + 1) rows of CHIAKI_AUDIO_RESAMPLER_TAPS coefficients
+	 */
+	float *filter;
+
+	/**
+	 * planar input history, channels * buf_frames_size floats
+	 */
+	float *buf;
+	size_t buf_frames_size;
+	size_t buf_frames;
+
+	/**
+	 * read position in buf in input frames
+	 */
+	double pos;
+
+	/**
+	 * output rate / input rate
+	 */
+	double ratio;
+
+	double fill_avg;
+	double drift_integral;
+	bool fill_avg_valid;
+} ChiakiAudioResampler;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_resampler_init(ChiakiAudioResampler *resampler, unsigned int channels);
+CHIAKI_EXPORT void chiaki_audio_resampler_fini(ChiakiAudioResampler *resampler);
+
+/**
+ * Drop all buffered input and reset the drift estimation
+ */
+CHIAKI_EXPORT void chiaki_audio_resampler_reset(ChiakiAudioResampler *resampler);
+
+static inline void chiaki_audio_resampler_set_ratio(ChiakiAudioResampler *resampler, double ratio)
+{
+	resampler->ratio = ratio;
+}
+
+static inline double chiaki_audio_resampler_get_ratio(ChiakiAudioResampler *resampler)
+{
+	return resampler->ratio;
+}
+
+/**
+ * @return the maximum number of frames chiaki_audio_resampler_process() can output for in_frames input frames
+ */
+static inline size_t chiaki_audio_resampler_out_frames_max(ChiakiAudioResampler *resampler, size_t in_frames)
+{
+	return (size_t)((double)(in_frames + CHIAKI_AUDIO_RESAMPLER_TAPS) * resampler->ratio) + 2;
+}
+
+/**
+ * Feed the current fill level of the output buffer to the drift estimator,
+ * which adjusts the ratio to keep the fill level at target_frames.
+ *
+ * Call this once before every chiaki_audio_resampler_process().
+ */
+CHIAKI_EXPORT void chiaki_audio_resampler_update_fill(ChiakiAudioResampler *resampler, size_t fill_frames, size_t target_frames);
+
+/**
+ * Resample interleaved 16-bit samples.
+ *
+ * Input that can not be processed yet is kept internally for the next call.
+ *
+ * @param out buffer for at least out_frames_max interleaved frames
+ * @param out_frames number of frames written to out
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_resampler_process(ChiakiAudioResampler *resampler,
+		const int16_t *in, size_t in_frames, int16_t *out, size_t out_frames_max, size_t *out_frames);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_AUDIORESAMPLER_H
@@ -0,0 +1,97 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_CLOCK_H
+#define CHIAKI_CLOCK_H
+
+#include "common.h"
+#include "thread.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chiaki_clock_t ChiakiClock;
+
+/**
+ * Source of time for components whose timing should be testable, e.g. in virtual time with ChiakiSimNet.
+ */
+struct chiaki_clock_t
+{
+	uint64_t (*now_us)(ChiakiClock *clock);
+
+	/**
+	 * Like chiaki_cond_timedwait_us(), but until deadline_us in the time base of this clock.
+	 * UINT64_MAX waits without a deadline. May wake up spuriously.
+	 */
+	ChiakiErrorCode (*cond_wait_until)(ChiakiClock *clock, ChiakiCond *cond, ChiakiMutex *mutex, uint64_t deadline_us);
+
+	/**
+	 * Optional, called right before cond is signaled or broadcast, so the clock knows that threads waiting on it in
+	 * cond_wait_until() are about to wake up. Conds waited on with the clock must always be woken through it,
+	 * see chiaki_clock_cond_signal().
+	 */
+	void (*cond_notify)(ChiakiClock *clock, ChiakiCond *cond);
+
+	/**
+	 * Optional, for clocks that only advance while every thread taking part is waiting on them, like ChiakiSimNet.
+	 * thread_add() is called before such a thread is created, thread_remove() once it is done.
+	 * See chiaki_clock_thread_create().
+	 */
+	void (*thread_add)(ChiakiClock *clock);
+	void (*thread_remove)(ChiakiClock *clock);
+};
+
+/**
+ * The clock of chiaki_time_now_monotonic_us()
+ */
+CHIAKI_EXPORT ChiakiClock *chiaki_clock_system(void);
+
+static inline uint64_t chiaki_clock_now_us(ChiakiClock *clock) { return clock->now_us(clock); }
+static inline uint64_t chiaki_clock_now_ms(ChiakiClock *clock) { return clock->now_us(clock) / 1000; }
+
+static inline ChiakiErrorCode chiaki_clock_cond_wait_until(ChiakiClock *clock, ChiakiCond *cond, ChiakiMutex *mutex, uint64_t deadline_us)
+{
+	return clock->cond_wait_until(clock, cond, mutex, deadline_us);
+}
+
+static inline ChiakiErrorCode chiaki_clock_cond_signal(ChiakiClock *clock, ChiakiCond *cond)
+{
+	if(clock->cond_notify)
+		clock->cond_notify(clock, cond);
+	return chiaki_cond_signal(cond);
+}
+
+static inline ChiakiErrorCode chiaki_clock_cond_broadcast(ChiakiClock *clock, ChiakiCond *cond)
+{
+	if(clock->cond_notify)
+		clock->cond_notify(clock, cond);
+	return chiaki_cond_broadcast(cond);
+}
+
+/**
+ * Like chiaki_thread_create(), for a thread that waits on clock. The thread is added to the clock for as long as func runs.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_clock_thread_create(ChiakiClock *clock, ChiakiThread *thread, ChiakiThreadFunc func, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_CLOCK_H
@@ -19,7 +19,7 @@
 #define CHIAKI_CONGESTIONCONTROL_H
 
 #include "takion.h"
-#include "thread.h"
+#include "timerservice.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -28,14 +28,14 @@ extern "C" {
 typedef struct chiaki_congestion_control_t
 {
 	ChiakiTakion *takion;
-	ChiakiThread thread;
-	ChiakiBoolPredCond stop_cond;
+	ChiakiTimerService *timer_service;
+	ChiakiTimer timer;
 } ChiakiCongestionControl;
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiTimerService *timer_service);
 
 /**
- * Stop control and join the thread
+ * Stop control and wait for a currently running send to finish
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_stop(ChiakiCongestionControl *control);
 
@@ -100,6 +100,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_send(ChiakiDiscovery *discovery,
 
 typedef void (*ChiakiDiscoveryCb)(ChiakiDiscoveryHost *host, void *user);
 
+/**
+ * Receive one datagram from the socket and pass it to cb if it is a valid response.
+ * @param block if false, return CHIAKI_ERR_TIMEOUT right away when nothing is pending, e.g. when driven by a ChiakiReactor
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_recv(ChiakiDiscovery *discovery, bool block, ChiakiDiscoveryCb cb, void *cb_user);
+
 typedef struct chiaki_discovery_thread_t
 {
 	ChiakiDiscovery *discovery;
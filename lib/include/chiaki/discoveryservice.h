@@ -20,27 +20,98 @@
 #define CHIAKI_DISCOVERYSERVICE_H
 
 #include "discovery.h"
+#include "timerservice.h"
+#include "reactor.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * Called with the full list of hosts after every change.
+ */
 typedef void (*ChiakiDiscoveryServiceCb)(ChiakiDiscoveryHost *hosts, size_t hosts_count, void *user);
 
+typedef enum chiaki_discovery_service_host_event_t
+{
+	CHIAKI_DISCOVERY_SERVICE_HOST_ADDED,
+	CHIAKI_DISCOVERY_SERVICE_HOST_CHANGED,
+	CHIAKI_DISCOVERY_SERVICE_HOST_REMOVED
+} ChiakiDiscoveryServiceHostEvent;
+
+/**
+ * Called once for every single host that appeared, changed or disappeared.
+ * host is only valid during the callback.
+ */
+typedef void (*ChiakiDiscoveryServiceHostCb)(ChiakiDiscoveryServiceHostEvent event, ChiakiDiscoveryHost *host, void *user);
+
+#define CHIAKI_DISCOVERY_SERVICE_TARGET_PREFIX_LEN_MIN 16
+
+/**
+ * IPv4 destination of discovery pings
+ */
+typedef struct chiaki_discovery_service_target_t
+{
+	uint32_t addr; // host byte order
+	uint8_t prefix_len; // 32 to send to addr only (unicast or broadcast), less to send to every host address of the subnet
+	uint16_t port; // 0 for CHIAKI_DISCOVERY_PORT
+} ChiakiDiscoveryServiceTarget;
+
+/**
+ * Parse "a.b.c.d" or "a.b.c.d/prefix_len" into target with the default port.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_service_target_parse(ChiakiDiscoveryServiceTarget *target, const char *str);
+
+/**
+ * @return number of addresses a ping is sent to for target
+ */
+CHIAKI_EXPORT uint64_t chiaki_discovery_service_target_addrs_count(const ChiakiDiscoveryServiceTarget *target);
+
 typedef struct chiaki_discovery_service_options_t
 {
 	size_t hosts_max;
 	uint64_t host_drop_pings;
 	uint64_t ping_ms;
+
+	/**
+	 * Optional address that is pinged as-is, e.g. a broadcast address, in addition to targets
+	 */
 	struct sockaddr *send_addr;
 	size_t send_addr_size;
-	ChiakiDiscoveryServiceCb cb;
+
+	ChiakiDiscoveryServiceTarget *targets;
+	size_t targets_count;
+
+	/**
+	 * If not 0, the pings of one round are spread out to at most sends_per_tick packets every send_tick_us
+	 */
+	size_t sends_per_tick;
+	uint64_t send_tick_us;
+
+	ChiakiDiscoveryServiceCb cb; // optional
+	ChiakiDiscoveryServiceHostCb host_cb; // optional
 	void *cb_user;
+
+	/**
+	 * Optional timer service to send the pings from, if NULL the Discovery Service creates its own.
+	 */
+	ChiakiTimerService *timer_service;
+
+	/**
+	 * Optional reactor to receive the responses on, if NULL or registering fails the Discovery Service uses a thread of its own.
+	 */
+	ChiakiReactor *reactor;
 } ChiakiDiscoveryServiceOptions;
 
 typedef struct chiaki_discovery_service_host_discovery_info_t
 {
 	uint64_t last_ping_index;
+	uint32_t id_hash;
+	uint32_t addr_hash;
+	size_t id_next; // next host in the same bucket of id_buckets, SIZE_MAX at the end
+	size_t addr_next; // next host in the same bucket of addr_buckets, SIZE_MAX at the end
+	size_t lru_prev;
+	size_t lru_next;
 } ChiakiDiscoveryServiceHostDiscoveryInfo;
 
 typedef struct chiaki_discovery_service_t
@@ -50,13 +121,39 @@ typedef struct chiaki_discovery_service_t
 	ChiakiDiscovery discovery;
 
 	uint64_t ping_index;
+
+	/**
+	 * Dense arrays of hosts_count entries, removing a host moves the last one into its place.
+	 */
 	ChiakiDiscoveryHost *hosts;
 	ChiakiDiscoveryServiceHostDiscoveryInfo *host_discovery_infos;
 	size_t hosts_count;
+
+	/**
+	 * Hash indices into hosts by host_id and host_addr
+	 */
+	size_t *id_buckets;
+	size_t *addr_buckets;
+	size_t buckets_mask;
+
+	/**
+	 * Hosts ordered by their last response, oldest first, so dropping only looks at the hosts that are actually stale
+	 */
+	size_t lru_head;
+	size_t lru_tail;
+
 	ChiakiMutex state_mutex;
 
-	ChiakiThread thread;
-	ChiakiBoolPredCond stop_cond;
+	uint64_t round_addrs_count;
+	uint64_t round_pos; // only accessed from the timer callbacks
+
+	ChiakiDiscoveryThread discovery_thread; // only used if reactor_active is false
+	ChiakiReactorSource reactor_source;
+	bool reactor_active;
+	ChiakiTimerService *timer_service;
+	ChiakiTimerService own_timer_service; // used if options.timer_service is NULL
+	ChiakiTimer ping_timer;
+	ChiakiTimer pace_timer;
 } ChiakiDiscoveryService;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_service_init(ChiakiDiscoveryService *service, ChiakiDiscoveryServiceOptions *options, ChiakiLog *log);
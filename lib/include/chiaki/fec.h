@@ -19,8 +19,10 @@
 #define CHIAKI_FEC_H
 
 #include "common.h"
+#include "fecpool.h"
 
 #include <stdint.h>
+#include <stddef.h>
 #ifndef _WIN32
 #include <unistd.h>
 #endif
@@ -33,6 +35,64 @@ extern "C" {
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decode(uint8_t *frame_buf, size_t unit_size, unsigned int k, unsigned int m, const unsigned int *erasures, size_t erasures_count);
 
+/**
+ * Decodes the units of one frame at a time while they arrive.
+ *
+ * Once a source unit is known to be missing, i.e. a later one has arrived or parity has started arriving,
+ * every received source unit is folded into an accumulator per parity row right away.
+ * chiaki_fec_decoder_finish() then only has to solve for the missing units, which is independent of k.
+ */
+typedef struct chiaki_fec_decoder_t
+{
+	ChiakiFecPool *pool; // optional, may be set by the user at any time between frames
+
+	uint8_t *frame_buf;
+	size_t unit_size;
+	unsigned int k;
+	unsigned int m;
+
+	int *matrix; // m x k coding matrix, kept while k and m don't change
+	unsigned int matrix_k;
+	unsigned int matrix_m;
+
+	uint8_t *acc_buf; // unit_size per parity row, sum of all received source units weighted by the row
+	size_t acc_buf_size;
+	uint8_t *received; // k + m flags
+	uint8_t *row_active; // m flags, whether the row's accumulator is up to date
+	size_t flags_size;
+
+	unsigned int source_received;
+	unsigned int source_next; // one past the highest source unit received
+	unsigned int source_skipped; // source units below source_next not received
+	unsigned int parity_next; // one past the highest parity row received
+	unsigned int rows_active;
+} ChiakiFecDecoder;
+
+CHIAKI_EXPORT void chiaki_fec_decoder_init(ChiakiFecDecoder *decoder);
+CHIAKI_EXPORT void chiaki_fec_decoder_fini(ChiakiFecDecoder *decoder);
+
+/**
+ * Start a new frame.
+ *
+ * @param frame_buf k + m units of unit_size each, all zero initially.
+ * Must stay valid until the next reset. Received units are written into it by the caller.
+ * @param m may be 0 for frames without parity, which can then only be finished if all source units arrive.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decoder_reset(ChiakiFecDecoder *decoder, uint8_t *frame_buf, size_t unit_size, unsigned int k, unsigned int m);
+
+/**
+ * Notify the decoder that the unit at index has been written to frame_buf.
+ * Bytes after the unit's data up to unit_size must be zero.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decoder_put_unit(ChiakiFecDecoder *decoder, unsigned int index);
+
+/**
+ * Recover all missing source units into frame_buf.
+ *
+ * @return CHIAKI_ERR_FEC_FAILED if fewer parity units than missing source units have been received
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decoder_finish(ChiakiFecDecoder *decoder);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,96 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_FECPOOL_H
+#define CHIAKI_FECPOOL_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_FEC_POOL_STRIPE_ALIGN 64
+#define CHIAKI_FEC_POOL_STRIPE_SIZE_MIN_DEFAULT 256
+#define CHIAKI_FEC_POOL_WORK_MIN_DEFAULT (128 * 1024)
+
+/**
+ * Process the bytes [offset, offset + size) of every unit involved.
+ */
+typedef void (*ChiakiFecPoolStripeFunc)(void *user, size_t offset, size_t size);
+
+typedef struct chiaki_fec_pool_job_t ChiakiFecPoolJob;
+
+/**
+ * Optional worker threads for FEC recovery, shared by many sessions.
+ *
+ * Recovery is independent across byte columns of the units,
+ * so large jobs are split into stripes which are processed by the workers and the calling thread together.
+ */
+typedef struct chiaki_fec_pool_t
+{
+	ChiakiLog *log;
+	ChiakiThread *workers;
+	size_t workers_count;
+
+	/**
+	 * Jobs with less estimated work in bytes than this run on the calling thread only,
+	 * where waking up workers would cost more than it saves. May be changed before the pool is used.
+	 */
+	size_t work_min;
+
+	/**
+	 * Stripes are never smaller than this, to keep them cache-friendly. May be changed before the pool is used.
+	 */
+	size_t stripe_size_min;
+
+	ChiakiMutex mutex;
+	ChiakiCond cond; // signaled when stripes are available or the workers should stop
+	ChiakiCond done_cond; // broadcast when a stripe has been finished
+	ChiakiFecPoolJob *jobs;
+	bool should_stop;
+} ChiakiFecPool;
+
+/**
+ * @param workers_count number of threads in addition to the ones calling chiaki_fec_pool_run()
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_pool_init(ChiakiFecPool *pool, size_t workers_count, ChiakiLog *log);
+
+/**
+ * No chiaki_fec_pool_run() may be in progress.
+ */
+CHIAKI_EXPORT void chiaki_fec_pool_fini(ChiakiFecPool *pool);
+
+/**
+ * Call func for stripes covering [0, size) and return once all of them are done.
+ *
+ * @param pool may be NULL to run everything on the calling thread
+ * @param work estimated number of bytes read and written in total, compared against work_min
+ */
+CHIAKI_EXPORT void chiaki_fec_pool_run(ChiakiFecPool *pool, size_t size, size_t work, ChiakiFecPoolStripeFunc func, void *user);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_FECPOOL_H
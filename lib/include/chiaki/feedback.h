@@ -66,6 +66,23 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_history_event_set_button(ChiakiFee
 CHIAKI_EXPORT void chiaki_feedback_history_event_set_touchpad(ChiakiFeedbackHistoryEvent *event,
 		bool down, uint8_t pointer_id, uint16_t x, uint16_t y);
 
+/**
+ * Maximum number of events chiaki_feedback_history_events_diff() can produce:
+ * every button, both analog triggers and one event per touch.
+ */
+#define CHIAKI_FEEDBACK_HISTORY_EVENTS_DIFF_MAX (CHIAKI_CONTROLLER_BUTTONS_COUNT + 2 + CHIAKI_CONTROLLER_TOUCHES_MAX)
+
+/**
+ * Create history events for all differences between two controller states,
+ * in the order in which they should be pushed to a ChiakiFeedbackHistoryBuffer.
+ *
+ * @param log optional, for events that could not be formatted
+ * @param events buffer for at least CHIAKI_FEEDBACK_HISTORY_EVENTS_DIFF_MAX events
+ * @return number of events written to events
+ */
+CHIAKI_EXPORT size_t chiaki_feedback_history_events_diff(ChiakiLog *log, ChiakiFeedbackHistoryEvent *events,
+		ChiakiControllerState *prev, ChiakiControllerState *now);
+
 /**
  * Ring buffer of ChiakiFeedbackHistoryEvent
  */
@@ -21,6 +21,7 @@
 #include "controller.h"
 #include "takion.h"
 #include "thread.h"
+#include "timerservice.h"
 #include "common.h"
 
 #ifdef __cplusplus
@@ -31,25 +32,42 @@ typedef struct chiaki_feedback_sender_t
 {
 	ChiakiLog *log;
 	ChiakiTakion *takion;
-	ChiakiThread thread;
+	ChiakiTimerService *timer_service;
+	ChiakiTimer timer;
 
 	ChiakiSeqNum16 state_seq_num;
 
-	ChiakiSeqNum16 history_seq_num;
+	ChiakiSeqNum16 history_seq_num; // next one to use
+	ChiakiSeqNum16 history_seq_num_sent; // of the last history packet sent, for repeating it
 	ChiakiFeedbackHistoryBuffer history_buf;
 
-	bool should_stop;
+	uint64_t sent_us; // when the last packet went out, in the time base of the timer service's clock
+
+	/**
+	 * How many times the last history packet is repeated on the following ticks
+	 * if no new history has to be sent, to cover packet loss.
+	 */
+	unsigned int history_redundancy;
+	unsigned int history_redundancy_left;
+
 	ChiakiControllerState controller_state_prev;
 	ChiakiControllerState controller_state;
 	bool controller_state_changed;
 	ChiakiMutex state_mutex;
-	ChiakiCond state_cond;
 } ChiakiFeedbackSender;
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTakion *takion);
+/**
+ * @param timer_service sends periodically and whenever the controller state changes from a timer on it
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTakion *takion, ChiakiTimerService *timer_service);
 CHIAKI_EXPORT void chiaki_feedback_sender_fini(ChiakiFeedbackSender *feedback_sender);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_set_controller_state(ChiakiFeedbackSender *feedback_sender, ChiakiControllerState *state);
 
+/**
+ * @param redundancy number of times every history packet is repeated, 0 to disable
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_set_history_redundancy(ChiakiFeedbackSender *feedback_sender, unsigned int redundancy);
+
 #ifdef __cplusplus
 }
 #endif
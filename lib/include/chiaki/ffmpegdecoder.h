@@ -0,0 +1,169 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_FFMPEGDECODER_H
+#define CHIAKI_FFMPEGDECODER_H
+
+#include <chiaki/config.h>
+#if CHIAKI_LIB_ENABLE_FFMPEG
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+#include "videoframe.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct AVCodecContext;
+struct AVPacket;
+struct AVFrame;
+
+typedef enum {
+	CHIAKI_FFMPEG_DECODER_THREADING_NONE, // one thread, lowest delay
+	CHIAKI_FFMPEG_DECODER_THREADING_SLICE, // threads per slice, no added delay, only helps if the stream has multiple slices
+	CHIAKI_FFMPEG_DECODER_THREADING_FRAME // threads per frame, highest throughput, adds one frame of delay per thread, no low delay
+} ChiakiFfmpegDecoderThreading;
+
+typedef struct chiaki_ffmpeg_decoder_options_t
+{
+	ChiakiFfmpegDecoderThreading threading;
+	unsigned int threads_count; // 0 to let FFmpeg decide
+	/**
+	 * AV_CODEC_FLAG_LOW_DELAY and AV_CODEC_FLAG2_FAST, output every frame as soon as it is decoded.
+	 * Ignored with CHIAKI_FFMPEG_DECODER_THREADING_FRAME, which FFmpeg does not combine with low delay.
+	 */
+	bool low_delay;
+
+	/**
+	 * Max number of samples waiting for the decode thread. If it is full, queued samples are discarded
+	 * and the video sample callback fails, so the session requests a new keyframe.
+	 */
+	size_t queue_size;
+
+	/**
+	 * Max number of decoded frames that the application may hold at once.
+	 * Frames decoded while none is available are dropped.
+	 */
+	size_t frames_count;
+} ChiakiFfmpegDecoderOptions;
+
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_options_default(ChiakiFfmpegDecoderOptions *options);
+
+struct chiaki_ffmpeg_decoder_t;
+
+/**
+ * Decoded frame from the pool of a ChiakiFfmpegDecoder.
+ */
+typedef struct chiaki_ffmpeg_frame_t
+{
+	struct AVFrame *frame;
+	uint64_t push_us; // monotonic time when the sample that completed this frame was pushed
+	uint64_t output_us; // monotonic time when the frame left the decoder
+
+	struct chiaki_ffmpeg_decoder_t *decoder;
+	volatile uint32_t refs; // only modified atomically
+	struct chiaki_ffmpeg_frame_t *next_free;
+} ChiakiFfmpegFrame;
+
+CHIAKI_EXPORT void chiaki_ffmpeg_frame_ref(ChiakiFfmpegFrame *frame);
+
+/**
+ * Drop a reference, the last one returns the frame to the pool of its decoder.
+ * May be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_ffmpeg_frame_unref(ChiakiFfmpegFrame *frame);
+
+/**
+ * Called on the decode thread for every decoded frame.
+ * The callback owns one reference to frame and must unref it when done, possibly later and from another thread.
+ */
+typedef void (*ChiakiFfmpegDecoderFrameCallback)(ChiakiFfmpegFrame *frame, void *user);
+
+typedef struct chiaki_ffmpeg_decoder_stats_t
+{
+	uint64_t samples; // pushed into the queue
+	uint64_t samples_dropped; // discarded because the queue was full
+	uint64_t frames; // passed to the frame callback
+	uint64_t frames_dropped; // decoded, but no pool frame was available
+	uint64_t decode_errors;
+	uint64_t decode_us_sum; // time spent in FFmpeg for all samples
+	uint64_t decode_us_max;
+	uint64_t latency_us_sum; // from pushing the sample to the frame callback, for all frames
+	uint64_t latency_us_max;
+} ChiakiFfmpegDecoderStats;
+
+typedef struct chiaki_ffmpeg_decoder_t
+{
+	ChiakiLog *log;
+	ChiakiFfmpegDecoderOptions options;
+	struct AVCodecContext *codec_context;
+
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool should_stop;
+	struct AVPacket **queue; // ring of options.queue_size
+	size_t queue_begin;
+	size_t queue_count;
+
+	ChiakiFfmpegFrame *frames;
+	ChiakiFfmpegFrame *frames_free;
+
+	ChiakiFfmpegDecoderStats stats;
+
+	ChiakiFfmpegDecoderFrameCallback frame_cb;
+	void *frame_cb_user;
+
+	ChiakiThread thread;
+} ChiakiFfmpegDecoder;
+
+/**
+ * Open an H.264 decoder and start its decode thread.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *decoder, const ChiakiFfmpegDecoderOptions *options,
+		ChiakiFfmpegDecoderFrameCallback frame_cb, void *frame_cb_user, ChiakiLog *log);
+
+/**
+ * Stop the decode thread. All frames must have been unreffed before.
+ */
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_fini(ChiakiFfmpegDecoder *decoder);
+
+/**
+ * Queue a sample for decoding, the data is copied.
+ * Matches ChiakiVideoSampleCallback, so it can be passed to chiaki_session_set_video_sample_cb() directly.
+ */
+CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, void *user);
+
+/**
+ * Queue a frame for decoding without copying, a reference is held until the decoder is done with it.
+ * Matches ChiakiVideoFrameCallback, so it can be passed to chiaki_session_set_video_frame_cb() directly.
+ */
+CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_frame_cb(ChiakiVideoFrame *frame, void *user);
+
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_get_stats(ChiakiFfmpegDecoder *decoder, ChiakiFfmpegDecoderStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+#endif // CHIAKI_FFMPEGDECODER_H
@@ -20,6 +20,8 @@
 
 #include "common.h"
 #include "takion.h"
+#include "videoframe.h"
+#include "fec.h"
 
 #include <stdint.h>
 #include <stdbool.h>
@@ -34,8 +36,9 @@ typedef struct chiaki_frame_unit_t ChiakiFrameUnit;
 typedef struct chiaki_frame_processor_t
 {
 	ChiakiLog *log;
-	uint8_t *frame_buf;
-	size_t frame_buf_size;
+	ChiakiMemAccount *mem;
+	ChiakiVideoFramePool *frame_pool; // created with the first frame
+	ChiakiVideoFrame *frame; // frame that is currently being assembled or has been flushed last
 	size_t buf_size_per_unit;
 	unsigned int units_source_expected;
 	unsigned int units_fec_expected;
@@ -43,6 +46,7 @@ typedef struct chiaki_frame_processor_t
 	unsigned int units_fec_received;
 	ChiakiFrameUnit *unit_slots;
 	size_t unit_slots_size;
+	ChiakiFecDecoder fec_decoder;
 } ChiakiFrameProcessor;
 
 typedef enum chiaki_frame_flush_result_t {
@@ -52,17 +56,34 @@ typedef enum chiaki_frame_flush_result_t {
 	CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED = 3
 } ChiakiFrameProcessorFlushResult;
 
-CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_processor, ChiakiLog *log);
+/**
+ * @param mem optional, frames and unit slots are allocated from it
+ */
+CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_processor, ChiakiLog *log, ChiakiMemAccount *mem);
 CHIAKI_EXPORT void chiaki_frame_processor_fini(ChiakiFrameProcessor *frame_processor);
 
+/**
+ * Get a frame from the pool of frame_processor, e.g. to deliver data other than assembled frames in the same way.
+ * The caller owns the returned reference.
+ */
+CHIAKI_EXPORT ChiakiVideoFrame *chiaki_frame_processor_acquire_frame(ChiakiFrameProcessor *frame_processor, size_t buf_capacity);
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet);
 
 /**
- * @param frame unless CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED returned, will receive a pointer into the internal buffer of frame_processor.
- * MUST NOT be used after the next call to this frame processor!
+ * @param frame unless CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED returned, will receive the assembled frame.
+ * The frame processor keeps its reference only until the next frame is allocated, take a reference to keep it longer.
  */
-CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size);
+CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, ChiakiVideoFrame **frame);
+
+/**
+ * @param pool optional workers for recovering large frames, NULL to recover on the calling thread
+ */
+static inline void chiaki_frame_processor_set_fec_pool(ChiakiFrameProcessor *frame_processor, ChiakiFecPool *pool)
+{
+	frame_processor->fec_decoder.pool = pool;
+}
 
 static inline bool chiaki_frame_processor_flush_possible(ChiakiFrameProcessor *frame_processor)
 {
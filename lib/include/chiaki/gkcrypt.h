@@ -20,6 +20,7 @@
 
 #include "common.h"
 #include "log.h"
+#include "memaccount.h"
 #include "thread.h"
 
 #include <stdlib.h>
@@ -30,20 +31,28 @@ extern "C" {
 #endif
 
 #define CHIAKI_GKCRYPT_BLOCK_SIZE 0x10
-#define CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT 0x20 // 2MB
+#define CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE 0x1000 // unit of the key buf blocks below
+#define CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT 0x20 // 128KB
+#define CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_MIN 0x8 // 32KB
+#define CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_MAX 0x200 // 2MB
+#define CHIAKI_GKCRYPT_KEY_BUF_LOOKAHEAD_MS 50
 #define CHIAKI_GKCRYPT_GMAC_SIZE 4
 #define CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS 45000
 #define CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_IV_OFFSET 44910
+#define CHIAKI_GKCRYPT_GMAC_CTX_POOL_SIZE 4
 
 typedef struct chiaki_gkcrypt_t {
 	uint8_t index;
 
 	uint8_t *key_buf; // circular buffer of the ctr mode key stream
 	size_t key_buf_size;
+	size_t key_buf_size_max; // key_buf is grown up to this size if the key pos advances faster than it is generated, 0 without key_buf
 	size_t key_buf_populated; // size of key_buf that is already populated (on startup)
 	size_t key_buf_key_pos_min; // minimal key pos currently in key_buf
 	size_t key_buf_start_offset; // offset in key_buf of the minimal key pos
 	size_t last_key_pos; // last key pos that has been requested
+	size_t key_buf_overruns; // times requests have overtaken the generator recently, see key_buf_size_max
+	size_t key_buf_overruns_key_pos; // key pos of the first of these overruns
 	bool key_buf_thread_stop;
 	ChiakiMutex key_buf_mutex;
 	ChiakiCond key_buf_cond;
@@ -52,19 +61,46 @@ typedef struct chiaki_gkcrypt_t {
 	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	uint8_t key_base[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	uint8_t key_gmac_base[CHIAKI_GKCRYPT_BLOCK_SIZE];
-	uint8_t key_gmac_current[CHIAKI_GKCRYPT_BLOCK_SIZE];
-	uint64_t key_gmac_index_current;
+	union
+	{
+		uint8_t key_gmac_current[CHIAKI_GKCRYPT_BLOCK_SIZE];
+		uint64_t key_gmac_current_words[CHIAKI_GKCRYPT_BLOCK_SIZE / 8]; // only accessed atomically while shared between threads
+	};
+	volatile uint64_t key_gmac_index_current;
+	volatile uint32_t key_gmac_seq; // odd while key_gmac_current/key_gmac_index_current are being replaced
+	volatile uint32_t key_gmac_writer; // 1 while one thread owns the right to replace key_gmac_current
+
+	/**
+	 * Cipher contexts reused by chiaki_gkcrypt_gmac() so concurrent senders don't allocate one per packet.
+	 * A slot is owned by a thread while gmac_ctx_busy is 1. NULL slots fall back to a temporary context.
+	 */
+	void *gmac_ctx[CHIAKI_GKCRYPT_GMAC_CTX_POOL_SIZE];
+	volatile uint32_t gmac_ctx_busy[CHIAKI_GKCRYPT_GMAC_CTX_POOL_SIZE];
 	ChiakiLog *log;
+	ChiakiMemAccount *mem;
 } ChiakiGKCrypt;
 
 struct chiaki_session_t;
 
 /**
- * @param key_buf_chunks if > 0, use a thread to generate the ctr mode key stream
+ * @param mem optional, key_buf is allocated from it
+ * @param key_buf_chunks if > 0, use a thread to generate the ctr mode key stream,
+ * otherwise it is generated on demand in the calling thread.
+ * The buffer grows on its own up to CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_MAX chunks when requests overtake the generator
+ * repeatedly within a short stretch of the key stream.
  */
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, ChiakiMemAccount *mem, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
 
 CHIAKI_EXPORT void chiaki_gkcrypt_fini(ChiakiGKCrypt *gkcrypt);
+
+/**
+ * Get a key buf size (in chunks, for chiaki_gkcrypt_init()) that keeps about
+ * CHIAKI_GKCRYPT_KEY_BUF_LOOKAHEAD_MS of key stream ahead of a stream with the given bitrate.
+ *
+ * @param bitrate in kbit/s, 0 for CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT
+ */
+CHIAKI_EXPORT size_t chiaki_gkcrypt_key_buf_chunks_for_bitrate(unsigned int bitrate);
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gen_key_stream(ChiakiGKCrypt *gkcrypt, size_t key_pos, uint8_t *buf, size_t buf_size);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcrypt, size_t key_pos, uint8_t *buf, size_t buf_size);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, size_t key_pos, uint8_t *buf, size_t buf_size);
@@ -72,14 +108,49 @@ static inline ChiakiErrorCode chiaki_gkcrypt_encrypt(ChiakiGKCrypt *gkcrypt, siz
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_gmac_key(uint64_t index, const uint8_t *key_base, const uint8_t *iv, uint8_t *key_out);
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_new_gmac_key(ChiakiGKCrypt *gkcrypt, uint64_t index);
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_tmp_gmac_key(ChiakiGKCrypt *gkcrypt, uint64_t index, uint8_t *key_out);
+
+/**
+ * Calculate the GMAC of buf.
+ *
+ * Thread-safe, may be called concurrently from multiple threads with different key_pos values.
+ */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, size_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out);
 
-static inline ChiakiGKCrypt *chiaki_gkcrypt_new(ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
+/**
+ * Calculate the GMAC of the concatenation of head and tail without copying them together.
+ *
+ * Thread-safe like chiaki_gkcrypt_gmac().
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac_split(ChiakiGKCrypt *gkcrypt, size_t key_pos, const uint8_t *head, size_t head_size, const uint8_t *tail, size_t tail_size, uint8_t *gmac_out);
+
+typedef struct chiaki_gkcrypt_gmac_verify_t
+{
+	size_t key_pos;
+	const uint8_t *buf;
+	size_t buf_size;
+	uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE]; // received GMAC to check against
+	bool valid; // set by chiaki_gkcrypt_gmac_verify_batch()
+} ChiakiGKCryptGmacVerify;
+
+/**
+ * Check the GMACs of multiple buffers in one go.
+ *
+ * The cipher context is set up once for the whole batch and the GMAC key schedule is only
+ * recalculated when the gmac key changes between consecutive entries, so entries should be ordered by key_pos.
+ * Every entry is still checked individually and gets its own valid flag.
+ *
+ * Thread-safe like chiaki_gkcrypt_gmac().
+ *
+ * @return an error if the GMACs could not be calculated, the valid flags are undefined then
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac_verify_batch(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptGmacVerify *entries, size_t count);
+
+static inline ChiakiGKCrypt *chiaki_gkcrypt_new(ChiakiLog *log, ChiakiMemAccount *mem, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
 {
 	ChiakiGKCrypt *gkcrypt = CHIAKI_NEW(ChiakiGKCrypt);
 	if(!gkcrypt)
 		return NULL;
-	ChiakiErrorCode err = chiaki_gkcrypt_init(gkcrypt, log, key_buf_chunks, index, handshake_key, ecdh_secret);
+	ChiakiErrorCode err = chiaki_gkcrypt_init(gkcrypt, log, mem, key_buf_chunks, index, handshake_key, ecdh_secret);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		free(gkcrypt);
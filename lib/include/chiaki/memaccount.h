@@ -0,0 +1,142 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_MEMACCOUNT_H
+#define CHIAKI_MEMACCOUNT_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum chiaki_mem_tag_t
+{
+	CHIAKI_MEM_TAG_OTHER,
+	CHIAKI_MEM_TAG_FRAME, // video frame buffers and unit slots
+	CHIAKI_MEM_TAG_GKCRYPT, // key stream buffers
+	CHIAKI_MEM_TAG_REORDER, // reorder queue slots and the data packets waiting in them
+	CHIAKI_MEM_TAG_SEND_BUFFER, // data packets kept until they are acked
+	CHIAKI_MEM_TAG_POSTPONED, // packets received before crypt became available
+	CHIAKI_MEM_TAG_LOG, // messages that don't fit into the stack buffer
+	CHIAKI_MEM_TAG_PROTO, // buffers copied out of decoded protobuf messages, like the video headers
+	CHIAKI_MEM_TAG_COUNT
+} ChiakiMemTag;
+
+CHIAKI_EXPORT const char *chiaki_mem_tag_string(ChiakiMemTag tag);
+
+/**
+ * @param alignment 0 for the alignment malloc() would give, otherwise a power of 2 that size is a multiple of
+ */
+typedef void *(*ChiakiAllocFunc)(size_t size, size_t alignment, ChiakiMemTag tag, void *user);
+
+/**
+ * Called with the same size, alignment and tag that ptr was allocated with.
+ */
+typedef void (*ChiakiFreeFunc)(void *ptr, size_t size, size_t alignment, ChiakiMemTag tag, void *user);
+
+/**
+ * Custom allocator for all memory a ChiakiMemAccount hands out, for example an arena per session.
+ * Called from any thread of the session.
+ */
+typedef struct chiaki_allocator_t
+{
+	ChiakiAllocFunc alloc;
+	ChiakiFreeFunc free;
+	void *user;
+} ChiakiAllocator;
+
+typedef struct chiaki_mem_stats_t
+{
+	uint64_t current[CHIAKI_MEM_TAG_COUNT]; // bytes currently allocated
+	uint64_t peak[CHIAKI_MEM_TAG_COUNT]; // high-water mark of current
+	uint64_t total_current;
+	uint64_t total_peak; // high-water mark of the sum over all tags, not the sum of peak
+} ChiakiMemStats;
+
+/**
+ * Counts the bytes allocated per ChiakiMemTag, usually one per session.
+ *
+ * Refcounted, because video frames handed to the application may outlive their session
+ * and still have to be freed through the account.
+ */
+typedef struct chiaki_mem_account_t
+{
+	ChiakiAllocator allocator; // alloc and free are NULL for the system allocator
+	volatile uint64_t current[CHIAKI_MEM_TAG_COUNT];
+	volatile uint64_t peak[CHIAKI_MEM_TAG_COUNT];
+	volatile uint64_t total_current;
+	volatile uint64_t total_peak;
+	volatile uint32_t refs;
+} ChiakiMemAccount;
+
+/**
+ * Process-wide account that is used wherever NULL is passed as a ChiakiMemAccount,
+ * for example for allocations not belonging to any session.
+ */
+CHIAKI_EXPORT ChiakiMemAccount *chiaki_mem_account_default(void);
+
+/**
+ * @param allocator optional, copied
+ * @return account with a single reference or NULL
+ */
+CHIAKI_EXPORT ChiakiMemAccount *chiaki_mem_account_new(const ChiakiAllocator *allocator);
+
+/**
+ * @return account, or the default account if account is NULL
+ */
+CHIAKI_EXPORT ChiakiMemAccount *chiaki_mem_account_ref(ChiakiMemAccount *account);
+
+/**
+ * Drop a reference. Everything allocated from the account should have been freed before the last one is dropped.
+ */
+CHIAKI_EXPORT void chiaki_mem_account_unref(ChiakiMemAccount *account);
+
+/**
+ * Get a snapshot of the counters. May be called from any thread.
+ */
+CHIAKI_EXPORT void chiaki_mem_account_get_stats(ChiakiMemAccount *account, ChiakiMemStats *stats);
+
+/**
+ * Count size bytes that were allocated elsewhere, like packets taken over from the socket, until chiaki_mem_uncharge().
+ */
+CHIAKI_EXPORT void chiaki_mem_charge(ChiakiMemAccount *account, ChiakiMemTag tag, size_t size);
+CHIAKI_EXPORT void chiaki_mem_uncharge(ChiakiMemAccount *account, ChiakiMemTag tag, size_t size);
+
+/**
+ * All of the following accept NULL for the default account.
+ * Memory must be freed with the same account, tag and size (and alignment) it was allocated with.
+ */
+CHIAKI_EXPORT void *chiaki_mem_alloc(ChiakiMemAccount *account, ChiakiMemTag tag, size_t size);
+CHIAKI_EXPORT void *chiaki_mem_calloc(ChiakiMemAccount *account, ChiakiMemTag tag, size_t count, size_t size);
+
+/**
+ * Like realloc(), ptr may be NULL. On failure, ptr stays valid with old_size.
+ */
+CHIAKI_EXPORT void *chiaki_mem_realloc(ChiakiMemAccount *account, ChiakiMemTag tag, void *ptr, size_t old_size, size_t size);
+CHIAKI_EXPORT void chiaki_mem_free(ChiakiMemAccount *account, ChiakiMemTag tag, void *ptr, size_t size);
+CHIAKI_EXPORT void *chiaki_mem_aligned_alloc(ChiakiMemAccount *account, ChiakiMemTag tag, size_t alignment, size_t size);
+CHIAKI_EXPORT void chiaki_mem_aligned_free(ChiakiMemAccount *account, ChiakiMemTag tag, void *ptr, size_t alignment, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_MEMACCOUNT_H
@@ -0,0 +1,109 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_NETBACKEND_H
+#define CHIAKI_NETBACKEND_H
+
+#include "common.h"
+#include "sock.h"
+#include "stoppipe.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chiaki_net_backend_t ChiakiNetBackend;
+
+typedef enum chiaki_net_backend_caps_t
+{
+	/**
+	 * Sockets are sockets of the OS, so they may also be used with OS calls directly,
+	 * e.g. for scatter/gather sends or to be watched by a ChiakiReactor.
+	 */
+	CHIAKI_NET_BACKEND_CAP_OS_SOCKETS = (1 << 0)
+} ChiakiNetBackendCaps;
+
+/**
+ * Socket operations of components that can run on something else than the OS,
+ * e.g. an in-memory network in virtual time with ChiakiSimNet.
+ * All functions follow the semantics of their BSD socket counterparts,
+ * except select, which follows chiaki_stop_pipe_select().
+ */
+struct chiaki_net_backend_t
+{
+	chiaki_socket_t (*socket)(ChiakiNetBackend *backend, int family, int type, int protocol);
+	int (*close)(ChiakiNetBackend *backend, chiaki_socket_t sock);
+	int (*setsockopt)(ChiakiNetBackend *backend, chiaki_socket_t sock, int level, int name, const void *val, socklen_t val_len);
+	int (*bind)(ChiakiNetBackend *backend, chiaki_socket_t sock, const struct sockaddr *addr, socklen_t addr_len);
+	int (*connect)(ChiakiNetBackend *backend, chiaki_socket_t sock, const struct sockaddr *addr, socklen_t addr_len);
+	int (*send)(ChiakiNetBackend *backend, chiaki_socket_t sock, const uint8_t *buf, size_t buf_size);
+	int (*sendto)(ChiakiNetBackend *backend, chiaki_socket_t sock, const uint8_t *buf, size_t buf_size, const struct sockaddr *addr, socklen_t addr_len);
+	int (*recv)(ChiakiNetBackend *backend, chiaki_socket_t sock, uint8_t *buf, size_t buf_size);
+	int (*recvfrom)(ChiakiNetBackend *backend, chiaki_socket_t sock, uint8_t *buf, size_t buf_size, struct sockaddr *addr, socklen_t *addr_len);
+
+	/**
+	 * Like recv, additionally reporting when the datagram arrived in the time base of the clock that belongs to the backend,
+	 * i.e. chiaki_clock_system() for the OS. Sets timestamp_us to 0 if that is unknown,
+	 * e.g. because chiaki_net_backend_enable_rx_timestamps() has not been called for sock.
+	 */
+	int (*recv_timestamp)(ChiakiNetBackend *backend, chiaki_socket_t sock, uint8_t *buf, size_t buf_size, uint64_t *timestamp_us);
+
+	/**
+	 * Make recv_timestamp report arrival times for sock.
+	 * Returns -1 if that is not supported.
+	 */
+	int (*enable_rx_timestamps)(ChiakiNetBackend *backend, chiaki_socket_t sock);
+
+	ChiakiErrorCode (*select)(ChiakiNetBackend *backend, ChiakiStopPipe *stop_pipe, ChiakiStopPipeSelectFd *fds, size_t fds_count, uint64_t timeout_ms);
+
+	unsigned int caps; // ChiakiNetBackendCaps
+};
+
+/**
+ * The sockets of the OS
+ */
+CHIAKI_EXPORT ChiakiNetBackend *chiaki_net_backend_system(void);
+
+/**
+ * recv_timestamp of chiaki_net_backend_system() with additional recv flags, e.g. MSG_DONTWAIT.
+ *
+ * The kernel timestamp is translated from the wall clock to the time base of chiaki_time_now_monotonic_us().
+ */
+CHIAKI_EXPORT int chiaki_net_system_recv_timestamp(chiaki_socket_t sock, uint8_t *buf, size_t buf_size, int flags, uint64_t *timestamp_us);
+
+static inline ChiakiErrorCode chiaki_net_backend_select_single(ChiakiNetBackend *backend, ChiakiStopPipe *stop_pipe, chiaki_socket_t sock, bool write, uint64_t timeout_ms)
+{
+	ChiakiStopPipeSelectFd fd = { sock, write, false };
+	return backend->select(backend, stop_pipe, &fd, CHIAKI_SOCKET_IS_INVALID(sock) ? 0 : 1, timeout_ms);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_NETBACKEND_H
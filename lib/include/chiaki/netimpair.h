@@ -0,0 +1,179 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_NETIMPAIR_H
+#define CHIAKI_NETIMPAIR_H
+
+#include "common.h"
+#include "log.h"
+#include "sock.h"
+#include "stoppipe.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Impairment applied to one direction of a link.
+ * All probabilities are in [0, 1] and evaluated per packet.
+ */
+typedef struct chiaki_net_impair_params_t
+{
+	double loss; // drop probability, in the good state if the burst model is enabled
+
+	// Gilbert-Elliott burst loss, enabled if burst_enter > 0
+	double burst_enter; // probability to go from the good to the bad state
+	double burst_leave; // probability to go from the bad to the good state
+	double burst_loss; // drop probability in the bad state
+
+	uint32_t delay_ms;
+	uint32_t jitter_ms; // uniform extra delay in [0, jitter_ms], packets are kept in order
+	double reorder; // probability to hold a packet back by reorder_ms, letting later ones overtake it
+	uint32_t reorder_ms;
+	double duplicate;
+
+	uint32_t rate_kbps; // bandwidth cap, 0 for unlimited
+	size_t queue_bytes_max; // bytes waiting for the capped link beyond which packets are dropped
+} ChiakiNetImpairParams;
+
+CHIAKI_EXPORT void chiaki_net_impair_params_default(ChiakiNetImpairParams *params);
+
+typedef struct chiaki_net_impair_stats_t
+{
+	uint64_t packets_in;
+	uint64_t bytes_in;
+	uint64_t packets_lost; // by loss or burst loss
+	uint64_t packets_lost_burst; // subset of packets_lost that happened in the bad state
+	uint64_t packets_dropped_queue; // by the rate cap
+	uint64_t packets_reordered;
+	uint64_t packets_duplicated;
+	uint64_t packets_out;
+	uint64_t bytes_out;
+} ChiakiNetImpairStats;
+
+typedef struct chiaki_net_impair_packet_t
+{
+	uint64_t release_us;
+	uint64_t seq;
+	uint8_t *buf;
+	size_t size;
+} ChiakiNetImpairPacket;
+
+/**
+ * Impairment model of one direction, without any I/O or locking.
+ * Which packets are lost, duplicated or reordered only depends on the seed and the order of the packets,
+ * so the same input always gives the same result.
+ */
+typedef struct chiaki_net_impair_t
+{
+	ChiakiNetImpairParams params;
+	uint64_t rng;
+	bool burst_bad;
+	uint64_t release_last_us;
+	uint64_t link_free_us; // when the capped link has sent everything queued so far
+	uint64_t seq;
+
+	ChiakiNetImpairPacket *heap; // min-heap by (release_us, seq)
+	size_t heap_count;
+	size_t heap_size;
+
+	ChiakiNetImpairStats stats;
+} ChiakiNetImpair;
+
+CHIAKI_EXPORT void chiaki_net_impair_init(ChiakiNetImpair *impair, const ChiakiNetImpairParams *params, uint64_t seed);
+CHIAKI_EXPORT void chiaki_net_impair_fini(ChiakiNetImpair *impair);
+
+/**
+ * Feed a packet received at now_us into the link. buf is copied.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_net_impair_push(ChiakiNetImpair *impair, const uint8_t *buf, size_t size, uint64_t now_us);
+
+/**
+ * @return time of the next packet to leave the link or UINT64_MAX if there is none
+ */
+CHIAKI_EXPORT uint64_t chiaki_net_impair_next_us(ChiakiNetImpair *impair);
+
+/**
+ * Take the next packet that is due at now_us.
+ * @param buf set to the packet data on success, must be freed with free() by the caller
+ * @return false if no packet is due
+ */
+CHIAKI_EXPORT bool chiaki_net_impair_pop(ChiakiNetImpair *impair, uint64_t now_us, uint8_t **buf, size_t *size);
+
+typedef enum
+{
+	CHIAKI_NET_IMPAIR_DIR_UP, // client to upstream
+	CHIAKI_NET_IMPAIR_DIR_DOWN // upstream to client
+} ChiakiNetImpairDir;
+
+/**
+ * UDP proxy that forwards between a single client and an upstream address with an impairment on each direction.
+ * The client is whoever sent the last packet to the listening socket.
+ */
+typedef struct chiaki_net_impair_proxy_t
+{
+	ChiakiLog *log;
+	chiaki_socket_t sock_listen;
+	chiaki_socket_t sock_upstream;
+	struct sockaddr_storage client_addr;
+	socklen_t client_addr_len; // 0 until the first packet from the client
+
+	ChiakiMutex mutex; // protects impair
+	ChiakiNetImpair impair[2];
+
+	ChiakiStopPipe stop_pipe;
+	ChiakiThread thread;
+} ChiakiNetImpairProxy;
+
+/**
+ * @param listen_addr address to bind the listening socket to, port 0 picks a free one, see chiaki_net_impair_proxy_get_listen_addr()
+ * @param params_up impairment for the client to upstream direction
+ * @param params_down impairment for the upstream to client direction
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_net_impair_proxy_init(ChiakiNetImpairProxy *proxy,
+		const struct sockaddr *listen_addr, socklen_t listen_addr_len,
+		const struct sockaddr *upstream_addr, socklen_t upstream_addr_len,
+		const ChiakiNetImpairParams *params_up, const ChiakiNetImpairParams *params_down,
+		uint64_t seed, ChiakiLog *log);
+CHIAKI_EXPORT void chiaki_net_impair_proxy_fini(ChiakiNetImpairProxy *proxy);
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_net_impair_proxy_get_listen_addr(ChiakiNetImpairProxy *proxy, struct sockaddr *addr, socklen_t *addr_len);
+
+/**
+ * Change the impairment while running, e.g. to sweep over loss rates. Packets already in flight keep their schedule.
+ */
+CHIAKI_EXPORT void chiaki_net_impair_proxy_set_params(ChiakiNetImpairProxy *proxy, ChiakiNetImpairDir dir, const ChiakiNetImpairParams *params);
+CHIAKI_EXPORT void chiaki_net_impair_proxy_get_stats(ChiakiNetImpairProxy *proxy, ChiakiNetImpairDir dir, ChiakiNetImpairStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_NETIMPAIR_H
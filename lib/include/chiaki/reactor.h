@@ -0,0 +1,117 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_REACTOR_H
+#define CHIAKI_REACTOR_H
+
+#include "common.h"
+#include "log.h"
+#include "sock.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Called on one of the reactor's workers when the registered socket has become readable.
+ * The socket is not watched while the callback runs, so the same source is never handled by two workers at once.
+ * The callback should read until the socket would block.
+ */
+typedef void (*ChiakiReactorCallback)(void *user);
+
+typedef struct chiaki_reactor_slot_t
+{
+	ChiakiReactorCallback cb;
+	void *user;
+	chiaki_socket_t fd;
+	uint32_t generation;
+	bool active;
+	bool running;
+	bool detached; // the fd is not watched anymore, but the source has not been removed yet
+} ChiakiReactorSlot;
+
+/**
+ * Optional event loop that drives the sockets of many sessions from a small, fixed pool of workers,
+ * as an alternative to the default of one receive thread per component.
+ *
+ * Currently only available on Linux (epoll and eventfd), chiaki_reactor_init() fails elsewhere.
+ */
+typedef struct chiaki_reactor_t
+{
+	ChiakiLog *log;
+	int epoll_fd;
+	int stop_fd;
+
+	ChiakiThread *workers;
+	size_t workers_count;
+
+	/**
+	 * Registered sources, referenced from epoll by index and generation,
+	 * so events that were already fetched for a removed source are recognized and dropped.
+	 */
+	ChiakiReactorSlot *slots;
+	size_t slots_count;
+
+	ChiakiMutex mutex;
+	ChiakiCond cond; // signaled when a callback has finished
+	bool should_stop;
+} ChiakiReactor;
+
+/**
+ * Handle of a socket registered in a ChiakiReactor.
+ */
+typedef struct chiaki_reactor_source_t
+{
+	ChiakiReactor *reactor;
+	size_t slot;
+} ChiakiReactorSource;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reactor_init(ChiakiReactor *reactor, ChiakiLog *log, size_t workers_count);
+
+/**
+ * All sources must have been removed before.
+ */
+CHIAKI_EXPORT void chiaki_reactor_fini(ChiakiReactor *reactor);
+
+/**
+ * Start watching fd for readability. Reads inside the callback must not block, e.g. use MSG_DONTWAIT.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reactor_add(ChiakiReactor *reactor, ChiakiReactorSource *source, chiaki_socket_t fd, ChiakiReactorCallback cb, void *user);
+
+/**
+ * Stop watching the source's fd. When this returns, the callback is not running and will not be called again.
+ * Must not be called from within the source's own callback.
+ */
+CHIAKI_EXPORT void chiaki_reactor_remove(ChiakiReactorSource *source);
+
+/**
+ * Stop watching the source's fd from within its own callback, e.g. after a fatal error on the socket.
+ * The callback will not be called again once it has returned and the fd may be closed right away,
+ * but chiaki_reactor_remove() must still be called afterwards to release the source.
+ */
+CHIAKI_EXPORT void chiaki_reactor_detach(ChiakiReactorSource *source);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_REACTOR_H
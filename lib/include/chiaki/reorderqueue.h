@@ -20,6 +20,7 @@
 
 #include <stdlib.h>
 
+#include "memaccount.h"
 #include "seqnum.h"
 
 #ifdef __cplusplus
@@ -47,6 +48,7 @@ typedef struct chiaki_reorder_queue_t
 {
 	size_t size_exp; // real size = 2^size * sizeof(ChiakiReorderQueueEntry)
 	ChiakiReorderQueueEntry *queue;
+	ChiakiMemAccount *mem;
 	uint64_t begin;
 	uint64_t count;
 	ChiakiReorderQueueSeqNumGt seq_num_gt;
@@ -59,21 +61,22 @@ typedef struct chiaki_reorder_queue_t
 } ChiakiReorderQueue;
 
 /**
+ * @param mem optional, the queue slots are allocated from it
  * @param size exponent for 2
  * @param seq_num_start sequence number of the first expected element
  */
-CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init(ChiakiReorderQueue *queue, size_t size_exp,
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init(ChiakiReorderQueue *queue, ChiakiMemAccount *mem, size_t size_exp,
 		uint64_t seq_num_start, ChiakiReorderQueueSeqNumGt seq_num_gt, ChiakiReorderQueueSeqNumLt seq_num_lt, ChiakiReorderQueueSeqNumAdd seq_num_add);
 
 /**
  * Helper to initialize a queue using ChiakiSeqNum16 sequence numbers
  */
-CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init_16(ChiakiReorderQueue *queue, size_t size_exp, ChiakiSeqNum16 seq_num_start);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init_16(ChiakiReorderQueue *queue, ChiakiMemAccount *mem, size_t size_exp, ChiakiSeqNum16 seq_num_start);
 
 /**
  * Helper to initialize a queue using ChiakiSeqNum32 sequence numbers
  */
-CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init_32(ChiakiReorderQueue *queue, size_t size_exp, ChiakiSeqNum32 seq_num_start);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init_32(ChiakiReorderQueue *queue, ChiakiMemAccount *mem, size_t size_exp, ChiakiSeqNum32 seq_num_start);
 
 CHIAKI_EXPORT void chiaki_reorder_queue_fini(ChiakiReorderQueue *queue);
 
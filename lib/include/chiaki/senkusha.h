@@ -26,6 +26,33 @@ extern "C" {
 
 typedef struct chiaki_session_t ChiakiSession;
 
+/**
+ * Network characteristics of one host as measured by Senkusha.
+ *
+ * Applications may persist this per host and pass it back in ChiakiConnectInfo,
+ * so the next session only has to validate the values instead of searching the MTUs again.
+ */
+typedef struct chiaki_network_cache_t
+{
+	bool valid;
+	uint32_t mtu_in;
+	uint32_t mtu_out;
+	uint64_t rtt_us;
+	uint64_t network_id; // identifies the local and remote addresses the values were measured with
+} ChiakiNetworkCache;
+
+#define CHIAKI_SENKUSHA_MTU_PROBES_MAX 16
+
+/**
+ * One of several MTU probes that are in flight at the same time.
+ */
+typedef struct chiaki_senkusha_mtu_probe_t
+{
+	uint32_t mtu;
+	uint32_t tag; // MTU command id for inbound probes, ping tag for outbound probes
+	bool received;
+} ChiakiSenkushaMtuProbe;
+
 typedef struct senkusha_t
 {
 	ChiakiSession *session;
@@ -41,7 +68,12 @@ typedef struct senkusha_t
 	uint16_t ping_test_index;
 	uint16_t ping_index;
 	uint32_t ping_tag;
-	uint32_t mtu_id;
+	uint32_t mtu_id; // id of the pending Client MTU Command
+	uint32_t mtu_command_id; // last id used for an MTU Command, never reset so late responses can not match newer probes
+	ChiakiSenkushaMtuProbe mtu_probes[CHIAKI_SENKUSHA_MTU_PROBES_MAX];
+	size_t mtu_probes_count;
+	size_t mtu_probes_received;
+	uint32_t mtu_probes_max;
 
 	/**
 	 * signaled on change of state_finished or should_stop
@@ -56,7 +88,11 @@ typedef struct senkusha_t
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_init(ChiakiSenkusha *senkusha, ChiakiSession *session);
 CHIAKI_EXPORT void chiaki_senkusha_fini(ChiakiSenkusha *senkusha);
-CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint32_t *mtu_in, uint32_t *mtu_out, uint64_t *rtt_us);
+/**
+ * @param cache optional values from a previous run. If they were measured on the same network, only a quick validation is done.
+ * @param result written with the (validated or measured) values on success
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, const ChiakiNetworkCache *cache, ChiakiNetworkCache *result);
 
 #ifdef __cplusplus
 }
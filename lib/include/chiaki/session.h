@@ -31,6 +31,11 @@
 #include "videoreceiver.h"
 #include "controller.h"
 #include "stoppipe.h"
+#include "senkusha.h"
+#include "reactor.h"
+#include "timerservice.h"
+#include "fecpool.h"
+#include "memaccount.h"
 
 #include <stdint.h>
 
@@ -97,6 +102,12 @@ typedef struct chiaki_connect_info_t
 	char regist_key[CHIAKI_SESSION_AUTH_SIZE]; // must be completely filled (pad with \0)
 	uint8_t morning[0x10];
 	ChiakiConnectVideoProfile video_profile;
+	ChiakiNetworkCache network_cache; // results of a previous session with the same host, set valid to false if none
+	ChiakiReactor *reactor; // optional, shared by many sessions to receive the stream without a thread per session
+	ChiakiFecPool *fec_pool; // optional, shared by many sessions to recover large frames on multiple cores
+	size_t receive_pipeline_workers; // 0 to receive on a single thread, otherwise see ChiakiTakionConnectInfo.pipeline_crypto_workers
+	ChiakiTakionSocketTuning socket_tuning; // for the stream connection, all zero for the defaults
+	const ChiakiAllocator *allocator; // optional, NULL for malloc(), the session's buffers are allocated with it
 } ChiakiConnectInfo;
 
 
@@ -123,6 +134,57 @@ typedef struct chiaki_quit_event_t
 	const char *reason_str;
 } ChiakiQuitEvent;
 
+/**
+ * Serial steps of bringing up a session, in the order they happen.
+ */
+typedef enum {
+	CHIAKI_STARTUP_PHASE_SESSION_REQUEST,
+	CHIAKI_STARTUP_PHASE_CTRL, // until the session id is received, includes waiting for the PIN
+	CHIAKI_STARTUP_PHASE_SENKUSHA,
+	CHIAKI_STARTUP_PHASE_PREPARE, // waiting for the background preparation (ECDH, handshake key) to finish
+	CHIAKI_STARTUP_PHASE_TAKION_CONNECT,
+	CHIAKI_STARTUP_PHASE_BANG,
+	CHIAKI_STARTUP_PHASE_STREAMINFO,
+	CHIAKI_STARTUP_PHASE_FIRST_FRAME,
+	CHIAKI_STARTUP_PHASE_COUNT
+} ChiakiStartupPhase;
+
+CHIAKI_EXPORT const char *chiaki_startup_phase_string(ChiakiStartupPhase phase);
+
+/**
+ * Timing of the session bring-up, all values in microseconds.
+ */
+typedef struct chiaki_startup_report_t
+{
+	uint64_t start_us; // monotonic time when the session thread started
+	uint64_t phase_end_us[CHIAKI_STARTUP_PHASE_COUNT]; // relative to start_us, 0 if the phase was not reached
+	uint64_t pin_wait_us; // part of CHIAKI_STARTUP_PHASE_CTRL spent waiting for the user to enter the PIN
+	uint64_t prepare_us; // duration of the background preparation, which overlaps the network phases
+} ChiakiStartupReport;
+
+CHIAKI_EXPORT void chiaki_startup_report_log(const ChiakiStartupReport *report, ChiakiLog *log);
+
+/**
+ * Counters and timing estimates of the received stream since the session started, see chiaki_session_get_stream_stats().
+ */
+typedef struct chiaki_stream_stats_t
+{
+	uint64_t video_frames; // passed to the video sample callback
+	uint64_t video_bytes;
+	uint64_t video_frames_fec_recovered; // completed only with the help of FEC units
+	uint64_t video_frames_lost; // missing, incomplete or corrupt, reported to the console
+	uint64_t audio_frames;
+	uint64_t audio_bytes;
+	uint64_t audio_frames_lost;
+
+	/**
+	 * Smoothed deviation of the arrival intervals of video frames from the frame rate, like the interarrival jitter of RFC 3550.
+	 * Measured on ChiakiTakionAVPacket.recv_time_us, so it only reflects the network when kernel receive timestamps are enabled.
+	 */
+	uint64_t video_frame_jitter_us;
+	uint64_t video_frame_spread_us; // smoothed time from the first to the last received packet of a video frame
+} ChiakiStreamStats;
+
 typedef struct chiaki_audio_stream_info_event_t
 {
 	ChiakiAudioHeader audio_header;
@@ -132,7 +194,10 @@ typedef struct chiaki_audio_stream_info_event_t
 typedef enum {
 	CHIAKI_EVENT_CONNECTED,
 	CHIAKI_EVENT_LOGIN_PIN_REQUEST,
-	CHIAKI_EVENT_QUIT
+	CHIAKI_EVENT_QUIT,
+	CHIAKI_EVENT_STARTUP_REPORT, // sent once after the first video frame has been passed to the video sample callback
+	CHIAKI_EVENT_VIDEO_PROFILES, // sent once when the stream info arrives, before any video sample
+	CHIAKI_EVENT_VIDEO_PROFILE_SWITCH // sent before the first sample of a different profile, including the very first one
 } ChiakiEventType;
 
 typedef struct chiaki_event_t
@@ -141,6 +206,20 @@ typedef struct chiaki_event_t
 	union
 	{
 		ChiakiQuitEvent quit;
+		ChiakiStartupReport startup_report;
+		struct
+		{
+			/**
+			 * All profiles the stream may switch between, indexed like video_profile_switch.profile_index.
+			 * Only valid during the callback, copy the headers to keep them.
+			 */
+			const ChiakiVideoProfile *profiles;
+			size_t profiles_count;
+		} video_profiles;
+		struct
+		{
+			size_t profile_index; // all following video samples belong to this profile
+		} video_profile_switch;
 		struct
 		{
 			bool pin_incorrect; // false on first request, true if the pin entered before was incorrect
@@ -156,6 +235,14 @@ typedef void (*ChiakiEventCallback)(ChiakiEvent *event, void *user);
  */
 typedef bool (*ChiakiVideoSampleCallback)(uint8_t *buf, size_t buf_size, void *user);
 
+/**
+ * Alternative to ChiakiVideoSampleCallback that delivers the refcounted frame itself.
+ * The frame is only borrowed for the duration of the call, use chiaki_video_frame_ref() to keep it,
+ * e.g. to decode it on another thread without copying.
+ * @return same as for ChiakiVideoSampleCallback
+ */
+typedef bool (*ChiakiVideoFrameCallback)(ChiakiVideoFrame *frame, void *user);
+
 
 
 typedef struct chiaki_session_t
@@ -180,6 +267,13 @@ typedef struct chiaki_session_t
 	uint32_t mtu_in;
 	uint32_t mtu_out;
 	uint64_t rtt_us;
+
+	/**
+	 * Initialized from ChiakiConnectInfo and updated after the network test.
+	 * Up to date when CHIAKI_EVENT_CONNECTED is sent, applications can read and persist it from then on.
+	 */
+	ChiakiNetworkCache network_cache;
+
 	ChiakiECDH ecdh;
 
 	ChiakiQuitReason quit_reason;
@@ -189,9 +283,31 @@ typedef struct chiaki_session_t
 	void *event_cb_user;
 	ChiakiVideoSampleCallback video_sample_cb;
 	void *video_sample_cb_user;
+	ChiakiVideoFrameCallback video_frame_cb;
+	void *video_frame_cb_user;
 	ChiakiAudioSink audio_sink;
 
+	ChiakiReactor *reactor;
+	ChiakiFecPool *fec_pool;
+	size_t receive_pipeline_workers;
+	ChiakiTakionSocketTuning socket_tuning;
+
+	/**
+	 * Counts the memory of all components per ChiakiMemTag, see chiaki_session_get_mem_stats()
+	 */
+	ChiakiMemAccount *mem;
+
+	/**
+	 * Runs the periodic work of all components, like heartbeats, feedback and re-sending
+	 */
+	ChiakiTimerService timer_service;
+
 	ChiakiThread session_thread;
+	ChiakiThread prepare_thread;
+	ChiakiErrorCode prepare_err;
+
+	ChiakiStartupReport startup_report;
+	ChiakiStreamStats stream_stats; // only modified atomically
 
 	ChiakiCond state_cond;
 	ChiakiMutex state_mutex;
@@ -223,6 +339,17 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_join(ChiakiSession *session);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_set_controller_state(ChiakiSession *session, ChiakiControllerState *state);
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_set_login_pin(ChiakiSession *session, const uint8_t *pin, size_t pin_size);
 
+/**
+ * Get a snapshot of the stream counters. May be called from any thread while the session exists.
+ */
+CHIAKI_EXPORT void chiaki_session_get_stream_stats(ChiakiSession *session, ChiakiStreamStats *stats);
+
+/**
+ * Get current and peak bytes allocated by the session per ChiakiMemTag. May be called from any thread while the session exists.
+ * Log messages are not counted here, they go to chiaki_mem_account_default() because the ChiakiLog may be shared.
+ */
+CHIAKI_EXPORT void chiaki_session_get_mem_stats(ChiakiSession *session, ChiakiMemStats *stats);
+
 static inline void chiaki_session_set_event_cb(ChiakiSession *session, ChiakiEventCallback cb, void *user)
 {
 	session->event_cb = cb;
@@ -235,6 +362,15 @@ static inline void chiaki_session_set_video_sample_cb(ChiakiSession *session, Ch
 	session->video_sample_cb_user = user;
 }
 
+/**
+ * If set, it is called instead of the video sample callback.
+ */
+static inline void chiaki_session_set_video_frame_cb(ChiakiSession *session, ChiakiVideoFrameCallback cb, void *user)
+{
+	session->video_frame_cb = cb;
+	session->video_frame_cb_user = user;
+}
+
 /**
  * @param sink contents are copied
  */
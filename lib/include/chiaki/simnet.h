@@ -0,0 +1,131 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_SIMNET_H
+#define CHIAKI_SIMNET_H
+
+#include "common.h"
+#include "clock.h"
+#include "netbackend.h"
+#include "netimpair.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_SIM_NET_SOCKETS_MAX 32
+#define CHIAKI_SIM_NET_TIME_START_US 1000000
+
+typedef struct chiaki_sim_net_packet_t ChiakiSimNetPacket;
+
+typedef struct chiaki_sim_net_waiter_t ChiakiSimNetWaiter;
+
+typedef struct chiaki_sim_net_socket_t
+{
+	bool used;
+	int family;
+	struct sockaddr_storage addr;
+	socklen_t addr_len; // 0 if not bound yet
+	struct sockaddr_storage peer;
+	socklen_t peer_len; // 0 if not connected
+	ChiakiNetImpair impair; // applied to all packets arriving at this socket
+	ChiakiSimNetPacket *rx_head;
+	ChiakiSimNetPacket *rx_tail;
+} ChiakiSimNetSocket;
+
+/**
+ * In-memory UDP network in virtual time, usable as the ChiakiNetBackend and ChiakiClock of Takion and the timer service.
+ *
+ * Time only advances inside chiaki_sim_net_run(), which jumps straight to the next deadline or packet delivery,
+ * so timeouts and re-sends take no real time to elapse. It does so only once every thread created with
+ * chiaki_clock_thread_create() on the simulation's clock is blocked in the simulation, i.e. waits in select on
+ * sockets without data or in chiaki_clock_cond_wait_until() on a cond nobody signaled, so no thread ever finds time
+ * advanced while it is still working, no matter how slow the machine is.
+ * This requires that:
+ *  - every thread using the simulation while chiaki_sim_net_run() runs has been created that way,
+ *  - such threads do not block anywhere else for long, e.g. on a plain cond or a real socket,
+ *  - conds waited on with the clock are only woken through chiaki_clock_cond_signal()/chiaki_clock_cond_broadcast().
+ * Stop pipes are not part of the simulation and only polled. Events of the same virtual time are processed
+ * in a fixed order and all impairment is seeded, but the order across threads is still up to the scheduler.
+ * Only the Takion paths and the timer service run on it, ctrl, senkusha and discovery still need real sockets.
+ *
+ * All sockets share a single host. A packet is delivered to the socket bound to its destination port,
+ * either with the same address or the wildcard one. Unbound sockets are bound to the wildcard address on first use.
+ */
+typedef struct chiaki_sim_net_t
+{
+	ChiakiClock clock;
+	ChiakiNetBackend backend;
+
+	ChiakiMutex mutex;
+	ChiakiCond cond; // broadcast whenever time advances or packets arrive
+	ChiakiCond driver_cond; // signaled whenever a thread might have become blocked
+	uint64_t now_us;
+	size_t threads; // registered through chiaki_clock_thread_create()
+	ChiakiSimNetWaiter *waiters;
+
+	ChiakiNetImpairParams impair_default;
+	uint64_t seed;
+	uint16_t port_next;
+	ChiakiSimNetSocket sockets[CHIAKI_SIM_NET_SOCKETS_MAX];
+} ChiakiSimNet;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_sim_net_init(ChiakiSimNet *sim, uint64_t seed);
+
+/**
+ * All sockets must have been closed and all threads using the simulation must have stopped.
+ */
+CHIAKI_EXPORT void chiaki_sim_net_fini(ChiakiSimNet *sim);
+
+static inline ChiakiClock *chiaki_sim_net_clock(ChiakiSimNet *sim) { return &sim->clock; }
+static inline ChiakiNetBackend *chiaki_sim_net_backend(ChiakiSimNet *sim) { return &sim->backend; }
+
+CHIAKI_EXPORT uint64_t chiaki_sim_net_now_us(ChiakiSimNet *sim);
+
+/**
+ * Impairment of sockets created after this call
+ */
+CHIAKI_EXPORT void chiaki_sim_net_set_impair_default(ChiakiSimNet *sim, const ChiakiNetImpairParams *params);
+
+/**
+ * Impairment of packets arriving at the socket that is currently bound to addr
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_sim_net_set_impair(ChiakiSimNet *sim, const struct sockaddr *addr, socklen_t addr_len, const ChiakiNetImpairParams *params);
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_sim_net_get_impair_stats(ChiakiSimNet *sim, const struct sockaddr *addr, socklen_t addr_len, ChiakiNetImpairStats *stats);
+
+/**
+ * Advance virtual time up to until_us, processing every deadline and packet delivery on the way.
+ * Must be called from a thread that does not use the simulation itself.
+ */
+CHIAKI_EXPORT void chiaki_sim_net_run(ChiakiSimNet *sim, uint64_t until_us);
+
+static inline void chiaki_sim_net_run_for(ChiakiSimNet *sim, uint64_t duration_us)
+{
+	chiaki_sim_net_run(sim, chiaki_sim_net_now_us(sim) + duration_us);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_SIMNET_H
@@ -0,0 +1,115 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_SPSCRING_H
+#define CHIAKI_SPSCRING_H
+
+#include "common.h"
+#include "thread.h"
+#include "clock.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chiaki_spsc_ring_stats_t
+{
+	uint64_t pushed;
+	uint64_t push_waits; // how often the producer had to wait for space, i.e. the consumer could not keep up
+	uint64_t pop_waits; // how often the consumer had to wait for items
+	uint32_t fill_max;
+} ChiakiSpscRingStats;
+
+/**
+ * Bounded lock-free queue of pointers between exactly one producer and one consumer thread.
+ *
+ * Pushing and popping only use atomic loads and stores of the indices.
+ * The mutex and cond are only touched when a side has to sleep because the ring is full or empty.
+ */
+typedef struct chiaki_spsc_ring_t
+{
+	void **slots;
+	uint32_t mask;
+	volatile uint32_t head; // next slot to pop, only written by the consumer
+	volatile uint32_t tail; // next slot to push, only written by the producer
+	volatile uint32_t consumer_waiting;
+	volatile uint32_t producer_waiting;
+	volatile uint32_t closed;
+	ChiakiClock *clock; // the sides sleep through it
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+
+	/**
+	 * pushed, push_waits and fill_max are written by the producer, pop_waits by the consumer.
+	 * Only read them from another thread once both have stopped.
+	 */
+	ChiakiSpscRingStats stats;
+} ChiakiSpscRing;
+
+/**
+ * @param capacity rounded up to a power of 2
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_ring_init(ChiakiSpscRing *ring, size_t capacity);
+
+/**
+ * Like chiaki_spsc_ring_init(), for threads that wait on clock
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_ring_init_clock(ChiakiSpscRing *ring, size_t capacity, ChiakiClock *clock);
+
+/**
+ * Items still in the ring are not freed.
+ */
+CHIAKI_EXPORT void chiaki_spsc_ring_fini(ChiakiSpscRing *ring);
+
+/**
+ * @return false if the ring is full
+ */
+CHIAKI_EXPORT bool chiaki_spsc_ring_try_push(ChiakiSpscRing *ring, void *item);
+
+/**
+ * Push, waiting for space if the ring is full.
+ *
+ * @return CHIAKI_ERR_CANCELED if the ring has been closed, the item has not been pushed then
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_ring_push(ChiakiSpscRing *ring, void *item);
+
+/**
+ * @return false if the ring is empty
+ */
+CHIAKI_EXPORT bool chiaki_spsc_ring_try_pop(ChiakiSpscRing *ring, void **item);
+
+/**
+ * Pop, waiting for an item if the ring is empty.
+ *
+ * @return CHIAKI_ERR_CANCELED once the ring has been closed and all items have been popped
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_ring_pop(ChiakiSpscRing *ring, void **item);
+
+/**
+ * Wake up both sides and make all following pushes fail. Items that were pushed before can still be popped.
+ */
+CHIAKI_EXPORT void chiaki_spsc_ring_close(ChiakiSpscRing *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_SPSCRING_H
@@ -47,16 +47,39 @@ typedef struct chiaki_stop_pipe_t
 	// this fd is audited by 'select' as
 	// fd_set *readfds
 	int fd;
+#elif defined(__linux__)
+	int event_fd; // readable as long as the pipe is stopped
 #else
 	int fds[2];
 #endif
 } ChiakiStopPipe;
 
+typedef struct chiaki_stop_pipe_select_fd_t
+{
+	chiaki_socket_t fd;
+	bool write; // wait for writability instead of readability
+	bool ready; // output, set if fd is ready
+} ChiakiStopPipeSelectFd;
+
 struct sockaddr;
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_init(ChiakiStopPipe *stop_pipe);
 CHIAKI_EXPORT void chiaki_stop_pipe_fini(ChiakiStopPipe *stop_pipe);
+
+/**
+ * Make all current and future selects on stop_pipe return CHIAKI_ERR_CANCELED until chiaki_stop_pipe_reset() is called.
+ */
 CHIAKI_EXPORT void chiaki_stop_pipe_stop(ChiakiStopPipe *stop_pipe);
+
+/**
+ * Wait until at least one of fds is ready, stop_pipe is stopped or timeout_ms has passed.
+ *
+ * @param fds ready is set on every entry that is ready, fds_count may be 0 to only sleep
+ * @param timeout_ms UINT64_MAX to wait forever
+ * @return CHIAKI_ERR_SUCCESS if any fd is ready, CHIAKI_ERR_CANCELED if stopped (takes precedence) or CHIAKI_ERR_TIMEOUT
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select(ChiakiStopPipe *stop_pipe, ChiakiStopPipeSelectFd *fds, size_t fds_count, uint64_t timeout_ms);
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select_single(ChiakiStopPipe *stop_pipe, chiaki_socket_t fd, bool write, uint64_t timeout_ms);
 /**
  * Like connect(), but can be canceled by the stop pipe. Only makes sense with a non-blocking socket.
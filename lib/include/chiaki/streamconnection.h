@@ -52,6 +52,8 @@ typedef struct chiaki_stream_connection_t
 	 */
 	ChiakiMutex feedback_sender_mutex;
 
+	ChiakiTimer heartbeat_timer;
+
 	/**
 	 * signaled on change of state_finished or should_stop
 	 */
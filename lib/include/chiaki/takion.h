@@ -27,6 +27,11 @@
 #include "reorderqueue.h"
 #include "feedback.h"
 #include "takionsendbuffer.h"
+#include "reactor.h"
+#include "timerservice.h"
+#include "clock.h"
+#include "netbackend.h"
+#include "spscring.h"
 
 #include <stdbool.h>
 
@@ -64,6 +69,15 @@ typedef struct chiaki_takion_av_packet_t
 
 	uint8_t *data; // not owned
 	size_t data_size;
+
+	bool decrypted; // data has already been decrypted by the receive pipeline, see ChiakiTakionConnectInfo.pipeline_crypto_workers
+
+	/**
+	 * When the datagram arrived, in the time base of the Takion clock.
+	 * Taken by the kernel if ChiakiTakionSocketTuning.rx_timestamps is enabled and supported,
+	 * otherwise when Takion got it from the socket.
+	 */
+	uint64_t recv_time_us;
 } ChiakiTakionAVPacket;
 
 static inline uint8_t chiaki_takion_av_packet_audio_unit_size(ChiakiTakionAVPacket *packet)				{ return packet->units_in_frame_fec >> 8; }
@@ -111,6 +125,33 @@ typedef struct chiaki_takion_event_t
 
 typedef void (*ChiakiTakionCallback)(ChiakiTakionEvent *event, void *user);
 
+#define CHIAKI_TAKION_RCVBUF_SIZE_AUTO SIZE_MAX
+
+/**
+ * Opt-in socket options for lower and better measurable receive latency.
+ * All zero keeps the defaults. Options the platform doesn't support are skipped with a warning.
+ */
+typedef struct chiaki_takion_socket_tuning_t
+{
+	bool rx_timestamps; // let the kernel timestamp received datagrams (SO_TIMESTAMPNS, or SO_TIMESTAMP where that is rejected), see ChiakiTakionAVPacket.recv_time_us
+
+	/**
+	 * SO_RCVBUF, 0 for the default.
+	 * CHIAKI_TAKION_RCVBUF_SIZE_AUTO is only meaningful for the stream connection, which replaces it
+	 * with chiaki_takion_rcvbuf_size_for_bitrate() of the requested video bitrate.
+	 */
+	size_t rcvbuf_size;
+
+	unsigned int busy_poll_us; // SO_BUSY_POLL, 0 to disable
+	int priority; // SO_PRIORITY, 0 to leave it unchanged
+} ChiakiTakionSocketTuning;
+
+/**
+ * Receive buffer size that can hold a burst of the stream at bitrate_kbps,
+ * e.g. a large keyframe arriving while the receiving thread is not scheduled.
+ */
+CHIAKI_EXPORT size_t chiaki_takion_rcvbuf_size_for_bitrate(unsigned int bitrate_kbps);
+
 typedef struct chiaki_takion_connect_info_t
 {
 	ChiakiLog *log;
@@ -121,8 +162,71 @@ typedef struct chiaki_takion_connect_info_t
 	void *cb_user;
 	bool enable_crypt;
 	uint8_t protocol_version;
+
+	/**
+	 * Optional. If set, the socket is handed to the reactor after the handshake
+	 * and the Takion thread exits instead of receiving on its own.
+	 */
+	ChiakiReactor *reactor;
+
+	/**
+	 * Runs the re-sending of unacknowledged packets, must not be NULL.
+	 */
+	ChiakiTimerService *timer_service;
+
+	/**
+	 * Optional, NULL for the OS sockets. The reactor is only used with the OS sockets.
+	 */
+	ChiakiNetBackend *net_backend;
+
+	/**
+	 * Optional, NULL for the system clock. Must be the same as the one of timer_service.
+	 */
+	ChiakiClock *clock;
+
+	/**
+	 * Optional, NULL for the default account. Send buffer, reorder queue and postponed packets are counted there.
+	 */
+	ChiakiMemAccount *mem;
+
+	/**
+	 * Optional, 0 to receive, verify, decrypt and dispatch everything on the Takion thread.
+	 *
+	 * Otherwise, after the handshake the Takion thread only receives datagrams and distributes them
+	 * round-robin to this many crypto threads which verify the MACs and decrypt AV packets.
+	 * A reassembly thread collects them again in the original order and runs the callback.
+	 * At most CHIAKI_TAKION_PIPELINE_CRYPTO_WORKERS_MAX. Not used together with the reactor.
+	 */
+	size_t pipeline_crypto_workers;
+
+	ChiakiTakionSocketTuning socket_tuning;
 } ChiakiTakionConnectInfo;
 
+#define CHIAKI_TAKION_PIPELINE_CRYPTO_WORKERS_MAX 8
+
+typedef struct chiaki_takion_pipeline_worker_t
+{
+	struct chiaki_takion_t *takion;
+	ChiakiThread thread;
+	ChiakiSpscRing in; // from the receive stage
+	ChiakiSpscRing out; // to the reassembly stage
+} ChiakiTakionPipelineWorker;
+
+typedef struct chiaki_takion_pipeline_t
+{
+	ChiakiTakionPipelineWorker workers[CHIAKI_TAKION_PIPELINE_CRYPTO_WORKERS_MAX];
+	size_t workers_count; // workers that are running
+	ChiakiThread reassembly_thread;
+	bool reassembly_running;
+
+	/**
+	 * Set by the reassembly stage once AV packets can be verified and decrypted out of order,
+	 * i.e. crypt is disabled or gkcrypt_remote is set and all postponed packets have been handled.
+	 * Before that, the crypto stage passes everything through untouched.
+	 */
+	volatile uint32_t crypt_ready;
+} ChiakiTakionPipeline;
+
 
 typedef struct chiaki_takion_t
 {
@@ -148,8 +252,7 @@ typedef struct chiaki_takion_t
 	size_t postponed_packets_count;
 
 	ChiakiGKCrypt *gkcrypt_local; // if NULL (default), no gmac is calculated and nothing is encrypted
-	size_t key_pos_local;
-	ChiakiMutex gkcrypt_local_mutex;
+	volatile size_t key_pos_local; // only modified atomically, see chiaki_takion_crypt_advance_key_pos()
 
 	ChiakiGKCrypt *gkcrypt_remote; // if NULL (default), remote gmacs are IGNORED (!) and everything is expected to be unencrypted
 
@@ -161,11 +264,27 @@ typedef struct chiaki_takion_t
 	chiaki_socket_t sock;
 	ChiakiThread thread;
 	ChiakiStopPipe stop_pipe;
+
+	ChiakiNetBackend *net;
+	ChiakiClock *clock;
+	ChiakiMemAccount *mem;
+	ChiakiTimerService *timer_service;
+
+	ChiakiReactor *reactor;
+	ChiakiReactorSource reactor_source;
+	bool reactor_active; // the socket is currently driven by the reactor
+	bool reactor_failed; // receiving failed inside the reactor, which has already disconnected
+
+	size_t pipeline_crypto_workers;
+	ChiakiTakionPipeline pipeline;
+
+	bool rx_timestamps; // receiving with ChiakiNetBackend.recv_timestamp
+
+	bool crypt_available; // whether gkcrypt_remote was set when the last packet was handled
 	uint32_t tag_local;
 	uint32_t tag_remote;
 
-	ChiakiSeqNum32 seq_num_local;
-	ChiakiMutex seq_num_local_mutex;
+	volatile ChiakiSeqNum32 seq_num_local; // only modified atomically
 
 	/**
 	 * Advertised Receiver Window Credit
@@ -190,7 +309,7 @@ static inline void chiaki_takion_set_crypt(ChiakiTakion *takion, ChiakiGKCrypt *
 /**
  * Get a new key pos and advance by data_size.
  *
- * Thread-safe while Takion is running.
+ * Thread-safe and lock-free while Takion is running.
  * @param key_pos pointer to write the new key pos to. will be 0 if encryption is disabled. Contents undefined on failure.
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_crypt_advance_key_pos(ChiakiTakion *takion, size_t data_size, size_t *key_pos);
@@ -202,6 +321,13 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_crypt_advance_key_pos(ChiakiTakion *
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw(ChiakiTakion *takion, const uint8_t *buf, size_t buf_size);
 
+/**
+ * Send a single datagram consisting of head followed by tail, without copying them together first.
+ *
+ * Thread-safe while Takion is running.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw_split(ChiakiTakion *takion, const uint8_t *head, size_t head_size, const uint8_t *tail, size_t tail_size);
+
 /**
  * Calculate the MAC for the packet depending on the type derived from the first byte in buf,
  * assign MAC inside buf at the respective position and send the packet.
@@ -229,6 +355,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_feedback_state(ChiakiTakion *ta
 
 /**
  * Thread-safe while Takion is running.
+ * The contents of payload are encrypted in place and undefined afterwards.
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_feedback_history(ChiakiTakion *takion, ChiakiSeqNum16 seq_num, uint8_t *payload, size_t payload_size);
 
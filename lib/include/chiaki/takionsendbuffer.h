@@ -20,7 +20,9 @@
 
 #include "common.h"
 #include "log.h"
+#include "memaccount.h"
 #include "thread.h"
+#include "timerservice.h"
 #include "seqnum.h"
 
 #include <stdbool.h>
@@ -37,29 +39,31 @@ typedef struct chiaki_takion_send_buffer_t
 {
 	ChiakiLog *log;
 	ChiakiTakion *takion;
+	ChiakiMemAccount *mem; // of the takion, packets are allocated from it with CHIAKI_MEM_TAG_SEND_BUFFER
 
 	ChiakiTakionSendBufferPacket *packets;
 	size_t packets_size; // allocated size
 	size_t packets_count; // current count
 
 	ChiakiMutex mutex;
-	ChiakiCond cond;
-	bool should_stop;
-	ChiakiThread thread;
+	ChiakiTimerService *timer_service;
+	ChiakiTimer resend_timer; // scheduled while there are packets in the buffer
 } ChiakiTakionSendBuffer;
 
 
 /**
- * Init a Send Buffer and start a thread that automatically re-sends packets on takion.
+ * Init a Send Buffer that automatically re-sends packets on takion from a timer on timer_service.
  *
- * @param takion if NULL, the Send Buffer thread will effectively do nothing (for unit testing)
+ * @param takion if NULL, the Send Buffer timer will effectively do nothing (for unit testing)
+ * @param timer_service if NULL, packets are never re-sent (for unit testing)
  * @param size number of packet slots
  */
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, size_t size);
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, ChiakiTimerService *timer_service, size_t size);
 CHIAKI_EXPORT void chiaki_takion_send_buffer_fini(ChiakiTakionSendBuffer *send_buffer);
 
 /**
  * @param buf ownership of this is taken by the ChiakiTakionSendBuffer, which will free it automatically later!
+ * Must be allocated from send_buffer->mem with CHIAKI_MEM_TAG_SEND_BUFFER and buf_size.
  * On error, buf is freed immediately.
  */
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint8_t *buf, size_t buf_size);
@@ -0,0 +1,133 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_TIMERSERVICE_H
+#define CHIAKI_TIMERSERVICE_H
+
+#include "common.h"
+#include "log.h"
+#include "thread.h"
+#include "clock.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CHIAKI_TIMER_SERVICE_TICK_SHIFT 8 // one tick is 256us
+#define CHIAKI_TIMER_SERVICE_LEVEL_BITS 6
+#define CHIAKI_TIMER_SERVICE_LEVEL_SLOTS (1 << CHIAKI_TIMER_SERVICE_LEVEL_BITS)
+#define CHIAKI_TIMER_SERVICE_LEVELS 5 // covers 2^30 ticks, about 76 hours
+
+/**
+ * Called on the thread of the ChiakiTimerService when the timer has expired.
+ * The timer is not scheduled anymore at this point and may be re-scheduled from inside the callback.
+ */
+typedef void (*ChiakiTimerCallback)(void *user);
+
+typedef struct chiaki_timer_t ChiakiTimer;
+
+/**
+ * Timer that can be scheduled on a ChiakiTimerService.
+ * Memory is owned by the user, all fields except cb and user are private to the service.
+ */
+struct chiaki_timer_t
+{
+	ChiakiTimerCallback cb;
+	void *user;
+
+	ChiakiTimer *next;
+	ChiakiTimer **pprev;
+	uint64_t deadline_us;
+	uint64_t expires_tick;
+	bool scheduled;
+};
+
+typedef struct chiaki_timer_service_stats_t
+{
+	uint64_t fired;
+	uint64_t lateness_us_sum;
+	uint64_t lateness_us_max;
+} ChiakiTimerServiceStats;
+
+/**
+ * Single thread that fires the periodic work of many components,
+ * organized as a hierarchical timer wheel.
+ */
+typedef struct chiaki_timer_service_t
+{
+	ChiakiLog *log;
+	ChiakiClock *clock;
+	ChiakiThread thread;
+	ChiakiMutex mutex;
+	ChiakiCond cond; // signaled when the thread must re-evaluate its wakeup time
+	ChiakiCond idle_cond; // signaled when a callback has finished
+	bool should_stop;
+
+	ChiakiTimer *wheel[CHIAKI_TIMER_SERVICE_LEVELS][CHIAKI_TIMER_SERVICE_LEVEL_SLOTS];
+	uint64_t tick; // next tick to be processed
+	uint64_t wakeup_tick; // tick the thread is currently sleeping until
+	ChiakiTimer *expired;
+	ChiakiTimer *running;
+
+	ChiakiTimerServiceStats stats;
+} ChiakiTimerService;
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_timer_service_init(ChiakiTimerService *service, ChiakiLog *log);
+
+/**
+ * Like chiaki_timer_service_init(), but deadlines are in the time base of clock instead of the system clock.
+ */
+CHIAKI_EXPORT ChiakiErrorCode chiaki_timer_service_init_clock(ChiakiTimerService *service, ChiakiClock *clock, ChiakiLog *log);
+
+/**
+ * Stops the thread. All timers must have been canceled before.
+ */
+CHIAKI_EXPORT void chiaki_timer_service_fini(ChiakiTimerService *service);
+
+CHIAKI_EXPORT void chiaki_timer_init(ChiakiTimer *timer, ChiakiTimerCallback cb, void *user);
+
+/**
+ * Schedule the timer to fire at the given time. If the timer is already scheduled, it is moved.
+ *
+ * @param deadline_us in the time base of the service's clock, the callback is never called before it
+ */
+CHIAKI_EXPORT void chiaki_timer_service_schedule(ChiakiTimerService *service, ChiakiTimer *timer, uint64_t deadline_us);
+
+/**
+ * Shorthand for scheduling timeout_ms from now.
+ */
+CHIAKI_EXPORT void chiaki_timer_service_schedule_ms(ChiakiTimerService *service, ChiakiTimer *timer, uint64_t timeout_ms);
+
+/**
+ * Unschedule the timer. If its callback is currently running, this waits until it has returned,
+ * so afterwards the callback is guaranteed to not be called anymore and the timer's memory can be freed.
+ *
+ * Must not be called from the timer's own callback,
+ * or while holding a lock that the callback acquires.
+ */
+CHIAKI_EXPORT void chiaki_timer_service_cancel(ChiakiTimerService *service, ChiakiTimer *timer);
+
+CHIAKI_EXPORT void chiaki_timer_service_get_stats(ChiakiTimerService *service, ChiakiTimerServiceStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_TIMERSERVICE_H
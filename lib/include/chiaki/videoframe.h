@@ -0,0 +1,104 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_VIDEOFRAME_H
+#define CHIAKI_VIDEOFRAME_H
+
+#include "common.h"
+#include "memaccount.h"
+#include "seqnum.h"
+#include "thread.h"
+#include "video.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	CHIAKI_VIDEO_FRAME_STATUS_COMPLETE,
+	CHIAKI_VIDEO_FRAME_STATUS_FEC_RECOVERED, // some source units were missing and have been restored with FEC
+	CHIAKI_VIDEO_FRAME_STATUS_CORRUPT // FEC failed, only the received source units are contained
+} ChiakiVideoFrameStatus;
+
+struct chiaki_video_frame_pool_t;
+
+/**
+ * Refcounted video frame owned by a ChiakiVideoFramePool.
+ * The data stays valid as long as a reference is held, independent of the frames that are received after it.
+ */
+typedef struct chiaki_video_frame_t
+{
+	uint8_t *buf; // always followed by CHIAKI_VIDEO_BUFFER_PADDING_SIZE zero bytes after buf_size
+	size_t buf_size;
+	size_t buf_capacity; // excluding padding
+
+	bool header; // contains only the codec header of profile_index, sent when switching to that profile
+	ChiakiSeqNum16 frame_index;
+	size_t profile_index;
+	ChiakiVideoFrameStatus status;
+	uint64_t first_unit_us; // monotonic time when the first unit of the frame was received
+	uint64_t complete_us; // monotonic time when the frame was assembled
+
+	struct chiaki_video_frame_pool_t *pool;
+	volatile uint32_t refs; // only modified atomically
+	struct chiaki_video_frame_t *next_free;
+} ChiakiVideoFrame;
+
+/**
+ * Recycles frames and their buffers. Stays alive until the owner and all frames have dropped their references.
+ */
+typedef struct chiaki_video_frame_pool_t
+{
+	ChiakiMutex mutex;
+	ChiakiVideoFrame *frames_free;
+	size_t frames_free_count;
+	size_t frames_free_max; // frames returned beyond this are freed
+	ChiakiMemAccount *mem; // referenced by the pool, frames and their buffers are allocated with CHIAKI_MEM_TAG_FRAME
+	volatile uint32_t refs; // one for the owner and one per acquired frame, only modified atomically
+} ChiakiVideoFramePool;
+
+/**
+ * @param mem optional, NULL for the default account
+ */
+CHIAKI_EXPORT ChiakiVideoFramePool *chiaki_video_frame_pool_new(ChiakiMemAccount *mem, size_t frames_free_max);
+
+/**
+ * Drop the owner's reference
+ */
+CHIAKI_EXPORT void chiaki_video_frame_pool_unref(ChiakiVideoFramePool *pool);
+
+/**
+ * Get a frame with a single reference and room for at least buf_capacity bytes.
+ * All fields except buf and buf_capacity are reset and buf is zeroed including the padding.
+ */
+CHIAKI_EXPORT ChiakiVideoFrame *chiaki_video_frame_pool_acquire(ChiakiVideoFramePool *pool, size_t buf_capacity);
+
+CHIAKI_EXPORT void chiaki_video_frame_ref(ChiakiVideoFrame *frame);
+
+/**
+ * Drop a reference, may be called from any thread. The last one returns the frame to its pool.
+ */
+CHIAKI_EXPORT void chiaki_video_frame_unref(ChiakiVideoFrame *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // CHIAKI_VIDEOFRAME_H
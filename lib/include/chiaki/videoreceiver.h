@@ -30,6 +30,41 @@ extern "C" {
 
 #define CHIAKI_VIDEO_PROFILES_MAX 8
 
+/**
+ * Arrival timing of video frames, see ChiakiStreamStats.video_frame_jitter_us and video_frame_spread_us
+ */
+typedef struct chiaki_video_frame_timing_t
+{
+	int32_t frame_index; // frame whose packets are currently arriving, < 0 if none yet
+	uint64_t first_recv_us;
+	uint64_t last_recv_us;
+	uint64_t jitter_x16_us; // scaled by 16 for the smoothing like in RFC 3550
+	uint64_t spread_x16_us;
+} ChiakiVideoFrameTiming;
+
+CHIAKI_EXPORT void chiaki_video_frame_timing_init(ChiakiVideoFrameTiming *timing);
+
+/**
+ * Account for the first packet of frame_index, which must be newer than the current frame.
+ * The spread of the current frame is complete now and the jitter is how far recv_time_us is off
+ * from where fps would put it, relative to the first packet of the current frame.
+ *
+ * @param fps nominal frame rate, 0 to only measure the spread
+ */
+CHIAKI_EXPORT void chiaki_video_frame_timing_frame(ChiakiVideoFrameTiming *timing, ChiakiSeqNum16 frame_index, uint64_t recv_time_us, unsigned int fps);
+
+/**
+ * Account for any further packet of the current frame.
+ */
+static inline void chiaki_video_frame_timing_packet(ChiakiVideoFrameTiming *timing, uint64_t recv_time_us)
+{
+	if(recv_time_us > timing->last_recv_us)
+		timing->last_recv_us = recv_time_us;
+}
+
+static inline uint64_t chiaki_video_frame_timing_jitter_us(ChiakiVideoFrameTiming *timing) { return timing->jitter_x16_us >> 4; }
+static inline uint64_t chiaki_video_frame_timing_spread_us(ChiakiVideoFrameTiming *timing) { return timing->spread_x16_us >> 4; }
+
 typedef struct chiaki_video_receiver_t
 {
 	struct chiaki_session_t *session;
@@ -42,6 +77,8 @@ typedef struct chiaki_video_receiver_t
 	int32_t frame_index_prev; // last frame that has been at least partially decoded
 	int32_t frame_index_prev_complete; // last frame that has been completely decoded
 	ChiakiFrameProcessor frame_processor;
+
+	ChiakiVideoFrameTiming frame_timing;
 } ChiakiVideoReceiver;
 
 CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session);
@@ -52,6 +89,7 @@ CHIAKI_EXPORT void chiaki_video_receiver_fini(ChiakiVideoReceiver *video_receive
  *
  * @param video_receiver
  * @param profiles Array of profiles. Ownership of the contained header buffers will be transferred to the ChiakiVideoReceiver!
+ * They must be allocated from the session's mem with CHIAKI_MEM_TAG_PROTO and header_sz + CHIAKI_VIDEO_BUFFER_PADDING_SIZE bytes.
  * @param profiles_count must be <= CHIAKI_VIDEO_PROFILES_MAX
  */
 CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_receiver, ChiakiVideoProfile *profiles, size_t profiles_count);
@@ -0,0 +1,149 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHIAKI_ATOMIC_H
+#define CHIAKI_ATOMIC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef _MSC_VER
+#include <windows.h>
+#endif
+
+/*
+ * Minimal set of atomic operations used inside the lib.
+ * C11 <stdatomic.h> is not available with all supported compilers (MSVC),
+ * so these operate on plain integers with compiler builtins instead.
+ * All operations are sequentially consistent.
+ */
+
+static inline uint32_t chiaki_atomic_fetch_add_u32(volatile uint32_t *v, uint32_t add)
+{
+#ifdef _MSC_VER
+	return (uint32_t)InterlockedExchangeAdd((volatile LONG *)v, (LONG)add);
+#else
+	return __atomic_fetch_add(v, add, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline uint64_t chiaki_atomic_fetch_add_u64(volatile uint64_t *v, uint64_t add)
+{
+#ifdef _MSC_VER
+	return (uint64_t)InterlockedExchangeAdd64((volatile LONG64 *)v, (LONG64)add);
+#else
+	return __atomic_fetch_add(v, add, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline size_t chiaki_atomic_load_size(volatile size_t *v)
+{
+#ifdef _MSC_VER
+#ifdef _WIN64
+	return (size_t)InterlockedCompareExchange64((volatile LONG64 *)v, 0, 0);
+#else
+	return (size_t)InterlockedCompareExchange((volatile LONG *)v, 0, 0);
+#endif
+#else
+	return __atomic_load_n(v, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline uint64_t chiaki_atomic_load_u64(volatile uint64_t *v)
+{
+#ifdef _MSC_VER
+	return (uint64_t)InterlockedCompareExchange64((volatile LONG64 *)v, 0, 0);
+#else
+	return __atomic_load_n(v, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline void chiaki_atomic_store_u64(volatile uint64_t *v, uint64_t val)
+{
+#ifdef _MSC_VER
+	InterlockedExchange64((volatile LONG64 *)v, (LONG64)val);
+#else
+	__atomic_store_n(v, val, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/**
+ * Replace *v by desired if it equals *expected, otherwise load the current value into *expected.
+ * @return whether *v was replaced
+ */
+static inline bool chiaki_atomic_compare_exchange_u64(volatile uint64_t *v, uint64_t *expected, uint64_t desired)
+{
+#ifdef _MSC_VER
+	uint64_t prev = (uint64_t)InterlockedCompareExchange64((volatile LONG64 *)v, (LONG64)desired, (LONG64)*expected);
+	if(prev == *expected)
+		return true;
+	*expected = prev;
+	return false;
+#else
+	return __atomic_compare_exchange_n(v, expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+/**
+ * Like chiaki_atomic_compare_exchange_u64(), for size_t.
+ */
+static inline bool chiaki_atomic_compare_exchange_size(volatile size_t *v, size_t *expected, size_t desired)
+{
+#ifdef _MSC_VER
+#ifdef _WIN64
+	size_t prev = (size_t)InterlockedCompareExchange64((volatile LONG64 *)v, (LONG64)desired, (LONG64)*expected);
+#else
+	size_t prev = (size_t)InterlockedCompareExchange((volatile LONG *)v, (LONG)desired, (LONG)*expected);
+#endif
+	if(prev == *expected)
+		return true;
+	*expected = prev;
+	return false;
+#else
+	return __atomic_compare_exchange_n(v, expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline uint32_t chiaki_atomic_exchange_u32(volatile uint32_t *v, uint32_t val)
+{
+#ifdef _MSC_VER
+	return (uint32_t)InterlockedExchange((volatile LONG *)v, (LONG)val);
+#else
+	return __atomic_exchange_n(v, val, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline uint32_t chiaki_atomic_load_u32(volatile uint32_t *v)
+{
+#ifdef _MSC_VER
+	return (uint32_t)InterlockedCompareExchange((volatile LONG *)v, 0, 0);
+#else
+	return __atomic_load_n(v, __ATOMIC_SEQ_CST);
+#endif
+}
+
+static inline void chiaki_atomic_store_u32(volatile uint32_t *v, uint32_t val)
+{
+#ifdef _MSC_VER
+	InterlockedExchange((volatile LONG *)v, (LONG)val);
+#else
+	__atomic_store_n(v, val, __ATOMIC_SEQ_CST);
+#endif
+}
+
+#endif // CHIAKI_ATOMIC_H
@@ -20,6 +20,8 @@
 
 #include <string.h>
 
+#include "atomic.h"
+
 static void chiaki_audio_receiver_frame(ChiakiAudioReceiver *audio_receiver, ChiakiSeqNum16 frame_index, uint8_t *buf, size_t buf_size);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_receiver_init(ChiakiAudioReceiver *audio_receiver, ChiakiSession *session)
@@ -126,6 +128,12 @@ static void chiaki_audio_receiver_frame(ChiakiAudioReceiver *audio_receiver, Chi
 
 	if(!chiaki_seq_num_16_gt(frame_index, audio_receiver->frame_index_prev))
 		goto beach;
+	ChiakiStreamStats *stats = &audio_receiver->session->stream_stats;
+	ChiakiSeqNum16 gap = frame_index - audio_receiver->frame_index_prev - 1;
+	if(gap)
+		chiaki_atomic_fetch_add_u64(&stats->audio_frames_lost, gap);
+	chiaki_atomic_fetch_add_u64(&stats->audio_frames, 1);
+	chiaki_atomic_fetch_add_u64(&stats->audio_bytes, buf_size);
 	audio_receiver->frame_index_prev = frame_index;
 
 	if(audio_receiver->session->audio_sink.frame_cb)
@@ -0,0 +1,237 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki/audioresampler.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define HISTORY_FRAMES (CHIAKI_AUDIO_RESAMPLER_TAPS / 2 - 1)
+
+// relative to the input rate, leaves some headroom to the Nyquist frequency for the short filter
+#define FILTER_CUTOFF 0.9
+
+#define FILL_AVG_ALPHA 0.02
+#define DRIFT_P 0.002
+#define DRIFT_I 0.00001
+
+static void filter_generate(float *filter)
+{
+	for(size_t phase=0; phase<=CHIAKI_AUDIO_RESAMPLER_PHASES; phase++)
+	{
+		float *row = filter + phase * CHIAKI_AUDIO_RESAMPLER_TAPS;
+		double frac = (double)phase / CHIAKI_AUDIO_RESAMPLER_PHASES;
+		double sum = 0.0;
+		for(size_t t=0; t<CHIAKI_AUDIO_RESAMPLER_TAPS; t++)
+		{
+			// distance of the tap from the output position in input frames
+			double d = (double)t - HISTORY_FRAMES - frac;
+			double x = M_PI * FILTER_CUTOFF * d;
+			double sinc = fabs(x) < 1e-9 ? 1.0 : sin(x) / x;
+			double w = 2.0 * M_PI * d / CHIAKI_AUDIO_RESAMPLER_TAPS;
+			double window = 0.42 + 0.5 * cos(w) + 0.08 * cos(2.0 * w); // Blackman
+			double v = sinc * window;
+			row[t] = (float)v;
+			sum += v;
+		}
+
+		// unity gain for every phase
+		for(size_t t=0; t<CHIAKI_AUDIO_RESAMPLER_TAPS; t++)
+			row[t] = (float)(row[t] / sum);
+	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_resampler_init(ChiakiAudioResampler *resampler, unsigned int channels)
+{
+	if(!channels)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	resampler->channels = channels;
+	resampler->filter = malloc(sizeof(float) * (CHIAKI_AUDIO_RESAMPLER_PHASES + 1) * CHIAKI_AUDIO_RESAMPLER_TAPS);
+	if(!resampler->filter)
+		return CHIAKI_ERR_MEMORY;
+	filter_generate(resampler->filter);
+
+	resampler->buf_frames_size = CHIAKI_AUDIO_RESAMPLER_TAPS * 64;
+	resampler->buf = malloc(sizeof(float) * channels * resampler->buf_frames_size);
+	if(!resampler->buf)
+	{
+		free(resampler->filter);
+		return CHIAKI_ERR_MEMORY;
+	}
+
+	resampler->ratio = 1.0;
+	chiaki_audio_resampler_reset(resampler);
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_audio_resampler_fini(ChiakiAudioResampler *resampler)
+{
+	free(resampler->buf);
+	free(resampler->filter);
+}
+
+CHIAKI_EXPORT void chiaki_audio_resampler_reset(ChiakiAudioResampler *resampler)
+{
+	// start with silence as history so the first input frame is at the center of the filter
+	resampler->buf_frames = HISTORY_FRAMES;
+	memset(resampler->buf, 0, sizeof(float) * resampler->channels * resampler->buf_frames_size);
+	resampler->pos = HISTORY_FRAMES;
+	resampler->fill_avg = 0.0;
+	resampler->drift_integral = 0.0;
+	resampler->fill_avg_valid = false;
+}
+
+CHIAKI_EXPORT void chiaki_audio_resampler_update_fill(ChiakiAudioResampler *resampler, size_t fill_frames, size_t target_frames)
+{
+	if(!target_frames)
+		return;
+
+	if(resampler->fill_avg_valid)
+		resampler->fill_avg += FILL_AVG_ALPHA * ((double)fill_frames - resampler->fill_avg);
+	else
+	{
+		resampler->fill_avg = (double)fill_frames;
+		resampler->fill_avg_valid = true;
+	}
+
+	// positive if the output device consumes slower than the remote produces
+	double error = (resampler->fill_avg - (double)target_frames) / (double)target_frames;
+
+	resampler->drift_integral += DRIFT_I * error;
+	if(resampler->drift_integral > CHIAKI_AUDIO_RESAMPLER_RATIO_DEVIATION_MAX)
+		resampler->drift_integral = CHIAKI_AUDIO_RESAMPLER_RATIO_DEVIATION_MAX;
+	else if(resampler->drift_integral < -CHIAKI_AUDIO_RESAMPLER_RATIO_DEVIATION_MAX)
+		resampler->drift_integral = -CHIAKI_AUDIO_RESAMPLER_RATIO_DEVIATION_MAX;
+
+	double correction = DRIFT_P * error + resampler->drift_integral;
+	if(correction > CHIAKI_AUDIO_RESAMPLER_RATIO_DEVIATION_MAX)
+		correction = CHIAKI_AUDIO_RESAMPLER_RATIO_DEVIATION_MAX;
+	else if(correction < -CHIAKI_AUDIO_RESAMPLER_RATIO_DEVIATION_MAX)
+		correction = -CHIAKI_AUDIO_RESAMPLER_RATIO_DEVIATION_MAX;
+
+	resampler->ratio = 1.0 - correction;
+}
+
+static ChiakiErrorCode buf_reserve(ChiakiAudioResampler *resampler, size_t frames)
+{
+	if(frames <= resampler->buf_frames_size)
+		return CHIAKI_ERR_SUCCESS;
+
+	size_t size_new = resampler->buf_frames_size;
+	while(size_new < frames)
+		size_new *= 2;
+
+	float *buf_new = calloc(resampler->channels * size_new, sizeof(float));
+	if(!buf_new)
+		return CHIAKI_ERR_MEMORY;
+	for(unsigned int c=0; c<resampler->channels; c++)
+		memcpy(buf_new + c * size_new, resampler->buf + c * resampler->buf_frames_size, sizeof(float) * resampler->buf_frames);
+	free(resampler->buf);
+	resampler->buf = buf_new;
+	resampler->buf_frames_size = size_new;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * Plain scalar loop over contiguous taps, interpolating between the two neighbouring phases.
+ */
+static inline float filter_apply(const float *__restrict x, const float *__restrict c0, const float *__restrict c1, float frac)
+{
+	float acc = 0.0f;
+	for(size_t t=0; t<CHIAKI_AUDIO_RESAMPLER_TAPS; t++)
+		acc += x[t] * (c0[t] + frac * (c1[t] - c0[t]));
+	return acc;
+}
+
+static inline int16_t sample_to_int16(float v)
+{
+	float s = v * 32768.0f;
+	if(s >= 32767.0f)
+		return INT16_MAX;
+	if(s <= -32768.0f)
+		return INT16_MIN;
+	return (int16_t)lrintf(s);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_audio_resampler_process(ChiakiAudioResampler *resampler,
+		const int16_t *in, size_t in_frames, int16_t *out, size_t out_frames_max, size_t *out_frames)
+{
+	*out_frames = 0;
+
+	ChiakiErrorCode err = buf_reserve(resampler, resampler->buf_frames + in_frames);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	unsigned int channels = resampler->channels;
+	size_t stride = resampler->buf_frames_size;
+	for(unsigned int c=0; c<channels; c++)
+	{
+		float *dst = resampler->buf + c * stride + resampler->buf_frames;
+		for(size_t i=0; i<in_frames; i++)
+			dst[i] = (float)in[i * channels + c] * (1.0f / 32768.0f);
+	}
+	resampler->buf_frames += in_frames;
+
+	double step = 1.0 / resampler->ratio;
+	double pos = resampler->pos;
+	size_t written = 0;
+	while(written < out_frames_max)
+	{
+		size_t index = (size_t)pos;
+		if(index + CHIAKI_AUDIO_RESAMPLER_TAPS / 2 >= resampler->buf_frames)
+			break;
+
+		double phase_pos = (pos - (double)index) * CHIAKI_AUDIO_RESAMPLER_PHASES;
+		size_t phase = (size_t)phase_pos;
+		float frac = (float)(phase_pos - (double)phase);
+		const float *c0 = resampler->filter + phase * CHIAKI_AUDIO_RESAMPLER_TAPS;
+		const float *c1 = c0 + CHIAKI_AUDIO_RESAMPLER_TAPS;
+
+		size_t start = index - HISTORY_FRAMES;
+		for(unsigned int c=0; c<channels; c++)
+			out[written * channels + c] = sample_to_int16(filter_apply(resampler->buf + c * stride + start, c0, c1, frac));
+
+		written++;
+		pos += step;
+	}
+
+	// keep only what is needed as history for the next output frame
+	size_t drop = (size_t)pos - HISTORY_FRAMES;
+	if(drop > resampler->buf_frames)
+		drop = resampler->buf_frames;
+	if(drop)
+	{
+		for(unsigned int c=0; c<channels; c++)
+		{
+			float *b = resampler->buf + c * stride;
+			memmove(b, b + drop, sizeof(float) * (resampler->buf_frames - drop));
+		}
+		resampler->buf_frames -= drop;
+		pos -= (double)drop;
+	}
+	resampler->pos = pos;
+
+	*out_frames = written;
+	return CHIAKI_ERR_SUCCESS;
+}
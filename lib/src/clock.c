@@ -0,0 +1,88 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki/clock.h>
+#include <chiaki/time.h>
+
+#include <stdlib.h>
+
+static uint64_t system_now_us(ChiakiClock *clock)
+{
+	return chiaki_time_now_monotonic_us();
+}
+
+static ChiakiErrorCode system_cond_wait_until(ChiakiClock *clock, ChiakiCond *cond, ChiakiMutex *mutex, uint64_t deadline_us)
+{
+	if(deadline_us == UINT64_MAX)
+		return chiaki_cond_wait(cond, mutex);
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	if(deadline_us <= now_us)
+		return CHIAKI_ERR_TIMEOUT;
+	return chiaki_cond_timedwait_us(cond, mutex, deadline_us - now_us);
+}
+
+static ChiakiClock system_clock = {
+	system_now_us,
+	system_cond_wait_until,
+	NULL,
+	NULL,
+	NULL
+};
+
+CHIAKI_EXPORT ChiakiClock *chiaki_clock_system(void)
+{
+	return &system_clock;
+}
+
+typedef struct clock_thread_t
+{
+	ChiakiClock *clock;
+	ChiakiThreadFunc func;
+	void *arg;
+} ClockThread;
+
+static void *clock_thread_func(void *user)
+{
+	ClockThread clock_thread = *(ClockThread *)user;
+	free(user);
+	void *r = clock_thread.func(clock_thread.arg);
+	clock_thread.clock->thread_remove(clock_thread.clock);
+	return r;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_clock_thread_create(ChiakiClock *clock, ChiakiThread *thread, ChiakiThreadFunc func, void *arg)
+{
+	if(!clock->thread_add)
+		return chiaki_thread_create(thread, func, arg);
+
+	ClockThread *clock_thread = malloc(sizeof(ClockThread));
+	if(!clock_thread)
+		return CHIAKI_ERR_MEMORY;
+	clock_thread->clock = clock;
+	clock_thread->func = func;
+	clock_thread->arg = arg;
+
+	// added before the thread can run, so the clock never sees it running without knowing about it
+	clock->thread_add(clock);
+	ChiakiErrorCode err = chiaki_thread_create(thread, clock_thread_func, clock_thread);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		clock->thread_remove(clock);
+		free(clock_thread);
+	}
+	return err;
+}
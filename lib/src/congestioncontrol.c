@@ -21,58 +21,28 @@
 #define CONGESTION_CONTROL_INTERVAL_MS 200
 
 
-static void *congestion_control_thread_func(void *user)
+static void congestion_control_timer_cb(void *user)
 {
 	ChiakiCongestionControl *control = user;
 
-	ChiakiErrorCode err = chiaki_bool_pred_cond_lock(&control->stop_cond);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return NULL;
+	//CHIAKI_LOGD(control->takion->log, "Sending Congestion Control Packet");
+	ChiakiTakionCongestionPacket packet = { 0 }; // TODO: fill with real values
+	chiaki_takion_send_congestion(control->takion, &packet);
 
-	while(true)
-	{
-		err = chiaki_bool_pred_cond_timedwait(&control->stop_cond, CONGESTION_CONTROL_INTERVAL_MS);
-		if(err != CHIAKI_ERR_TIMEOUT)
-			break;
-
-		//CHIAKI_LOGD(control->takion->log, "Sending Congestion Control Packet");
-		ChiakiTakionCongestionPacket packet = { 0 }; // TODO: fill with real values
-		chiaki_takion_send_congestion(control->takion, &packet);
-	}
-
-	chiaki_bool_pred_cond_unlock(&control->stop_cond);
-	return NULL;
+	chiaki_timer_service_schedule_ms(control->timer_service, &control->timer, CONGESTION_CONTROL_INTERVAL_MS);
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_start(ChiakiCongestionControl *control, ChiakiTakion *takion, ChiakiTimerService *timer_service)
 {
 	control->takion = takion;
-
-	ChiakiErrorCode err = chiaki_bool_pred_cond_init(&control->stop_cond);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-
-	err = chiaki_thread_create(&control->thread, congestion_control_thread_func, control);
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		chiaki_bool_pred_cond_fini(&control->stop_cond);
-		return err;
-	}
-
-	chiaki_thread_set_name(&control->thread, "Chiaki Congestion Control");
-
+	control->timer_service = timer_service;
+	chiaki_timer_init(&control->timer, congestion_control_timer_cb, control);
+	chiaki_timer_service_schedule_ms(timer_service, &control->timer, CONGESTION_CONTROL_INTERVAL_MS);
 	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_congestion_control_stop(ChiakiCongestionControl *control)
 {
-	ChiakiErrorCode err = chiaki_bool_pred_cond_signal(&control->stop_cond);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-
-	err = chiaki_thread_join(&control->thread, NULL);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-
-	return chiaki_bool_pred_cond_fini(&control->stop_cond);
+	chiaki_timer_service_cancel(control->timer_service, &control->timer);
+	return CHIAKI_ERR_SUCCESS;
 }
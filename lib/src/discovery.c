@@ -34,6 +34,10 @@
 #include <arpa/inet.h>
 #endif
 
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT 0 // only used with ChiakiReactor, which is not available on these platforms
+#endif
+
 const char *chiaki_discovery_host_state_string(ChiakiDiscoveryHostState state)
 {
 	switch(state)
@@ -258,41 +262,55 @@ static void *discovery_thread_func(void *user)
 			break;
 		}
 
-		char buf[512];
-		struct sockaddr client_addr;
-		socklen_t client_addr_size = sizeof(client_addr);
-		int n = recvfrom(discovery->socket, buf, sizeof(buf) - 1, 0, &client_addr, &client_addr_size);
-		if(n < 0)
-		{
-			CHIAKI_LOGE(discovery->log, "Discovery thread failed to read from socket");
+		err = chiaki_discovery_recv(discovery, true, thread->cb, thread->cb_user);
+		if(err != CHIAKI_ERR_SUCCESS)
 			break;
-		}
+	}
 
-		if(n == 0)
-			continue;
+	return NULL;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_recv(ChiakiDiscovery *discovery, bool block, ChiakiDiscoveryCb cb, void *cb_user)
+{
+	char buf[512];
+	struct sockaddr client_addr;
+	socklen_t client_addr_size = sizeof(client_addr);
+	int n = recvfrom(discovery->socket, buf, sizeof(buf) - 1, block ? 0 : MSG_DONTWAIT, &client_addr, &client_addr_size);
+	if(n < 0)
+	{
+#ifndef _WIN32
+		if(!block && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return CHIAKI_ERR_TIMEOUT;
+		if(errno == EINTR)
+			return CHIAKI_ERR_SUCCESS;
+#endif
+		CHIAKI_LOGE(discovery->log, "Discovery failed to read from socket");
+		return CHIAKI_ERR_NETWORK;
+	}
 
-		if(n > sizeof(buf) - 1)
-			n = sizeof(buf) - 1;
+	if(n == 0)
+		return CHIAKI_ERR_SUCCESS;
 
-		buf[n] = '\00';
+	if(n > sizeof(buf) - 1)
+		n = sizeof(buf) - 1;
 
-		//CHIAKI_LOGV(discovery->log, "Discovery received:\n%s", buf);
-		//chiaki_log_hexdump_raw(discovery->log, CHIAKI_LOG_VERBOSE, (const uint8_t *)buf, n);
+	buf[n] = '\00';
 
-		char addr_buf[64];
-		ChiakiDiscoveryHost response;
-		err = chiaki_discovery_srch_response_parse(&response, &client_addr, addr_buf, sizeof(addr_buf), buf, n);
-		if(err != CHIAKI_ERR_SUCCESS)
-		{
-			CHIAKI_LOGI(discovery->log, "Discovery Response invalid");
-			continue;
-		}
+	//CHIAKI_LOGV(discovery->log, "Discovery received:\n%s", buf);
+	//chiaki_log_hexdump_raw(discovery->log, CHIAKI_LOG_VERBOSE, (const uint8_t *)buf, n);
 
-		if(thread->cb)
-			thread->cb(&response, thread->cb_user);
+	char addr_buf[64];
+	ChiakiDiscoveryHost response;
+	ChiakiErrorCode err = chiaki_discovery_srch_response_parse(&response, &client_addr, addr_buf, sizeof(addr_buf), buf, n);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGI(discovery->log, "Discovery Response invalid");
+		return CHIAKI_ERR_SUCCESS;
 	}
 
-	return NULL;
+	if(cb)
+		cb(&response, cb_user);
+	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_wakeup(ChiakiLog *log, ChiakiDiscovery *discovery, const char *host, uint64_t user_credential)
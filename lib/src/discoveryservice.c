@@ -16,71 +16,206 @@
  */
 
 #include <chiaki/discoveryservice.h>
+#include <chiaki/clock.h>
 
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
 #include <assert.h>
 
-static void *discovery_service_thread_func(void *user);
-static void discovery_service_ping(ChiakiDiscoveryService *service);
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#endif
+
+#define BUCKETS_MIN 16
+
+static void discovery_service_ping_timer_cb(void *user);
+static void discovery_service_pace_timer_cb(void *user);
+static void discovery_service_send_round(ChiakiDiscoveryService *service);
 static void discovery_service_drop_old_hosts(ChiakiDiscoveryService *service);
+static void discovery_service_host_remove(ChiakiDiscoveryService *service, size_t index);
 static void discovery_service_host_received(ChiakiDiscoveryHost *host, void *user);
+static void discovery_service_reactor_cb(void *user);
 static void discovery_service_report_state(ChiakiDiscoveryService *service);
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_service_target_parse(ChiakiDiscoveryServiceTarget *target, const char *str)
+{
+	char addr_str[INET_ADDRSTRLEN];
+	const char *slash = strchr(str, '/');
+	size_t addr_len = slash ? (size_t)(slash - str) : strlen(str);
+	if(addr_len >= sizeof(addr_str))
+		return CHIAKI_ERR_PARSE_ADDR;
+	memcpy(addr_str, str, addr_len);
+	addr_str[addr_len] = '\0';
+
+	struct in_addr addr;
+	if(inet_pton(AF_INET, addr_str, &addr) != 1)
+		return CHIAKI_ERR_PARSE_ADDR;
+
+	unsigned long prefix_len = 32;
+	if(slash)
+	{
+		char *end;
+		prefix_len = strtoul(slash + 1, &end, 10);
+		if(end == slash + 1 || *end || prefix_len > 32)
+			return CHIAKI_ERR_PARSE_ADDR;
+	}
+
+	target->addr = ntohl(addr.s_addr);
+	target->prefix_len = (uint8_t)prefix_len;
+	target->port = 0;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT uint64_t chiaki_discovery_service_target_addrs_count(const ChiakiDiscoveryServiceTarget *target)
+{
+	uint64_t size = (uint64_t)1 << (32 - target->prefix_len);
+	// network and broadcast address are skipped for everything but /31 and /32
+	return target->prefix_len >= 31 ? size : size - 2;
+}
+
+static uint32_t discovery_service_target_addr(const ChiakiDiscoveryServiceTarget *target, uint64_t index)
+{
+	if(target->prefix_len == 32)
+		return target->addr;
+	uint32_t network = target->addr & ~(uint32_t)(((uint64_t)1 << (32 - target->prefix_len)) - 1);
+	return network + (uint32_t)index + (target->prefix_len >= 31 ? 0 : 1);
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_discovery_service_init(ChiakiDiscoveryService *service, ChiakiDiscoveryServiceOptions *options, ChiakiLog *log)
 {
+	if(!options->send_addr && !options->targets_count)
+		return CHIAKI_ERR_INVALID_DATA;
+	if(options->targets_count && options->send_addr && options->send_addr->sa_family != AF_INET)
+		return CHIAKI_ERR_INVALID_DATA; // targets are IPv4 only
+
 	service->log = log;
 	service->options = *options;
 	service->ping_index = 0;
+	service->round_addrs_count = options->send_addr ? 1 : 0;
+
+	for(size_t i=0; i<options->targets_count; i++)
+	{
+		if(options->targets[i].prefix_len < CHIAKI_DISCOVERY_SERVICE_TARGET_PREFIX_LEN_MIN || options->targets[i].prefix_len > 32)
+		{
+			CHIAKI_LOGE(log, "Discovery Service target has invalid prefix length %u", (unsigned int)options->targets[i].prefix_len);
+			return CHIAKI_ERR_INVALID_DATA;
+		}
+		service->round_addrs_count += chiaki_discovery_service_target_addrs_count(&options->targets[i]);
+	}
+	service->round_pos = service->round_addrs_count; // no round in progress
 
+	size_t buckets_count = BUCKETS_MIN;
+	while(buckets_count < service->options.hosts_max * 2)
+		buckets_count <<= 1;
+	service->buckets_mask = buckets_count - 1;
+
+	ChiakiErrorCode err = CHIAKI_ERR_MEMORY;
 	service->hosts = calloc(service->options.hosts_max, sizeof(ChiakiDiscoveryHost));
 	if(!service->hosts)
 		return CHIAKI_ERR_MEMORY;
 
-	ChiakiErrorCode err;
 	service->host_discovery_infos = calloc(service->options.hosts_max, sizeof(ChiakiDiscoveryServiceHostDiscoveryInfo));
 	if(!service->host_discovery_infos)
-	{
-		err = CHIAKI_ERR_MEMORY;
 		goto error_hosts;
+
+	service->id_buckets = malloc(buckets_count * sizeof(size_t));
+	if(!service->id_buckets)
+		goto error_host_discovery_infos;
+
+	service->addr_buckets = malloc(buckets_count * sizeof(size_t));
+	if(!service->addr_buckets)
+		goto error_id_buckets;
+
+	for(size_t i=0; i<buckets_count; i++)
+	{
+		service->id_buckets[i] = SIZE_MAX;
+		service->addr_buckets[i] = SIZE_MAX;
 	}
 
 	service->hosts_count = 0;
+	service->lru_head = SIZE_MAX;
+	service->lru_tail = SIZE_MAX;
 
 	err = chiaki_mutex_init(&service->state_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_host_discovery_infos;
+		goto error_addr_buckets;
+
+	service->options.send_addr = NULL;
+	if(options->send_addr)
+	{
+		service->options.send_addr = malloc(service->options.send_addr_size);
+		if(!service->options.send_addr)
+		{
+			err = CHIAKI_ERR_MEMORY;
+			goto error_state_mutex;
+		}
+		memcpy(service->options.send_addr, options->send_addr, service->options.send_addr_size);
+	}
 
-	service->options.send_addr = malloc(service->options.send_addr_size);
-	if(!service->options.send_addr)
+	service->options.targets = NULL;
+	if(options->targets_count)
 	{
-		err = CHIAKI_ERR_MEMORY;
-		goto error_state_mutex;
+		service->options.targets = malloc(options->targets_count * sizeof(ChiakiDiscoveryServiceTarget));
+		if(!service->options.targets)
+		{
+			err = CHIAKI_ERR_MEMORY;
+			goto error_send_addr;
+		}
+		memcpy(service->options.targets, options->targets, options->targets_count * sizeof(ChiakiDiscoveryServiceTarget));
 	}
-	memcpy(service->options.send_addr, options->send_addr, service->options.send_addr_size);
 
-	err = chiaki_discovery_init(&service->discovery, log, service->options.send_addr->sa_family);
+	err = chiaki_discovery_init(&service->discovery, log, service->options.send_addr ? service->options.send_addr->sa_family : AF_INET);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_send_addr;
+		goto error_targets;
 
-	err = chiaki_bool_pred_cond_init(&service->stop_cond);
-	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_discovery;
+	service->timer_service = service->options.timer_service;
+	if(!service->timer_service)
+	{
+		err = chiaki_timer_service_init(&service->own_timer_service, log);
+		if(err != CHIAKI_ERR_SUCCESS)
+			goto error_discovery;
+		service->timer_service = &service->own_timer_service;
+	}
 
-	err = chiaki_thread_create(&service->thread, discovery_service_thread_func, service);
-	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_stop_cond;
+	service->reactor_active = false;
+	if(service->options.reactor)
+	{
+		err = chiaki_reactor_add(service->options.reactor, &service->reactor_source, service->discovery.socket, discovery_service_reactor_cb, service);
+		if(err == CHIAKI_ERR_SUCCESS)
+			service->reactor_active = true;
+		else
+			CHIAKI_LOGW(log, "Discovery Service failed to register with reactor, receiving on its own thread");
+	}
+
+	if(!service->reactor_active)
+	{
+		err = chiaki_discovery_thread_start(&service->discovery_thread, &service->discovery, discovery_service_host_received, service);
+		if(err != CHIAKI_ERR_SUCCESS)
+			goto error_timer_service;
+	}
 
-	chiaki_thread_set_name(&service->thread, "Chiaki Discovery Service");
+	chiaki_timer_init(&service->ping_timer, discovery_service_ping_timer_cb, service);
+	chiaki_timer_init(&service->pace_timer, discovery_service_pace_timer_cb, service);
+	chiaki_timer_service_schedule_ms(service->timer_service, &service->ping_timer, service->options.ping_ms);
 
 	return CHIAKI_ERR_SUCCESS;
-error_stop_cond:
-	chiaki_bool_pred_cond_fini(&service->stop_cond);
+error_timer_service:
+	if(service->timer_service == &service->own_timer_service)
+		chiaki_timer_service_fini(&service->own_timer_service);
 error_discovery:
 	chiaki_discovery_fini(&service->discovery);
+error_targets:
+	free(service->options.targets);
 error_send_addr:
 	free(service->options.send_addr);
 error_state_mutex:
 	chiaki_mutex_fini(&service->state_mutex);
+error_addr_buckets:
+	free(service->addr_buckets);
+error_id_buckets:
+	free(service->id_buckets);
 error_host_discovery_infos:
 	free(service->host_discovery_infos);
 error_hosts:
@@ -90,12 +225,18 @@ error_hosts:
 
 CHIAKI_EXPORT void chiaki_discovery_service_fini(ChiakiDiscoveryService *service)
 {
-	chiaki_bool_pred_cond_signal(&service->stop_cond);
-	chiaki_thread_join(&service->thread, NULL);
-	chiaki_bool_pred_cond_fini(&service->stop_cond);
+	chiaki_timer_service_cancel(service->timer_service, &service->ping_timer);
+	chiaki_timer_service_cancel(service->timer_service, &service->pace_timer);
+	if(service->timer_service == &service->own_timer_service)
+		chiaki_timer_service_fini(&service->own_timer_service);
+	if(service->reactor_active)
+		chiaki_reactor_remove(&service->reactor_source);
+	else
+		chiaki_discovery_thread_stop(&service->discovery_thread);
 	chiaki_discovery_fini(&service->discovery);
 	chiaki_mutex_fini(&service->state_mutex);
 	free(service->options.send_addr);
+	free(service->options.targets);
 
 	for(size_t i=0; i<service->hosts_count; i++)
 	{
@@ -105,89 +246,241 @@ CHIAKI_EXPORT void chiaki_discovery_service_fini(ChiakiDiscoveryService *service
 #undef FREE_STRING
 	}
 
+	free(service->addr_buckets);
+	free(service->id_buckets);
 	free(service->host_discovery_infos);
 	free(service->hosts);
 }
 
-static void *discovery_service_thread_func(void *user)
+static void discovery_service_ping_timer_cb(void *user)
 {
 	ChiakiDiscoveryService *service = user;
 
-	ChiakiErrorCode err = chiaki_bool_pred_cond_lock(&service->stop_cond);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return NULL;
+	ChiakiErrorCode err = chiaki_mutex_lock(&service->state_mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	service->ping_index++;
+	discovery_service_drop_old_hosts(service);
+	chiaki_mutex_unlock(&service->state_mutex);
 
-	ChiakiDiscoveryThread discovery_thread;
-	err = chiaki_discovery_thread_start(&discovery_thread, &service->discovery, discovery_service_host_received, service);
-	if(err != CHIAKI_ERR_SUCCESS)
-		goto beach;
+	if(service->round_pos < service->round_addrs_count)
+		CHIAKI_LOGW(service->log, "Discovery Service starting new ping round before the last one was finished, ping_ms is too short for the targets");
 
-	while(true)
+	CHIAKI_LOGV(service->log, "Discovery Service sending ping to %llu addresses", (unsigned long long)service->round_addrs_count);
+	service->round_pos = 0;
+	discovery_service_send_round(service);
+
+	chiaki_timer_service_schedule_ms(service->timer_service, &service->ping_timer, service->options.ping_ms);
+}
+
+static void discovery_service_pace_timer_cb(void *user)
+{
+	ChiakiDiscoveryService *service = user;
+	discovery_service_send_round(service);
+}
+
+static void discovery_service_send_ping(ChiakiDiscoveryService *service, uint64_t pos)
+{
+	ChiakiDiscoveryPacket packet = { 0 };
+	packet.cmd = CHIAKI_DISCOVERY_CMD_SRCH;
+
+	if(service->options.send_addr)
 	{
-		err = chiaki_bool_pred_cond_timedwait(&service->stop_cond, service->options.ping_ms);
-		if(err != CHIAKI_ERR_TIMEOUT)
-			break;
-		discovery_service_ping(service);
+		if(pos == 0)
+		{
+			chiaki_discovery_send(&service->discovery, &packet, service->options.send_addr, service->options.send_addr_size);
+			return;
+		}
+		pos--;
 	}
 
-	chiaki_discovery_thread_stop(&discovery_thread);
+	for(size_t i=0; i<service->options.targets_count; i++)
+	{
+		const ChiakiDiscoveryServiceTarget *target = &service->options.targets[i];
+		uint64_t count = chiaki_discovery_service_target_addrs_count(target);
+		if(pos >= count)
+		{
+			pos -= count;
+			continue;
+		}
 
-beach:
-	chiaki_bool_pred_cond_unlock(&service->stop_cond);
-	return NULL;
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(target->port ? target->port : CHIAKI_DISCOVERY_PORT);
+		addr.sin_addr.s_addr = htonl(discovery_service_target_addr(target, pos));
+		chiaki_discovery_send(&service->discovery, &packet, (struct sockaddr *)&addr, sizeof(addr));
+		return;
+	}
 }
 
-static void discovery_service_ping(ChiakiDiscoveryService *service)
+/**
+ * Send the next batch of the current round and schedule the following one.
+ */
+static void discovery_service_send_round(ChiakiDiscoveryService *service)
 {
-	ChiakiErrorCode err = chiaki_mutex_lock(&service->state_mutex);
-	assert(err == CHIAKI_ERR_SUCCESS);
+	uint64_t end = service->round_addrs_count;
+	if(service->options.sends_per_tick && end - service->round_pos > service->options.sends_per_tick)
+		end = service->round_pos + service->options.sends_per_tick;
 
-	service->ping_index++;
-	discovery_service_drop_old_hosts(service);
+	for(; service->round_pos < end; service->round_pos++)
+		discovery_service_send_ping(service, service->round_pos);
 
-	chiaki_mutex_unlock(&service->state_mutex);
+	if(service->round_pos < service->round_addrs_count)
+	{
+		chiaki_timer_service_schedule(service->timer_service, &service->pace_timer,
+				chiaki_clock_now_us(service->timer_service->clock) + service->options.send_tick_us);
+	}
+}
 
-	CHIAKI_LOGV(service->log, "Discovery Service sending ping");
-	ChiakiDiscoveryPacket packet = { 0 };
-	packet.cmd = CHIAKI_DISCOVERY_CMD_SRCH;
-	err = chiaki_discovery_send(&service->discovery, &packet, service->options.send_addr, service->options.send_addr_size);
-	if(err != CHIAKI_ERR_SUCCESS)
-		CHIAKI_LOGE(service->log, "Discovery Service failed to send ping");
+static uint32_t discovery_service_hash(const char *str)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	if(!str)
+		return hash;
+	for(; *str; str++)
+	{
+		hash ^= (uint8_t)*str;
+		hash *= 16777619u;
+	}
+	return hash;
 }
 
-static void discovery_service_drop_old_hosts(ChiakiDiscoveryService *service)
+static size_t *discovery_service_host_chain_next(ChiakiDiscoveryServiceHostDiscoveryInfo *info, bool by_addr)
 {
-	// service->state_mutex must be locked
+	return by_addr ? &info->addr_next : &info->id_next;
+}
 
-	bool change = false;
+/**
+ * @return pointer to the bucket of the index by_addr that index is in
+ */
+static size_t *discovery_service_host_bucket(ChiakiDiscoveryService *service, size_t index, bool by_addr)
+{
+	ChiakiDiscoveryServiceHostDiscoveryInfo *info = &service->host_discovery_infos[index];
+	if(by_addr)
+		return &service->addr_buckets[info->addr_hash & service->buckets_mask];
+	return &service->id_buckets[info->id_hash & service->buckets_mask];
+}
 
-	for(size_t i=0; i<service->hosts_count; i++)
+static void discovery_service_host_index_link(ChiakiDiscoveryService *service, size_t index, bool by_addr)
+{
+	size_t *bucket = discovery_service_host_bucket(service, index, by_addr);
+	*discovery_service_host_chain_next(&service->host_discovery_infos[index], by_addr) = *bucket;
+	*bucket = index;
+}
+
+/**
+ * Replace the reference to index in its chain by replacement, which may be SIZE_MAX to unlink it.
+ */
+static void discovery_service_host_index_replace(ChiakiDiscoveryService *service, size_t index, size_t replacement, bool by_addr)
+{
+	size_t *p = discovery_service_host_bucket(service, index, by_addr);
+	while(*p != index)
 	{
-		if(service->host_discovery_infos[i].last_ping_index + service->options.host_drop_pings >= service->ping_index)
-			continue;
+		assert(*p != SIZE_MAX);
+		p = discovery_service_host_chain_next(&service->host_discovery_infos[*p], by_addr);
+	}
+	if(replacement == SIZE_MAX)
+		*p = *discovery_service_host_chain_next(&service->host_discovery_infos[index], by_addr);
+	else
+		*p = replacement;
+}
 
-		ChiakiDiscoveryHost *host = &service->hosts[i];
-		CHIAKI_LOGI(service->log, "Discovery Service: Host with id %s is no longer available", host->host_id ? host->host_id : "");
+static size_t discovery_service_host_find(ChiakiDiscoveryService *service, const char *key, uint32_t hash, bool by_addr)
+{
+	size_t index = by_addr ? service->addr_buckets[hash & service->buckets_mask] : service->id_buckets[hash & service->buckets_mask];
+	while(index != SIZE_MAX)
+	{
+		ChiakiDiscoveryServiceHostDiscoveryInfo *info = &service->host_discovery_infos[index];
+		const char *host_key = by_addr ? service->hosts[index].host_addr : service->hosts[index].host_id;
+		if((by_addr ? info->addr_hash : info->id_hash) == hash && host_key && strcmp(host_key, key) == 0)
+			return index;
+		index = *discovery_service_host_chain_next(info, by_addr);
+	}
+	return SIZE_MAX;
+}
+
+static void discovery_service_lru_unlink(ChiakiDiscoveryService *service, size_t index)
+{
+	ChiakiDiscoveryServiceHostDiscoveryInfo *info = &service->host_discovery_infos[index];
+	if(info->lru_prev != SIZE_MAX)
+		service->host_discovery_infos[info->lru_prev].lru_next = info->lru_next;
+	else
+		service->lru_head = info->lru_next;
+	if(info->lru_next != SIZE_MAX)
+		service->host_discovery_infos[info->lru_next].lru_prev = info->lru_prev;
+	else
+		service->lru_tail = info->lru_prev;
+}
+
+static void discovery_service_lru_append(ChiakiDiscoveryService *service, size_t index)
+{
+	ChiakiDiscoveryServiceHostDiscoveryInfo *info = &service->host_discovery_infos[index];
+	info->lru_prev = service->lru_tail;
+	info->lru_next = SIZE_MAX;
+	if(service->lru_tail != SIZE_MAX)
+		service->host_discovery_infos[service->lru_tail].lru_next = index;
+	else
+		service->lru_head = index;
+	service->lru_tail = index;
+}
+
+static void discovery_service_host_event(ChiakiDiscoveryService *service, ChiakiDiscoveryServiceHostEvent event, size_t index)
+{
+	if(service->options.host_cb)
+		service->options.host_cb(event, &service->hosts[index], service->options.cb_user);
+}
+
+static void discovery_service_host_remove(ChiakiDiscoveryService *service, size_t index)
+{
+	// service->state_mutex must be locked
+
+	ChiakiDiscoveryHost *host = &service->hosts[index];
+	CHIAKI_LOGI(service->log, "Discovery Service: Host with id %s is no longer available", host->host_id ? host->host_id : "");
+	discovery_service_host_event(service, CHIAKI_DISCOVERY_SERVICE_HOST_REMOVED, index);
+
+	discovery_service_host_index_replace(service, index, SIZE_MAX, false);
+	discovery_service_host_index_replace(service, index, SIZE_MAX, true);
+	discovery_service_lru_unlink(service, index);
 
 #define FREE_STRING(name) do { free((char *)host->name); } while(0)
-		CHIAKI_DISCOVERY_HOST_STRING_FOREACH(FREE_STRING)
+	CHIAKI_DISCOVERY_HOST_STRING_FOREACH(FREE_STRING)
 #undef FREE_STRING
 
-		if(i < service->hosts_count - 1)
-		{
-			memmove(service->host_discovery_infos + i,
-					service->host_discovery_infos + i + 1,
-					sizeof(ChiakiDiscoveryServiceHostDiscoveryInfo) * (service->hosts_count - i - 1));
+	size_t last = service->hosts_count - 1;
+	if(index != last)
+	{
+		// move the last host into the gap, only the references to it have to be updated
+		ChiakiDiscoveryServiceHostDiscoveryInfo *last_info = &service->host_discovery_infos[last];
+		discovery_service_host_index_replace(service, last, index, false);
+		discovery_service_host_index_replace(service, last, index, true);
+		if(last_info->lru_prev != SIZE_MAX)
+			service->host_discovery_infos[last_info->lru_prev].lru_next = index;
+		else
+			service->lru_head = index;
+		if(last_info->lru_next != SIZE_MAX)
+			service->host_discovery_infos[last_info->lru_next].lru_prev = index;
+		else
+			service->lru_tail = index;
+
+		service->hosts[index] = service->hosts[last];
+		service->host_discovery_infos[index] = *last_info;
+	}
+	service->hosts_count--;
+}
 
-			memmove(service->hosts + i,
-					service->hosts + i + 1,
-					sizeof(ChiakiDiscoveryHost) * (service->hosts_count - i - 1));
-		}
+static void discovery_service_drop_old_hosts(ChiakiDiscoveryService *service)
+{
+	// service->state_mutex must be locked
 
+	bool change = false;
+	while(service->lru_head != SIZE_MAX)
+	{
+		size_t index = service->lru_head;
+		if(service->host_discovery_infos[index].last_ping_index + service->options.host_drop_pings >= service->ping_index)
+			break;
+		discovery_service_host_remove(service, index);
 		change = true;
-
-		i--;
-		service->hosts_count--;
 	}
 
 	if(change)
@@ -206,55 +499,76 @@ static void discovery_service_host_received(ChiakiDiscoveryHost *host, void *use
 
 	CHIAKI_LOGV(service->log, "Discovery Service Received host with id %s", host->host_id);
 
+	uint32_t id_hash = discovery_service_hash(host->host_id);
+	uint32_t addr_hash = discovery_service_hash(host->host_addr);
+
 	ChiakiErrorCode err = chiaki_mutex_lock(&service->state_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
 
 	bool change = false;
 
-	size_t index = SIZE_MAX;
-	for(size_t i=0; i<service->hosts_count; i++)
+	if(host->host_addr)
 	{
-		if(!service->hosts[i].host_id)
-			continue;
-
-		if(strcmp(service->hosts[i].host_id, host->host_id) == 0)
+		size_t addr_index = discovery_service_host_find(service, host->host_addr, addr_hash, true);
+		if(addr_index != SIZE_MAX && strcmp(service->hosts[addr_index].host_id, host->host_id) != 0)
 		{
-			index = i;
-			break;
+			// only one host can answer from an address, so the old one is gone
+			discovery_service_host_remove(service, addr_index);
+			change = true;
 		}
 	}
 
+	size_t index = discovery_service_host_find(service, host->host_id, id_hash, false);
+	bool added = false;
 	if(index == SIZE_MAX)
 	{
 		if(service->hosts_count == service->options.hosts_max)
 		{
 			CHIAKI_LOGE(service->log, "Discovery Service received new host, but no space available");
-			goto r2con;
+			goto unlock;
 		}
 
 		CHIAKI_LOGI(service->log, "Discovery Service detected new host with id %s", host->host_id);
 
-		change = true;
+		added = true;
 		index = service->hosts_count++;
 		memset(&service->hosts[index], 0, sizeof(ChiakiDiscoveryHost));
+		service->host_discovery_infos[index].id_hash = id_hash;
+		service->host_discovery_infos[index].addr_hash = addr_hash;
+		discovery_service_host_index_link(service, index, false);
+		discovery_service_host_index_link(service, index, true);
+		discovery_service_lru_append(service, index);
+	}
+	else
+	{
+		discovery_service_lru_unlink(service, index);
+		discovery_service_lru_append(service, index);
 	}
 
 	service->host_discovery_infos[index].last_ping_index = service->ping_index;
 
 	ChiakiDiscoveryHost *host_slot = &service->hosts[index];
+	bool host_change = added;
 
 	if(host_slot->state != host->state || host_slot->host_request_port != host->host_request_port)
-		change = true;
+		host_change = true;
 
 	host_slot->state = host->state;
 	host_slot->host_request_port = host->host_request_port;
 
+	if(!added && service->host_discovery_infos[index].addr_hash != addr_hash)
+	{
+		discovery_service_host_index_replace(service, index, SIZE_MAX, true);
+		service->host_discovery_infos[index].addr_hash = addr_hash;
+		discovery_service_host_index_link(service, index, true);
+	}
+
 #define UPDATE_STRING(name) do { \
 		if(host_slot->name && host->name && strcmp(host_slot->name, host->name) == 0) \
-            break; \
+			break; \
 		if(!host_slot->name && !host->name) \
 			break; \
-		change = true; \
+		host_change = true; \
 		if(host_slot->name) \
 			free((char *)host_slot->name); \
 		if(host->name) \
@@ -267,16 +581,38 @@ static void discovery_service_host_received(ChiakiDiscoveryHost *host, void *use
 
 #undef UPDATE_STRING
 
+	if(host_change)
+	{
+		discovery_service_host_event(service, added ? CHIAKI_DISCOVERY_SERVICE_HOST_ADDED : CHIAKI_DISCOVERY_SERVICE_HOST_CHANGED, index);
+		change = true;
+	}
+
+unlock:
 	if(change)
 		discovery_service_report_state(service);
-
-r2con:
 	chiaki_mutex_unlock(&service->state_mutex);
 }
 
+static void discovery_service_reactor_cb(void *user)
+{
+	ChiakiDiscoveryService *service = user;
+	while(true)
+	{
+		ChiakiErrorCode err = chiaki_discovery_recv(&service->discovery, false, discovery_service_host_received, service);
+		if(err == CHIAKI_ERR_TIMEOUT)
+			return;
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			// same as the discovery thread: stop receiving, chiaki_discovery_service_fini() releases the source
+			chiaki_reactor_detach(&service->reactor_source);
+			return;
+		}
+	}
+}
+
 static void discovery_service_report_state(ChiakiDiscoveryService *service)
 {
 	// service->state_mutex must be locked
 	if(service->options.cb)
 		service->options.cb(service->hosts, service->hosts_count, service->options.cb_user);
-}
\ No newline at end of file
+}
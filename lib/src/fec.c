@@ -19,9 +19,11 @@
 
 #include <jerasure.h>
 #include <cauchy.h>
+#include <galois.h>
 
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 
 int *create_matrix(unsigned int k, unsigned int m)
 {
@@ -84,4 +86,264 @@ error_jerasures:
 error_matrix:
 	free(matrix);
 	return err;
-}
\ No newline at end of file
+}
+CHIAKI_EXPORT void chiaki_fec_decoder_init(ChiakiFecDecoder *decoder)
+{
+	memset(decoder, 0, sizeof(*decoder));
+}
+
+CHIAKI_EXPORT void chiaki_fec_decoder_fini(ChiakiFecDecoder *decoder)
+{
+	free(decoder->matrix);
+	free(decoder->acc_buf);
+	free(decoder->received);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decoder_reset(ChiakiFecDecoder *decoder, uint8_t *frame_buf, size_t unit_size, unsigned int k, unsigned int m)
+{
+	decoder->frame_buf = NULL;
+	if(!k || k + m > (1 << CHIAKI_FEC_WORDSIZE) || unit_size > INT_MAX)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	// without parity there are no rows, missing units just can not be recovered
+	if(m && (!decoder->matrix || decoder->matrix_k != k || decoder->matrix_m != m))
+	{
+		free(decoder->matrix);
+		decoder->matrix = create_matrix(k, m);
+		if(!decoder->matrix)
+			return CHIAKI_ERR_MEMORY;
+		decoder->matrix_k = k;
+		decoder->matrix_m = m;
+	}
+
+	if(m && unit_size > SIZE_MAX / m)
+		return CHIAKI_ERR_OVERFLOW;
+	size_t acc_buf_size = unit_size * m;
+	if(decoder->acc_buf_size < acc_buf_size)
+	{
+		free(decoder->acc_buf);
+		decoder->acc_buf = malloc(acc_buf_size);
+		decoder->acc_buf_size = decoder->acc_buf ? acc_buf_size : 0;
+		if(!decoder->acc_buf)
+			return CHIAKI_ERR_MEMORY;
+	}
+
+	size_t flags_size = k + m + m;
+	if(decoder->flags_size < flags_size)
+	{
+		free(decoder->received);
+		decoder->received = malloc(flags_size);
+		decoder->flags_size = decoder->received ? flags_size : 0;
+		if(!decoder->received)
+			return CHIAKI_ERR_MEMORY;
+	}
+	decoder->row_active = decoder->received + k + m;
+	memset(decoder->received, 0, flags_size);
+
+	decoder->frame_buf = frame_buf;
+	decoder->unit_size = unit_size;
+	decoder->k = k;
+	decoder->m = m;
+	decoder->source_received = 0;
+	decoder->source_next = 0;
+	decoder->source_skipped = 0;
+	decoder->parity_next = 0;
+	decoder->rows_active = 0;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+typedef struct fec_row_activate_t
+{
+	ChiakiFecDecoder *decoder;
+	unsigned int row;
+} FecRowActivate;
+
+static void fec_decoder_row_activate_stripe(void *user, size_t offset, size_t size)
+{
+	FecRowActivate *activate = user;
+	ChiakiFecDecoder *decoder = activate->decoder;
+	uint8_t *acc = decoder->acc_buf + activate->row * decoder->unit_size + offset;
+	memset(acc, 0, size);
+	const int *coefs = decoder->matrix + activate->row * decoder->k;
+	for(unsigned int i=0; i<decoder->k; i++)
+	{
+		if(decoder->received[i])
+			galois_w08_region_multiply((char *)decoder->frame_buf + i * decoder->unit_size + offset, coefs[i], (int)size, (char *)acc, 1);
+	}
+}
+
+static void fec_decoder_row_activate(ChiakiFecDecoder *decoder, unsigned int row)
+{
+	FecRowActivate activate = { decoder, row };
+	chiaki_fec_pool_run(decoder->pool, decoder->unit_size, (size_t)decoder->source_received * decoder->unit_size,
+			fec_decoder_row_activate_stripe, &activate);
+	decoder->row_active[row] = 1;
+	decoder->rows_active++;
+}
+
+/**
+ * Make sure at least count rows are kept up to date.
+ * Rows of received parity are active already, so the next ones are those whose parity can still arrive in order,
+ * and only then the ones that were skipped over and most likely lost.
+ */
+static void fec_decoder_rows_ensure(ChiakiFecDecoder *decoder, unsigned int count)
+{
+	if(count > decoder->m)
+		count = decoder->m;
+	for(unsigned int row=decoder->parity_next; row<decoder->m && decoder->rows_active < count; row++)
+	{
+		if(!decoder->row_active[row])
+			fec_decoder_row_activate(decoder, row);
+	}
+	for(unsigned int row=0; row<decoder->parity_next && decoder->rows_active < count; row++)
+	{
+		if(!decoder->row_active[row])
+			fec_decoder_row_activate(decoder, row);
+	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decoder_put_unit(ChiakiFecDecoder *decoder, unsigned int index)
+{
+	if(!decoder->frame_buf || index >= decoder->k + decoder->m)
+		return CHIAKI_ERR_INVALID_DATA;
+	if(decoder->received[index])
+		return CHIAKI_ERR_SUCCESS;
+
+	if(index >= decoder->k)
+	{
+		// parity is only needed for units that are still missing, so its row starts to be tracked now at the latest
+		unsigned int row = index - decoder->k;
+		if(decoder->source_received < decoder->k && !decoder->row_active[row])
+			fec_decoder_row_activate(decoder, row);
+		if(row >= decoder->parity_next)
+			decoder->parity_next = row + 1;
+		decoder->received[index] = 1;
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	if(index >= decoder->source_next)
+	{
+		decoder->source_skipped += index - decoder->source_next;
+		decoder->source_next = index + 1;
+	}
+	else
+		decoder->source_skipped--; // skipped before, arrived late
+
+	// catch up rows for newly skipped units before adding this one, so it is not added twice
+	fec_decoder_rows_ensure(decoder, decoder->source_skipped);
+
+	decoder->received[index] = 1;
+	decoder->source_received++;
+
+	if(decoder->rows_active)
+	{
+		uint8_t *unit = decoder->frame_buf + index * decoder->unit_size;
+		for(unsigned int row=0; row<decoder->m; row++)
+		{
+			if(decoder->row_active[row])
+				galois_w08_region_multiply((char *)unit, decoder->matrix[row * decoder->k + index], (int)decoder->unit_size,
+						(char *)decoder->acc_buf + row * decoder->unit_size, 1);
+		}
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+typedef struct fec_solve_t
+{
+	ChiakiFecDecoder *decoder;
+	const unsigned int *missing;
+	const unsigned int *rows;
+	const int *inv;
+	unsigned int missing_count;
+} FecSolve;
+
+static void fec_decoder_solve_stripe(void *user, size_t offset, size_t size)
+{
+	FecSolve *solve = user;
+	ChiakiFecDecoder *decoder = solve->decoder;
+	unsigned int missing_count = solve->missing_count;
+
+	// parity minus the received units leaves only the contribution of the missing ones
+	for(unsigned int r=0; r<missing_count; r++)
+	{
+		galois_region_xor((char *)decoder->frame_buf + (decoder->k + solve->rows[r]) * decoder->unit_size + offset,
+				(char *)decoder->acc_buf + solve->rows[r] * decoder->unit_size + offset, (int)size);
+	}
+
+	for(unsigned int c=0; c<missing_count; c++)
+	{
+		uint8_t *unit = decoder->frame_buf + solve->missing[c] * decoder->unit_size + offset;
+		memset(unit, 0, size);
+		for(unsigned int r=0; r<missing_count; r++)
+		{
+			galois_w08_region_multiply((char *)decoder->acc_buf + solve->rows[r] * decoder->unit_size + offset, solve->inv[c * missing_count + r],
+					(int)size, (char *)unit, 1);
+		}
+	}
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_decoder_finish(ChiakiFecDecoder *decoder)
+{
+	if(!decoder->frame_buf)
+		return CHIAKI_ERR_UNINITIALIZED;
+	unsigned int missing_count = decoder->k - decoder->source_received;
+	if(!missing_count)
+		return CHIAKI_ERR_SUCCESS;
+
+	ChiakiErrorCode err = CHIAKI_ERR_MEMORY;
+	unsigned int *missing = malloc(missing_count * sizeof(unsigned int) * 2);
+	if(!missing)
+		return CHIAKI_ERR_MEMORY;
+	unsigned int *rows = missing + missing_count;
+	int *mat = malloc(missing_count * missing_count * sizeof(int) * 2);
+	if(!mat)
+		goto error_missing;
+	int *inv = mat + missing_count * missing_count;
+
+	unsigned int missing_index = 0;
+	for(unsigned int i=0; i<decoder->k; i++)
+	{
+		if(!decoder->received[i])
+			missing[missing_index++] = i;
+	}
+
+	unsigned int rows_count = 0;
+	for(unsigned int row=0; row<decoder->m && rows_count < missing_count; row++)
+	{
+		if(decoder->received[decoder->k + row])
+			rows[rows_count++] = row;
+	}
+	if(rows_count < missing_count)
+	{
+		err = CHIAKI_ERR_FEC_FAILED;
+		goto error_mat;
+	}
+
+	// rows of received parity restricted to the missing units
+	for(unsigned int r=0; r<missing_count; r++)
+	{
+		for(unsigned int c=0; c<missing_count; c++)
+			mat[r * missing_count + c] = decoder->matrix[rows[r] * decoder->k + missing[c]];
+	}
+	if(jerasure_invert_matrix(mat, inv, (int)missing_count, CHIAKI_FEC_WORDSIZE) < 0)
+	{
+		err = CHIAKI_ERR_FEC_FAILED;
+		goto error_mat;
+	}
+
+	FecSolve solve = { decoder, missing, rows, inv, missing_count };
+	chiaki_fec_pool_run(decoder->pool, decoder->unit_size, (size_t)missing_count * (missing_count + 1) * decoder->unit_size,
+			fec_decoder_solve_stripe, &solve);
+
+	// the accumulators have been consumed
+	memset(decoder->row_active, 0, decoder->m);
+	decoder->rows_active = 0;
+	decoder->frame_buf = NULL;
+	err = CHIAKI_ERR_SUCCESS;
+
+error_mat:
+	free(mat);
+error_missing:
+	free(missing);
+	return err;
+}
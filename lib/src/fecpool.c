@@ -0,0 +1,210 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki/fecpool.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+struct chiaki_fec_pool_job_t
+{
+	ChiakiFecPoolStripeFunc func;
+	void *user;
+	size_t size;
+	size_t stripe_size;
+	size_t stripes_count;
+	size_t stripe_next;
+	size_t stripes_done;
+	ChiakiFecPoolJob *next;
+};
+
+/**
+ * Take the next stripe of job, run it and mark it as done.
+ * Must be called with the mutex locked, which is released while the stripe runs.
+ */
+static void fec_pool_job_run_stripe(ChiakiFecPool *pool, ChiakiFecPoolJob *job)
+{
+	size_t offset = job->stripe_next++ * job->stripe_size;
+	size_t size = job->size - offset;
+	if(size > job->stripe_size)
+		size = job->stripe_size;
+
+	chiaki_mutex_unlock(&pool->mutex);
+	job->func(job->user, offset, size);
+	chiaki_mutex_lock(&pool->mutex);
+
+	job->stripes_done++;
+	if(job->stripes_done == job->stripes_count)
+		chiaki_cond_broadcast(&pool->done_cond);
+}
+
+static ChiakiFecPoolJob *fec_pool_job_pending(ChiakiFecPool *pool)
+{
+	for(ChiakiFecPoolJob *job = pool->jobs; job; job = job->next)
+	{
+		if(job->stripe_next < job->stripes_count)
+			return job;
+	}
+	return NULL;
+}
+
+static void *fec_pool_worker_func(void *user)
+{
+	ChiakiFecPool *pool = user;
+	chiaki_mutex_lock(&pool->mutex);
+	while(true)
+	{
+		ChiakiFecPoolJob *job;
+		while(!pool->should_stop && !(job = fec_pool_job_pending(pool)))
+			chiaki_cond_wait(&pool->cond, &pool->mutex);
+		if(pool->should_stop)
+			break;
+		fec_pool_job_run_stripe(pool, job);
+	}
+	chiaki_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_fec_pool_init(ChiakiFecPool *pool, size_t workers_count, ChiakiLog *log)
+{
+	pool->log = log;
+	pool->workers = NULL;
+	pool->workers_count = 0;
+	pool->work_min = CHIAKI_FEC_POOL_WORK_MIN_DEFAULT;
+	pool->stripe_size_min = CHIAKI_FEC_POOL_STRIPE_SIZE_MIN_DEFAULT;
+	pool->jobs = NULL;
+	pool->should_stop = false;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&pool->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	err = chiaki_cond_init(&pool->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+	err = chiaki_cond_init(&pool->done_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+
+	if(workers_count)
+	{
+		pool->workers = calloc(workers_count, sizeof(ChiakiThread));
+		if(!pool->workers)
+		{
+			err = CHIAKI_ERR_MEMORY;
+			goto error_done_cond;
+		}
+	}
+
+	for(; pool->workers_count<workers_count; pool->workers_count++)
+	{
+		err = chiaki_thread_create(&pool->workers[pool->workers_count], fec_pool_worker_func, pool);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(pool->log, "FEC pool failed to create worker thread");
+			goto error_workers;
+		}
+		chiaki_thread_set_name(&pool->workers[pool->workers_count], "Chiaki FEC");
+	}
+
+	CHIAKI_LOGI(pool->log, "FEC pool started with %llu workers", (unsigned long long)pool->workers_count);
+	return CHIAKI_ERR_SUCCESS;
+
+error_workers:
+	chiaki_mutex_lock(&pool->mutex);
+	pool->should_stop = true;
+	chiaki_cond_broadcast(&pool->cond);
+	chiaki_mutex_unlock(&pool->mutex);
+	for(size_t i=0; i<pool->workers_count; i++)
+		chiaki_thread_join(&pool->workers[i], NULL);
+	free(pool->workers);
+error_done_cond:
+	chiaki_cond_fini(&pool->done_cond);
+error_cond:
+	chiaki_cond_fini(&pool->cond);
+error_mutex:
+	chiaki_mutex_fini(&pool->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_fec_pool_fini(ChiakiFecPool *pool)
+{
+	chiaki_mutex_lock(&pool->mutex);
+	pool->should_stop = true;
+	chiaki_cond_broadcast(&pool->cond);
+	chiaki_mutex_unlock(&pool->mutex);
+	for(size_t i=0; i<pool->workers_count; i++)
+		chiaki_thread_join(&pool->workers[i], NULL);
+	free(pool->workers);
+	chiaki_cond_fini(&pool->done_cond);
+	chiaki_cond_fini(&pool->cond);
+	chiaki_mutex_fini(&pool->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_fec_pool_run(ChiakiFecPool *pool, size_t size, size_t work, ChiakiFecPoolStripeFunc func, void *user)
+{
+	if(!size)
+		return;
+
+	size_t stripe_size = 0;
+	if(pool && pool->workers_count && work >= pool->work_min)
+	{
+		// one stripe per thread, unless that would make them too small
+		size_t threads_count = pool->workers_count + 1;
+		stripe_size = (size + threads_count - 1) / threads_count;
+		stripe_size = (stripe_size + CHIAKI_FEC_POOL_STRIPE_ALIGN - 1) / CHIAKI_FEC_POOL_STRIPE_ALIGN * CHIAKI_FEC_POOL_STRIPE_ALIGN;
+		if(stripe_size < pool->stripe_size_min)
+			stripe_size = pool->stripe_size_min;
+	}
+	if(!stripe_size || stripe_size >= size)
+	{
+		func(user, 0, size);
+		return;
+	}
+
+	ChiakiFecPoolJob job;
+	job.func = func;
+	job.user = user;
+	job.size = size;
+	job.stripe_size = stripe_size;
+	job.stripes_count = (size + stripe_size - 1) / stripe_size;
+	job.stripe_next = 0;
+	job.stripes_done = 0;
+
+	chiaki_mutex_lock(&pool->mutex);
+	ChiakiFecPoolJob **tail = &pool->jobs;
+	while(*tail)
+		tail = &(*tail)->next;
+	job.next = NULL;
+	*tail = &job;
+	chiaki_cond_broadcast(&pool->cond);
+
+	// work on our own job instead of just waiting for it
+	while(job.stripe_next < job.stripes_count)
+		fec_pool_job_run_stripe(pool, &job);
+	while(job.stripes_done < job.stripes_count)
+		chiaki_cond_wait(&pool->done_cond, &pool->mutex);
+
+	for(ChiakiFecPoolJob **j = &pool->jobs; *j; j = &(*j)->next)
+	{
+		if(*j == &job)
+		{
+			*j = job.next;
+			break;
+		}
+	}
+	chiaki_mutex_unlock(&pool->mutex);
+}
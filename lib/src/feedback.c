@@ -130,6 +130,59 @@ CHIAKI_EXPORT void chiaki_feedback_history_event_set_touchpad(ChiakiFeedbackHist
 	event->buf[4] = (uint8_t)y;
 }
 
+CHIAKI_EXPORT size_t chiaki_feedback_history_events_diff(ChiakiLog *log, ChiakiFeedbackHistoryEvent *events,
+		ChiakiControllerState *prev, ChiakiControllerState *now)
+{
+	size_t count = 0;
+
+	uint64_t buttons_changed = prev->buttons ^ now->buttons;
+	for(uint8_t i=0; i<CHIAKI_CONTROLLER_BUTTONS_COUNT; i++)
+	{
+		uint64_t button_id = 1 << i;
+		if(!(buttons_changed & button_id))
+			continue;
+		if(chiaki_feedback_history_event_set_button(&events[count], button_id, (now->buttons & button_id) ? 0xff : 0) == CHIAKI_ERR_SUCCESS)
+			count++;
+		else
+			CHIAKI_LOGE(log, "Feedback History failed to format button history event for button id %llu", (unsigned long long)button_id);
+	}
+
+	if(prev->l2_state != now->l2_state)
+	{
+		if(chiaki_feedback_history_event_set_button(&events[count], CHIAKI_CONTROLLER_ANALOG_BUTTON_L2, now->l2_state) == CHIAKI_ERR_SUCCESS)
+			count++;
+		else
+			CHIAKI_LOGE(log, "Feedback History failed to format button history event for L2");
+	}
+
+	if(prev->r2_state != now->r2_state)
+	{
+		if(chiaki_feedback_history_event_set_button(&events[count], CHIAKI_CONTROLLER_ANALOG_BUTTON_R2, now->r2_state) == CHIAKI_ERR_SUCCESS)
+			count++;
+		else
+			CHIAKI_LOGE(log, "Feedback History failed to format button history event for R2");
+	}
+
+	for(size_t i=0; i<CHIAKI_CONTROLLER_TOUCHES_MAX; i++)
+	{
+		if(prev->touches[i].id != now->touches[i].id && prev->touches[i].id >= 0)
+		{
+			chiaki_feedback_history_event_set_touchpad(&events[count++], false, (uint8_t)prev->touches[i].id,
+					prev->touches[i].x, prev->touches[i].y);
+		}
+		else if(now->touches[i].id >= 0
+				&& (prev->touches[i].id != now->touches[i].id
+					|| prev->touches[i].x != now->touches[i].x
+					|| prev->touches[i].y != now->touches[i].y))
+		{
+			chiaki_feedback_history_event_set_touchpad(&events[count++], true, (uint8_t)now->touches[i].id,
+					now->touches[i].x, now->touches[i].y);
+		}
+	}
+
+	return count;
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_history_buffer_init(ChiakiFeedbackHistoryBuffer *feedback_history_buffer, size_t size)
 {
 	feedback_history_buffer->events = calloc(size, sizeof(ChiakiFeedbackHistoryEvent));
@@ -21,13 +21,16 @@
 #define FEEDBACK_STATE_TIMEOUT_MAX_MS 200 // maximum time to wait between sending 2 packets
 
 #define FEEDBACK_HISTORY_BUFFER_SIZE 0x10
+#define FEEDBACK_HISTORY_REDUNDANCY_DEFAULT 0
 
-static void *feedback_sender_thread_func(void *user);
+static void feedback_sender_timer_cb(void *user);
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTakion *takion)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *feedback_sender, ChiakiTakion *takion, ChiakiTimerService *timer_service)
 {
 	feedback_sender->log = takion->log;
 	feedback_sender->takion = takion;
+	feedback_sender->timer_service = timer_service;
+	chiaki_timer_init(&feedback_sender->timer, feedback_sender_timer_cb, feedback_sender);
 
 	chiaki_controller_state_set_idle(&feedback_sender->controller_state_prev);
 	chiaki_controller_state_set_idle(&feedback_sender->controller_state);
@@ -35,42 +38,30 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_init(ChiakiFeedbackSender *
 	feedback_sender->state_seq_num = 0;
 
 	feedback_sender->history_seq_num = 0;
+	feedback_sender->history_seq_num_sent = 0;
+	feedback_sender->sent_us = 0;
+	feedback_sender->history_redundancy = FEEDBACK_HISTORY_REDUNDANCY_DEFAULT;
+	feedback_sender->history_redundancy_left = 0;
+	feedback_sender->controller_state_changed = false;
 	ChiakiErrorCode err = chiaki_feedback_history_buffer_init(&feedback_sender->history_buf, FEEDBACK_HISTORY_BUFFER_SIZE);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
 	err = chiaki_mutex_init(&feedback_sender->state_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_history_buffer;
-
-	err = chiaki_cond_init(&feedback_sender->state_cond);
-	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_mutex;
-
-	err = chiaki_thread_create(&feedback_sender->thread, feedback_sender_thread_func, feedback_sender);
-	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_cond;
+	{
+		chiaki_feedback_history_buffer_fini(&feedback_sender->history_buf);
+		return err;
+	}
 
-	chiaki_thread_set_name(&feedback_sender->thread, "Chiaki Feedback Sender");
+	chiaki_timer_service_schedule_ms(feedback_sender->timer_service, &feedback_sender->timer, FEEDBACK_STATE_TIMEOUT_MAX_MS);
 
 	return CHIAKI_ERR_SUCCESS;
-error_cond:
-	chiaki_cond_fini(&feedback_sender->state_cond);
-error_mutex:
-	chiaki_mutex_fini(&feedback_sender->state_mutex);
-error_history_buffer:
-	chiaki_feedback_history_buffer_fini(&feedback_sender->history_buf);
-	return err;
 }
 
 CHIAKI_EXPORT void chiaki_feedback_sender_fini(ChiakiFeedbackSender *feedback_sender)
 {
-	chiaki_mutex_lock(&feedback_sender->state_mutex);
-	feedback_sender->should_stop = true;
-	chiaki_mutex_unlock(&feedback_sender->state_mutex);
-	chiaki_cond_signal(&feedback_sender->state_cond);
-	chiaki_thread_join(&feedback_sender->thread, NULL);
-	chiaki_cond_fini(&feedback_sender->state_cond);
+	chiaki_timer_service_cancel(feedback_sender->timer_service, &feedback_sender->timer);
 	chiaki_mutex_fini(&feedback_sender->state_mutex);
 	chiaki_feedback_history_buffer_fini(&feedback_sender->history_buf);
 }
@@ -90,12 +81,29 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_set_controller_state(Chiaki
 	feedback_sender->controller_state = *state;
 	feedback_sender->controller_state_changed = true;
 
+	// send right away, unless the last packet went out less than FEEDBACK_STATE_TIMEOUT_MIN_MS ago.
+	// Changes until then are coalesced into the next packet.
+	// The timer is never scheduled earlier than this, so it is never delayed by moving it here.
+	chiaki_timer_service_schedule(feedback_sender->timer_service, &feedback_sender->timer,
+			feedback_sender->sent_us + FEEDBACK_STATE_TIMEOUT_MIN_MS * 1000);
+
 	chiaki_mutex_unlock(&feedback_sender->state_mutex);
-	chiaki_cond_signal(&feedback_sender->state_cond);
 
 	return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_feedback_sender_set_history_redundancy(ChiakiFeedbackSender *feedback_sender, unsigned int redundancy)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&feedback_sender->state_mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	feedback_sender->history_redundancy = redundancy;
+	if(feedback_sender->history_redundancy_left > redundancy)
+		feedback_sender->history_redundancy_left = redundancy;
+	chiaki_mutex_unlock(&feedback_sender->state_mutex);
+	return CHIAKI_ERR_SUCCESS;
+}
+
 static bool controller_state_equals_for_feedback_state(ChiakiControllerState *a, ChiakiControllerState *b)
 {
 	return a->left_x == b->left_x
@@ -133,7 +141,7 @@ static bool controller_state_equals_for_feedback_history(ChiakiControllerState *
 	return true;
 }
 
-static void feedback_sender_send_history_packet(ChiakiFeedbackSender *feedback_sender)
+static void feedback_sender_send_history_packet(ChiakiFeedbackSender *feedback_sender, ChiakiSeqNum16 seq_num)
 {
 	uint8_t buf[0x300];
 	size_t buf_size = sizeof(buf);
@@ -146,133 +154,88 @@ static void feedback_sender_send_history_packet(ChiakiFeedbackSender *feedback_s
 
 	//CHIAKI_LOGD(feedback_sender->log, "Feedback History:");
 	//chiaki_log_hexdump(feedback_sender->log, CHIAKI_LOG_DEBUG, buf, buf_size);
-	chiaki_takion_send_feedback_history(feedback_sender->takion, feedback_sender->history_seq_num++, buf, buf_size);
+	chiaki_takion_send_feedback_history(feedback_sender->takion, seq_num, buf, buf_size);
+	feedback_sender->history_seq_num_sent = seq_num;
 }
 
+/**
+ * Push all changes since the last tick and send them in a single packet.
+ */
 static void feedback_sender_send_history(ChiakiFeedbackSender *feedback_sender)
 {
-	ChiakiControllerState *state_prev = &feedback_sender->controller_state_prev;
-	ChiakiControllerState *state_now = &feedback_sender->controller_state;
-	uint64_t buttons_prev = state_prev->buttons;
-	uint64_t buttons_now = state_now->buttons;
-	for(uint8_t i=0; i<CHIAKI_CONTROLLER_BUTTONS_COUNT; i++)
-	{
-		uint64_t button_id = 1 << i;
-		bool prev = buttons_prev & button_id;
-		bool now = buttons_now & button_id;
-		if(prev != now)
-		{
-			ChiakiFeedbackHistoryEvent event;
-			ChiakiErrorCode err = chiaki_feedback_history_event_set_button(&event, button_id, now ? 0xff : 0);
-			if(err != CHIAKI_ERR_SUCCESS)
-			{
-				CHIAKI_LOGE(feedback_sender->log, "Feedback Sender failed to format button history event for button id %llu", (unsigned long long)button_id);
-				continue;
-			}
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
-		}
-	}
-
-	if(state_prev->l2_state != state_now->l2_state)
-	{
-		ChiakiFeedbackHistoryEvent event;
-		ChiakiErrorCode err = chiaki_feedback_history_event_set_button(&event, CHIAKI_CONTROLLER_ANALOG_BUTTON_L2, state_now->l2_state);
-		if(err == CHIAKI_ERR_SUCCESS)
-		{
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
-		}
-		else
-			CHIAKI_LOGE(feedback_sender->log, "Feedback Sender failed to format button history event for L2");
-	}
+	ChiakiFeedbackHistoryEvent events[CHIAKI_FEEDBACK_HISTORY_EVENTS_DIFF_MAX];
+	size_t events_count = chiaki_feedback_history_events_diff(feedback_sender->log, events,
+			&feedback_sender->controller_state_prev, &feedback_sender->controller_state);
+	if(!events_count)
+		return;
 
-	if(state_prev->r2_state != state_now->r2_state)
+	size_t pushed = 0;
+	for(size_t i=0; i<events_count; i++)
 	{
-		ChiakiFeedbackHistoryEvent event;
-		ChiakiErrorCode err = chiaki_feedback_history_event_set_button(&event, CHIAKI_CONTROLLER_ANALOG_BUTTON_R2, state_now->r2_state);
-		if(err == CHIAKI_ERR_SUCCESS)
+		if(pushed == feedback_sender->history_buf.size)
 		{
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
+			// more changes than fit into one packet, flush so none get lost
+			feedback_sender_send_history_packet(feedback_sender, feedback_sender->history_seq_num++);
+			pushed = 0;
 		}
-		else
-			CHIAKI_LOGE(feedback_sender->log, "Feedback Sender failed to format button history event for R2");
+		chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &events[i]);
+		pushed++;
 	}
 
-	for(size_t i=0; i<CHIAKI_CONTROLLER_TOUCHES_MAX; i++)
-	{
-		if(state_prev->touches[i].id != state_now->touches[i].id && state_prev->touches[i].id >= 0)
-		{
-			ChiakiFeedbackHistoryEvent event;
-			chiaki_feedback_history_event_set_touchpad(&event, false, (uint8_t)state_prev->touches[i].id,
-					state_prev->touches[i].x, state_prev->touches[i].y);
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
-		}
-		else if(state_now->touches[i].id >= 0
-				&& (state_prev->touches[i].id != state_now->touches[i].id
-					|| state_prev->touches[i].x != state_now->touches[i].x
-					|| state_prev->touches[i].y != state_now->touches[i].y))
-		{
-			ChiakiFeedbackHistoryEvent event;
-			chiaki_feedback_history_event_set_touchpad(&event, true, (uint8_t)state_now->touches[i].id,
-					state_now->touches[i].x, state_now->touches[i].y);
-			chiaki_feedback_history_buffer_push(&feedback_sender->history_buf, &event);
-			feedback_sender_send_history_packet(feedback_sender);
-		}
-	}
+	feedback_sender_send_history_packet(feedback_sender, feedback_sender->history_seq_num++);
+	feedback_sender->history_redundancy_left = feedback_sender->history_redundancy;
 }
 
-static bool state_cond_check(void *user)
+/**
+ * Repeat the last history packet with the same sequence number.
+ */
+static void feedback_sender_send_history_redundant(ChiakiFeedbackSender *feedback_sender)
 {
-	ChiakiFeedbackSender *feedback_sender = user;
-	return feedback_sender->should_stop || feedback_sender->controller_state_changed;
+	feedback_sender->history_redundancy_left--;
+	feedback_sender_send_history_packet(feedback_sender, feedback_sender->history_seq_num_sent);
 }
 
-static void *feedback_sender_thread_func(void *user)
+static void feedback_sender_timer_cb(void *user)
 {
 	ChiakiFeedbackSender *feedback_sender = user;
 
 	ChiakiErrorCode err = chiaki_mutex_lock(&feedback_sender->state_mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
-		return NULL;
-
-	uint64_t next_timeout = FEEDBACK_STATE_TIMEOUT_MAX_MS;
-	while(true)
-	{
-		err = chiaki_cond_timedwait_pred(&feedback_sender->state_cond, &feedback_sender->state_mutex, next_timeout, state_cond_check, feedback_sender);
-		if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT)
-			break;
+		return;
 
-		if(feedback_sender->should_stop)
-			break;
+	bool send_feedback_state = true;
+	bool send_feedback_history = false;
 
-		bool send_feedback_state = true;
-		bool send_feedback_history = false;
+	if(feedback_sender->controller_state_changed)
+	{
+		feedback_sender->controller_state_changed = false;
 
-		if(feedback_sender->controller_state_changed)
-		{
-			// TODO: FEEDBACK_STATE_TIMEOUT_MIN_MS
-			feedback_sender->controller_state_changed = false;
+		// don't need to send feedback state if nothing relevant changed
+		if(controller_state_equals_for_feedback_state(&feedback_sender->controller_state, &feedback_sender->controller_state_prev))
+			send_feedback_state = false;
 
-			// don't need to send feedback state if nothing relevant changed
-			if(controller_state_equals_for_feedback_state(&feedback_sender->controller_state, &feedback_sender->controller_state_prev))
-				send_feedback_state = false;
+		send_feedback_history = !controller_state_equals_for_feedback_history(&feedback_sender->controller_state, &feedback_sender->controller_state_prev);
+	}
+	else if(feedback_sender->history_redundancy_left) // timeout
+	{
+		// woken up early only to repeat the history
+		send_feedback_state = false;
+	}
 
-			send_feedback_history = !controller_state_equals_for_feedback_history(&feedback_sender->controller_state, &feedback_sender->controller_state_prev);
-		} // else: timeout
+	if(send_feedback_state)
+		feedback_sender_send_state(feedback_sender);
 
-		if(send_feedback_state)
-			feedback_sender_send_state(feedback_sender);
+	if(send_feedback_history)
+		feedback_sender_send_history(feedback_sender);
+	else if(feedback_sender->history_redundancy_left)
+		feedback_sender_send_history_redundant(feedback_sender);
 
-		if(send_feedback_history)
-			feedback_sender_send_history(feedback_sender);
+	feedback_sender->controller_state_prev = feedback_sender->controller_state;
+	feedback_sender->sent_us = chiaki_clock_now_us(feedback_sender->timer_service->clock);
 
-		feedback_sender->controller_state_prev = feedback_sender->controller_state;
-	}
+	// repeat history packets quickly, they are only useful while the input is still fresh
+	uint64_t next_timeout = feedback_sender->history_redundancy_left ? FEEDBACK_STATE_TIMEOUT_MIN_MS : FEEDBACK_STATE_TIMEOUT_MAX_MS;
+	chiaki_timer_service_schedule_ms(feedback_sender->timer_service, &feedback_sender->timer, next_timeout);
 
 	chiaki_mutex_unlock(&feedback_sender->state_mutex);
-
-	return NULL;
 }
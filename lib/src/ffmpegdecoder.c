@@ -0,0 +1,393 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki/config.h>
+#if CHIAKI_LIB_ENABLE_FFMPEG
+
+#include <chiaki/ffmpegdecoder.h>
+#include <chiaki/time.h>
+
+#include <libavcodec/avcodec.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "atomic.h"
+
+static void *ffmpeg_decoder_thread_func(void *user);
+
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_options_default(ChiakiFfmpegDecoderOptions *options)
+{
+	options->threading = CHIAKI_FFMPEG_DECODER_THREADING_SLICE;
+	options->threads_count = 0;
+	options->low_delay = true;
+	options->queue_size = 16;
+	options->frames_count = 4;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_ffmpeg_decoder_init(ChiakiFfmpegDecoder *decoder, const ChiakiFfmpegDecoderOptions *options,
+		ChiakiFfmpegDecoderFrameCallback frame_cb, void *frame_cb_user, ChiakiLog *log)
+{
+	if(!options->queue_size || !options->frames_count)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	decoder->log = log;
+	decoder->options = *options;
+	if(decoder->options.threading == CHIAKI_FFMPEG_DECODER_THREADING_FRAME && decoder->options.low_delay)
+	{
+		// FFmpeg silently falls back to slice threading if low delay is requested
+		CHIAKI_LOGW(log, "FFmpeg Decoder: Low delay is not possible with frame threading, disabling it");
+		decoder->options.low_delay = false;
+	}
+	decoder->frame_cb = frame_cb;
+	decoder->frame_cb_user = frame_cb_user;
+	decoder->should_stop = false;
+	decoder->queue_begin = 0;
+	decoder->queue_count = 0;
+	memset(&decoder->stats, 0, sizeof(decoder->stats));
+
+#if LIBAVCODEC_VERSION_INT < AV_VERSION_INT(58, 9, 100)
+	avcodec_register_all();
+#endif
+	const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+	if(!codec)
+	{
+		CHIAKI_LOGE(log, "FFmpeg Decoder: H264 codec not available");
+		return CHIAKI_ERR_UNKNOWN;
+	}
+
+	decoder->codec_context = avcodec_alloc_context3(codec);
+	if(!decoder->codec_context)
+		return CHIAKI_ERR_MEMORY;
+
+	if(decoder->options.low_delay)
+	{
+		decoder->codec_context->flags |= AV_CODEC_FLAG_LOW_DELAY;
+		decoder->codec_context->flags2 |= AV_CODEC_FLAG2_FAST;
+	}
+
+	switch(options->threading)
+	{
+		case CHIAKI_FFMPEG_DECODER_THREADING_NONE:
+			decoder->codec_context->thread_count = 1;
+			break;
+		case CHIAKI_FFMPEG_DECODER_THREADING_SLICE:
+			decoder->codec_context->thread_type = FF_THREAD_SLICE;
+			decoder->codec_context->thread_count = (int)options->threads_count;
+			break;
+		case CHIAKI_FFMPEG_DECODER_THREADING_FRAME:
+			decoder->codec_context->thread_type = FF_THREAD_FRAME;
+			decoder->codec_context->thread_count = (int)options->threads_count;
+			break;
+	}
+
+	ChiakiErrorCode err = CHIAKI_ERR_UNKNOWN;
+	if(avcodec_open2(decoder->codec_context, codec, NULL) < 0)
+	{
+		CHIAKI_LOGE(log, "FFmpeg Decoder: Failed to open codec context");
+		goto error_codec_context;
+	}
+
+	err = CHIAKI_ERR_MEMORY;
+	decoder->queue = calloc(options->queue_size, sizeof(AVPacket *));
+	if(!decoder->queue)
+		goto error_codec_context;
+
+	decoder->frames = calloc(options->frames_count, sizeof(ChiakiFfmpegFrame));
+	if(!decoder->frames)
+		goto error_queue;
+
+	decoder->frames_free = NULL;
+	for(size_t i=0; i<options->frames_count; i++)
+	{
+		ChiakiFfmpegFrame *frame = &decoder->frames[i];
+		frame->frame = av_frame_alloc();
+		if(!frame->frame)
+			goto error_frames;
+		frame->decoder = decoder;
+		frame->refs = 0;
+		frame->next_free = decoder->frames_free;
+		decoder->frames_free = frame;
+	}
+
+	err = chiaki_mutex_init(&decoder->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_frames;
+
+	err = chiaki_cond_init(&decoder->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = chiaki_thread_create(&decoder->thread, ffmpeg_decoder_thread_func, decoder);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+
+	chiaki_thread_set_name(&decoder->thread, "Chiaki FFmpeg Decoder");
+
+	return CHIAKI_ERR_SUCCESS;
+error_cond:
+	chiaki_cond_fini(&decoder->cond);
+error_mutex:
+	chiaki_mutex_fini(&decoder->mutex);
+error_frames:
+	for(size_t i=0; i<options->frames_count; i++)
+		av_frame_free(&decoder->frames[i].frame);
+	free(decoder->frames);
+error_queue:
+	free(decoder->queue);
+error_codec_context:
+	avcodec_free_context(&decoder->codec_context);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_fini(ChiakiFfmpegDecoder *decoder)
+{
+	chiaki_mutex_lock(&decoder->mutex);
+	decoder->should_stop = true;
+	chiaki_cond_signal(&decoder->cond);
+	chiaki_mutex_unlock(&decoder->mutex);
+	chiaki_thread_join(&decoder->thread, NULL);
+
+	for(size_t i=0; i<decoder->queue_count; i++)
+		av_packet_free(&decoder->queue[(decoder->queue_begin + i) % decoder->options.queue_size]);
+	free(decoder->queue);
+
+	for(size_t i=0; i<decoder->options.frames_count; i++)
+	{
+		if(decoder->frames[i].refs)
+			CHIAKI_LOGE(decoder->log, "FFmpeg Decoder: Frame still referenced on fini");
+		av_frame_free(&decoder->frames[i].frame);
+	}
+	free(decoder->frames);
+
+	chiaki_cond_fini(&decoder->cond);
+	chiaki_mutex_fini(&decoder->mutex);
+	avcodec_free_context(&decoder->codec_context);
+}
+
+CHIAKI_EXPORT void chiaki_ffmpeg_frame_ref(ChiakiFfmpegFrame *frame)
+{
+	chiaki_atomic_fetch_add_u32(&frame->refs, 1);
+}
+
+CHIAKI_EXPORT void chiaki_ffmpeg_frame_unref(ChiakiFfmpegFrame *frame)
+{
+	if(chiaki_atomic_fetch_add_u32(&frame->refs, (uint32_t)-1) != 1)
+		return;
+
+	av_frame_unref(frame->frame);
+
+	ChiakiFfmpegDecoder *decoder = frame->decoder;
+	chiaki_mutex_lock(&decoder->mutex);
+	frame->next_free = decoder->frames_free;
+	decoder->frames_free = frame;
+	chiaki_mutex_unlock(&decoder->mutex);
+}
+
+static bool ffmpeg_decoder_push_packet(ChiakiFfmpegDecoder *decoder, AVPacket *packet)
+{
+	// carried through the decoder to measure the latency of each frame
+	packet->pts = packet->dts = (int64_t)chiaki_time_now_monotonic_us();
+
+	chiaki_mutex_lock(&decoder->mutex);
+	if(decoder->queue_count == decoder->options.queue_size)
+	{
+		// the decoder can not keep up, skip to the next keyframe instead of lagging behind
+		CHIAKI_LOGW(decoder->log, "FFmpeg Decoder: Queue full, dropping %zu samples", decoder->queue_count + 1);
+		for(size_t i=0; i<decoder->queue_count; i++)
+			av_packet_free(&decoder->queue[(decoder->queue_begin + i) % decoder->options.queue_size]);
+		decoder->stats.samples_dropped += decoder->queue_count + 1;
+		decoder->queue_count = 0;
+		chiaki_mutex_unlock(&decoder->mutex);
+		av_packet_free(&packet);
+		return false;
+	}
+
+	decoder->queue[(decoder->queue_begin + decoder->queue_count) % decoder->options.queue_size] = packet;
+	decoder->queue_count++;
+	decoder->stats.samples++;
+	chiaki_cond_signal(&decoder->cond);
+	chiaki_mutex_unlock(&decoder->mutex);
+	return true;
+}
+
+CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_sample_cb(uint8_t *buf, size_t buf_size, void *user)
+{
+	ChiakiFfmpegDecoder *decoder = user;
+
+	AVPacket *packet = av_packet_alloc();
+	if(!packet)
+		return false;
+	if(av_new_packet(packet, (int)buf_size) < 0)
+	{
+		av_packet_free(&packet);
+		return false;
+	}
+	memcpy(packet->data, buf, buf_size);
+	return ffmpeg_decoder_push_packet(decoder, packet);
+}
+
+static void ffmpeg_decoder_video_frame_free(void *opaque, uint8_t *data)
+{
+	(void)data;
+	chiaki_video_frame_unref(opaque);
+}
+
+CHIAKI_EXPORT bool chiaki_ffmpeg_decoder_video_frame_cb(ChiakiVideoFrame *frame, void *user)
+{
+	ChiakiFfmpegDecoder *decoder = user;
+
+	AVPacket *packet = av_packet_alloc();
+	if(!packet)
+		return false;
+	// the frame buffer already carries the padding libavcodec requires
+	chiaki_video_frame_ref(frame);
+	packet->buf = av_buffer_create(frame->buf, (int)(frame->buf_size + CHIAKI_VIDEO_BUFFER_PADDING_SIZE),
+			ffmpeg_decoder_video_frame_free, frame, AV_BUFFER_FLAG_READONLY);
+	if(!packet->buf)
+	{
+		chiaki_video_frame_unref(frame);
+		av_packet_free(&packet);
+		return false;
+	}
+	packet->data = frame->buf;
+	packet->size = (int)frame->buf_size;
+	return ffmpeg_decoder_push_packet(decoder, packet);
+}
+
+CHIAKI_EXPORT void chiaki_ffmpeg_decoder_get_stats(ChiakiFfmpegDecoder *decoder, ChiakiFfmpegDecoderStats *stats)
+{
+	chiaki_mutex_lock(&decoder->mutex);
+	*stats = decoder->stats;
+	chiaki_mutex_unlock(&decoder->mutex);
+}
+
+static void ffmpeg_decoder_output(ChiakiFfmpegDecoder *decoder, AVFrame *av_frame)
+{
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	uint64_t push_us = av_frame->pts != AV_NOPTS_VALUE ? (uint64_t)av_frame->pts : now_us;
+	uint64_t latency_us = now_us > push_us ? now_us - push_us : 0;
+
+	chiaki_mutex_lock(&decoder->mutex);
+	ChiakiFfmpegFrame *frame = decoder->frames_free;
+	if(!frame)
+	{
+		decoder->stats.frames_dropped++;
+		chiaki_mutex_unlock(&decoder->mutex);
+		av_frame_unref(av_frame);
+		return;
+	}
+	decoder->frames_free = frame->next_free;
+	decoder->stats.frames++;
+	decoder->stats.latency_us_sum += latency_us;
+	if(latency_us > decoder->stats.latency_us_max)
+		decoder->stats.latency_us_max = latency_us;
+	chiaki_mutex_unlock(&decoder->mutex);
+
+	av_frame_move_ref(frame->frame, av_frame);
+	frame->push_us = push_us;
+	frame->output_us = now_us;
+	frame->next_free = NULL;
+	frame->refs = 1;
+
+	if(decoder->frame_cb)
+		decoder->frame_cb(frame, decoder->frame_cb_user);
+	else
+		chiaki_ffmpeg_frame_unref(frame);
+}
+
+static void ffmpeg_decoder_decode(ChiakiFfmpegDecoder *decoder, AVPacket *packet, AVFrame *av_frame)
+{
+	bool error = false;
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+	uint64_t decode_us = 0;
+
+	int r = avcodec_send_packet(decoder->codec_context, packet);
+	if(r < 0)
+	{
+		char errbuf[128];
+		av_make_error_string(errbuf, sizeof(errbuf), r);
+		CHIAKI_LOGE(decoder->log, "FFmpeg Decoder: Failed to push sample: %s", errbuf);
+		error = true;
+		decode_us = chiaki_time_now_monotonic_us() - start_us;
+	}
+
+	while(!error)
+	{
+		r = avcodec_receive_frame(decoder->codec_context, av_frame);
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		decode_us += now_us - start_us;
+		if(r == AVERROR(EAGAIN) || r == AVERROR_EOF)
+			break;
+		if(r < 0)
+		{
+			char errbuf[128];
+			av_make_error_string(errbuf, sizeof(errbuf), r);
+			CHIAKI_LOGE(decoder->log, "FFmpeg Decoder: Failed to pull frame: %s", errbuf);
+			error = true;
+			break;
+		}
+		// time spent in the frame callback is not decode time
+		ffmpeg_decoder_output(decoder, av_frame);
+		start_us = chiaki_time_now_monotonic_us();
+	}
+
+	chiaki_mutex_lock(&decoder->mutex);
+	if(error)
+		decoder->stats.decode_errors++;
+	decoder->stats.decode_us_sum += decode_us;
+	if(decode_us > decoder->stats.decode_us_max)
+		decoder->stats.decode_us_max = decode_us;
+	chiaki_mutex_unlock(&decoder->mutex);
+}
+
+static void *ffmpeg_decoder_thread_func(void *user)
+{
+	ChiakiFfmpegDecoder *decoder = user;
+
+	AVFrame *av_frame = av_frame_alloc();
+	if(!av_frame)
+	{
+		CHIAKI_LOGE(decoder->log, "FFmpeg Decoder: Failed to alloc frame");
+		return NULL;
+	}
+
+	chiaki_mutex_lock(&decoder->mutex);
+	while(true)
+	{
+		while(!decoder->should_stop && !decoder->queue_count)
+			chiaki_cond_wait(&decoder->cond, &decoder->mutex);
+		if(decoder->should_stop)
+			break;
+
+		AVPacket *packet = decoder->queue[decoder->queue_begin];
+		decoder->queue_begin = (decoder->queue_begin + 1) % decoder->options.queue_size;
+		decoder->queue_count--;
+		chiaki_mutex_unlock(&decoder->mutex);
+
+		ffmpeg_decoder_decode(decoder, packet, av_frame);
+		av_packet_free(&packet);
+
+		chiaki_mutex_lock(&decoder->mutex);
+	}
+	chiaki_mutex_unlock(&decoder->mutex);
+
+	av_frame_free(&av_frame);
+	return NULL;
+}
+
+#endif
@@ -18,17 +18,16 @@
 #include <chiaki/frameprocessor.h>
 #include <chiaki/fec.h>
 #include <chiaki/video.h>
-
-#include <jerasure.h>
+#include <chiaki/time.h>
 
 #include <string.h>
-#include <assert.h>
 
 #ifndef _WIN32
 #include <arpa/inet.h>
 #endif
 
 #define UNIT_SLOTS_MAX 256
+#define FRAMES_FREE_MAX 8
 
 
 struct chiaki_frame_unit_t
@@ -37,25 +36,49 @@ struct chiaki_frame_unit_t
 };
 
 
-CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_processor, ChiakiLog *log)
+CHIAKI_EXPORT void chiaki_frame_processor_init(ChiakiFrameProcessor *frame_processor, ChiakiLog *log, ChiakiMemAccount *mem)
 {
 	frame_processor->log = log;
-	frame_processor->frame_buf = NULL;
-	frame_processor->frame_buf_size = 0;
+	frame_processor->mem = mem;
+	frame_processor->frame_pool = NULL;
+	frame_processor->frame = NULL;
 	frame_processor->units_source_expected = 0;
 	frame_processor->units_fec_expected = 0;
 	frame_processor->unit_slots = NULL;
 	frame_processor->unit_slots_size = 0;
+	chiaki_fec_decoder_init(&frame_processor->fec_decoder);
 }
 
 CHIAKI_EXPORT void chiaki_frame_processor_fini(ChiakiFrameProcessor *frame_processor)
 {
-	free(frame_processor->frame_buf);
-	free(frame_processor->unit_slots);
+	if(frame_processor->frame)
+		chiaki_video_frame_unref(frame_processor->frame);
+	if(frame_processor->frame_pool)
+		chiaki_video_frame_pool_unref(frame_processor->frame_pool);
+	chiaki_mem_free(frame_processor->mem, CHIAKI_MEM_TAG_FRAME, frame_processor->unit_slots, frame_processor->unit_slots_size * sizeof(ChiakiFrameUnit));
+	chiaki_fec_decoder_fini(&frame_processor->fec_decoder);
+}
+
+CHIAKI_EXPORT ChiakiVideoFrame *chiaki_frame_processor_acquire_frame(ChiakiFrameProcessor *frame_processor, size_t buf_capacity)
+{
+	if(!frame_processor->frame_pool)
+	{
+		frame_processor->frame_pool = chiaki_video_frame_pool_new(frame_processor->mem, FRAMES_FREE_MAX);
+		if(!frame_processor->frame_pool)
+			return NULL;
+	}
+	return chiaki_video_frame_pool_acquire(frame_processor->frame_pool, buf_capacity);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet)
 {
+	if(frame_processor->frame)
+	{
+		// consumers that still need the previous frame hold their own reference
+		chiaki_video_frame_unref(frame_processor->frame);
+		frame_processor->frame = NULL;
+	}
+
 	if(packet->units_in_frame_total < packet->units_in_frame_fec)
 	{
 		CHIAKI_LOGE(frame_processor->log, "Packet has units_in_frame_total < units_in_frame_fec");
@@ -95,15 +118,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 	}
 	if(unit_slots_size_required != frame_processor->unit_slots_size)
 	{
-		void *new_ptr = NULL;
-		if(frame_processor->unit_slots)
-		{
-			new_ptr = realloc(frame_processor->unit_slots, unit_slots_size_required * sizeof(ChiakiFrameUnit));
-			if(!new_ptr)
-				free(frame_processor->unit_slots);
-		}
-		else
-			new_ptr = malloc(unit_slots_size_required * sizeof(ChiakiFrameUnit));
+		void *new_ptr = chiaki_mem_realloc(frame_processor->mem, CHIAKI_MEM_TAG_FRAME, frame_processor->unit_slots,
+				frame_processor->unit_slots_size * sizeof(ChiakiFrameUnit), unit_slots_size_required * sizeof(ChiakiFrameUnit));
+		if(!new_ptr)
+			chiaki_mem_free(frame_processor->mem, CHIAKI_MEM_TAG_FRAME, frame_processor->unit_slots, frame_processor->unit_slots_size * sizeof(ChiakiFrameUnit));
 
 		frame_processor->unit_slots = new_ptr;
 		if(!new_ptr)
@@ -119,25 +137,31 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_alloc_frame(ChiakiFrameProc
 	if(frame_processor->unit_slots_size > SIZE_MAX / frame_processor->buf_size_per_unit)
 		return CHIAKI_ERR_OVERFLOW;
 	size_t frame_buf_size_required = frame_processor->unit_slots_size * frame_processor->buf_size_per_unit;
-	if(frame_processor->frame_buf_size < frame_buf_size_required)
+	frame_processor->frame = chiaki_frame_processor_acquire_frame(frame_processor, frame_buf_size_required);
+	if(!frame_processor->frame)
+		return CHIAKI_ERR_MEMORY;
+	frame_processor->frame->frame_index = packet->frame_index;
+	frame_processor->frame->profile_index = packet->adaptive_stream_index;
+	frame_processor->frame->first_unit_us = chiaki_time_now_monotonic_us();
+
+	ChiakiErrorCode err = chiaki_fec_decoder_reset(&frame_processor->fec_decoder, frame_processor->frame->buf, frame_processor->buf_size_per_unit,
+			frame_processor->units_source_expected, frame_processor->units_fec_expected);
+	if(err != CHIAKI_ERR_SUCCESS)
 	{
-		free(frame_processor->frame_buf);
-		frame_processor->frame_buf = malloc(frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
-		if(!frame_processor->frame_buf)
-		{
-			frame_processor->frame_buf_size = 0;
-			return CHIAKI_ERR_MEMORY;
-		}
-		frame_processor->frame_buf_size = frame_buf_size_required;
+		CHIAKI_LOGE(frame_processor->log, "Failed to reset FEC decoder for %u+%u units",
+				frame_processor->units_source_expected, frame_processor->units_fec_expected);
+		return err;
 	}
-	memset(frame_processor->frame_buf, 0, frame_buf_size_required + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
 
 	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcessor *frame_processor, ChiakiTakionAVPacket *packet)
 {
-	if(packet->unit_index > frame_processor->unit_slots_size)
+	if(!frame_processor->frame)
+		return CHIAKI_ERR_UNINITIALIZED;
+
+	if(packet->unit_index >= frame_processor->unit_slots_size)
 	{
 		CHIAKI_LOGE(frame_processor->log, "Packet's unit index is too high");
 		return CHIAKI_ERR_INVALID_DATA;
@@ -163,7 +187,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcess
 	}
 
 	unit->data_size = packet->data_size;
-	memcpy(frame_processor->frame_buf + packet->unit_index * frame_processor->buf_size_per_unit,
+	memcpy(frame_processor->frame->buf + packet->unit_index * frame_processor->buf_size_per_unit,
 			packet->data,
 			packet->data_size);
 
@@ -172,7 +196,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_frame_processor_put_unit(ChiakiFrameProcess
 	else
 		frame_processor->units_fec_received++;
 
-	return CHIAKI_ERR_SUCCESS;
+	// recovery work is done right away once units are missing, so little is left for the flush
+	return chiaki_fec_decoder_put_unit(&frame_processor->fec_decoder, packet->unit_index);
 }
 
 static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_processor)
@@ -181,35 +206,7 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 				frame_processor->units_source_received, frame_processor->units_fec_received,
 				frame_processor->units_source_expected, frame_processor->units_fec_expected);
 
-
-	size_t erasures_count = (frame_processor->units_source_expected + frame_processor->units_fec_expected)
-			- (frame_processor->units_source_received + frame_processor->units_fec_received);
-	unsigned int *erasures = calloc(erasures_count, sizeof(unsigned int));
-	if(!erasures)
-		return CHIAKI_ERR_MEMORY;
-
-	size_t erasure_index = 0;
-	for(size_t i=0; i<frame_processor->units_source_expected + frame_processor->units_fec_expected; i++)
-	{
-		ChiakiFrameUnit *slot = frame_processor->unit_slots + i;
-		if(!slot->data_size)
-		{
-			if(erasure_index >= erasures_count)
-			{
-				// should never happen by design, but too scary not to check
-				assert(false);
-				free(erasures);
-				return CHIAKI_ERR_UNKNOWN;
-			}
-			erasures[erasure_index++] = (unsigned int)i;
-		}
-	}
-	assert(erasure_index == erasures_count);
-
-	ChiakiErrorCode err = chiaki_fec_decode(frame_processor->frame_buf, frame_processor->buf_size_per_unit,
-			frame_processor->units_source_expected, frame_processor->units_fec_received,
-			erasures, erasures_count);
-
+	ChiakiErrorCode err = chiaki_fec_decoder_finish(&frame_processor->fec_decoder);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		err = CHIAKI_ERR_FEC_FAILED;
@@ -224,7 +221,7 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 		for(size_t i=0; i<frame_processor->units_source_expected; i++)
 		{
 			ChiakiFrameUnit *slot = frame_processor->unit_slots + i;
-			uint8_t *buf_ptr = frame_processor->frame_buf + frame_processor->buf_size_per_unit * i;
+			uint8_t *buf_ptr = frame_processor->frame->buf + frame_processor->buf_size_per_unit * i;
 			uint16_t padding = ntohs(*((chiaki_unaligned_uint16_t *)buf_ptr));
 			if(padding >= frame_processor->buf_size_per_unit)
 			{
@@ -237,13 +234,12 @@ static ChiakiErrorCode chiaki_frame_processor_fec(ChiakiFrameProcessor *frame_pr
 		}
 	}
 
-	free(erasures);
 	return err;
 }
 
-CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, uint8_t **frame, size_t *frame_size)
+CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(ChiakiFrameProcessor *frame_processor, ChiakiVideoFrame **frame)
 {
-	if(frame_processor->units_source_expected == 0)
+	if(frame_processor->units_source_expected == 0 || !frame_processor->frame)
 		return CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED;
 
 	ChiakiFrameProcessorFlushResult result = CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_SUCCESS;
@@ -268,16 +264,32 @@ CHIAKI_EXPORT ChiakiFrameProcessorFlushResult chiaki_frame_processor_flush(Chiak
 		if(unit->data_size < 2)
 		{
 			CHIAKI_LOGE(frame_processor->log, "Saved unit has size < 2");
-			chiaki_log_hexdump(frame_processor->log, CHIAKI_LOG_VERBOSE, frame_processor->frame_buf + i*frame_processor->buf_size_per_unit, 0x50);
+			chiaki_log_hexdump(frame_processor->log, CHIAKI_LOG_VERBOSE, frame_processor->frame->buf + i*frame_processor->buf_size_per_unit, 0x50);
 			continue;
 		}
 		size_t part_size = unit->data_size - 2;
-		uint8_t *buf_ptr = frame_processor->frame_buf + i*frame_processor->buf_size_per_unit;
-		memmove(frame_processor->frame_buf + cur, buf_ptr + 2, part_size);
+		uint8_t *buf_ptr = frame_processor->frame->buf + i*frame_processor->buf_size_per_unit;
+		memmove(frame_processor->frame->buf + cur, buf_ptr + 2, part_size);
 		cur += part_size;
 	}
 
-	*frame = frame_processor->frame_buf;
-	*frame_size = cur;
+	ChiakiVideoFrame *f = frame_processor->frame;
+	memset(f->buf + cur, 0, CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	f->buf_size = cur;
+	switch(result)
+	{
+		case CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS:
+			f->status = CHIAKI_VIDEO_FRAME_STATUS_FEC_RECOVERED;
+			break;
+		case CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED:
+			f->status = CHIAKI_VIDEO_FRAME_STATUS_CORRUPT;
+			break;
+		default:
+			f->status = CHIAKI_VIDEO_FRAME_STATUS_COMPLETE;
+			break;
+	}
+	f->complete_us = chiaki_time_now_monotonic_us();
+
+	*frame = f;
 	return result;
 }
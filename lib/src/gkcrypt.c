@@ -33,31 +33,46 @@
 #endif
 
 #include "utils.h"
+#include "atomic.h"
 
 
-#define KEY_BUF_CHUNK_SIZE 0x1000
+// the key buf grows after this many overruns within KEY_BUF_GROW_WINDOW_SIZES times its size of key stream,
+// a single jump ahead, e.g. after packet loss, is nothing the generator couldn't keep up with
+#define KEY_BUF_GROW_OVERRUNS 3
+#define KEY_BUF_GROW_WINDOW_SIZES 8
 
 
 static ChiakiErrorCode gkcrypt_gen_key_iv(ChiakiGKCrypt *gkcrypt, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret);
+static void gkcrypt_gmac_ctx_pool_init(ChiakiGKCrypt *gkcrypt);
+static void gkcrypt_gmac_ctx_pool_fini(ChiakiGKCrypt *gkcrypt);
 
 static void *gkcrypt_thread_func(void *user);
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, ChiakiLog *log, ChiakiMemAccount *mem, size_t key_buf_chunks, uint8_t index, const uint8_t *handshake_key, const uint8_t *ecdh_secret)
 {
 	gkcrypt->log = log;
+	gkcrypt->mem = mem;
 	gkcrypt->index = index;
 
-	gkcrypt->key_buf_size = key_buf_chunks * KEY_BUF_CHUNK_SIZE;
+	gkcrypt->key_buf_size = key_buf_chunks * CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE;
+	if(!key_buf_chunks)
+		gkcrypt->key_buf_size_max = 0;
+	else if(key_buf_chunks > CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_MAX)
+		gkcrypt->key_buf_size_max = gkcrypt->key_buf_size;
+	else
+		gkcrypt->key_buf_size_max = CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_MAX * CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE;
 	gkcrypt->key_buf_populated = 0;
 	gkcrypt->key_buf_key_pos_min = 0;
 	gkcrypt->key_buf_start_offset = 0;
 	gkcrypt->last_key_pos = 0;
+	gkcrypt->key_buf_overruns = 0;
+	gkcrypt->key_buf_overruns_key_pos = 0;
 	gkcrypt->key_buf_thread_stop = false;
 
 	ChiakiErrorCode err;
 	if(gkcrypt->key_buf_size)
 	{
-		gkcrypt->key_buf = chiaki_aligned_alloc(KEY_BUF_CHUNK_SIZE, gkcrypt->key_buf_size);
+		gkcrypt->key_buf = chiaki_mem_aligned_alloc(gkcrypt->mem, CHIAKI_MEM_TAG_GKCRYPT, CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE, gkcrypt->key_buf_size);
 		if(!gkcrypt->key_buf)
 		{
 			err = CHIAKI_ERR_MEMORY;
@@ -86,12 +101,19 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_init(ChiakiGKCrypt *gkcrypt, Chiaki
 	chiaki_gkcrypt_gen_gmac_key(0, gkcrypt->key_base, gkcrypt->iv, gkcrypt->key_gmac_base);
 	gkcrypt->key_gmac_index_current = 0;
 	memcpy(gkcrypt->key_gmac_current, gkcrypt->key_gmac_base, sizeof(gkcrypt->key_gmac_current));
+	gkcrypt->key_gmac_seq = 0;
+	gkcrypt->key_gmac_writer = 0;
+
+	gkcrypt_gmac_ctx_pool_init(gkcrypt);
 
 	if(gkcrypt->key_buf)
 	{
 		err = chiaki_thread_create(&gkcrypt->key_buf_thread, gkcrypt_thread_func, gkcrypt);
 		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			gkcrypt_gmac_ctx_pool_fini(gkcrypt);
 			goto error_key_buf_cond;
+		}
 
 		chiaki_thread_set_name(&gkcrypt->key_buf_thread, "Chiaki GKCrypt");
 	}
@@ -105,7 +127,7 @@ error_key_buf_mutex:
 	if(gkcrypt->key_buf)
 		chiaki_mutex_fini(&gkcrypt->key_buf_mutex);
 error_key_buf:
-	chiaki_aligned_free(gkcrypt->key_buf);
+	chiaki_mem_aligned_free(gkcrypt->mem, CHIAKI_MEM_TAG_GKCRYPT, gkcrypt->key_buf, CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE, gkcrypt->key_buf_size);
 error:
 	return err;
 }
@@ -121,8 +143,48 @@ CHIAKI_EXPORT void chiaki_gkcrypt_fini(ChiakiGKCrypt *gkcrypt)
 		chiaki_thread_join(&gkcrypt->key_buf_thread, NULL);
 		chiaki_cond_fini(&gkcrypt->key_buf_cond);
 		chiaki_mutex_fini(&gkcrypt->key_buf_mutex);
-		chiaki_aligned_free(gkcrypt->key_buf);
+		chiaki_mem_aligned_free(gkcrypt->mem, CHIAKI_MEM_TAG_GKCRYPT, gkcrypt->key_buf, CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE, gkcrypt->key_buf_size);
+	}
+	gkcrypt_gmac_ctx_pool_fini(gkcrypt);
+}
+
+CHIAKI_EXPORT size_t chiaki_gkcrypt_key_buf_chunks_for_bitrate(unsigned int bitrate)
+{
+	if(!bitrate)
+		return CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT;
+	// the generator refills once half of the buffer has been consumed, so keep twice the lookahead
+	uint64_t bytes = (uint64_t)bitrate * 1000 / 8 * CHIAKI_GKCRYPT_KEY_BUF_LOOKAHEAD_MS * 2 / 1000;
+	uint64_t chunks = (bytes + CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE - 1) / CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE;
+	if(chunks < CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_MIN)
+		chunks = CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_MIN;
+	if(chunks > CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_MAX)
+		chunks = CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_MAX;
+	return (size_t)chunks;
+}
+
+static void gkcrypt_gmac_ctx_pool_init(ChiakiGKCrypt *gkcrypt)
+{
+	for(size_t i=0; i<CHIAKI_GKCRYPT_GMAC_CTX_POOL_SIZE; i++)
+	{
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+		gkcrypt->gmac_ctx[i] = NULL; // mbedtls gcm contexts live on the stack, nothing to pool
+#else
+		gkcrypt->gmac_ctx[i] = EVP_CIPHER_CTX_new(); // may be NULL, then a temporary one is used
+#endif
+		gkcrypt->gmac_ctx_busy[i] = 0;
+	}
+}
+
+static void gkcrypt_gmac_ctx_pool_fini(ChiakiGKCrypt *gkcrypt)
+{
+#ifndef CHIAKI_LIB_ENABLE_MBEDTLS
+	for(size_t i=0; i<CHIAKI_GKCRYPT_GMAC_CTX_POOL_SIZE; i++)
+	{
+		if(gkcrypt->gmac_ctx[i])
+			EVP_CIPHER_CTX_free(gkcrypt->gmac_ctx[i]);
+		gkcrypt->gmac_ctx[i] = NULL;
 	}
+#endif
 }
 
 
@@ -210,11 +272,28 @@ CHIAKI_EXPORT void chiaki_gkcrypt_gen_gmac_key(uint64_t index, const uint8_t *ke
 	memcpy(key_out, md, CHIAKI_GKCRYPT_BLOCK_SIZE);
 }
 
+/**
+ * Replace key_gmac_current, the caller must own key_gmac_writer or have exclusive access.
+ * Everything is written atomically, so readers on weakly ordered CPUs never see the new sequence number
+ * together with a partially written key.
+ */
+static void gkcrypt_gmac_key_publish(ChiakiGKCrypt *gkcrypt, uint64_t index, const uint8_t *key)
+{
+	uint64_t words[CHIAKI_GKCRYPT_BLOCK_SIZE / 8];
+	memcpy(words, key, sizeof(words));
+	chiaki_atomic_fetch_add_u32(&gkcrypt->key_gmac_seq, 1);
+	for(size_t i=0; i<CHIAKI_GKCRYPT_BLOCK_SIZE / 8; i++)
+		chiaki_atomic_store_u64(&gkcrypt->key_gmac_current_words[i], words[i]);
+	chiaki_atomic_store_u64(&gkcrypt->key_gmac_index_current, index);
+	chiaki_atomic_fetch_add_u32(&gkcrypt->key_gmac_seq, 1);
+}
+
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_new_gmac_key(ChiakiGKCrypt *gkcrypt, uint64_t index)
 {
 	assert(index > 0);
-	chiaki_gkcrypt_gen_gmac_key(index, gkcrypt->key_gmac_base, gkcrypt->iv, gkcrypt->key_gmac_current);
-	gkcrypt->key_gmac_index_current = index;
+	uint8_t key[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	chiaki_gkcrypt_gen_gmac_key(index, gkcrypt->key_gmac_base, gkcrypt->iv, key);
+	gkcrypt_gmac_key_publish(gkcrypt, index, key);
 }
 
 CHIAKI_EXPORT void chiaki_gkcrypt_gen_tmp_gmac_key(ChiakiGKCrypt *gkcrypt, uint64_t index, uint8_t *key_out)
@@ -293,7 +372,7 @@ static bool gkcrypt_key_buf_should_generate(ChiakiGKCrypt *gkcrypt)
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_get_key_stream(ChiakiGKCrypt *gkcrypt, size_t key_pos, uint8_t *buf, size_t buf_size)
 {
-	if(!gkcrypt->key_buf)
+	if(!gkcrypt->key_buf_size_max) // key_buf itself may be replaced by the thread
 		return chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf, buf_size);
 
 	chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
@@ -355,40 +434,134 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_decrypt(ChiakiGKCrypt *gkcrypt, siz
 	return CHIAKI_ERR_SUCCESS;
 }
 
+/**
+ * Get the gmac key for key_index without blocking.
+ *
+ * key_gmac_current is protected by a sequence counter: readers copy it and, instead of retrying,
+ * derive the key themselves if a replacement was in progress. Only one thread at a time
+ * (the one winning key_gmac_writer) publishes a newer key.
+ *
+ * The key and its index are copied with atomic loads, which keeps the copy from being
+ * reordered past the second load of the sequence number.
+ */
+static void gkcrypt_gmac_key(ChiakiGKCrypt *gkcrypt, uint64_t key_index, uint8_t *key_out)
+{
+	uint32_t seq = chiaki_atomic_load_u32(&gkcrypt->key_gmac_seq);
+	if(!(seq & 1))
+	{
+		uint64_t index_current = chiaki_atomic_load_u64(&gkcrypt->key_gmac_index_current);
+		uint64_t key_current[CHIAKI_GKCRYPT_BLOCK_SIZE / 8];
+		for(size_t i=0; i<CHIAKI_GKCRYPT_BLOCK_SIZE / 8; i++)
+			key_current[i] = chiaki_atomic_load_u64(&gkcrypt->key_gmac_current_words[i]);
+		if(chiaki_atomic_load_u32(&gkcrypt->key_gmac_seq) == seq)
+		{
+			if(key_index == index_current)
+			{
+				memcpy(key_out, key_current, sizeof(key_current));
+				return;
+			}
+
+			if(key_index > index_current && !chiaki_atomic_exchange_u32(&gkcrypt->key_gmac_writer, 1))
+			{
+				chiaki_gkcrypt_gen_tmp_gmac_key(gkcrypt, key_index, key_out);
+				// re-check under writer ownership, another writer may have been faster in the meantime
+				if(key_index > chiaki_atomic_load_u64(&gkcrypt->key_gmac_index_current))
+					gkcrypt_gmac_key_publish(gkcrypt, key_index, key_out);
+				chiaki_atomic_store_u32(&gkcrypt->key_gmac_writer, 0);
+				return;
+			}
+		}
+	}
+
+	chiaki_gkcrypt_gen_tmp_gmac_key(gkcrypt, key_index, key_out);
+}
+
+#ifndef CHIAKI_LIB_ENABLE_MBEDTLS
+/**
+ * Grab a free context from the pool, or fall back to a temporary one.
+ *
+ * @param pool_index set to CHIAKI_GKCRYPT_GMAC_CTX_POOL_SIZE for a temporary context
+ */
+static EVP_CIPHER_CTX *gkcrypt_gmac_ctx_acquire(ChiakiGKCrypt *gkcrypt, size_t *pool_index)
+{
+	for(size_t i=0; i<CHIAKI_GKCRYPT_GMAC_CTX_POOL_SIZE; i++)
+	{
+		if(!gkcrypt->gmac_ctx[i] || chiaki_atomic_exchange_u32(&gkcrypt->gmac_ctx_busy[i], 1))
+			continue;
+		*pool_index = i;
+		return gkcrypt->gmac_ctx[i];
+	}
+
+	*pool_index = CHIAKI_GKCRYPT_GMAC_CTX_POOL_SIZE;
+	return EVP_CIPHER_CTX_new();
+}
+
+static void gkcrypt_gmac_ctx_release(ChiakiGKCrypt *gkcrypt, EVP_CIPHER_CTX *ctx, size_t pool_index)
+{
+	if(pool_index < CHIAKI_GKCRYPT_GMAC_CTX_POOL_SIZE)
+		chiaki_atomic_store_u32(&gkcrypt->gmac_ctx_busy[pool_index], 0);
+	else
+		EVP_CIPHER_CTX_free(ctx);
+}
+#endif
+
+/**
+ * Compare MACs without returning early, so the time taken does not depend on where they differ.
+ */
+static bool gkcrypt_gmac_equal(const uint8_t *a, const uint8_t *b)
+{
+	uint8_t diff = 0;
+	for(size_t i=0; i<CHIAKI_GKCRYPT_GMAC_SIZE; i++)
+		diff |= a[i] ^ b[i];
+	return diff == 0;
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, size_t key_pos, const uint8_t *buf, size_t buf_size, uint8_t *gmac_out)
+{
+	return chiaki_gkcrypt_gmac_split(gkcrypt, key_pos, buf, buf_size, NULL, 0, gmac_out);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac_split(ChiakiGKCrypt *gkcrypt, size_t key_pos, const uint8_t *head, size_t head_size, const uint8_t *tail, size_t tail_size, uint8_t *gmac_out)
 {
 	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	counter_add(iv, gkcrypt->iv, key_pos / 0x10);
 
-	uint8_t *gmac_key = gkcrypt->key_gmac_current;
-	uint8_t gmac_key_tmp[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	uint8_t gmac_key[CHIAKI_GKCRYPT_BLOCK_SIZE];
 	uint64_t key_index = (key_pos > 0 ? key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
+	gkcrypt_gmac_key(gkcrypt, key_index, gmac_key);
 
-	if(key_index > gkcrypt->key_gmac_index_current)
-	{
-		chiaki_gkcrypt_gen_new_gmac_key(gkcrypt, key_index);
-	}
-	else if(key_index < gkcrypt->key_gmac_index_current)
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	// mbedtls takes the additional data in one piece only
+	const uint8_t *buf = head;
+	size_t buf_size = head_size;
+	uint8_t *buf_joined = NULL;
+	if(tail_size)
 	{
-		chiaki_gkcrypt_gen_tmp_gmac_key(gkcrypt, key_index, gmac_key_tmp);
-		gmac_key = gmac_key_tmp;
+		buf_size = head_size + tail_size;
+		buf_joined = malloc(buf_size);
+		if(!buf_joined)
+			return CHIAKI_ERR_MEMORY;
+		memcpy(buf_joined, head, head_size);
+		memcpy(buf_joined + head_size, tail, tail_size);
+		buf = buf_joined;
 	}
 
-#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
+
 	// build mbedtls gcm context AES_128_GCM
 	// Encryption
 	mbedtls_gcm_context actx;
 	mbedtls_gcm_init(&actx);
 	// set gmac_key 128 bits key
 	if(mbedtls_gcm_setkey(&actx, MBEDTLS_CIPHER_ID_AES, gmac_key, CHIAKI_GKCRYPT_BLOCK_SIZE*8) != 0){
-		mbedtls_gcm_free(&actx);
-		return CHIAKI_ERR_UNKNOWN;
+		ret = CHIAKI_ERR_UNKNOWN;
+		goto beach;
 	}
 
 	// encrypt without additional data
 	if(mbedtls_gcm_starts(&actx, MBEDTLS_GCM_ENCRYPT, iv, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL, 0) != 0){
-		mbedtls_gcm_free(&actx);
-		return CHIAKI_ERR_UNKNOWN;
+		ret = CHIAKI_ERR_UNKNOWN;
+		goto beach;
 	}
 	// set "additional data" only whitout input nor output
 	// to get the same result as:
@@ -397,18 +570,19 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, size_t
 		0, iv, CHIAKI_GKCRYPT_BLOCK_SIZE,
 		buf, buf_size, NULL, NULL,
 		CHIAKI_GKCRYPT_GMAC_SIZE, gmac_out) != 0){
-
-		mbedtls_gcm_free(&actx);
-		return CHIAKI_ERR_UNKNOWN;
+		ret = CHIAKI_ERR_UNKNOWN;
+		goto beach;
 	}
 
+beach:
 	mbedtls_gcm_free(&actx);
-
-	return CHIAKI_ERR_SUCCESS;
+	free(buf_joined);
+	return ret;
 #else
 	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
 
-	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	size_t pool_index;
+	EVP_CIPHER_CTX *ctx = gkcrypt_gmac_ctx_acquire(gkcrypt, &pool_index);
 	if(!ctx)
 	{
 		ret = CHIAKI_ERR_MEMORY;
@@ -434,7 +608,13 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, size_t
 	}
 
 	int len;
-	if(!EVP_EncryptUpdate(ctx, NULL, &len, buf, (int)buf_size))
+	if(!EVP_EncryptUpdate(ctx, NULL, &len, head, (int)head_size))
+	{
+		ret = CHIAKI_ERR_UNKNOWN;
+		goto fail_cipher;
+	}
+
+	if(tail_size && !EVP_EncryptUpdate(ctx, NULL, &len, tail, (int)tail_size))
 	{
 		ret = CHIAKI_ERR_UNKNOWN;
 		goto fail_cipher;
@@ -453,12 +633,103 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac(ChiakiGKCrypt *gkcrypt, size_t
 	}
 
 fail_cipher:
-	EVP_CIPHER_CTX_free(ctx);
+	gkcrypt_gmac_ctx_release(gkcrypt, ctx, pool_index);
 fail:
 	return ret;
 #endif
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_gkcrypt_gmac_verify_batch(ChiakiGKCrypt *gkcrypt, ChiakiGKCryptGmacVerify *entries, size_t count)
+{
+	if(!count)
+		return CHIAKI_ERR_SUCCESS;
+
+	ChiakiErrorCode ret = CHIAKI_ERR_SUCCESS;
+	uint8_t gmac_key[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	uint64_t key_index_set = UINT64_MAX; // key the context is currently set up with
+	uint8_t iv[CHIAKI_GKCRYPT_BLOCK_SIZE];
+	uint8_t gmac[CHIAKI_GKCRYPT_BLOCK_SIZE];
+
+#ifdef CHIAKI_LIB_ENABLE_MBEDTLS
+	mbedtls_gcm_context actx;
+	mbedtls_gcm_init(&actx);
+
+	for(size_t i=0; i<count; i++)
+	{
+		ChiakiGKCryptGmacVerify *entry = &entries[i];
+		uint64_t key_index = (entry->key_pos > 0 ? entry->key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
+		if(key_index != key_index_set)
+		{
+			gkcrypt_gmac_key(gkcrypt, key_index, gmac_key);
+			if(mbedtls_gcm_setkey(&actx, MBEDTLS_CIPHER_ID_AES, gmac_key, CHIAKI_GKCRYPT_BLOCK_SIZE*8) != 0)
+			{
+				ret = CHIAKI_ERR_UNKNOWN;
+				goto beach;
+			}
+			key_index_set = key_index;
+		}
+
+		counter_add(iv, gkcrypt->iv, entry->key_pos / 0x10);
+		if(mbedtls_gcm_crypt_and_tag(&actx, MBEDTLS_GCM_ENCRYPT,
+			0, iv, CHIAKI_GKCRYPT_BLOCK_SIZE,
+			entry->buf, entry->buf_size, NULL, NULL,
+			CHIAKI_GKCRYPT_GMAC_SIZE, gmac) != 0)
+		{
+			ret = CHIAKI_ERR_UNKNOWN;
+			goto beach;
+		}
+		entry->valid = gkcrypt_gmac_equal(gmac, entry->gmac);
+	}
+
+beach:
+	mbedtls_gcm_free(&actx);
+	return ret;
+#else
+	size_t pool_index;
+	EVP_CIPHER_CTX *ctx = gkcrypt_gmac_ctx_acquire(gkcrypt, &pool_index);
+	if(!ctx)
+		return CHIAKI_ERR_MEMORY;
+
+	if(!EVP_CipherInit_ex(ctx, EVP_aes_128_gcm(), NULL, NULL, NULL, 1)
+		|| !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, CHIAKI_GKCRYPT_BLOCK_SIZE, NULL))
+	{
+		ret = CHIAKI_ERR_UNKNOWN;
+		goto beach;
+	}
+
+	for(size_t i=0; i<count; i++)
+	{
+		ChiakiGKCryptGmacVerify *entry = &entries[i];
+		uint64_t key_index = (entry->key_pos > 0 ? entry->key_pos - 1 : 0) / CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS;
+		counter_add(iv, gkcrypt->iv, entry->key_pos / 0x10);
+
+		// passing no key keeps the AES key schedule and GHASH tables of the previous entry
+		const uint8_t *key = NULL;
+		if(key_index != key_index_set)
+		{
+			gkcrypt_gmac_key(gkcrypt, key_index, gmac_key);
+			key = gmac_key;
+			key_index_set = key_index;
+		}
+
+		int len;
+		if(!EVP_CipherInit_ex(ctx, NULL, NULL, key, iv, 1)
+			|| !EVP_EncryptUpdate(ctx, NULL, &len, entry->buf, (int)entry->buf_size)
+			|| !EVP_EncryptFinal_ex(ctx, NULL, &len)
+			|| !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CHIAKI_GKCRYPT_GMAC_SIZE, gmac))
+		{
+			ret = CHIAKI_ERR_UNKNOWN;
+			goto beach;
+		}
+		entry->valid = gkcrypt_gmac_equal(gmac, entry->gmac);
+	}
+
+beach:
+	gkcrypt_gmac_ctx_release(gkcrypt, ctx, pool_index);
+	return ret;
+#endif
+}
+
 static bool key_buf_mutex_pred(void *user)
 {
 	ChiakiGKCrypt *gkcrypt = user;
@@ -476,25 +747,72 @@ static bool key_buf_mutex_pred(void *user)
 
 static ChiakiErrorCode gkcrypt_generate_next_chunk(ChiakiGKCrypt *gkcrypt)
 {
-	assert(gkcrypt->key_buf_populated + KEY_BUF_CHUNK_SIZE <= gkcrypt->key_buf_size);
+	assert(gkcrypt->key_buf_populated + CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE <= gkcrypt->key_buf_size);
 	size_t buf_offset = (gkcrypt->key_buf_start_offset + gkcrypt->key_buf_populated) % gkcrypt->key_buf_size;
 	size_t key_pos = gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated;
 	uint8_t *buf_start = gkcrypt->key_buf + buf_offset;
 
 	chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
 
-	ChiakiErrorCode err = chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf_start, KEY_BUF_CHUNK_SIZE);
+	ChiakiErrorCode err = chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, buf_start, CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE);
 	if(err != CHIAKI_ERR_SUCCESS)
 		CHIAKI_LOGE(gkcrypt->log, "GKCrypt failed to generate key stream chunk");
 
 	chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
 
 	if(err == CHIAKI_ERR_SUCCESS)
-		gkcrypt->key_buf_populated += KEY_BUF_CHUNK_SIZE;
+		gkcrypt->key_buf_populated += CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE;
 
 	return err;
 }
 
+/**
+ * Count an overrun of the key buf at key_pos.
+ *
+ * @return whether there have been enough overruns recently to grow the buffer
+ */
+static bool gkcrypt_key_buf_overrun(ChiakiGKCrypt *gkcrypt, size_t key_pos)
+{
+	if(!gkcrypt->key_buf_overruns || key_pos - gkcrypt->key_buf_overruns_key_pos > gkcrypt->key_buf_size * KEY_BUF_GROW_WINDOW_SIZES)
+	{
+		gkcrypt->key_buf_overruns = 0;
+		gkcrypt->key_buf_overruns_key_pos = key_pos;
+	}
+	if(++gkcrypt->key_buf_overruns < KEY_BUF_GROW_OVERRUNS)
+		return false;
+	gkcrypt->key_buf_overruns = 0;
+	return true;
+}
+
+/**
+ * Double the size of key_buf, called from the key buf thread with key_buf_mutex locked and key_buf_populated == 0.
+ * Readers only touch key_buf while holding the mutex, so the buffer can be swapped without further synchronization.
+ */
+static void gkcrypt_key_buf_grow(ChiakiGKCrypt *gkcrypt)
+{
+	if(gkcrypt->key_buf_size >= gkcrypt->key_buf_size_max)
+		return;
+	size_t size = gkcrypt->key_buf_size * 2;
+	if(size > gkcrypt->key_buf_size_max)
+		size = gkcrypt->key_buf_size_max;
+
+	chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+	uint8_t *key_buf = chiaki_mem_aligned_alloc(gkcrypt->mem, CHIAKI_MEM_TAG_GKCRYPT, CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE, size);
+	chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
+	if(!key_buf)
+		return;
+
+	CHIAKI_LOGI(gkcrypt->log, "GKCrypt %d growing key buf from %#llx to %#llx",
+				(int)gkcrypt->index,
+				(unsigned long long)gkcrypt->key_buf_size,
+				(unsigned long long)size);
+	chiaki_mem_aligned_free(gkcrypt->mem, CHIAKI_MEM_TAG_GKCRYPT, gkcrypt->key_buf, CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE, gkcrypt->key_buf_size);
+	gkcrypt->key_buf = key_buf;
+	gkcrypt->key_buf_size = size;
+	gkcrypt->key_buf_start_offset = 0;
+	gkcrypt->key_buf_populated = 0;
+}
+
 static void *gkcrypt_thread_func(void *user)
 {
 	ChiakiGKCrypt *gkcrypt = user;
@@ -520,19 +838,26 @@ static void *gkcrypt_thread_func(void *user)
 		if(gkcrypt->last_key_pos > gkcrypt->key_buf_key_pos_min + gkcrypt->key_buf_populated)
 		{
 			// skip ahead if the last key pos is already beyond our buffer
-			size_t key_pos = (gkcrypt->last_key_pos / KEY_BUF_CHUNK_SIZE) * KEY_BUF_CHUNK_SIZE;
+			size_t key_pos = (gkcrypt->last_key_pos / CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE) * CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE;
 			CHIAKI_LOGW(gkcrypt->log, "Already requested a higher key pos than in the buffer, skipping ahead from min %#llx to %#llx",
 						(unsigned long long)gkcrypt->key_buf_key_pos_min,
 						(unsigned long long)key_pos);
 			gkcrypt->key_buf_key_pos_min = key_pos;
 			gkcrypt->key_buf_start_offset = 0;
 			gkcrypt->key_buf_populated = 0;
+			if(gkcrypt_key_buf_overrun(gkcrypt, key_pos))
+			{
+				// the key pos advances faster than we can keep up with this buffer
+				gkcrypt_key_buf_grow(gkcrypt);
+				if(gkcrypt->key_buf_thread_stop)
+					break;
+			}
 		}
 		else if(gkcrypt->key_buf_populated == gkcrypt->key_buf_size)
 		{
-			gkcrypt->key_buf_start_offset = (gkcrypt->key_buf_start_offset + KEY_BUF_CHUNK_SIZE) % gkcrypt->key_buf_size;
-			gkcrypt->key_buf_key_pos_min += KEY_BUF_CHUNK_SIZE;
-			gkcrypt->key_buf_populated -= KEY_BUF_CHUNK_SIZE;
+			gkcrypt->key_buf_start_offset = (gkcrypt->key_buf_start_offset + CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE) % gkcrypt->key_buf_size;
+			gkcrypt->key_buf_key_pos_min += CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE;
+			gkcrypt->key_buf_populated -= CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE;
 		}
 		err = gkcrypt_generate_next_chunk(gkcrypt);
 		if(err != CHIAKI_ERR_SUCCESS)
@@ -16,6 +16,7 @@
  */
 
 #include <chiaki/log.h>
+#include <chiaki/memaccount.h>
 
 #include <stdio.h>
 #include <stdarg.h>
@@ -83,6 +84,7 @@ CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *
 	va_list args;
 	char buf[0x100];
 	char *msg = buf;
+	size_t msg_size = sizeof(buf);
 
 	va_start(args, fmt);
 	int written = vsnprintf(buf, sizeof(buf), fmt, args);
@@ -93,17 +95,19 @@ CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *
 
 	if(written >= sizeof(buf))
 	{
-		msg = malloc(written + 1);
+		// the log may be shared by many sessions, so this is counted in the default account
+		msg_size = (size_t)written + 1;
+		msg = chiaki_mem_alloc(NULL, CHIAKI_MEM_TAG_LOG, msg_size);
 		if(!msg)
 			return;
 
 		va_start(args, fmt);
-		written = vsnprintf(msg, written + 1, fmt, args);
+		written = vsnprintf(msg, msg_size, fmt, args);
 		va_end(args);
 
 		if(written < 0)
 		{
-			free(msg);
+			chiaki_mem_free(NULL, CHIAKI_MEM_TAG_LOG, msg, msg_size);
 			return;
 		}
 	}
@@ -113,7 +117,7 @@ CHIAKI_EXPORT void chiaki_log(ChiakiLog *log, ChiakiLogLevel level, const char *
 	cb(level, msg, user);
 
 	if(msg != buf)
-		free(msg);
+		chiaki_mem_free(NULL, CHIAKI_MEM_TAG_LOG, msg, msg_size);
 }
 
 #define HEXDUMP_WIDTH 0x10
@@ -179,7 +183,8 @@ CHIAKI_EXPORT void chiaki_log_hexdump_raw(ChiakiLog *log, ChiakiLogLevel level,
 	if(log && !(log->level_mask & level))
 		return;
 
-	char *str = malloc(buf_size * 2 + 1);
+	size_t str_size = buf_size * 2 + 1;
+	char *str = chiaki_mem_alloc(NULL, CHIAKI_MEM_TAG_LOG, str_size);
 	if(!str)
 		return;
 	for(size_t i=0; i<buf_size; i++)
@@ -190,5 +195,5 @@ CHIAKI_EXPORT void chiaki_log_hexdump_raw(ChiakiLog *log, ChiakiLogLevel level,
 	}
 	str[buf_size*2] = 0;
 	chiaki_log(log, level, "%s", str);
-	free(str);
+	chiaki_mem_free(NULL, CHIAKI_MEM_TAG_LOG, str, str_size);
 }
\ No newline at end of file
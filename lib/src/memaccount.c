@@ -0,0 +1,215 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki/memaccount.h>
+
+#include "atomic.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static ChiakiMemAccount default_account = { { NULL, NULL, NULL }, { 0 }, { 0 }, 0, 0, 1 };
+
+CHIAKI_EXPORT const char *chiaki_mem_tag_string(ChiakiMemTag tag)
+{
+	switch(tag)
+	{
+		case CHIAKI_MEM_TAG_OTHER:
+			return "Other";
+		case CHIAKI_MEM_TAG_FRAME:
+			return "Frames";
+		case CHIAKI_MEM_TAG_GKCRYPT:
+			return "GKCrypt";
+		case CHIAKI_MEM_TAG_REORDER:
+			return "Reorder Queue";
+		case CHIAKI_MEM_TAG_SEND_BUFFER:
+			return "Send Buffer";
+		case CHIAKI_MEM_TAG_POSTPONED:
+			return "Postponed";
+		case CHIAKI_MEM_TAG_LOG:
+			return "Log";
+		case CHIAKI_MEM_TAG_PROTO:
+			return "Protobuf";
+		default:
+			return "Unknown";
+	}
+}
+
+CHIAKI_EXPORT ChiakiMemAccount *chiaki_mem_account_default(void)
+{
+	return &default_account;
+}
+
+CHIAKI_EXPORT ChiakiMemAccount *chiaki_mem_account_new(const ChiakiAllocator *allocator)
+{
+	ChiakiMemAccount *account = calloc(1, sizeof(ChiakiMemAccount));
+	if(!account)
+		return NULL;
+	if(allocator && allocator->alloc && allocator->free)
+		account->allocator = *allocator;
+	account->refs = 1;
+	return account;
+}
+
+CHIAKI_EXPORT ChiakiMemAccount *chiaki_mem_account_ref(ChiakiMemAccount *account)
+{
+	if(!account)
+		return &default_account;
+	chiaki_atomic_fetch_add_u32(&account->refs, 1);
+	return account;
+}
+
+CHIAKI_EXPORT void chiaki_mem_account_unref(ChiakiMemAccount *account)
+{
+	if(!account)
+		return;
+	if(chiaki_atomic_fetch_add_u32(&account->refs, (uint32_t)-1) != 1)
+		return;
+	if(account == &default_account) // never really dropped
+	{
+		chiaki_atomic_fetch_add_u32(&account->refs, 1);
+		return;
+	}
+	free(account);
+}
+
+CHIAKI_EXPORT void chiaki_mem_account_get_stats(ChiakiMemAccount *account, ChiakiMemStats *stats)
+{
+	if(!account)
+		account = &default_account;
+	for(size_t i=0; i<CHIAKI_MEM_TAG_COUNT; i++)
+	{
+		stats->current[i] = chiaki_atomic_load_u64(&account->current[i]);
+		stats->peak[i] = chiaki_atomic_load_u64(&account->peak[i]);
+	}
+	stats->total_current = chiaki_atomic_load_u64(&account->total_current);
+	stats->total_peak = chiaki_atomic_load_u64(&account->total_peak);
+}
+
+static void mem_peak_update(volatile uint64_t *peak, uint64_t current)
+{
+	uint64_t prev = chiaki_atomic_load_u64(peak);
+	while(current > prev && !chiaki_atomic_compare_exchange_u64(peak, &prev, current));
+}
+
+CHIAKI_EXPORT void chiaki_mem_charge(ChiakiMemAccount *account, ChiakiMemTag tag, size_t size)
+{
+	if(!account)
+		account = &default_account;
+	if(tag >= CHIAKI_MEM_TAG_COUNT)
+		tag = CHIAKI_MEM_TAG_OTHER;
+	uint64_t current = chiaki_atomic_fetch_add_u64(&account->current[tag], size) + size;
+	mem_peak_update(&account->peak[tag], current);
+	uint64_t total = chiaki_atomic_fetch_add_u64(&account->total_current, size) + size;
+	mem_peak_update(&account->total_peak, total);
+}
+
+CHIAKI_EXPORT void chiaki_mem_uncharge(ChiakiMemAccount *account, ChiakiMemTag tag, size_t size)
+{
+	if(!account)
+		account = &default_account;
+	if(tag >= CHIAKI_MEM_TAG_COUNT)
+		tag = CHIAKI_MEM_TAG_OTHER;
+	chiaki_atomic_fetch_add_u64(&account->current[tag], (uint64_t)0 - size);
+	chiaki_atomic_fetch_add_u64(&account->total_current, (uint64_t)0 - size);
+}
+
+static void *mem_alloc(ChiakiMemAccount *account, ChiakiMemTag tag, size_t alignment, size_t size)
+{
+	if(!account)
+		account = &default_account;
+	void *ptr;
+	if(account->allocator.alloc)
+		ptr = account->allocator.alloc(size, alignment, tag, account->allocator.user);
+	else if(alignment)
+		ptr = chiaki_aligned_alloc(alignment, size);
+	else
+		ptr = malloc(size);
+	if(ptr)
+		chiaki_mem_charge(account, tag, size);
+	return ptr;
+}
+
+static void mem_free(ChiakiMemAccount *account, ChiakiMemTag tag, void *ptr, size_t alignment, size_t size)
+{
+	if(!ptr)
+		return;
+	if(!account)
+		account = &default_account;
+	chiaki_mem_uncharge(account, tag, size);
+	if(account->allocator.free)
+		account->allocator.free(ptr, size, alignment, tag, account->allocator.user);
+	else if(alignment)
+		chiaki_aligned_free(ptr);
+	else
+		free(ptr);
+}
+
+CHIAKI_EXPORT void *chiaki_mem_alloc(ChiakiMemAccount *account, ChiakiMemTag tag, size_t size)
+{
+	return mem_alloc(account, tag, 0, size);
+}
+
+CHIAKI_EXPORT void *chiaki_mem_calloc(ChiakiMemAccount *account, ChiakiMemTag tag, size_t count, size_t size)
+{
+	if(size && count > SIZE_MAX / size)
+		return NULL;
+	void *ptr = mem_alloc(account, tag, 0, count * size);
+	if(ptr)
+		memset(ptr, 0, count * size);
+	return ptr;
+}
+
+CHIAKI_EXPORT void *chiaki_mem_realloc(ChiakiMemAccount *account, ChiakiMemTag tag, void *ptr, size_t old_size, size_t size)
+{
+	if(!ptr)
+		return mem_alloc(account, tag, 0, size);
+	if(!account)
+		account = &default_account;
+
+	if(account->allocator.alloc)
+	{
+		void *new_ptr = mem_alloc(account, tag, 0, size);
+		if(!new_ptr)
+			return NULL;
+		memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+		mem_free(account, tag, ptr, 0, old_size);
+		return new_ptr;
+	}
+
+	void *new_ptr = realloc(ptr, size);
+	if(!new_ptr)
+		return NULL;
+	chiaki_mem_uncharge(account, tag, old_size);
+	chiaki_mem_charge(account, tag, size);
+	return new_ptr;
+}
+
+CHIAKI_EXPORT void chiaki_mem_free(ChiakiMemAccount *account, ChiakiMemTag tag, void *ptr, size_t size)
+{
+	mem_free(account, tag, ptr, 0, size);
+}
+
+CHIAKI_EXPORT void *chiaki_mem_aligned_alloc(ChiakiMemAccount *account, ChiakiMemTag tag, size_t alignment, size_t size)
+{
+	return mem_alloc(account, tag, alignment, size);
+}
+
+CHIAKI_EXPORT void chiaki_mem_aligned_free(ChiakiMemAccount *account, ChiakiMemTag tag, void *ptr, size_t alignment, size_t size)
+{
+	mem_free(account, tag, ptr, alignment, size);
+}
@@ -0,0 +1,191 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki/netbackend.h>
+#include <chiaki/time.h>
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_WIN32) || defined(__SWITCH__)
+// no kernel receive timestamps
+#elif defined(SO_TIMESTAMPNS) || defined(SO_TIMESTAMP)
+#define RX_TIMESTAMPS
+#include <sys/uio.h>
+#endif
+
+static chiaki_socket_t system_socket(ChiakiNetBackend *backend, int family, int type, int protocol)
+{
+	return socket(family, type, protocol);
+}
+
+static int system_close(ChiakiNetBackend *backend, chiaki_socket_t sock)
+{
+	return CHIAKI_SOCKET_CLOSE(sock);
+}
+
+static int system_setsockopt(ChiakiNetBackend *backend, chiaki_socket_t sock, int level, int name, const void *val, socklen_t val_len)
+{
+	return setsockopt(sock, level, name, (const char *)val, val_len);
+}
+
+static int system_bind(ChiakiNetBackend *backend, chiaki_socket_t sock, const struct sockaddr *addr, socklen_t addr_len)
+{
+	return bind(sock, addr, addr_len);
+}
+
+static int system_connect(ChiakiNetBackend *backend, chiaki_socket_t sock, const struct sockaddr *addr, socklen_t addr_len)
+{
+	return connect(sock, addr, addr_len);
+}
+
+static int system_send(ChiakiNetBackend *backend, chiaki_socket_t sock, const uint8_t *buf, size_t buf_size)
+{
+	return (int)send(sock, (const char *)buf, buf_size, 0);
+}
+
+static int system_sendto(ChiakiNetBackend *backend, chiaki_socket_t sock, const uint8_t *buf, size_t buf_size, const struct sockaddr *addr, socklen_t addr_len)
+{
+	return (int)sendto(sock, (const char *)buf, buf_size, 0, addr, addr_len);
+}
+
+static int system_recv(ChiakiNetBackend *backend, chiaki_socket_t sock, uint8_t *buf, size_t buf_size)
+{
+	return (int)recv(sock, (char *)buf, buf_size, 0);
+}
+
+static int system_recvfrom(ChiakiNetBackend *backend, chiaki_socket_t sock, uint8_t *buf, size_t buf_size, struct sockaddr *addr, socklen_t *addr_len)
+{
+	return (int)recvfrom(sock, (char *)buf, buf_size, 0, addr, addr_len);
+}
+
+static int system_recv_timestamp(ChiakiNetBackend *backend, chiaki_socket_t sock, uint8_t *buf, size_t buf_size, uint64_t *timestamp_us)
+{
+	return chiaki_net_system_recv_timestamp(sock, buf, buf_size, 0, timestamp_us);
+}
+
+static int system_enable_rx_timestamps(ChiakiNetBackend *backend, chiaki_socket_t sock)
+{
+#ifdef RX_TIMESTAMPS
+	const int enable = 1;
+#ifdef SO_TIMESTAMPNS
+	if(setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) == 0)
+		return 0;
+#endif
+#ifdef SO_TIMESTAMP
+	// e.g. macOS or a kernel that rejects SO_TIMESTAMPNS, microseconds only
+	return setsockopt(sock, SOL_SOCKET, SO_TIMESTAMP, &enable, sizeof(enable));
+#else
+	return -1;
+#endif
+#else
+	errno = ENOPROTOOPT;
+	return -1;
+#endif
+}
+
+static ChiakiErrorCode system_select(ChiakiNetBackend *backend, ChiakiStopPipe *stop_pipe, ChiakiStopPipeSelectFd *fds, size_t fds_count, uint64_t timeout_ms)
+{
+	return chiaki_stop_pipe_select(stop_pipe, fds, fds_count, timeout_ms);
+}
+
+static ChiakiNetBackend system_backend = {
+	system_socket,
+	system_close,
+	system_setsockopt,
+	system_bind,
+	system_connect,
+	system_send,
+	system_sendto,
+	system_recv,
+	system_recvfrom,
+	system_recv_timestamp,
+	system_enable_rx_timestamps,
+	system_select,
+	CHIAKI_NET_BACKEND_CAP_OS_SOCKETS
+};
+
+CHIAKI_EXPORT int chiaki_net_system_recv_timestamp(chiaki_socket_t sock, uint8_t *buf, size_t buf_size, int flags, uint64_t *timestamp_us)
+{
+	*timestamp_us = 0;
+#ifdef RX_TIMESTAMPS
+	struct iovec iov = { buf, buf_size };
+	// whichever of SO_TIMESTAMPNS and SO_TIMESTAMP chiaki_net_backend_system()->enable_rx_timestamps could set
+	union
+	{
+		struct cmsghdr align;
+		uint8_t buf_ns[CMSG_SPACE(sizeof(struct timespec))];
+		uint8_t buf_us[CMSG_SPACE(sizeof(struct timeval))];
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t r = recvmsg(sock, &msg, flags);
+	if(r < 0)
+		return -1;
+
+	for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if(cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+		int64_t ts_sec, ts_sub_us;
+#ifdef SO_TIMESTAMPNS
+		if(cmsg->cmsg_type == SCM_TIMESTAMPNS)
+		{
+			struct timespec ts;
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+			ts_sec = (int64_t)ts.tv_sec;
+			ts_sub_us = (int64_t)(ts.tv_nsec / 1000);
+		}
+		else
+#endif
+#ifdef SO_TIMESTAMP
+		if(cmsg->cmsg_type == SCM_TIMESTAMP)
+		{
+			struct timeval ts;
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+			ts_sec = (int64_t)ts.tv_sec;
+			ts_sub_us = (int64_t)ts.tv_usec;
+		}
+		else
+#endif
+			continue;
+		struct timespec now_real;
+		clock_gettime(CLOCK_REALTIME, &now_real);
+		uint64_t now_us = chiaki_time_now_monotonic_us();
+		int64_t age_us = ((int64_t)now_real.tv_sec - ts_sec) * 1000000
+			+ (int64_t)(now_real.tv_nsec / 1000) - ts_sub_us;
+		if(age_us < 0) // wall clock jumped
+			age_us = 0;
+		*timestamp_us = now_us - (uint64_t)age_us;
+		break;
+	}
+	return (int)r;
+#else
+	return (int)recv(sock, (char *)buf, buf_size, flags);
+#endif
+}
+
+CHIAKI_EXPORT ChiakiNetBackend *chiaki_net_backend_system(void)
+{
+	return &system_backend;
+}
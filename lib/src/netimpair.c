@@ -0,0 +1,436 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki/netimpair.h>
+#include <chiaki/time.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <errno.h>
+#include <netinet/in.h>
+#endif
+
+#define HEAP_SIZE_MIN 64
+#define PROXY_BUF_SIZE 0x10000
+#define PROXY_RECV_BURST_MAX 64 // per socket and wakeup, so one direction can't starve the other
+
+CHIAKI_EXPORT void chiaki_net_impair_params_default(ChiakiNetImpairParams *params)
+{
+	memset(params, 0, sizeof(*params));
+	params->queue_bytes_max = 256 * 1024;
+}
+
+static uint64_t rng_next(uint64_t *state)
+{
+	// splitmix64
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+static double rng_uniform(uint64_t *state)
+{
+	return (double)(rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+CHIAKI_EXPORT void chiaki_net_impair_init(ChiakiNetImpair *impair, const ChiakiNetImpairParams *params, uint64_t seed)
+{
+	memset(impair, 0, sizeof(*impair));
+	impair->params = *params;
+	impair->rng = seed;
+}
+
+CHIAKI_EXPORT void chiaki_net_impair_fini(ChiakiNetImpair *impair)
+{
+	for(size_t i=0; i<impair->heap_count; i++)
+		free(impair->heap[i].buf);
+	free(impair->heap);
+}
+
+static bool packet_before(const ChiakiNetImpairPacket *a, const ChiakiNetImpairPacket *b)
+{
+	return a->release_us < b->release_us || (a->release_us == b->release_us && a->seq < b->seq);
+}
+
+static ChiakiErrorCode heap_push(ChiakiNetImpair *impair, uint64_t release_us, uint8_t *buf, size_t size)
+{
+	if(impair->heap_count == impair->heap_size)
+	{
+		size_t heap_size = impair->heap_size ? impair->heap_size * 2 : HEAP_SIZE_MIN;
+		ChiakiNetImpairPacket *heap = realloc(impair->heap, heap_size * sizeof(ChiakiNetImpairPacket));
+		if(!heap)
+			return CHIAKI_ERR_MEMORY;
+		impair->heap = heap;
+		impair->heap_size = heap_size;
+	}
+
+	ChiakiNetImpairPacket packet = { release_us, impair->seq++, buf, size };
+	size_t i = impair->heap_count++;
+	while(i > 0)
+	{
+		size_t parent = (i - 1) / 2;
+		if(!packet_before(&packet, &impair->heap[parent]))
+			break;
+		impair->heap[i] = impair->heap[parent];
+		i = parent;
+	}
+	impair->heap[i] = packet;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static void heap_pop(ChiakiNetImpair *impair)
+{
+	ChiakiNetImpairPacket last = impair->heap[--impair->heap_count];
+	size_t i = 0;
+	while(true)
+	{
+		size_t child = i * 2 + 1;
+		if(child >= impair->heap_count)
+			break;
+		if(child + 1 < impair->heap_count && packet_before(&impair->heap[child + 1], &impair->heap[child]))
+			child++;
+		if(!packet_before(&impair->heap[child], &last))
+			break;
+		impair->heap[i] = impair->heap[child];
+		i = child;
+	}
+	impair->heap[i] = last;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_net_impair_push(ChiakiNetImpair *impair, const uint8_t *buf, size_t size, uint64_t now_us)
+{
+	ChiakiNetImpairParams *params = &impair->params;
+	impair->stats.packets_in++;
+	impair->stats.bytes_in += size;
+
+	// always draw the same amount of numbers, so changing one parameter does not change the decisions of the others
+	double r_burst = rng_uniform(&impair->rng);
+	double r_loss = rng_uniform(&impair->rng);
+	double r_jitter = rng_uniform(&impair->rng);
+	double r_reorder = rng_uniform(&impair->rng);
+	double r_duplicate = rng_uniform(&impair->rng);
+
+	double loss = params->loss;
+	if(params->burst_enter > 0.0)
+	{
+		if(impair->burst_bad ? r_burst < params->burst_leave : r_burst < params->burst_enter)
+			impair->burst_bad = !impair->burst_bad;
+		if(impair->burst_bad)
+			loss = params->burst_loss;
+	}
+	if(r_loss < loss)
+	{
+		impair->stats.packets_lost++;
+		if(impair->burst_bad)
+			impair->stats.packets_lost_burst++;
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	uint64_t sent_us = now_us;
+	if(params->rate_kbps)
+	{
+		uint64_t link_start_us = impair->link_free_us > now_us ? impair->link_free_us : now_us;
+		uint64_t backlog_bytes = (link_start_us - now_us) * params->rate_kbps / 8000;
+		if(backlog_bytes + size > params->queue_bytes_max)
+		{
+			impair->stats.packets_dropped_queue++;
+			return CHIAKI_ERR_SUCCESS;
+		}
+		sent_us = link_start_us + (uint64_t)size * 8000 / params->rate_kbps;
+		impair->link_free_us = sent_us;
+	}
+
+	uint64_t release_us = sent_us + (uint64_t)params->delay_ms * 1000
+		+ (uint64_t)(r_jitter * params->jitter_ms * 1000.0);
+	if(release_us < impair->release_last_us)
+		release_us = impair->release_last_us;
+	impair->release_last_us = release_us;
+
+	if(r_reorder < params->reorder)
+	{
+		release_us += (uint64_t)params->reorder_ms * 1000;
+		impair->stats.packets_reordered++;
+	}
+
+	size_t copies = r_duplicate < params->duplicate ? 2 : 1;
+	for(size_t i=0; i<copies; i++)
+	{
+		uint8_t *copy = malloc(size ? size : 1);
+		if(!copy)
+			return CHIAKI_ERR_MEMORY;
+		memcpy(copy, buf, size);
+		ChiakiErrorCode err = heap_push(impair, release_us, copy, size);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			free(copy);
+			return err;
+		}
+	}
+	if(copies > 1)
+		impair->stats.packets_duplicated++;
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT uint64_t chiaki_net_impair_next_us(ChiakiNetImpair *impair)
+{
+	return impair->heap_count ? impair->heap[0].release_us : UINT64_MAX;
+}
+
+CHIAKI_EXPORT bool chiaki_net_impair_pop(ChiakiNetImpair *impair, uint64_t now_us, uint8_t **buf, size_t *size)
+{
+	if(!impair->heap_count || impair->heap[0].release_us > now_us)
+		return false;
+	*buf = impair->heap[0].buf;
+	*size = impair->heap[0].size;
+	heap_pop(impair);
+	impair->stats.packets_out++;
+	impair->stats.bytes_out += *size;
+	return true;
+}
+
+static bool sock_would_block(void)
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+static void proxy_recv(ChiakiNetImpairProxy *proxy, ChiakiNetImpairDir dir, uint8_t *buf)
+{
+	for(size_t i=0; i<PROXY_RECV_BURST_MAX; i++)
+	{
+		int received;
+		if(dir == CHIAKI_NET_IMPAIR_DIR_UP)
+		{
+			struct sockaddr_storage addr;
+			socklen_t addr_len = sizeof(addr);
+			received = (int)recvfrom(proxy->sock_listen, (char *)buf, PROXY_BUF_SIZE, 0, (struct sockaddr *)&addr, &addr_len);
+			if(received >= 0)
+			{
+				if(proxy->client_addr_len != addr_len || memcmp(&proxy->client_addr, &addr, addr_len) != 0)
+					CHIAKI_LOGI(proxy->log, "Net Impair Proxy got packet from new client");
+				memcpy(&proxy->client_addr, &addr, addr_len);
+				proxy->client_addr_len = addr_len;
+			}
+		}
+		else
+			received = (int)recv(proxy->sock_upstream, (char *)buf, PROXY_BUF_SIZE, 0);
+
+		if(received < 0)
+		{
+			if(!sock_would_block())
+				CHIAKI_LOGV(proxy->log, "Net Impair Proxy failed to receive: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+			return;
+		}
+
+		chiaki_mutex_lock(&proxy->mutex);
+		ChiakiErrorCode err = chiaki_net_impair_push(&proxy->impair[dir], buf, (size_t)received, chiaki_time_now_monotonic_us());
+		chiaki_mutex_unlock(&proxy->mutex);
+		if(err != CHIAKI_ERR_SUCCESS)
+			CHIAKI_LOGE(proxy->log, "Net Impair Proxy failed to queue packet");
+	}
+}
+
+static void proxy_send_due(ChiakiNetImpairProxy *proxy, ChiakiNetImpairDir dir)
+{
+	while(true)
+	{
+		uint8_t *buf;
+		size_t size;
+		chiaki_mutex_lock(&proxy->mutex);
+		bool due = chiaki_net_impair_pop(&proxy->impair[dir], chiaki_time_now_monotonic_us(), &buf, &size);
+		chiaki_mutex_unlock(&proxy->mutex);
+		if(!due)
+			return;
+
+		int r;
+		if(dir == CHIAKI_NET_IMPAIR_DIR_UP)
+			r = (int)send(proxy->sock_upstream, (const char *)buf, size, 0);
+		else if(proxy->client_addr_len)
+			r = (int)sendto(proxy->sock_listen, (const char *)buf, size, 0, (struct sockaddr *)&proxy->client_addr, proxy->client_addr_len);
+		else
+			r = 0; // no client yet to send to
+		if(r < 0)
+			CHIAKI_LOGV(proxy->log, "Net Impair Proxy failed to send: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		free(buf);
+	}
+}
+
+static void *proxy_thread_func(void *user)
+{
+	ChiakiNetImpairProxy *proxy = user;
+
+	uint8_t *buf = malloc(PROXY_BUF_SIZE);
+	if(!buf)
+		return NULL;
+
+	while(true)
+	{
+		chiaki_mutex_lock(&proxy->mutex);
+		uint64_t next_us = chiaki_net_impair_next_us(&proxy->impair[CHIAKI_NET_IMPAIR_DIR_UP]);
+		uint64_t next_down_us = chiaki_net_impair_next_us(&proxy->impair[CHIAKI_NET_IMPAIR_DIR_DOWN]);
+		chiaki_mutex_unlock(&proxy->mutex);
+		if(next_down_us < next_us)
+			next_us = next_down_us;
+
+		uint64_t timeout_ms = UINT64_MAX;
+		if(next_us != UINT64_MAX)
+		{
+			uint64_t now_us = chiaki_time_now_monotonic_us();
+			// round up, so we never wake up too early and spin
+			timeout_ms = next_us > now_us ? (next_us - now_us + 999) / 1000 : 0;
+		}
+
+		ChiakiStopPipeSelectFd fds[2] = {
+			{ proxy->sock_listen, false, false },
+			{ proxy->sock_upstream, false, false }
+		};
+		ChiakiErrorCode err = chiaki_stop_pipe_select(&proxy->stop_pipe, fds, 2, timeout_ms);
+		if(err == CHIAKI_ERR_CANCELED)
+			break;
+		if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT)
+		{
+			CHIAKI_LOGE(proxy->log, "Net Impair Proxy failed to select");
+			break;
+		}
+
+		if(fds[0].ready)
+			proxy_recv(proxy, CHIAKI_NET_IMPAIR_DIR_UP, buf);
+		if(fds[1].ready)
+			proxy_recv(proxy, CHIAKI_NET_IMPAIR_DIR_DOWN, buf);
+		proxy_send_due(proxy, CHIAKI_NET_IMPAIR_DIR_UP);
+		proxy_send_due(proxy, CHIAKI_NET_IMPAIR_DIR_DOWN);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_net_impair_proxy_init(ChiakiNetImpairProxy *proxy,
+		const struct sockaddr *listen_addr, socklen_t listen_addr_len,
+		const struct sockaddr *upstream_addr, socklen_t upstream_addr_len,
+		const ChiakiNetImpairParams *params_up, const ChiakiNetImpairParams *params_down,
+		uint64_t seed, ChiakiLog *log)
+{
+	proxy->log = log;
+	proxy->client_addr_len = 0;
+
+	// derive independent streams for both directions from the single seed
+	uint64_t seed_state = seed;
+	chiaki_net_impair_init(&proxy->impair[CHIAKI_NET_IMPAIR_DIR_UP], params_up, rng_next(&seed_state));
+	chiaki_net_impair_init(&proxy->impair[CHIAKI_NET_IMPAIR_DIR_DOWN], params_down, rng_next(&seed_state));
+
+	ChiakiErrorCode err = chiaki_mutex_init(&proxy->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_impair;
+
+	err = chiaki_stop_pipe_init(&proxy->stop_pipe);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = CHIAKI_ERR_NETWORK;
+	proxy->sock_listen = socket(listen_addr->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+	if(CHIAKI_SOCKET_IS_INVALID(proxy->sock_listen))
+	{
+		CHIAKI_LOGE(log, "Net Impair Proxy failed to create listen socket");
+		goto error_stop_pipe;
+	}
+	if(bind(proxy->sock_listen, listen_addr, listen_addr_len) < 0)
+	{
+		CHIAKI_LOGE(log, "Net Impair Proxy failed to bind: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		goto error_sock_listen;
+	}
+
+	proxy->sock_upstream = socket(upstream_addr->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+	if(CHIAKI_SOCKET_IS_INVALID(proxy->sock_upstream))
+	{
+		CHIAKI_LOGE(log, "Net Impair Proxy failed to create upstream socket");
+		goto error_sock_listen;
+	}
+	if(connect(proxy->sock_upstream, upstream_addr, upstream_addr_len) < 0)
+	{
+		CHIAKI_LOGE(log, "Net Impair Proxy failed to connect upstream: " CHIAKI_SOCKET_ERROR_FMT, CHIAKI_SOCKET_ERROR_VALUE);
+		goto error_sock_upstream;
+	}
+
+	if(chiaki_socket_set_nonblock(proxy->sock_listen, true) != CHIAKI_ERR_SUCCESS
+		|| chiaki_socket_set_nonblock(proxy->sock_upstream, true) != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(log, "Net Impair Proxy failed to set sockets to non-blocking");
+		goto error_sock_upstream;
+	}
+
+	err = chiaki_thread_create(&proxy->thread, proxy_thread_func, proxy);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_sock_upstream;
+	chiaki_thread_set_name(&proxy->thread, "Chiaki Net Impair");
+
+	return CHIAKI_ERR_SUCCESS;
+error_sock_upstream:
+	CHIAKI_SOCKET_CLOSE(proxy->sock_upstream);
+error_sock_listen:
+	CHIAKI_SOCKET_CLOSE(proxy->sock_listen);
+error_stop_pipe:
+	chiaki_stop_pipe_fini(&proxy->stop_pipe);
+error_mutex:
+	chiaki_mutex_fini(&proxy->mutex);
+error_impair:
+	chiaki_net_impair_fini(&proxy->impair[CHIAKI_NET_IMPAIR_DIR_UP]);
+	chiaki_net_impair_fini(&proxy->impair[CHIAKI_NET_IMPAIR_DIR_DOWN]);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_net_impair_proxy_fini(ChiakiNetImpairProxy *proxy)
+{
+	chiaki_stop_pipe_stop(&proxy->stop_pipe);
+	chiaki_thread_join(&proxy->thread, NULL);
+	CHIAKI_SOCKET_CLOSE(proxy->sock_upstream);
+	CHIAKI_SOCKET_CLOSE(proxy->sock_listen);
+	chiaki_stop_pipe_fini(&proxy->stop_pipe);
+	chiaki_mutex_fini(&proxy->mutex);
+	chiaki_net_impair_fini(&proxy->impair[CHIAKI_NET_IMPAIR_DIR_UP]);
+	chiaki_net_impair_fini(&proxy->impair[CHIAKI_NET_IMPAIR_DIR_DOWN]);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_net_impair_proxy_get_listen_addr(ChiakiNetImpairProxy *proxy, struct sockaddr *addr, socklen_t *addr_len)
+{
+	if(getsockname(proxy->sock_listen, addr, addr_len) < 0)
+		return CHIAKI_ERR_NETWORK;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT void chiaki_net_impair_proxy_set_params(ChiakiNetImpairProxy *proxy, ChiakiNetImpairDir dir, const ChiakiNetImpairParams *params)
+{
+	chiaki_mutex_lock(&proxy->mutex);
+	proxy->impair[dir].params = *params;
+	chiaki_mutex_unlock(&proxy->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_net_impair_proxy_get_stats(ChiakiNetImpairProxy *proxy, ChiakiNetImpairDir dir, ChiakiNetImpairStats *stats)
+{
+	chiaki_mutex_lock(&proxy->mutex);
+	*stats = proxy->impair[dir].stats;
+	chiaki_mutex_unlock(&proxy->mutex);
+}
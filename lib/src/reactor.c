@@ -0,0 +1,343 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki/reactor.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef __linux__
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#define REACTOR_STOP_DATA UINT64_MAX
+#define REACTOR_SLOTS_INITIAL 16
+
+#ifdef __linux__
+
+static void *reactor_worker_func(void *user);
+
+static uint64_t reactor_slot_data(size_t slot, uint32_t generation)
+{
+	return ((uint64_t)generation << 32) | (uint32_t)slot;
+}
+
+static ChiakiErrorCode reactor_slot_arm(ChiakiReactor *reactor, size_t slot_index, int op)
+{
+	ChiakiReactorSlot *slot = &reactor->slots[slot_index];
+	struct epoll_event event = { 0 };
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.u64 = reactor_slot_data(slot_index, slot->generation);
+	if(epoll_ctl(reactor->epoll_fd, op, slot->fd, &event) < 0)
+	{
+		CHIAKI_LOGE(reactor->log, "Reactor failed to arm fd %d: %s", slot->fd, strerror(errno));
+		return CHIAKI_ERR_UNKNOWN;
+	}
+	return CHIAKI_ERR_SUCCESS;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reactor_init(ChiakiReactor *reactor, ChiakiLog *log, size_t workers_count)
+{
+	if(!workers_count)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	reactor->log = log;
+	reactor->should_stop = false;
+	reactor->slots = NULL;
+	reactor->slots_count = 0;
+	reactor->workers_count = 0;
+
+	ChiakiErrorCode err = chiaki_mutex_init(&reactor->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	err = chiaki_cond_init(&reactor->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(reactor->epoll_fd < 0)
+	{
+		CHIAKI_LOGE(log, "Reactor failed to create epoll fd: %s", strerror(errno));
+		err = CHIAKI_ERR_UNKNOWN;
+		goto error_cond;
+	}
+
+	reactor->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(reactor->stop_fd < 0)
+	{
+		CHIAKI_LOGE(log, "Reactor failed to create eventfd: %s", strerror(errno));
+		err = CHIAKI_ERR_UNKNOWN;
+		goto error_epoll;
+	}
+
+	// level-triggered, so once it is signaled every worker wakes up from it
+	struct epoll_event stop_event = { 0 };
+	stop_event.events = EPOLLIN;
+	stop_event.data.u64 = REACTOR_STOP_DATA;
+	if(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->stop_fd, &stop_event) < 0)
+	{
+		CHIAKI_LOGE(log, "Reactor failed to add eventfd to epoll: %s", strerror(errno));
+		err = CHIAKI_ERR_UNKNOWN;
+		goto error_stop_fd;
+	}
+
+	reactor->workers = calloc(workers_count, sizeof(ChiakiThread));
+	if(!reactor->workers)
+	{
+		err = CHIAKI_ERR_MEMORY;
+		goto error_stop_fd;
+	}
+
+	for(; reactor->workers_count<workers_count; reactor->workers_count++)
+	{
+		err = chiaki_thread_create(&reactor->workers[reactor->workers_count], reactor_worker_func, reactor);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(log, "Reactor failed to create worker thread");
+			goto error_workers;
+		}
+		chiaki_thread_set_name(&reactor->workers[reactor->workers_count], "Chiaki Reactor");
+	}
+
+	CHIAKI_LOGI(log, "Reactor started with %llu workers", (unsigned long long)workers_count);
+	return CHIAKI_ERR_SUCCESS;
+
+error_workers:
+	{
+		uint64_t one = 1;
+		if(write(reactor->stop_fd, &one, sizeof(one)) < 0)
+			CHIAKI_LOGE(log, "Reactor failed to signal eventfd: %s", strerror(errno));
+	}
+	for(size_t i=0; i<reactor->workers_count; i++)
+		chiaki_thread_join(&reactor->workers[i], NULL);
+	free(reactor->workers);
+error_stop_fd:
+	close(reactor->stop_fd);
+error_epoll:
+	close(reactor->epoll_fd);
+error_cond:
+	chiaki_cond_fini(&reactor->cond);
+error_mutex:
+	chiaki_mutex_fini(&reactor->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_reactor_fini(ChiakiReactor *reactor)
+{
+	chiaki_mutex_lock(&reactor->mutex);
+	reactor->should_stop = true;
+	chiaki_mutex_unlock(&reactor->mutex);
+
+	uint64_t one = 1;
+	if(write(reactor->stop_fd, &one, sizeof(one)) < 0)
+		CHIAKI_LOGE(reactor->log, "Reactor failed to signal eventfd: %s", strerror(errno));
+
+	for(size_t i=0; i<reactor->workers_count; i++)
+		chiaki_thread_join(&reactor->workers[i], NULL);
+	free(reactor->workers);
+
+#ifndef NDEBUG
+	for(size_t i=0; i<reactor->slots_count; i++)
+		assert(!reactor->slots[i].active);
+#endif
+	free(reactor->slots);
+
+	close(reactor->stop_fd);
+	close(reactor->epoll_fd);
+	chiaki_cond_fini(&reactor->cond);
+	chiaki_mutex_fini(&reactor->mutex);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reactor_add(ChiakiReactor *reactor, ChiakiReactorSource *source, chiaki_socket_t fd, ChiakiReactorCallback cb, void *user)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&reactor->mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+
+	size_t slot_index = 0;
+	while(slot_index < reactor->slots_count
+		&& (reactor->slots[slot_index].active || reactor->slots[slot_index].running))
+		slot_index++;
+
+	if(slot_index == reactor->slots_count)
+	{
+		size_t slots_count = reactor->slots_count ? reactor->slots_count * 2 : REACTOR_SLOTS_INITIAL;
+		ChiakiReactorSlot *slots = realloc(reactor->slots, slots_count * sizeof(ChiakiReactorSlot));
+		if(!slots)
+		{
+			err = CHIAKI_ERR_MEMORY;
+			goto beach;
+		}
+		memset(slots + reactor->slots_count, 0, (slots_count - reactor->slots_count) * sizeof(ChiakiReactorSlot));
+		reactor->slots = slots;
+		reactor->slots_count = slots_count;
+	}
+
+	ChiakiReactorSlot *slot = &reactor->slots[slot_index];
+	slot->cb = cb;
+	slot->user = user;
+	slot->fd = fd;
+	slot->running = false;
+	slot->detached = false;
+
+	err = reactor_slot_arm(reactor, slot_index, EPOLL_CTL_ADD);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto beach;
+
+	slot->active = true;
+	source->reactor = reactor;
+	source->slot = slot_index;
+
+beach:
+	chiaki_mutex_unlock(&reactor->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_reactor_remove(ChiakiReactorSource *source)
+{
+	ChiakiReactor *reactor = source->reactor;
+	ChiakiErrorCode err = chiaki_mutex_lock(&reactor->mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+
+	ChiakiReactorSlot *slot = &reactor->slots[source->slot];
+	assert(slot->active);
+	slot->active = false;
+	if(!slot->detached && epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, slot->fd, NULL) < 0)
+		CHIAKI_LOGE(reactor->log, "Reactor failed to remove fd %d: %s", slot->fd, strerror(errno));
+
+	// slots may be reallocated while waiting
+	while(reactor->slots[source->slot].running)
+		chiaki_cond_wait(&reactor->cond, &reactor->mutex);
+
+	slot = &reactor->slots[source->slot];
+	slot->generation++;
+	slot->cb = NULL;
+	slot->user = NULL;
+	slot->fd = CHIAKI_INVALID_SOCKET;
+	slot->detached = false;
+
+	chiaki_mutex_unlock(&reactor->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_reactor_detach(ChiakiReactorSource *source)
+{
+	ChiakiReactor *reactor = source->reactor;
+	ChiakiErrorCode err = chiaki_mutex_lock(&reactor->mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+
+	ChiakiReactorSlot *slot = &reactor->slots[source->slot];
+	assert(slot->active && slot->running);
+	if(!slot->detached)
+	{
+		// the fd is disarmed while its callback runs, so no worker can have fetched another event for it
+		slot->detached = true;
+		if(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, slot->fd, NULL) < 0)
+			CHIAKI_LOGE(reactor->log, "Reactor failed to detach fd %d: %s", slot->fd, strerror(errno));
+	}
+
+	chiaki_mutex_unlock(&reactor->mutex);
+}
+
+static void *reactor_worker_func(void *user)
+{
+	ChiakiReactor *reactor = user;
+
+	while(true)
+	{
+		// one event at a time, so a slow callback never holds back events another worker could handle
+		struct epoll_event event;
+		int r = epoll_wait(reactor->epoll_fd, &event, 1, -1);
+		if(r < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			CHIAKI_LOGE(reactor->log, "Reactor epoll_wait failed: %s", strerror(errno));
+			break;
+		}
+		if(r == 0)
+			continue;
+
+		if(event.data.u64 == REACTOR_STOP_DATA)
+			break;
+
+		size_t slot_index = (uint32_t)event.data.u64;
+		uint32_t generation = (uint32_t)(event.data.u64 >> 32);
+
+		chiaki_mutex_lock(&reactor->mutex);
+		if(reactor->should_stop)
+		{
+			chiaki_mutex_unlock(&reactor->mutex);
+			break;
+		}
+
+		ChiakiReactorSlot *slot = slot_index < reactor->slots_count ? &reactor->slots[slot_index] : NULL;
+		if(!slot || !slot->active || slot->generation != generation)
+		{
+			// the source was removed after this event was fetched
+			chiaki_mutex_unlock(&reactor->mutex);
+			continue;
+		}
+		slot->running = true;
+		ChiakiReactorCallback cb = slot->cb;
+		void *cb_user = slot->user;
+		chiaki_mutex_unlock(&reactor->mutex);
+
+		cb(cb_user);
+
+		chiaki_mutex_lock(&reactor->mutex);
+		slot = &reactor->slots[slot_index];
+		slot->running = false;
+		if(!slot->active)
+			chiaki_cond_broadcast(&reactor->cond);
+		else if(!slot->detached)
+			reactor_slot_arm(reactor, slot_index, EPOLL_CTL_MOD);
+		chiaki_mutex_unlock(&reactor->mutex);
+	}
+
+	return NULL;
+}
+
+#else
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reactor_init(ChiakiReactor *reactor, ChiakiLog *log, size_t workers_count)
+{
+	CHIAKI_LOGE(log, "Reactor is not supported on this platform");
+	return CHIAKI_ERR_UNKNOWN;
+}
+
+CHIAKI_EXPORT void chiaki_reactor_fini(ChiakiReactor *reactor)
+{
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reactor_add(ChiakiReactor *reactor, ChiakiReactorSource *source, chiaki_socket_t fd, ChiakiReactorCallback cb, void *user)
+{
+	return CHIAKI_ERR_UNKNOWN;
+}
+
+CHIAKI_EXPORT void chiaki_reactor_remove(ChiakiReactorSource *source)
+{
+}
+
+CHIAKI_EXPORT void chiaki_reactor_detach(ChiakiReactorSource *source)
+{
+}
+
+#endif
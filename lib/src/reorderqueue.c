@@ -28,7 +28,7 @@
 #define IDX_MASK ((1 << queue->size_exp) - 1)
 #define idx(seq_num) ((seq_num) & IDX_MASK)
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init(ChiakiReorderQueue *queue, size_t size_exp,
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init(ChiakiReorderQueue *queue, ChiakiMemAccount *mem, size_t size_exp,
 		uint64_t seq_num_start, ChiakiReorderQueueSeqNumGt seq_num_gt, ChiakiReorderQueueSeqNumLt seq_num_lt, ChiakiReorderQueueSeqNumAdd seq_num_add)
 {
 	queue->size_exp = size_exp;
@@ -40,7 +40,8 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init(ChiakiReorderQueue *queu
 	queue->drop_strategy = CHIAKI_REORDER_QUEUE_DROP_STRATEGY_END;
 	queue->drop_cb = NULL;
 	queue->drop_cb_user = NULL;
-	queue->queue = calloc(1 << size_exp, sizeof(ChiakiReorderQueueEntry));
+	queue->mem = mem;
+	queue->queue = chiaki_mem_calloc(mem, CHIAKI_MEM_TAG_REORDER, (size_t)1 << size_exp, sizeof(ChiakiReorderQueueEntry));
 	if(!queue->queue)
 		return CHIAKI_ERR_MEMORY;
 	return CHIAKI_ERR_SUCCESS;
@@ -51,9 +52,9 @@ static bool seq_num_##bits##_gt(uint64_t a, uint64_t b) { return chiaki_seq_num_
 static bool seq_num_##bits##_lt(uint64_t a, uint64_t b) { return chiaki_seq_num_##bits##_lt((ChiakiSeqNum##bits)a, (ChiakiSeqNum##bits)b); } \
 static uint64_t seq_num_##bits##_add(uint64_t a, uint64_t b) { return (uint64_t)((ChiakiSeqNum##bits)a + (ChiakiSeqNum##bits)b); } \
 \
-CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init_##bits(ChiakiReorderQueue *queue, size_t size_exp, ChiakiSeqNum##bits seq_num_start) \
+CHIAKI_EXPORT ChiakiErrorCode chiaki_reorder_queue_init_##bits(ChiakiReorderQueue *queue, ChiakiMemAccount *mem, size_t size_exp, ChiakiSeqNum##bits seq_num_start) \
 { \
-	return chiaki_reorder_queue_init(queue, size_exp, (uint64_t)seq_num_start, \
+	return chiaki_reorder_queue_init(queue, mem, size_exp, (uint64_t)seq_num_start, \
 			seq_num_##bits##_gt, seq_num_##bits##_lt, seq_num_##bits##_add); \
 }
 
@@ -72,7 +73,7 @@ CHIAKI_EXPORT void chiaki_reorder_queue_fini(ChiakiReorderQueue *queue)
 				queue->drop_cb(seq_num, entry->user, queue->drop_cb_user);
 		}
 	}
-	free(queue->queue);
+	chiaki_mem_free(queue->mem, CHIAKI_MEM_TAG_REORDER, queue->queue, ((size_t)1 << queue->size_exp) * sizeof(ChiakiReorderQueueEntry));
 }
 
 CHIAKI_EXPORT void chiaki_reorder_queue_push(ChiakiReorderQueue *queue, uint64_t seq_num, void *user)
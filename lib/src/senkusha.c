@@ -45,8 +45,32 @@
 #define EXPECT_TIMEOUT_MS 5000
 
 #define SENKUSHA_PING_COUNT_DEFAULT 10
+#define SENKUSHA_PING_COUNT_VALIDATE 3
 #define EXPECT_PONG_TIMEOUT_MS 1000
 
+// once the rtt is known, pongs are only waited for RTT_FACTOR times as long, but at least MIN_MS
+#define SENKUSHA_PONG_TIMEOUT_RTT_FACTOR 4
+#define SENKUSHA_PONG_TIMEOUT_MIN_MS 20
+
+// MTU probes are sent in rounds of SIZES candidates with COPIES packets each to tolerate loss.
+// Inbound, every candidate is an MTU Command to the console, which has only been seen answering them
+// one at a time. It is not known whether it accepts more than one in flight, so inbound rounds only
+// have IN_SIZES candidates.
+#define SENKUSHA_MTU_PROBE_SIZES 8
+#define SENKUSHA_MTU_IN_PROBE_SIZES 1
+#define SENKUSHA_MTU_PROBE_COPIES 2
+#define SENKUSHA_MTU_TIMEOUT_RTT_FACTOR 5
+#define SENKUSHA_MTU_TIMEOUT_MIN_MS 5
+#define SENKUSHA_MTU_TIMEOUT_MAX_MS 500
+#define SENKUSHA_MTU_VALIDATE_ATTEMPTS 2
+
+// cached values are only trusted if the current rtt is below cached * FACTOR + ADD
+#define SENKUSHA_CACHE_RTT_FACTOR 2
+#define SENKUSHA_CACHE_RTT_ADD_US 2000
+
+#define SENKUSHA_MTU_MIN 576
+#define SENKUSHA_MTU_MAX 1454
+
 // Assuming IPv4, sizeof(ip header) + sizeof(udp header)
 #define MTU_UDP_PACKET_ADD 0x1c
 
@@ -62,12 +86,19 @@ typedef enum {
 	STATE_EXPECT_DATA_ACK,
 	STATE_EXPECT_PONG,
 	STATE_EXPECT_MTU,
+	STATE_EXPECT_MTU_PONG,
 	STATE_EXPECT_CLIENT_MTU_COMMAND
 } SenkushaState;
 
 static ChiakiErrorCode senkusha_run_rtt_test(ChiakiSenkusha *senkusha, uint16_t ping_test_index, uint16_t ping_count, uint64_t *rtt_us);
-static ChiakiErrorCode senkusha_run_mtu_in_test(ChiakiSenkusha *senkusha, uint32_t min, uint32_t max, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu);
-static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint32_t mtu_in, uint32_t min, uint32_t max, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu);
+static ChiakiErrorCode senkusha_run_mtu_in_test(ChiakiSenkusha *senkusha, uint32_t min, uint32_t max, uint64_t timeout_ms, uint32_t *mtu);
+static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint32_t mtu_in, uint32_t min, uint32_t max, uint64_t timeout_ms, bool validate, uint32_t *mtu);
+static ChiakiErrorCode senkusha_run_mtu_search(ChiakiSenkusha *senkusha, uint8_t *packet_buf, size_t packet_buf_size, uint32_t min, uint32_t max, uint64_t timeout_ms, uint32_t *mtu);
+static ChiakiErrorCode senkusha_run_mtu_probes(ChiakiSenkusha *senkusha, uint8_t *packet_buf, size_t packet_buf_size, const uint32_t *mtus, size_t mtus_count, uint64_t timeout_ms, bool *success);
+static ChiakiErrorCode senkusha_send_mtu_ping(ChiakiSenkusha *senkusha, uint8_t *packet_buf, size_t packet_buf_size, uint16_t probe_index, ChiakiSenkushaMtuProbe *probe);
+static uint64_t senkusha_mtu_timeout_ms(uint64_t rtt_us);
+static ChiakiErrorCode senkusha_run_validate_cache(ChiakiSenkusha *senkusha, const ChiakiNetworkCache *cache, ChiakiNetworkCache *result, bool *valid);
+static uint64_t senkusha_network_id(ChiakiSenkusha *senkusha);
 static void senkusha_takion_cb(ChiakiTakionEvent *event, void *user);
 static void senkusha_takion_data(ChiakiSenkusha *senkusha, ChiakiTakionMessageDataType data_type, uint8_t *buf, size_t buf_size);
 static void senkusha_takion_data_ack(ChiakiSenkusha *senkusha, ChiakiSeqNum32 seq_num);
@@ -99,6 +130,11 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_init(ChiakiSenkusha *senkusha, Chi
 	senkusha->data_ack_seq_num_expected = 0;
 	senkusha->ping_tag = 0;
 	senkusha->pong_time_us = 0;
+	senkusha->mtu_id = 0;
+	senkusha->mtu_command_id = 0;
+	senkusha->mtu_probes_count = 0;
+	senkusha->mtu_probes_received = 0;
+	senkusha->mtu_probes_max = 0;
 
 	return CHIAKI_ERR_SUCCESS;
 
@@ -120,7 +156,7 @@ static bool state_finished_cond_check(void *user)
 	return senkusha->state_finished || senkusha->should_stop;
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint32_t *mtu_in, uint32_t *mtu_out, uint64_t *rtt_us)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, const ChiakiNetworkCache *cache, ChiakiNetworkCache *result)
 {
 	ChiakiSession *session = senkusha->session;
 	ChiakiErrorCode err;
@@ -156,6 +192,13 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 
 	takion_info.enable_crypt = false;
 	takion_info.protocol_version = 7;
+	takion_info.reactor = NULL; // short-lived and timing sensitive, keep it on its own thread
+	takion_info.timer_service = &senkusha->session->timer_service;
+	takion_info.net_backend = NULL;
+	takion_info.clock = NULL;
+	takion_info.mem = senkusha->session->mem;
+	takion_info.pipeline_crypto_workers = 0;
+	memset(&takion_info.socket_tuning, 0, sizeof(takion_info.socket_tuning));
 
 	takion_info.cb = senkusha_takion_cb;
 	takion_info.cb_user = senkusha;
@@ -217,33 +260,59 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_senkusha_run(ChiakiSenkusha *senkusha, uint
 
 	CHIAKI_LOGI(session->log, "Senkusha successfully received bang");
 
-	err = senkusha_run_rtt_test(senkusha, 0, SENKUSHA_PING_COUNT_DEFAULT, rtt_us);
+	result->valid = false;
+	result->network_id = senkusha_network_id(senkusha);
+
+	if(cache && cache->valid)
+	{
+		if(cache->network_id != result->network_id)
+			CHIAKI_LOGI(senkusha->log, "Senkusha ignoring cached values because the network changed");
+		else
+		{
+			bool valid;
+			err = senkusha_run_validate_cache(senkusha, cache, result, &valid);
+			if(err != CHIAKI_ERR_SUCCESS)
+			{
+				CHIAKI_LOGE(senkusha->log, "Senkusha cache validation failed");
+				goto disconnect;
+			}
+
+			if(valid)
+			{
+				CHIAKI_LOGI(senkusha->log, "Senkusha validated cached values, skipping full test");
+				result->valid = true;
+				goto disconnect;
+			}
+
+			CHIAKI_LOGI(senkusha->log, "Senkusha cached values are outdated, running full test");
+		}
+	}
+
+	err = senkusha_run_rtt_test(senkusha, 0, SENKUSHA_PING_COUNT_DEFAULT, &result->rtt_us);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(senkusha->log, "Senkusha Ping Test failed");
 		goto disconnect;
 	}
 
-	uint64_t mtu_timeout_ms = (*rtt_us * 5) / 1000;
-	if(mtu_timeout_ms < 5)
-		mtu_timeout_ms = 5;
-	if(mtu_timeout_ms > 500)
-		mtu_timeout_ms = 500;
+	uint64_t mtu_timeout_ms = senkusha_mtu_timeout_ms(result->rtt_us);
 
-	err = senkusha_run_mtu_in_test(senkusha, 576, 1454, 3, mtu_timeout_ms, mtu_in);
+	err = senkusha_run_mtu_in_test(senkusha, SENKUSHA_MTU_MIN, SENKUSHA_MTU_MAX, mtu_timeout_ms, &result->mtu_in);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(senkusha->log, "Senkusha MTU in test failed");
 		goto disconnect;
 	}
 
-	err = senkusha_run_mtu_out_test(senkusha, *mtu_in, 576, 1454, 3, mtu_timeout_ms, mtu_out);
+	err = senkusha_run_mtu_out_test(senkusha, result->mtu_in, SENKUSHA_MTU_MIN, SENKUSHA_MTU_MAX, mtu_timeout_ms, false, &result->mtu_out);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(senkusha->log, "Senkusha MTU out test failed");
 		goto disconnect;
 	}
 
+	result->valid = true;
+
 disconnect:
 	CHIAKI_LOGI(session->log, "Senkusha is disconnecting");
 
@@ -313,13 +382,24 @@ static ChiakiErrorCode senkusha_run_rtt_test(ChiakiSenkusha *senkusha, uint16_t
 			return err;
 		}
 
-		err = chiaki_cond_timedwait_pred(&senkusha->state_cond, &senkusha->state_mutex, EXPECT_PONG_TIMEOUT_MS, state_finished_cond_check, senkusha);
+		// no need to wait for a whole second once we know what to expect
+		uint64_t timeout_ms = EXPECT_PONG_TIMEOUT_MS;
+		if(pings_successful)
+		{
+			timeout_ms = (rtt_us_acc / pings_successful) * SENKUSHA_PONG_TIMEOUT_RTT_FACTOR / 1000;
+			if(timeout_ms < SENKUSHA_PONG_TIMEOUT_MIN_MS)
+				timeout_ms = SENKUSHA_PONG_TIMEOUT_MIN_MS;
+			if(timeout_ms > EXPECT_PONG_TIMEOUT_MS)
+				timeout_ms = EXPECT_PONG_TIMEOUT_MS;
+		}
+
+		err = chiaki_cond_timedwait_pred(&senkusha->state_cond, &senkusha->state_mutex, timeout_ms, state_finished_cond_check, senkusha);
 		assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
 
 		if(!senkusha->state_finished)
 		{
 			if(err == CHIAKI_ERR_TIMEOUT)
-				CHIAKI_LOGE(senkusha->log, "Senkusha pong receive timeout");
+				CHIAKI_LOGE(senkusha->log, "Senkusha pong receive timeout after %llu ms", (unsigned long long)timeout_ms);
 
 			if(senkusha->should_stop)
 				return CHIAKI_ERR_CANCELED;
@@ -356,79 +436,271 @@ static ChiakiErrorCode senkusha_run_rtt_test(ChiakiSenkusha *senkusha, uint16_t
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static ChiakiErrorCode senkusha_run_mtu_in_test(ChiakiSenkusha *senkusha, uint32_t min, uint32_t max, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu)
+static ChiakiErrorCode senkusha_run_validate_cache(ChiakiSenkusha *senkusha, const ChiakiNetworkCache *cache, ChiakiNetworkCache *result, bool *valid)
 {
-	CHIAKI_LOGI(senkusha->log, "Senkusha starting MTU in test with min %u, max %u, retries %u, timeout %llu ms",
-			(unsigned int)min, (unsigned int)max, (unsigned int)retries, (unsigned long long)timeout_ms);
+	*valid = false;
+
+	CHIAKI_LOGI(senkusha->log, "Senkusha validating cached MTU in %u, MTU out %u, RTT %.3f ms",
+			(unsigned int)cache->mtu_in, (unsigned int)cache->mtu_out, (float)cache->rtt_us * 0.001f);
+
+	if(cache->mtu_in < SENKUSHA_MTU_MIN || cache->mtu_in > SENKUSHA_MTU_MAX
+		|| cache->mtu_out < SENKUSHA_MTU_MIN || cache->mtu_out > SENKUSHA_MTU_MAX)
+		return CHIAKI_ERR_SUCCESS;
+
+	uint64_t rtt_us;
+	ChiakiErrorCode err = senkusha_run_rtt_test(senkusha, 0, SENKUSHA_PING_COUNT_VALIDATE, &rtt_us);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
 
-	uint32_t cur = max;
-	uint32_t request_id = 0;
-	while(max > min)
+	if(rtt_us > cache->rtt_us * SENKUSHA_CACHE_RTT_FACTOR + SENKUSHA_CACHE_RTT_ADD_US)
 	{
-		bool success = false;
-		for(uint32_t attempt=0; attempt<retries; attempt++)
+		CHIAKI_LOGI(senkusha->log, "Senkusha RTT %.3f ms does not match cached value", (float)rtt_us * 0.001f);
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	uint64_t mtu_timeout_ms = senkusha_mtu_timeout_ms(rtt_us);
+
+	bool success = false;
+	for(unsigned int attempt=0; attempt<SENKUSHA_MTU_VALIDATE_ATTEMPTS && !success; attempt++)
+	{
+		err = senkusha_run_mtu_probes(senkusha, NULL, 0, &cache->mtu_in, 1, mtu_timeout_ms, &success);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+	}
+	if(!success)
+	{
+		CHIAKI_LOGI(senkusha->log, "Senkusha cached MTU in %u does not work anymore", (unsigned int)cache->mtu_in);
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	uint32_t mtu_out;
+	err = senkusha_run_mtu_out_test(senkusha, cache->mtu_in, SENKUSHA_MTU_MIN, cache->mtu_out, mtu_timeout_ms, true, &mtu_out);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	if(mtu_out != cache->mtu_out)
+	{
+		CHIAKI_LOGI(senkusha->log, "Senkusha cached MTU out %u does not work anymore", (unsigned int)cache->mtu_out);
+		return CHIAKI_ERR_SUCCESS;
+	}
+
+	result->mtu_in = cache->mtu_in;
+	result->mtu_out = cache->mtu_out;
+	result->rtt_us = rtt_us;
+	*valid = true;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static uint64_t senkusha_mtu_timeout_ms(uint64_t rtt_us)
+{
+	uint64_t timeout_ms = (rtt_us * SENKUSHA_MTU_TIMEOUT_RTT_FACTOR) / 1000;
+	if(timeout_ms < SENKUSHA_MTU_TIMEOUT_MIN_MS)
+		timeout_ms = SENKUSHA_MTU_TIMEOUT_MIN_MS;
+	if(timeout_ms > SENKUSHA_MTU_TIMEOUT_MAX_MS)
+		timeout_ms = SENKUSHA_MTU_TIMEOUT_MAX_MS;
+	return timeout_ms;
+}
+
+static ChiakiErrorCode senkusha_send_mtu_ping(ChiakiSenkusha *senkusha, uint8_t *packet_buf, size_t packet_buf_size, uint16_t probe_index, ChiakiSenkushaMtuProbe *probe)
+{
+	ChiakiTakionAVPacket av_packet = { 0 };
+	av_packet.codec = 0xff;
+	av_packet.is_video = false;
+	av_packet.frame_index = 0;
+	av_packet.unit_index = probe_index;
+	av_packet.units_in_frame_total = 0x800;
+
+	size_t header_size;
+	ChiakiErrorCode err = chiaki_takion_v7_av_packet_format_header(packet_buf, packet_buf_size, &header_size, &av_packet);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(senkusha->log, "Senkusha failed to format AV Header");
+		return err;
+	}
+	assert(header_size == MTU_AV_PACKET_ADD);
+
+	*((chiaki_unaligned_uint32_t *)(packet_buf + MTU_AV_PACKET_ADD)) = 0;
+	*((chiaki_unaligned_uint32_t *)(packet_buf + MTU_AV_PACKET_ADD + 4)) = htonl(probe->tag);
+
+	for(unsigned int i=0; i<SENKUSHA_MTU_PROBE_COPIES; i++)
+	{
+		err = chiaki_takion_send_raw(&senkusha->takion, packet_buf, probe->mtu - MTU_UDP_PACKET_ADD);
+		if(err != CHIAKI_ERR_SUCCESS)
 		{
-			senkusha->state = STATE_EXPECT_MTU;
-			senkusha->state_finished = false;
-			senkusha->state_failed = false;
-			senkusha->mtu_id = ++request_id;
+			CHIAKI_LOGE(senkusha->log, "Senkusha failed to send ping");
+			return err;
+		}
+	}
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * Send probes for all given MTUs at once and wait for the responses once.
+ *
+ * @param packet_buf if NULL, the MTUs are probed inbound by requesting packets of each size from the server,
+ * otherwise outbound by sending pings from this buffer, which must hold at least the largest MTU - MTU_UDP_PACKET_ADD
+ * @param success array of mtus_count, set to whether the respective MTU was received
+ */
+static ChiakiErrorCode senkusha_run_mtu_probes(ChiakiSenkusha *senkusha, uint8_t *packet_buf, size_t packet_buf_size, const uint32_t *mtus, size_t mtus_count, uint64_t timeout_ms, bool *success)
+{
+	assert(mtus_count > 0 && mtus_count <= CHIAKI_SENKUSHA_MTU_PROBES_MAX);
+	bool out = packet_buf != NULL;
+
+	senkusha->state = out ? STATE_EXPECT_MTU_PONG : STATE_EXPECT_MTU;
+	senkusha->state_finished = false;
+	senkusha->state_failed = false;
+	senkusha->mtu_probes_received = 0;
+	senkusha->mtu_probes_max = 0;
+	for(size_t i=0; i<mtus_count; i++)
+	{
+		ChiakiSenkushaMtuProbe *probe = &senkusha->mtu_probes[i];
+		probe->mtu = mtus[i];
+		probe->tag = out ? chiaki_random_32() : ++senkusha->mtu_command_id;
+		probe->received = false;
+		if(probe->mtu > senkusha->mtu_probes_max)
+			senkusha->mtu_probes_max = probe->mtu;
+	}
+	senkusha->mtu_probes_count = mtus_count;
 
+	ChiakiErrorCode err;
+	for(size_t i=0; i<mtus_count; i++)
+	{
+		ChiakiSenkushaMtuProbe *probe = &senkusha->mtu_probes[i];
+		if(out)
+		{
+			assert(probe->mtu - MTU_UDP_PACKET_ADD <= packet_buf_size);
+			err = senkusha_send_mtu_ping(senkusha, packet_buf, packet_buf_size, (uint16_t)i, probe);
+			if(err != CHIAKI_ERR_SUCCESS)
+				return err;
+		}
+		else
+		{
 			tkproto_SenkushaMtuCommand mtu_cmd;
-			mtu_cmd.id = request_id;
-			mtu_cmd.mtu_req = cur;
-			mtu_cmd.num = 1;
-			ChiakiErrorCode err = senkusha_send_mtu_command(senkusha, &mtu_cmd);
+			mtu_cmd.id = probe->tag;
+			mtu_cmd.mtu_req = probe->mtu;
+			mtu_cmd.num = SENKUSHA_MTU_PROBE_COPIES;
+			err = senkusha_send_mtu_command(senkusha, &mtu_cmd);
 			if(err != CHIAKI_ERR_SUCCESS)
 			{
 				CHIAKI_LOGE(senkusha->log, "Senkusha failed to send MTU command");
 				return err;
 			}
+		}
+	}
 
-			CHIAKI_LOGI(senkusha->log, "Senkusha MTU request %u (min %u, max %u), id %u, attempt %u",
-					(unsigned int)cur, (unsigned int)min, (unsigned int)max, (unsigned int)request_id, (unsigned int)attempt);
+	CHIAKI_LOGI(senkusha->log, "Senkusha sent %llu MTU %s probes from %u to %u",
+			(unsigned long long)mtus_count, out ? "out" : "in",
+			(unsigned int)senkusha->mtu_probes[0].mtu, (unsigned int)senkusha->mtu_probes_max);
 
-			err = chiaki_cond_timedwait_pred(&senkusha->state_cond, &senkusha->state_mutex, timeout_ms, state_finished_cond_check, senkusha);
-			assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
+	err = chiaki_cond_timedwait_pred(&senkusha->state_cond, &senkusha->state_mutex, timeout_ms, state_finished_cond_check, senkusha);
+	assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
 
-			if(!senkusha->state_finished)
+	if(!senkusha->state_finished && senkusha->should_stop)
+		return CHIAKI_ERR_CANCELED;
+
+	for(size_t i=0; i<mtus_count; i++)
+		success[i] = senkusha->mtu_probes[i].received;
+
+	CHIAKI_LOGI(senkusha->log, "Senkusha received %llu of %llu MTU %s probes",
+			(unsigned long long)senkusha->mtu_probes_received, (unsigned long long)mtus_count, out ? "out" : "in");
+
+	return CHIAKI_ERR_SUCCESS;
+}
+
+/**
+ * Narrow down the MTU between min and max by probing up to SENKUSHA_MTU_PROBE_SIZES
+ * (SENKUSHA_MTU_IN_PROBE_SIZES inbound) evenly spaced candidates per round, so a full search only takes a few RTTs.
+ * The first round always includes max, so a path that supports it is done after one round.
+ * With a single candidate per round, the following rounds bisect the remaining range.
+ *
+ * If an inbound round of several MTU Commands gets only one answer, the console may have dropped the others,
+ * so their failure is not trusted and the search continues with one command per round.
+ *
+ * @param packet_buf see senkusha_run_mtu_probes()
+ */
+static ChiakiErrorCode senkusha_run_mtu_search(ChiakiSenkusha *senkusha, uint8_t *packet_buf, size_t packet_buf_size, uint32_t min, uint32_t max, uint64_t timeout_ms, uint32_t *mtu)
+{
+	size_t probes_max = packet_buf ? SENKUSHA_MTU_PROBE_SIZES : SENKUSHA_MTU_IN_PROBE_SIZES;
+	uint32_t good = min - 1; // largest MTU known to work
+	uint32_t bad = max + 1; // smallest MTU known to fail
+	bool first_round = true;
+	while(bad - good > 1)
+	{
+		uint32_t range = bad - good - 1;
+		size_t count = range < probes_max ? range : probes_max;
+		uint32_t candidates[SENKUSHA_MTU_PROBE_SIZES];
+		if(count == 1 && !first_round)
+			candidates[0] = good + (range + 1) / 2;
+		else
+		{
+			for(size_t i=0; i<count; i++)
+				candidates[i] = good + (uint32_t)(((uint64_t)range * (i + 1)) / count);
+		}
+		first_round = false;
+
+		bool success[SENKUSHA_MTU_PROBE_SIZES];
+		ChiakiErrorCode err = senkusha_run_mtu_probes(senkusha, packet_buf, packet_buf_size, candidates, count, timeout_ms, success);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+
+		// a lost probe below a received one is ignored, the larger one proves the path
+		uint32_t round_good = good;
+		size_t received = 0;
+		for(size_t i=0; i<count; i++)
+		{
+			if(success[i])
 			{
-				if(err == CHIAKI_ERR_TIMEOUT)
-				{
-					CHIAKI_LOGI(senkusha->log, "Senkusha MTU %u timeout", (unsigned int)cur);
-					continue;
-				}
-
-				if(senkusha->should_stop)
-					return CHIAKI_ERR_CANCELED;
-				else
-					CHIAKI_LOGE(senkusha->log, "Senkusha failed to receive MTU response");
+				round_good = candidates[i];
+				received++;
 			}
+		}
+		good = round_good;
 
-			CHIAKI_LOGI(senkusha->log, "Senkusha MTU %u success", (unsigned int)cur);
-			success = true;
-			break;
+		if(!packet_buf && count > 1 && received == 1)
+		{
+			CHIAKI_LOGW(senkusha->log, "Senkusha got only one answer to %llu MTU Commands, continuing with one per round",
+					(unsigned long long)count);
+			probes_max = 1;
+			continue;
 		}
 
-		if(success)
-			min = cur + 1;
-		else
-			max = cur - 1;
-		cur = min + (max - min) / 2;
+		for(size_t i=0; i<count; i++)
+		{
+			if(!success[i] && candidates[i] > round_good)
+			{
+				bad = candidates[i];
+				break;
+			}
+		}
 	}
 
-	CHIAKI_LOGI(senkusha->log, "Senkusha determined inbound MTU %u", (unsigned int)max);
-	*mtu = max;
+	*mtu = good < min ? min : good;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode senkusha_run_mtu_in_test(ChiakiSenkusha *senkusha, uint32_t min, uint32_t max, uint64_t timeout_ms, uint32_t *mtu)
+{
+	CHIAKI_LOGI(senkusha->log, "Senkusha starting MTU in test with min %u, max %u, timeout %llu ms",
+			(unsigned int)min, (unsigned int)max, (unsigned long long)timeout_ms);
+
+	ChiakiErrorCode err = senkusha_run_mtu_search(senkusha, NULL, 0, min, max, timeout_ms, mtu);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
 
+	CHIAKI_LOGI(senkusha->log, "Senkusha determined inbound MTU %u", (unsigned int)*mtu);
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint32_t mtu_in, uint32_t min, uint32_t max, uint32_t retries, uint64_t timeout_ms, uint32_t *mtu)
+/**
+ * @param validate if true, only max is probed and *mtu is set to max on success or 0 on failure
+ */
+static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint32_t mtu_in, uint32_t min, uint32_t max, uint64_t timeout_ms, bool validate, uint32_t *mtu)
 {
-	if(min < 8 + MTU_PING_DATA_ADD || max < min || mtu_in < min || mtu_in > max)
+	if(min < 8 + MTU_PING_DATA_ADD || max < min || mtu_in < min)
 		return CHIAKI_ERR_INVALID_DATA;
 
-	CHIAKI_LOGI(senkusha->log, "Senkusha starting MTU out test with min %u, max %u, retries %u, timeout %llu ms",
-				(unsigned int)min, (unsigned int)max, (unsigned int)retries, (unsigned long long)timeout_ms);
+	CHIAKI_LOGI(senkusha->log, "Senkusha starting MTU out test with min %u, max %u, timeout %llu ms%s",
+				(unsigned int)min, (unsigned int)max, (unsigned long long)timeout_ms, validate ? " (validate only)" : "");
 
 	senkusha->state = STATE_EXPECT_CLIENT_MTU_COMMAND;
 	senkusha->state_finished = false;
@@ -478,90 +750,32 @@ static ChiakiErrorCode senkusha_run_mtu_out_test(ChiakiSenkusha *senkusha, uint3
 	for(size_t i=0; i<packet_buf_size - (MTU_AV_PACKET_ADD + 8); i++)
 		packet_buf[i + (MTU_AV_PACKET_ADD + 8)] = padding[i % sizeof(padding)];
 
-	err = CHIAKI_ERR_SUCCESS;
-
-	uint32_t cur = mtu_in;
-	while(max > min)
+	uint32_t result;
+	if(validate)
 	{
 		bool success = false;
-		for(uint32_t attempt=0; attempt<retries; attempt++)
+		for(unsigned int attempt=0; attempt<SENKUSHA_MTU_VALIDATE_ATTEMPTS && !success; attempt++)
 		{
-			uint32_t tag = chiaki_random_32();
-
-			senkusha->state = STATE_EXPECT_PONG;
-			senkusha->state_finished = false;
-			senkusha->state_failed = false;
-			senkusha->ping_tag = tag;
-			senkusha->ping_test_index = 0;
-			senkusha->ping_index = (uint16_t)attempt;
-
-			ChiakiTakionAVPacket av_packet = { 0 };
-			av_packet.codec = 0xff;
-			av_packet.is_video = false;
-			av_packet.frame_index = senkusha->ping_test_index;
-			av_packet.unit_index = senkusha->ping_index;
-			av_packet.units_in_frame_total = 0x800;
-
-			size_t header_size;
-			err = chiaki_takion_v7_av_packet_format_header(packet_buf, packet_buf_size, &header_size, &av_packet);
-			if(err != CHIAKI_ERR_SUCCESS)
-			{
-				CHIAKI_LOGE(senkusha->log, "Senkusha failed to format AV Header");
-				return err;
-			}
-			assert(header_size == MTU_AV_PACKET_ADD);
-
-			*((chiaki_unaligned_uint32_t *)(packet_buf + MTU_AV_PACKET_ADD)) = 0;
-			*((chiaki_unaligned_uint32_t *)(packet_buf + MTU_AV_PACKET_ADD + 4)) = htonl(tag);
-
-			CHIAKI_LOGI(senkusha->log, "Senkusha MTU %u out ping attempt %u", (unsigned int)cur, (unsigned int)attempt);
-
-			err = chiaki_takion_send_raw(&senkusha->takion, packet_buf, cur - MTU_UDP_PACKET_ADD);
+			err = senkusha_run_mtu_probes(senkusha, packet_buf, packet_buf_size, &max, 1, timeout_ms, &success);
 			if(err != CHIAKI_ERR_SUCCESS)
-			{
-				CHIAKI_LOGE(senkusha->log, "Senkusha failed to send ping");
 				goto beach;
-			}
-
-			err = chiaki_cond_timedwait_pred(&senkusha->state_cond, &senkusha->state_mutex, timeout_ms, state_finished_cond_check, senkusha);
-			assert(err == CHIAKI_ERR_SUCCESS || err == CHIAKI_ERR_TIMEOUT);
-
-			if(!senkusha->state_finished)
-			{
-				if(err == CHIAKI_ERR_TIMEOUT)
-				{
-					CHIAKI_LOGI(senkusha->log, "Senkusha MTU pong %u timeout", (unsigned int)cur);
-					continue;
-				}
-
-				if(senkusha->should_stop)
-				{
-					err = CHIAKI_ERR_CANCELED;
-					goto beach;
-				}
-				else
-					CHIAKI_LOGE(senkusha->log, "Senkusha failed to receive MTU pong");
-			}
-
-			CHIAKI_LOGI(senkusha->log, "Senkusha MTU ping %u success", (unsigned int)cur);
-			success = true;
-			break;
 		}
-
-		if(success)
-			min = cur + 1;
-		else
-			max = cur - 1;
-		cur = min + (max - min) / 2;
+		result = success ? max : 0;
+	}
+	else
+	{
+		err = senkusha_run_mtu_search(senkusha, packet_buf, packet_buf_size, min, max, timeout_ms, &result);
+		if(err != CHIAKI_ERR_SUCCESS)
+			goto beach;
+		CHIAKI_LOGI(senkusha->log, "Senkusha determined outbound MTU %u", (unsigned int)result);
 	}
 
-	CHIAKI_LOGI(senkusha->log, "Senkusha determined outbound MTU %u", (unsigned int)max);
-	*mtu = max;
+	*mtu = result;
 
 	CHIAKI_LOGI(senkusha->log, "Senkusha sending final Client MTU Command");
 	client_mtu_cmd.id = 2;
 	client_mtu_cmd.state = false;
-	client_mtu_cmd.mtu_req = max;
+	client_mtu_cmd.mtu_req = result ? result : min;
 	client_mtu_cmd.has_mtu_down = true;
 	client_mtu_cmd.mtu_down = mtu_in;
 	err = senkusha_send_client_mtu_command(senkusha, &client_mtu_cmd, true);
@@ -573,6 +787,49 @@ beach:
 	return err;
 }
 
+static uint64_t senkusha_network_id_update(uint64_t hash, const struct sockaddr *sa)
+{
+	const uint8_t *addr;
+	size_t addr_size;
+	switch(sa->sa_family)
+	{
+		case AF_INET:
+			addr = (const uint8_t *)&((const struct sockaddr_in *)sa)->sin_addr;
+			addr_size = sizeof(((const struct sockaddr_in *)sa)->sin_addr);
+			break;
+		case AF_INET6:
+			addr = (const uint8_t *)&((const struct sockaddr_in6 *)sa)->sin6_addr;
+			addr_size = sizeof(((const struct sockaddr_in6 *)sa)->sin6_addr);
+			break;
+		default:
+			return hash;
+	}
+
+	// FNV-1a over the address only, ports change on every connect
+	for(size_t i=0; i<addr_size; i++)
+	{
+		hash ^= addr[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/**
+ * Identify the path to the host by the remote address and the local address used to reach it.
+ */
+static uint64_t senkusha_network_id(ChiakiSenkusha *senkusha)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	hash = senkusha_network_id_update(hash, senkusha->session->connect_info.host_addrinfo_selected->ai_addr);
+
+	struct sockaddr_storage local_addr;
+	socklen_t local_addr_len = sizeof(local_addr);
+	if(getsockname(senkusha->takion.sock, (struct sockaddr *)&local_addr, &local_addr_len) == 0)
+		hash = senkusha_network_id_update(hash, (struct sockaddr *)&local_addr);
+
+	return hash;
+}
+
 static void senkusha_takion_cb(ChiakiTakionEvent *event, void *user)
 {
 	ChiakiSenkusha *senkusha = user;
@@ -672,6 +929,25 @@ static void senkusha_takion_data_ack(ChiakiSenkusha *senkusha, ChiakiSeqNum32 se
 		chiaki_mutex_unlock(&senkusha->state_mutex);
 }
 
+/**
+ * Must be called with state_mutex locked.
+ */
+static void senkusha_mtu_probe_received(ChiakiSenkusha *senkusha, size_t probe_index)
+{
+	ChiakiSenkushaMtuProbe *probe = &senkusha->mtu_probes[probe_index];
+	if(probe->received)
+		return;
+	probe->received = true;
+	senkusha->mtu_probes_received++;
+
+	// the largest candidate working answers the whole round, no need to wait for the others
+	if(probe->mtu == senkusha->mtu_probes_max || senkusha->mtu_probes_received == senkusha->mtu_probes_count)
+	{
+		senkusha->state_finished = true;
+		chiaki_cond_signal(&senkusha->state_cond);
+	}
+}
+
 static void senkusha_takion_av(ChiakiSenkusha *senkusha, ChiakiTakionAVPacket *packet)
 {
 	uint64_t time_us = chiaki_time_now_monotonic_us();
@@ -691,7 +967,7 @@ static void senkusha_takion_av(ChiakiSenkusha *senkusha, ChiakiTakionAVPacket *p
 			goto beach;
 		}
 
-		uint32_t tag = ntohl(*((uint32_t *)(packet->data + 4)));
+		uint32_t tag = ntohl(*((chiaki_unaligned_uint32_t *)(packet->data + 4)));
 		if(tag != senkusha->ping_tag)
 		{
 			CHIAKI_LOGW(senkusha->log, "Senkusha received Pong with invalid tag");
@@ -710,18 +986,41 @@ static void senkusha_takion_av(ChiakiSenkusha *senkusha, ChiakiTakionAVPacket *p
 		//chiaki_log_hexdump(senkusha->log, CHIAKI_LOG_DEBUG, packet->data, packet->data_size);
 		//CHIAKI_LOGD(senkusha->log, "packet index: %u, frame index: %u, unit index: %u, units in frame: %u", packet->packet_index, packet->frame_index, packet->unit_index, packet->units_in_frame_total);
 
+		// responses are identified by the id of the MTU command they answer
+		size_t probe_index = 0;
+		while(probe_index < senkusha->mtu_probes_count && senkusha->mtu_probes[probe_index].tag != packet->frame_index)
+			probe_index++;
 		if(!packet->is_video
-			|| packet->frame_index != senkusha->mtu_id)
+			|| probe_index == senkusha->mtu_probes_count)
 		{
 			CHIAKI_LOGW(senkusha->log, "Senkusha received invalid MTU response %u, size: %#llx, is video: %d",
 					(unsigned int)packet->frame_index, (unsigned long long)packet->data_size, packet->is_video ? 1 : 0);
 			goto beach;
 		}
 
-		senkusha->state_finished = true;
-		chiaki_mutex_unlock(&senkusha->state_mutex);
-		chiaki_cond_signal(&senkusha->state_cond);
-		return;
+		senkusha_mtu_probe_received(senkusha, probe_index);
+	}
+	else if(senkusha->state == STATE_EXPECT_MTU_PONG)
+	{
+		// pongs are identified by unit index = probe index and the tag
+		if(packet->is_video
+			|| packet->frame_index != 0
+			|| packet->unit_index >= senkusha->mtu_probes_count
+			|| packet->data_size < 8)
+		{
+			CHIAKI_LOGW(senkusha->log, "Senkusha received invalid MTU Pong %u/%u, size: %#llx",
+					(unsigned int)packet->frame_index, (unsigned int)packet->unit_index, (unsigned long long)packet->data_size);
+			goto beach;
+		}
+
+		uint32_t tag = ntohl(*((chiaki_unaligned_uint32_t *)(packet->data + 4)));
+		if(tag != senkusha->mtu_probes[packet->unit_index].tag)
+		{
+			CHIAKI_LOGW(senkusha->log, "Senkusha received MTU Pong with invalid tag");
+			goto beach;
+		}
+
+		senkusha_mtu_probe_received(senkusha, packet->unit_index);
 	}
 
 beach:
@@ -21,6 +21,7 @@
 #include <chiaki/http.h>
 #include <chiaki/base64.h>
 #include <chiaki/random.h>
+#include <chiaki/time.h>
 
 #include <stdlib.h>
 #include <string.h>
@@ -39,6 +40,7 @@
 #endif
 
 #include "utils.h"
+#include "atomic.h"
 
 
 #define SESSION_PORT					9295
@@ -46,6 +48,7 @@
 #define SESSION_EXPECT_TIMEOUT_MS		5000
 
 static void *session_thread_func(void *arg);
+static void *session_prepare_thread_func(void *arg);
 static bool session_thread_request_session(ChiakiSession *session, ChiakiRpVersion *server_version_out);
 
 const char *chiaki_rp_application_reason_string(uint32_t reason)
@@ -166,6 +169,64 @@ CHIAKI_EXPORT const char *chiaki_quit_reason_string(ChiakiQuitReason reason)
 	}
 }
 
+CHIAKI_EXPORT const char *chiaki_startup_phase_string(ChiakiStartupPhase phase)
+{
+	switch(phase)
+	{
+		case CHIAKI_STARTUP_PHASE_SESSION_REQUEST:
+			return "Session Request";
+		case CHIAKI_STARTUP_PHASE_CTRL:
+			return "Ctrl";
+		case CHIAKI_STARTUP_PHASE_SENKUSHA:
+			return "Senkusha";
+		case CHIAKI_STARTUP_PHASE_PREPARE:
+			return "Preparation";
+		case CHIAKI_STARTUP_PHASE_TAKION_CONNECT:
+			return "Takion Connect";
+		case CHIAKI_STARTUP_PHASE_BANG:
+			return "Bang";
+		case CHIAKI_STARTUP_PHASE_STREAMINFO:
+			return "Streaminfo";
+		case CHIAKI_STARTUP_PHASE_FIRST_FRAME:
+			return "First Frame";
+		default:
+			return "Unknown";
+	}
+}
+
+CHIAKI_EXPORT void chiaki_startup_report_log(const ChiakiStartupReport *report, ChiakiLog *log)
+{
+	CHIAKI_LOGI(log, "Startup report:");
+	uint64_t prev_us = 0;
+	for(int i=0; i<CHIAKI_STARTUP_PHASE_COUNT; i++)
+	{
+		uint64_t end_us = report->phase_end_us[i];
+		if(!end_us)
+		{
+			CHIAKI_LOGI(log, "  %-16s not reached", chiaki_startup_phase_string((ChiakiStartupPhase)i));
+			continue;
+		}
+		CHIAKI_LOGI(log, "  %-16s %9.3f ms, done after %9.3f ms", chiaki_startup_phase_string((ChiakiStartupPhase)i),
+				(float)(end_us - prev_us) * 0.001f, (float)end_us * 0.001f);
+		prev_us = end_us;
+	}
+	if(report->pin_wait_us)
+		CHIAKI_LOGI(log, "  Waiting for PIN  %9.3f ms (included in Ctrl)", (float)report->pin_wait_us * 0.001f);
+	CHIAKI_LOGI(log, "  Preparation ran  %9.3f ms in the background", (float)report->prepare_us * 0.001f);
+}
+
+/**
+ * Mark the end of a startup phase.
+ * Must not be called concurrently for the same session, phases up to Senkusha and Preparation are marked
+ * by the session thread, all later ones by the Takion thread.
+ */
+void chiaki_session_startup_mark(ChiakiSession *session, ChiakiStartupPhase phase)
+{
+	uint64_t now_us = chiaki_time_now_monotonic_us();
+	session->startup_report.phase_end_us[phase] = now_us > session->startup_report.start_us ? now_us - session->startup_report.start_us : 1;
+	CHIAKI_LOGV(session->log, "Startup phase %s done", chiaki_startup_phase_string(phase));
+}
+
 
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, ChiakiConnectInfo *connect_info, ChiakiLog *log)
@@ -176,9 +237,13 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	session->quit_reason = CHIAKI_QUIT_REASON_NONE;
 	session->rp_version = CHIAKI_RP_VERSION_9_0;
 
+	session->mem = chiaki_mem_account_new(connect_info->allocator);
+	if(!session->mem)
+		return CHIAKI_ERR_MEMORY;
+
 	ChiakiErrorCode err = chiaki_cond_init(&session->state_cond);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto error;
+		goto error_mem;
 
 	err = chiaki_mutex_init(&session->state_mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -188,6 +253,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	if(err != CHIAKI_ERR_SUCCESS)
 		goto error_state_mutex;
 
+	err = chiaki_timer_service_init(&session->timer_service, session->log);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_stop_pipe;
+
 	session->should_stop = false;
 	session->ctrl_session_id_received = false;
 	session->ctrl_login_pin_requested = false;
@@ -199,7 +268,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(session->log, "StreamConnection init failed");
-		goto error_stop_pipe;
+		goto error_timer_service;
 	}
 
 	int r = getaddrinfo(connect_info->host, NULL, NULL, &session->connect_info.host_addrinfos);
@@ -221,15 +290,23 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_init(ChiakiSession *session, Chiaki
 	memcpy(session->connect_info.did + sizeof(session->connect_info.did) - sizeof(did_suffix), did_suffix, sizeof(did_suffix));
 
 	session->connect_info.video_profile = connect_info->video_profile;
+	session->network_cache = connect_info->network_cache;
+	session->reactor = connect_info->reactor;
+	session->fec_pool = connect_info->fec_pool;
+	session->receive_pipeline_workers = connect_info->receive_pipeline_workers;
+	session->socket_tuning = connect_info->socket_tuning;
 
 	return CHIAKI_ERR_SUCCESS;
+error_timer_service:
+	chiaki_timer_service_fini(&session->timer_service);
 error_stop_pipe:
 	chiaki_stop_pipe_fini(&session->stop_pipe);
 error_state_mutex:
 	chiaki_mutex_fini(&session->state_mutex);
 error_state_cond:
 	chiaki_cond_fini(&session->state_cond);
-error:
+error_mem:
+	chiaki_mem_account_unref(session->mem);
 	return err;
 }
 
@@ -240,10 +317,12 @@ CHIAKI_EXPORT void chiaki_session_fini(ChiakiSession *session)
 	free(session->login_pin);
 	free(session->quit_reason_str);
 	chiaki_stream_connection_fini(&session->stream_connection);
+	chiaki_timer_service_fini(&session->timer_service);
 	chiaki_stop_pipe_fini(&session->stop_pipe);
 	chiaki_cond_fini(&session->state_cond);
 	chiaki_mutex_fini(&session->state_mutex);
 	freeaddrinfo(session->connect_info.host_addrinfos);
+	chiaki_mem_account_unref(session->mem);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_session_start(ChiakiSession *session)
@@ -305,6 +384,25 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_session_set_login_pin(ChiakiSession *sessio
 	return CHIAKI_ERR_SUCCESS;
 }
 
+CHIAKI_EXPORT void chiaki_session_get_stream_stats(ChiakiSession *session, ChiakiStreamStats *stats)
+{
+	ChiakiStreamStats *src = &session->stream_stats;
+	stats->video_frames = chiaki_atomic_load_u64(&src->video_frames);
+	stats->video_bytes = chiaki_atomic_load_u64(&src->video_bytes);
+	stats->video_frames_fec_recovered = chiaki_atomic_load_u64(&src->video_frames_fec_recovered);
+	stats->video_frames_lost = chiaki_atomic_load_u64(&src->video_frames_lost);
+	stats->audio_frames = chiaki_atomic_load_u64(&src->audio_frames);
+	stats->audio_bytes = chiaki_atomic_load_u64(&src->audio_bytes);
+	stats->audio_frames_lost = chiaki_atomic_load_u64(&src->audio_frames_lost);
+	stats->video_frame_jitter_us = chiaki_atomic_load_u64(&src->video_frame_jitter_us);
+	stats->video_frame_spread_us = chiaki_atomic_load_u64(&src->video_frame_spread_us);
+}
+
+CHIAKI_EXPORT void chiaki_session_get_mem_stats(ChiakiSession *session, ChiakiMemStats *stats)
+{
+	chiaki_mem_account_get_stats(session->mem, stats);
+}
+
 void chiaki_session_send_event(ChiakiSession *session, ChiakiEvent *event)
 {
 	if(!session->event_cb)
@@ -351,6 +449,10 @@ static void *session_thread_func(void *arg)
 {
 	ChiakiSession *session = arg;
 	bool success;
+	bool prepare_joined = false;
+
+	memset(&session->startup_report, 0, sizeof(session->startup_report));
+	session->startup_report.start_us = chiaki_time_now_monotonic_us();
 
 	chiaki_mutex_lock(&session->state_mutex);
 
@@ -367,6 +469,15 @@ static void *session_thread_func(void *arg)
 
 	CHECK_STOP(quit);
 
+	// everything that does not depend on the console runs while the handshakes below are in flight
+	ChiakiErrorCode err = chiaki_thread_create(&session->prepare_thread, session_prepare_thread_func, session);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(session->log, "Session failed to start preparation thread");
+		QUIT(quit);
+	}
+	chiaki_thread_set_name(&session->prepare_thread, "Chiaki Session Prepare");
+
 	CHIAKI_LOGI(session->log, "Starting session request");
 
 	ChiakiRpVersion server_rp_version = CHIAKI_RP_VERSION_UNKNOWN;
@@ -380,9 +491,10 @@ static void *session_thread_func(void *arg)
 	}
 
 	if(!success)
-		QUIT(quit);
+		QUIT(quit_prepare);
 
 	CHIAKI_LOGI(session->log, "Session request successful");
+	chiaki_session_startup_mark(session, CHIAKI_STARTUP_PHASE_SESSION_REQUEST);
 
 	chiaki_rpcrypt_init_auth(&session->rpcrypt, session->nonce, session->connect_info.morning);
 
@@ -391,9 +503,9 @@ static void *session_thread_func(void *arg)
 
 	CHIAKI_LOGI(session->log, "Starting ctrl");
 
-	ChiakiErrorCode err = chiaki_ctrl_start(&session->ctrl, session);
+	err = chiaki_ctrl_start(&session->ctrl, session);
 	if(err != CHIAKI_ERR_SUCCESS)
-		QUIT(quit);
+		QUIT(quit_prepare);
 
 	chiaki_cond_timedwait_pred(&session->state_cond, &session->state_mutex, SESSION_EXPECT_TIMEOUT_MS, session_check_state_pred_ctrl_start, session);
 	CHECK_STOP(quit_ctrl);
@@ -418,7 +530,9 @@ static void *session_thread_func(void *arg)
 		chiaki_session_send_event(session, &event);
 		pin_incorrect = true;
 
+		uint64_t pin_wait_start_us = chiaki_time_now_monotonic_us();
 		chiaki_cond_timedwait_pred(&session->state_cond, &session->state_mutex, UINT64_MAX, session_check_state_pred_pin, session);
+		session->startup_report.pin_wait_us += chiaki_time_now_monotonic_us() - pin_wait_start_us;
 		CHECK_STOP(quit_ctrl);
 		if(session->ctrl_failed)
 		{
@@ -449,6 +563,8 @@ ctrl_failed:
 		QUIT(quit_ctrl);
 	}
 
+	chiaki_session_startup_mark(session, CHIAKI_STARTUP_PHASE_CTRL);
+
 #ifdef ENABLE_SENKUSHA
 	CHIAKI_LOGI(session->log, "Starting Senkusha");
 
@@ -457,35 +573,37 @@ ctrl_failed:
 	if(err != CHIAKI_ERR_SUCCESS)
 		QUIT(quit_ctrl);
 
-	err = chiaki_senkusha_run(&senkusha, &session->mtu_in, &session->mtu_out, &session->rtt_us);
+	ChiakiNetworkCache network_result;
+	err = chiaki_senkusha_run(&senkusha, &session->network_cache, &network_result);
 	chiaki_senkusha_fini(&senkusha);
 
 	if(err == CHIAKI_ERR_SUCCESS)
+	{
 		CHIAKI_LOGI(session->log, "Senkusha completed successfully");
+		session->network_cache = network_result;
+		session->mtu_in = network_result.mtu_in;
+		session->mtu_out = network_result.mtu_out;
+		session->rtt_us = network_result.rtt_us;
+	}
 	else if(err == CHIAKI_ERR_CANCELED)
 		QUIT(quit_ctrl);
 	else
 	{
 		CHIAKI_LOGE(session->log, "Senkusha failed, but we still try to connect with fallback values");
+		session->network_cache.valid = false;
 		session->mtu_in = 1454;
 		session->mtu_out = 1454;
 		session->rtt_us = 1000;
 	}
+	chiaki_session_startup_mark(session, CHIAKI_STARTUP_PHASE_SENKUSHA);
 #endif
 
-	err = chiaki_random_bytes_crypt(session->handshake_key, sizeof(session->handshake_key));
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		CHIAKI_LOGE(session->log, "Session failed to generate handshake key");
-		QUIT(quit_ctrl);
-	}
-
-	err = chiaki_ecdh_init(&session->ecdh);
-	if(err != CHIAKI_ERR_SUCCESS)
-	{
-		CHIAKI_LOGE(session->log, "Session failed to initialize ECDH");
+	// the preparation thread does not touch state_mutex, so it can be joined while holding it
+	chiaki_thread_join(&session->prepare_thread, NULL);
+	prepare_joined = true;
+	chiaki_session_startup_mark(session, CHIAKI_STARTUP_PHASE_PREPARE);
+	if(session->prepare_err != CHIAKI_ERR_SUCCESS)
 		QUIT(quit_ctrl);
-	}
 
 	session->audio_receiver = chiaki_audio_receiver_new(session);
 	if(!session->audio_receiver)
@@ -538,6 +656,14 @@ quit_ctrl:
 	chiaki_ctrl_join(&session->ctrl);
 	CHIAKI_LOGI(session->log, "Ctrl stopped");
 
+quit_prepare:
+	if(!prepare_joined)
+	{
+		chiaki_thread_join(&session->prepare_thread, NULL);
+		if(session->prepare_err == CHIAKI_ERR_SUCCESS)
+			chiaki_ecdh_fini(&session->ecdh);
+	}
+
 	ChiakiEvent quit_event;
 quit:
 
@@ -552,6 +678,28 @@ quit:
 #undef QUIT
 }
 
+static void *session_prepare_thread_func(void *arg)
+{
+	ChiakiSession *session = arg;
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+
+	ChiakiErrorCode err = chiaki_random_bytes_crypt(session->handshake_key, sizeof(session->handshake_key));
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(session->log, "Session failed to generate handshake key");
+		goto beach;
+	}
+
+	err = chiaki_ecdh_init(&session->ecdh);
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(session->log, "Session failed to initialize ECDH");
+
+beach:
+	session->prepare_err = err;
+	session->startup_report.prepare_us = chiaki_time_now_monotonic_us() - start_us;
+	return NULL;
+}
+
 
 
 
@@ -0,0 +1,741 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki/simnet.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#endif
+
+#define SOCKET_BASE 0x4000 // keep simulated sockets apart from real ones when debugging
+#define PORT_EPHEMERAL_FIRST 49152
+#define POLL_MS 1 // how often waits check for conditions that are not signaled by the simulation
+
+struct chiaki_sim_net_packet_t
+{
+	ChiakiSimNetPacket *next;
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	size_t size;
+	uint64_t arrived_us;
+	// followed by the data
+};
+
+struct chiaki_sim_net_waiter_t
+{
+	uint64_t deadline_us;
+	ChiakiCond *cond; // waiting in sim_cond_wait_until() if set, else in sim_select()
+	bool notified; // cond is about to be signaled
+	ChiakiStopPipe *stop_pipe;
+	ChiakiStopPipeSelectFd *fds;
+	size_t fds_count;
+	ChiakiSimNetWaiter *next;
+};
+
+#define SIM_FROM_CLOCK(c) ((ChiakiSimNet *)((uint8_t *)(c) - offsetof(ChiakiSimNet, clock)))
+#define SIM_FROM_BACKEND(b) ((ChiakiSimNet *)((uint8_t *)(b) - offsetof(ChiakiSimNet, backend)))
+
+static void waiter_add(ChiakiSimNet *sim, ChiakiSimNetWaiter *waiter)
+{
+	waiter->next = sim->waiters;
+	sim->waiters = waiter;
+	chiaki_cond_signal(&sim->driver_cond);
+}
+
+static void waiter_remove(ChiakiSimNet *sim, ChiakiSimNetWaiter *waiter)
+{
+	for(ChiakiSimNetWaiter **w = &sim->waiters; *w; w = &(*w)->next)
+	{
+		if(*w == waiter)
+		{
+			*w = waiter->next;
+			break;
+		}
+	}
+}
+
+static ChiakiSimNetSocket *sim_socket(ChiakiSimNet *sim, chiaki_socket_t sock)
+{
+	if(CHIAKI_SOCKET_IS_INVALID(sock) || sock < SOCKET_BASE || sock >= SOCKET_BASE + CHIAKI_SIM_NET_SOCKETS_MAX)
+		return NULL;
+	ChiakiSimNetSocket *s = &sim->sockets[sock - SOCKET_BASE];
+	return s->used ? s : NULL;
+}
+
+static uint16_t addr_port(const struct sockaddr *addr)
+{
+	if(addr->sa_family == AF_INET6)
+		return ntohs(((const struct sockaddr_in6 *)addr)->sin6_port);
+	return ntohs(((const struct sockaddr_in *)addr)->sin_port);
+}
+
+static bool addr_is_any(const struct sockaddr *addr)
+{
+	if(addr->sa_family == AF_INET6)
+	{
+		static const uint8_t any[16] = { 0 };
+		return memcmp(&((const struct sockaddr_in6 *)addr)->sin6_addr, any, sizeof(any)) == 0;
+	}
+	return ((const struct sockaddr_in *)addr)->sin_addr.s_addr == htonl(INADDR_ANY);
+}
+
+static bool addr_host_equal(const struct sockaddr *a, const struct sockaddr *b)
+{
+	if(a->sa_family != b->sa_family)
+		return false;
+	if(a->sa_family == AF_INET6)
+		return memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr, &((const struct sockaddr_in6 *)b)->sin6_addr, 16) == 0;
+	return ((const struct sockaddr_in *)a)->sin_addr.s_addr == ((const struct sockaddr_in *)b)->sin_addr.s_addr;
+}
+
+/**
+ * Find the bound socket that receives packets sent to addr
+ */
+static ChiakiSimNetSocket *sim_socket_find(ChiakiSimNet *sim, const struct sockaddr *addr)
+{
+	ChiakiSimNetSocket *wildcard = NULL;
+	for(size_t i=0; i<CHIAKI_SIM_NET_SOCKETS_MAX; i++)
+	{
+		ChiakiSimNetSocket *s = &sim->sockets[i];
+		if(!s->used || !s->addr_len || s->family != addr->sa_family)
+			continue;
+		const struct sockaddr *bound = (const struct sockaddr *)&s->addr;
+		if(addr_port(bound) != addr_port(addr))
+			continue;
+		if(addr_host_equal(bound, addr))
+			return s;
+		if(addr_is_any(bound))
+			wildcard = s;
+	}
+	return wildcard;
+}
+
+static int sim_socket_bind(ChiakiSimNet *sim, ChiakiSimNetSocket *s, const struct sockaddr *addr, socklen_t addr_len)
+{
+	if(s->addr_len || addr->sa_family != s->family || addr_len > sizeof(s->addr))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct sockaddr_storage bound;
+	memset(&bound, 0, sizeof(bound));
+	memcpy(&bound, addr, addr_len);
+	if(!addr_port(addr))
+	{
+		// pick an ephemeral port that is not in use yet
+		for(size_t tries=0; tries<UINT16_MAX; tries++)
+		{
+			uint16_t port = sim->port_next++;
+			if(sim->port_next < PORT_EPHEMERAL_FIRST)
+				sim->port_next = PORT_EPHEMERAL_FIRST;
+			if(bound.ss_family == AF_INET6)
+				((struct sockaddr_in6 *)&bound)->sin6_port = htons(port);
+			else
+				((struct sockaddr_in *)&bound)->sin_port = htons(port);
+			if(!sim_socket_find(sim, (struct sockaddr *)&bound))
+				break;
+		}
+	}
+	else
+	{
+		ChiakiSimNetSocket *other = sim_socket_find(sim, addr);
+		if(other && addr_host_equal((struct sockaddr *)&other->addr, addr))
+		{
+			errno = EADDRINUSE;
+			return -1;
+		}
+	}
+
+	s->addr = bound;
+	s->addr_len = addr_len;
+	return 0;
+}
+
+static int sim_socket_bind_any(ChiakiSimNet *sim, ChiakiSimNetSocket *s)
+{
+	if(s->addr_len)
+		return 0;
+	struct sockaddr_storage any;
+	memset(&any, 0, sizeof(any));
+	any.ss_family = (sa_family_t)s->family;
+	return sim_socket_bind(sim, s, (struct sockaddr *)&any,
+			s->family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+}
+
+static void sim_socket_deliver_due(ChiakiSimNet *sim, ChiakiSimNetSocket *s)
+{
+	uint8_t *buf;
+	size_t size;
+	while(chiaki_net_impair_pop(&s->impair, sim->now_us, &buf, &size))
+	{
+		// the impairment carries whole packets including the header with the sender's address
+		ChiakiSimNetPacket *packet = (ChiakiSimNetPacket *)buf;
+		packet->next = NULL;
+		packet->arrived_us = sim->now_us;
+		if(s->rx_tail)
+			s->rx_tail->next = packet;
+		else
+			s->rx_head = packet;
+		s->rx_tail = packet;
+	}
+}
+
+static bool sim_fd_ready(ChiakiSimNet *sim, const ChiakiStopPipeSelectFd *fd)
+{
+	ChiakiSimNetSocket *s = sim_socket(sim, fd->fd);
+	return !s || fd->write || s->rx_head; // errors show up on the following call
+}
+
+/**
+ * Whether the waiter's thread cannot continue before time advances
+ */
+static bool waiter_blocked(ChiakiSimNet *sim, ChiakiSimNetWaiter *waiter)
+{
+	if(sim->now_us >= waiter->deadline_us)
+		return false;
+	if(waiter->cond)
+		return !waiter->notified;
+	// the stop pipe is not part of the simulation, so it is polled
+	if(waiter->stop_pipe && chiaki_stop_pipe_select(waiter->stop_pipe, NULL, 0, 0) == CHIAKI_ERR_CANCELED)
+		return false;
+	for(size_t i=0; i<waiter->fds_count; i++)
+	{
+		if(sim_fd_ready(sim, &waiter->fds[i]))
+			return false;
+	}
+	return true;
+}
+
+static uint64_t sim_now_us(ChiakiClock *clock)
+{
+	ChiakiSimNet *sim = SIM_FROM_CLOCK(clock);
+	chiaki_mutex_lock(&sim->mutex);
+	uint64_t r = sim->now_us;
+	chiaki_mutex_unlock(&sim->mutex);
+	return r;
+}
+
+static ChiakiErrorCode sim_cond_wait_until(ChiakiClock *clock, ChiakiCond *cond, ChiakiMutex *mutex, uint64_t deadline_us)
+{
+	ChiakiSimNet *sim = SIM_FROM_CLOCK(clock);
+	ChiakiSimNetWaiter waiter = { 0 };
+	waiter.deadline_us = deadline_us;
+	waiter.cond = cond;
+
+	chiaki_mutex_lock(&sim->mutex);
+	if(sim->now_us >= deadline_us)
+	{
+		chiaki_mutex_unlock(&sim->mutex);
+		return CHIAKI_ERR_TIMEOUT;
+	}
+	waiter_add(sim, &waiter);
+	chiaki_mutex_unlock(&sim->mutex);
+
+	ChiakiErrorCode err;
+	while(true)
+	{
+		// cond is signaled by the user or broadcast by chiaki_sim_net_run() once the deadline has passed
+		err = chiaki_cond_timedwait(cond, mutex, POLL_MS);
+		if(err != CHIAKI_ERR_TIMEOUT)
+			break;
+		chiaki_mutex_lock(&sim->mutex);
+		bool expired = sim->now_us >= deadline_us;
+		bool notified = waiter.notified;
+		chiaki_mutex_unlock(&sim->mutex);
+		if(notified)
+		{
+			// the signal went to another thread waiting on the same cond, wake up spuriously
+			// instead of counting as running forever
+			err = CHIAKI_ERR_SUCCESS;
+			break;
+		}
+		if(expired)
+			break;
+	}
+
+	chiaki_mutex_lock(&sim->mutex);
+	waiter_remove(sim, &waiter);
+	chiaki_mutex_unlock(&sim->mutex);
+	return err;
+}
+
+static void sim_cond_notify(ChiakiClock *clock, ChiakiCond *cond)
+{
+	ChiakiSimNet *sim = SIM_FROM_CLOCK(clock);
+	chiaki_mutex_lock(&sim->mutex);
+	for(ChiakiSimNetWaiter *waiter = sim->waiters; waiter; waiter = waiter->next)
+	{
+		if(waiter->cond == cond)
+			waiter->notified = true;
+	}
+	chiaki_mutex_unlock(&sim->mutex);
+}
+
+static void sim_thread_add(ChiakiClock *clock)
+{
+	ChiakiSimNet *sim = SIM_FROM_CLOCK(clock);
+	chiaki_mutex_lock(&sim->mutex);
+	sim->threads++;
+	chiaki_mutex_unlock(&sim->mutex);
+}
+
+static void sim_thread_remove(ChiakiClock *clock)
+{
+	ChiakiSimNet *sim = SIM_FROM_CLOCK(clock);
+	chiaki_mutex_lock(&sim->mutex);
+	sim->threads--;
+	chiaki_cond_signal(&sim->driver_cond);
+	chiaki_mutex_unlock(&sim->mutex);
+}
+
+static chiaki_socket_t sim_socket_create(ChiakiNetBackend *backend, int family, int type, int protocol)
+{
+	ChiakiSimNet *sim = SIM_FROM_BACKEND(backend);
+	if(type != SOCK_DGRAM || (family != AF_INET && family != AF_INET6))
+	{
+		errno = EPROTONOSUPPORT;
+		return CHIAKI_INVALID_SOCKET;
+	}
+
+	chiaki_mutex_lock(&sim->mutex);
+	chiaki_socket_t r = CHIAKI_INVALID_SOCKET;
+	for(size_t i=0; i<CHIAKI_SIM_NET_SOCKETS_MAX; i++)
+	{
+		ChiakiSimNetSocket *s = &sim->sockets[i];
+		if(s->used)
+			continue;
+		memset(s, 0, sizeof(*s));
+		s->used = true;
+		s->family = family;
+		// every socket gets its own stream of decisions, independent of creation time
+		chiaki_net_impair_init(&s->impair, &sim->impair_default, sim->seed ^ ((uint64_t)(i + 1) * 0x9e3779b97f4a7c15ull));
+		r = (chiaki_socket_t)(SOCKET_BASE + i);
+		break;
+	}
+	if(CHIAKI_SOCKET_IS_INVALID(r))
+		errno = EMFILE;
+	chiaki_mutex_unlock(&sim->mutex);
+	return r;
+}
+
+static int sim_close(ChiakiNetBackend *backend, chiaki_socket_t sock)
+{
+	ChiakiSimNet *sim = SIM_FROM_BACKEND(backend);
+	chiaki_mutex_lock(&sim->mutex);
+	ChiakiSimNetSocket *s = sim_socket(sim, sock);
+	if(!s)
+	{
+		chiaki_mutex_unlock(&sim->mutex);
+		errno = EBADF;
+		return -1;
+	}
+	while(s->rx_head)
+	{
+		ChiakiSimNetPacket *packet = s->rx_head;
+		s->rx_head = packet->next;
+		free(packet);
+	}
+	chiaki_net_impair_fini(&s->impair);
+	s->used = false;
+	chiaki_cond_broadcast(&sim->cond);
+	chiaki_mutex_unlock(&sim->mutex);
+	return 0;
+}
+
+static int sim_setsockopt(ChiakiNetBackend *backend, chiaki_socket_t sock, int level, int name, const void *val, socklen_t val_len)
+{
+	// options like buffer sizes and don't fragment have no meaning here
+	return 0;
+}
+
+static int sim_bind(ChiakiNetBackend *backend, chiaki_socket_t sock, const struct sockaddr *addr, socklen_t addr_len)
+{
+	ChiakiSimNet *sim = SIM_FROM_BACKEND(backend);
+	chiaki_mutex_lock(&sim->mutex);
+	ChiakiSimNetSocket *s = sim_socket(sim, sock);
+	int r;
+	if(!s)
+	{
+		errno = EBADF;
+		r = -1;
+	}
+	else
+		r = sim_socket_bind(sim, s, addr, addr_len);
+	chiaki_mutex_unlock(&sim->mutex);
+	return r;
+}
+
+static int sim_connect(ChiakiNetBackend *backend, chiaki_socket_t sock, const struct sockaddr *addr, socklen_t addr_len)
+{
+	ChiakiSimNet *sim = SIM_FROM_BACKEND(backend);
+	chiaki_mutex_lock(&sim->mutex);
+	ChiakiSimNetSocket *s = sim_socket(sim, sock);
+	int r = -1;
+	if(!s)
+		errno = EBADF;
+	else if(addr->sa_family != s->family || addr_len > sizeof(s->peer))
+		errno = EINVAL;
+	else if(sim_socket_bind_any(sim, s) == 0)
+	{
+		memcpy(&s->peer, addr, addr_len);
+		s->peer_len = addr_len;
+		r = 0;
+	}
+	chiaki_mutex_unlock(&sim->mutex);
+	return r;
+}
+
+static int sim_sendto_locked(ChiakiSimNet *sim, ChiakiSimNetSocket *s, const uint8_t *buf, size_t buf_size, const struct sockaddr *addr)
+{
+	if(sim_socket_bind_any(sim, s) < 0)
+		return -1;
+
+	ChiakiSimNetSocket *dst = sim_socket_find(sim, addr);
+	if(!dst)
+		return (int)buf_size; // nobody listening, lost like on a real network
+
+	ChiakiSimNetPacket *packet = malloc(sizeof(ChiakiSimNetPacket) + buf_size);
+	if(!packet)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+	packet->next = NULL;
+	packet->from = s->addr;
+	packet->from_len = s->addr_len;
+	packet->size = buf_size;
+	memcpy(packet + 1, buf, buf_size);
+
+	ChiakiErrorCode err = chiaki_net_impair_push(&dst->impair, (uint8_t *)packet, sizeof(ChiakiSimNetPacket) + buf_size, sim->now_us);
+	free(packet);
+	if(err != CHIAKI_ERR_SUCCESS)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	// without delay, the packet arrives right away instead of with the next step
+	sim_socket_deliver_due(sim, dst);
+	if(dst->rx_head)
+		chiaki_cond_broadcast(&sim->cond);
+	return (int)buf_size;
+}
+
+static int sim_send(ChiakiNetBackend *backend, chiaki_socket_t sock, const uint8_t *buf, size_t buf_size)
+{
+	ChiakiSimNet *sim = SIM_FROM_BACKEND(backend);
+	chiaki_mutex_lock(&sim->mutex);
+	ChiakiSimNetSocket *s = sim_socket(sim, sock);
+	int r = -1;
+	if(!s)
+		errno = EBADF;
+	else if(!s->peer_len)
+		errno = ENOTCONN;
+	else
+		r = sim_sendto_locked(sim, s, buf, buf_size, (struct sockaddr *)&s->peer);
+	chiaki_mutex_unlock(&sim->mutex);
+	return r;
+}
+
+static int sim_sendto(ChiakiNetBackend *backend, chiaki_socket_t sock, const uint8_t *buf, size_t buf_size, const struct sockaddr *addr, socklen_t addr_len)
+{
+	ChiakiSimNet *sim = SIM_FROM_BACKEND(backend);
+	chiaki_mutex_lock(&sim->mutex);
+	ChiakiSimNetSocket *s = sim_socket(sim, sock);
+	int r = -1;
+	if(!s)
+		errno = EBADF;
+	else if(addr->sa_family != s->family)
+		errno = EINVAL;
+	else
+		r = sim_sendto_locked(sim, s, buf, buf_size, addr);
+	chiaki_mutex_unlock(&sim->mutex);
+	return r;
+}
+
+static int sim_recv_packet(ChiakiNetBackend *backend, chiaki_socket_t sock, uint8_t *buf, size_t buf_size, struct sockaddr *addr, socklen_t *addr_len, uint64_t *arrived_us)
+{
+	ChiakiSimNet *sim = SIM_FROM_BACKEND(backend);
+	chiaki_mutex_lock(&sim->mutex);
+	ChiakiSimNetSocket *s = sim_socket(sim, sock);
+	int r = -1;
+	if(!s)
+		errno = EBADF;
+	else if(!s->rx_head)
+		errno = EAGAIN; // never blocks, select first
+	else
+	{
+		ChiakiSimNetPacket *packet = s->rx_head;
+		s->rx_head = packet->next;
+		if(!s->rx_head)
+			s->rx_tail = NULL;
+		size_t size = packet->size < buf_size ? packet->size : buf_size;
+		memcpy(buf, packet + 1, size);
+		if(addr && addr_len)
+		{
+			socklen_t len = *addr_len < packet->from_len ? *addr_len : packet->from_len;
+			memcpy(addr, &packet->from, len);
+			*addr_len = packet->from_len;
+		}
+		if(arrived_us)
+			*arrived_us = packet->arrived_us;
+		free(packet);
+		r = (int)size;
+	}
+	chiaki_mutex_unlock(&sim->mutex);
+	return r;
+}
+
+static int sim_recvfrom(ChiakiNetBackend *backend, chiaki_socket_t sock, uint8_t *buf, size_t buf_size, struct sockaddr *addr, socklen_t *addr_len)
+{
+	return sim_recv_packet(backend, sock, buf, buf_size, addr, addr_len, NULL);
+}
+
+static int sim_recv(ChiakiNetBackend *backend, chiaki_socket_t sock, uint8_t *buf, size_t buf_size)
+{
+	return sim_recv_packet(backend, sock, buf, buf_size, NULL, NULL, NULL);
+}
+
+static int sim_recv_timestamp(ChiakiNetBackend *backend, chiaki_socket_t sock, uint8_t *buf, size_t buf_size, uint64_t *timestamp_us)
+{
+	// arrival times are always known here
+	*timestamp_us = 0;
+	return sim_recv_packet(backend, sock, buf, buf_size, NULL, NULL, timestamp_us);
+}
+
+static int sim_enable_rx_timestamps(ChiakiNetBackend *backend, chiaki_socket_t sock)
+{
+	return 0;
+}
+
+static ChiakiErrorCode sim_select(ChiakiNetBackend *backend, ChiakiStopPipe *stop_pipe, ChiakiStopPipeSelectFd *fds, size_t fds_count, uint64_t timeout_ms)
+{
+	ChiakiSimNet *sim = SIM_FROM_BACKEND(backend);
+	ChiakiSimNetWaiter waiter = { 0 };
+	waiter.stop_pipe = stop_pipe;
+	waiter.fds = fds;
+	waiter.fds_count = fds_count;
+	ChiakiErrorCode err;
+
+	chiaki_mutex_lock(&sim->mutex);
+	waiter.deadline_us = timeout_ms == UINT64_MAX ? UINT64_MAX : sim->now_us + timeout_ms * 1000;
+	waiter_add(sim, &waiter);
+	while(true)
+	{
+		// the stop pipe is not part of the simulation, so it is polled
+		if(stop_pipe && chiaki_stop_pipe_select(stop_pipe, NULL, 0, 0) == CHIAKI_ERR_CANCELED)
+		{
+			err = CHIAKI_ERR_CANCELED;
+			break;
+		}
+
+		bool ready = false;
+		for(size_t i=0; i<fds_count; i++)
+		{
+			fds[i].ready = sim_fd_ready(sim, &fds[i]);
+			ready = ready || fds[i].ready;
+		}
+		if(ready)
+		{
+			err = CHIAKI_ERR_SUCCESS;
+			break;
+		}
+
+		if(sim->now_us >= waiter.deadline_us)
+		{
+			err = CHIAKI_ERR_TIMEOUT;
+			break;
+		}
+
+		chiaki_cond_timedwait(&sim->cond, &sim->mutex, POLL_MS);
+	}
+	waiter_remove(sim, &waiter);
+	chiaki_mutex_unlock(&sim->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_sim_net_init(ChiakiSimNet *sim, uint64_t seed)
+{
+	memset(sim, 0, sizeof(*sim));
+	sim->clock.now_us = sim_now_us;
+	sim->clock.cond_wait_until = sim_cond_wait_until;
+	sim->clock.cond_notify = sim_cond_notify;
+	sim->clock.thread_add = sim_thread_add;
+	sim->clock.thread_remove = sim_thread_remove;
+	sim->backend.socket = sim_socket_create;
+	sim->backend.close = sim_close;
+	sim->backend.setsockopt = sim_setsockopt;
+	sim->backend.bind = sim_bind;
+	sim->backend.connect = sim_connect;
+	sim->backend.send = sim_send;
+	sim->backend.sendto = sim_sendto;
+	sim->backend.recv = sim_recv;
+	sim->backend.recvfrom = sim_recvfrom;
+	sim->backend.recv_timestamp = sim_recv_timestamp;
+	sim->backend.enable_rx_timestamps = sim_enable_rx_timestamps;
+	sim->backend.select = sim_select;
+	sim->backend.caps = 0; // sockets only exist in memory
+
+	sim->now_us = CHIAKI_SIM_NET_TIME_START_US;
+	sim->seed = seed;
+	sim->port_next = PORT_EPHEMERAL_FIRST;
+	chiaki_net_impair_params_default(&sim->impair_default);
+
+	ChiakiErrorCode err = chiaki_mutex_init(&sim->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+	err = chiaki_cond_init(&sim->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+	err = chiaki_cond_init(&sim->driver_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+	return CHIAKI_ERR_SUCCESS;
+
+error_cond:
+	chiaki_cond_fini(&sim->cond);
+error_mutex:
+	chiaki_mutex_fini(&sim->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_sim_net_fini(ChiakiSimNet *sim)
+{
+	for(size_t i=0; i<CHIAKI_SIM_NET_SOCKETS_MAX; i++)
+	{
+		if(sim->sockets[i].used)
+			sim_close(&sim->backend, (chiaki_socket_t)(SOCKET_BASE + i));
+	}
+	chiaki_cond_fini(&sim->driver_cond);
+	chiaki_cond_fini(&sim->cond);
+	chiaki_mutex_fini(&sim->mutex);
+}
+
+CHIAKI_EXPORT uint64_t chiaki_sim_net_now_us(ChiakiSimNet *sim)
+{
+	return sim_now_us(&sim->clock);
+}
+
+CHIAKI_EXPORT void chiaki_sim_net_set_impair_default(ChiakiSimNet *sim, const ChiakiNetImpairParams *params)
+{
+	chiaki_mutex_lock(&sim->mutex);
+	sim->impair_default = *params;
+	chiaki_mutex_unlock(&sim->mutex);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_sim_net_set_impair(ChiakiSimNet *sim, const struct sockaddr *addr, socklen_t addr_len, const ChiakiNetImpairParams *params)
+{
+	chiaki_mutex_lock(&sim->mutex);
+	ChiakiSimNetSocket *s = sim_socket_find(sim, addr);
+	if(s)
+		s->impair.params = *params;
+	chiaki_mutex_unlock(&sim->mutex);
+	return s ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_INVALID_DATA;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_sim_net_get_impair_stats(ChiakiSimNet *sim, const struct sockaddr *addr, socklen_t addr_len, ChiakiNetImpairStats *stats)
+{
+	chiaki_mutex_lock(&sim->mutex);
+	ChiakiSimNetSocket *s = sim_socket_find(sim, addr);
+	if(s)
+		*stats = s->impair.stats;
+	chiaki_mutex_unlock(&sim->mutex);
+	return s ? CHIAKI_ERR_SUCCESS : CHIAKI_ERR_INVALID_DATA;
+}
+
+static size_t sim_blocked_count(ChiakiSimNet *sim)
+{
+	size_t r = 0;
+	for(ChiakiSimNetWaiter *waiter = sim->waiters; waiter; waiter = waiter->next)
+	{
+		if(waiter_blocked(sim, waiter))
+			r++;
+	}
+	return r;
+}
+
+/**
+ * Wait until every registered thread is blocked inside the simulation, so nothing can happen anymore before time advances.
+ */
+static void sim_settle(ChiakiSimNet *sim)
+{
+	// waiter_add() and sim_thread_remove() signal driver_cond, the timeout is only for stop pipes
+	while(sim_blocked_count(sim) < sim->threads)
+		chiaki_cond_timedwait(&sim->driver_cond, &sim->mutex, POLL_MS);
+}
+
+static void sim_wake(ChiakiSimNet *sim)
+{
+	chiaki_cond_broadcast(&sim->cond);
+	for(ChiakiSimNetWaiter *waiter = sim->waiters; waiter; waiter = waiter->next)
+	{
+		// the waiter is still inside sim_cond_wait_until(), so its cond is valid
+		if(waiter->cond && waiter->deadline_us <= sim->now_us)
+			chiaki_cond_broadcast(waiter->cond);
+	}
+}
+
+CHIAKI_EXPORT void chiaki_sim_net_run(ChiakiSimNet *sim, uint64_t until_us)
+{
+	chiaki_mutex_lock(&sim->mutex);
+	while(true)
+	{
+		sim_settle(sim);
+
+		uint64_t next_us = UINT64_MAX;
+		for(ChiakiSimNetWaiter *waiter = sim->waiters; waiter; waiter = waiter->next)
+		{
+			if(waiter->deadline_us < next_us)
+				next_us = waiter->deadline_us;
+		}
+		for(size_t i=0; i<CHIAKI_SIM_NET_SOCKETS_MAX; i++)
+		{
+			if(!sim->sockets[i].used)
+				continue;
+			uint64_t packet_us = chiaki_net_impair_next_us(&sim->sockets[i].impair);
+			if(packet_us < next_us)
+				next_us = packet_us;
+		}
+
+		if(next_us > until_us)
+		{
+			if(sim->now_us < until_us)
+				sim->now_us = until_us;
+			sim_wake(sim);
+			sim_settle(sim); // let everything due at until_us run before returning
+			break;
+		}
+
+		if(next_us > sim->now_us)
+			sim->now_us = next_us;
+		for(size_t i=0; i<CHIAKI_SIM_NET_SOCKETS_MAX; i++)
+		{
+			if(sim->sockets[i].used)
+				sim_socket_deliver_due(sim, &sim->sockets[i]);
+		}
+		sim_wake(sim);
+	}
+	chiaki_mutex_unlock(&sim->mutex);
+}
@@ -0,0 +1,155 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki/spscring.h>
+
+#include "atomic.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_ring_init(ChiakiSpscRing *ring, size_t capacity)
+{
+	return chiaki_spsc_ring_init_clock(ring, capacity, chiaki_clock_system());
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_ring_init_clock(ChiakiSpscRing *ring, size_t capacity, ChiakiClock *clock)
+{
+	if(capacity < 2 || capacity > ((size_t)1 << 30))
+		return CHIAKI_ERR_INVALID_DATA;
+	size_t size = 1;
+	while(size < capacity)
+		size <<= 1;
+
+	ring->slots = calloc(size, sizeof(void *));
+	if(!ring->slots)
+		return CHIAKI_ERR_MEMORY;
+	ring->mask = (uint32_t)(size - 1);
+	ring->head = 0;
+	ring->tail = 0;
+	ring->consumer_waiting = 0;
+	ring->producer_waiting = 0;
+	ring->closed = 0;
+	ring->clock = clock;
+	memset(&ring->stats, 0, sizeof(ring->stats));
+
+	ChiakiErrorCode err = chiaki_mutex_init(&ring->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_slots;
+	err = chiaki_cond_init(&ring->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+	return CHIAKI_ERR_SUCCESS;
+
+error_mutex:
+	chiaki_mutex_fini(&ring->mutex);
+error_slots:
+	free(ring->slots);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_spsc_ring_fini(ChiakiSpscRing *ring)
+{
+	chiaki_cond_fini(&ring->cond);
+	chiaki_mutex_fini(&ring->mutex);
+	free(ring->slots);
+}
+
+static void spsc_ring_wake(ChiakiSpscRing *ring)
+{
+	chiaki_mutex_lock(&ring->mutex);
+	chiaki_clock_cond_broadcast(ring->clock, &ring->cond);
+	chiaki_mutex_unlock(&ring->mutex);
+}
+
+CHIAKI_EXPORT bool chiaki_spsc_ring_try_push(ChiakiSpscRing *ring, void *item)
+{
+	uint32_t tail = ring->tail; // only we write it
+	uint32_t fill = tail - chiaki_atomic_load_u32(&ring->head);
+	if(fill > ring->mask)
+		return false;
+	ring->slots[tail & ring->mask] = item;
+	chiaki_atomic_store_u32(&ring->tail, tail + 1);
+
+	ring->stats.pushed++;
+	if(fill + 1 > ring->stats.fill_max)
+		ring->stats.fill_max = fill + 1;
+
+	// the store of tail above and this load are both sequentially consistent,
+	// so either the consumer sees the new item before sleeping or we see that it sleeps
+	if(chiaki_atomic_load_u32(&ring->consumer_waiting))
+		spsc_ring_wake(ring);
+	return true;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_ring_push(ChiakiSpscRing *ring, void *item)
+{
+	while(true)
+	{
+		if(chiaki_atomic_load_u32(&ring->closed))
+			return CHIAKI_ERR_CANCELED;
+		if(chiaki_spsc_ring_try_push(ring, item))
+			return CHIAKI_ERR_SUCCESS;
+
+		ring->stats.push_waits++;
+		chiaki_mutex_lock(&ring->mutex);
+		chiaki_atomic_store_u32(&ring->producer_waiting, 1);
+		while(ring->tail - chiaki_atomic_load_u32(&ring->head) > ring->mask && !chiaki_atomic_load_u32(&ring->closed))
+			chiaki_clock_cond_wait_until(ring->clock, &ring->cond, &ring->mutex, UINT64_MAX);
+		chiaki_atomic_store_u32(&ring->producer_waiting, 0);
+		chiaki_mutex_unlock(&ring->mutex);
+	}
+}
+
+CHIAKI_EXPORT bool chiaki_spsc_ring_try_pop(ChiakiSpscRing *ring, void **item)
+{
+	uint32_t head = ring->head; // only we write it
+	if(head == chiaki_atomic_load_u32(&ring->tail))
+		return false;
+	*item = ring->slots[head & ring->mask];
+	chiaki_atomic_store_u32(&ring->head, head + 1);
+
+	if(chiaki_atomic_load_u32(&ring->producer_waiting))
+		spsc_ring_wake(ring);
+	return true;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_spsc_ring_pop(ChiakiSpscRing *ring, void **item)
+{
+	while(true)
+	{
+		if(chiaki_spsc_ring_try_pop(ring, item))
+			return CHIAKI_ERR_SUCCESS;
+		// check closed only after the ring was seen empty, so nothing pushed before closing is lost
+		if(chiaki_atomic_load_u32(&ring->closed) && ring->head == chiaki_atomic_load_u32(&ring->tail))
+			return CHIAKI_ERR_CANCELED;
+
+		ring->stats.pop_waits++;
+		chiaki_mutex_lock(&ring->mutex);
+		chiaki_atomic_store_u32(&ring->consumer_waiting, 1);
+		while(ring->head == chiaki_atomic_load_u32(&ring->tail) && !chiaki_atomic_load_u32(&ring->closed))
+			chiaki_clock_cond_wait_until(ring->clock, &ring->cond, &ring->mutex, UINT64_MAX);
+		chiaki_atomic_store_u32(&ring->consumer_waiting, 0);
+		chiaki_mutex_unlock(&ring->mutex);
+	}
+}
+
+CHIAKI_EXPORT void chiaki_spsc_ring_close(ChiakiSpscRing *ring)
+{
+	chiaki_atomic_store_u32(&ring->closed, 1);
+	spsc_ring_wake(ring);
+}
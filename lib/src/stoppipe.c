@@ -19,15 +19,24 @@
 #include <chiaki/sock.h>
 
 #include <fcntl.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
 
 #ifdef _WIN32
 #include <ws2tcpip.h>
 #else
 #include <unistd.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <poll.h>
 #endif
 
+#if defined(__linux__) && !defined(CHIAKI_ENABLE_SWITCH_LINUX)
+#include <sys/eventfd.h>
+#endif
+
+#define SELECT_FDS_STACK_MAX 8
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_init(ChiakiStopPipe *stop_pipe)
 {
 #ifdef _WIN32
@@ -60,6 +69,10 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_init(ChiakiStopPipe *stop_pipe)
 		close(stop_pipe->fd);
 		return CHIAKI_ERR_UNKNOWN;
 	}
+#elif defined(__linux__)
+	stop_pipe->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(stop_pipe->event_fd < 0)
+		return CHIAKI_ERR_UNKNOWN;
 #else
 	int r = pipe(stop_pipe->fds);
 	if(r < 0)
@@ -81,6 +94,8 @@ CHIAKI_EXPORT void chiaki_stop_pipe_fini(ChiakiStopPipe *stop_pipe)
 	WSACloseEvent(stop_pipe->event);
 #elif defined(__SWITCH__) || defined(CHIAKI_ENABLE_SWITCH_LINUX)
 	close(stop_pipe->fd);
+#elif defined(__linux__)
+	close(stop_pipe->event_fd);
 #else
 	close(stop_pipe->fds[0]);
 	close(stop_pipe->fds[1]);
@@ -95,89 +110,128 @@ CHIAKI_EXPORT void chiaki_stop_pipe_stop(ChiakiStopPipe *stop_pipe)
 	// send to local socket (FIXME MSG_CONFIRM)
 	sendto(stop_pipe->fd, "\x00", 1, 0,
 		(struct sockaddr*)&stop_pipe->addr, sizeof(struct sockaddr_in));
+#elif defined(__linux__)
+	uint64_t v = 1;
+	write(stop_pipe->event_fd, &v, sizeof(v));
 #else
 	write(stop_pipe->fds[1], "\x00", 1);
 #endif
 }
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select_single(ChiakiStopPipe *stop_pipe, chiaki_socket_t fd, bool write, uint64_t timeout_ms)
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select(ChiakiStopPipe *stop_pipe, ChiakiStopPipeSelectFd *fds, size_t fds_count, uint64_t timeout_ms)
 {
+	for(size_t i=0; i<fds_count; i++)
+		fds[i].ready = false;
+
 #ifdef _WIN32
-	WSAEVENT events[2];
+	if(fds_count + 1 > WSA_MAXIMUM_WAIT_EVENTS)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	WSAEVENT events[WSA_MAXIMUM_WAIT_EVENTS];
 	DWORD events_count = 1;
 	events[0] = stop_pipe->event;
 
-	if(!CHIAKI_SOCKET_IS_INVALID(fd))
+	ChiakiErrorCode err;
+	for(size_t i=0; i<fds_count; i++)
 	{
-		events_count = 2;
-		events[1] = WSACreateEvent();
-		if(events[1] == WSA_INVALID_EVENT)
-			return CHIAKI_ERR_UNKNOWN;
-		WSAEventSelect(fd, events[1], write ? FD_WRITE : FD_READ);
+		events[events_count] = WSACreateEvent();
+		if(events[events_count] == WSA_INVALID_EVENT)
+		{
+			err = CHIAKI_ERR_UNKNOWN;
+			goto beach;
+		}
+		WSAEventSelect(fds[i].fd, events[events_count], fds[i].write ? FD_WRITE : FD_READ);
+		events_count++;
 	}
 
 	DWORD r = WSAWaitForMultipleEvents(events_count, events, FALSE, timeout_ms == UINT64_MAX ? WSA_INFINITE : (DWORD)timeout_ms, FALSE);
 
-	if(events_count == 2)
-		WSACloseEvent(events[1]);
-
-	switch(r)
+	if(r == WSA_WAIT_EVENT_0)
+		err = CHIAKI_ERR_CANCELED;
+	else if(r > WSA_WAIT_EVENT_0 && r < WSA_WAIT_EVENT_0 + events_count)
 	{
-		case WSA_WAIT_EVENT_0:
-			return CHIAKI_ERR_CANCELED;
-		case WSA_WAIT_EVENT_0+1:
-			return CHIAKI_ERR_SUCCESS;
-		case WSA_WAIT_TIMEOUT:
-			return CHIAKI_ERR_TIMEOUT;
-		default:
-			return CHIAKI_ERR_UNKNOWN;
+		// only the lowest signaled index is reported, so check all of them
+		for(size_t i=0; i<fds_count; i++)
+			fds[i].ready = WSAWaitForMultipleEvents(1, &events[i + 1], FALSE, 0, FALSE) == WSA_WAIT_EVENT_0;
+		err = CHIAKI_ERR_SUCCESS;
 	}
+	else if(r == WSA_WAIT_TIMEOUT)
+		err = CHIAKI_ERR_TIMEOUT;
+	else
+		err = CHIAKI_ERR_UNKNOWN;
+
+beach:
+	for(DWORD i=1; i<events_count; i++)
+		WSACloseEvent(events[i]);
+	return err;
 #else
-	fd_set rfds;
-	FD_ZERO(&rfds);
 #if defined(__SWITCH__) || defined(CHIAKI_ENABLE_SWITCH_LINUX)
 	// push udp local socket as fd
 	int stop_fd = stop_pipe->fd;
+#elif defined(__linux__)
+	int stop_fd = stop_pipe->event_fd;
 #else
 	int stop_fd = stop_pipe->fds[0];
 #endif
-	FD_SET(stop_fd, &rfds);
-	int nfds = stop_fd;
 
-	fd_set wfds;
-	FD_ZERO(&wfds);
-	if(!CHIAKI_SOCKET_IS_INVALID(fd))
+	struct pollfd pfds_stack[SELECT_FDS_STACK_MAX + 1];
+	struct pollfd *pfds = pfds_stack;
+	if(fds_count > SELECT_FDS_STACK_MAX)
 	{
-		FD_SET(fd, write ? &wfds : &rfds);
-		if(fd > nfds)
-			nfds = fd;
+		pfds = malloc((fds_count + 1) * sizeof(struct pollfd));
+		if(!pfds)
+			return CHIAKI_ERR_MEMORY;
 	}
-	nfds++;
 
-	struct timeval timeout_s;
-	struct timeval *timeout = NULL;
-	if(timeout_ms != UINT64_MAX)
+	pfds[0].fd = stop_fd;
+	pfds[0].events = POLLIN;
+	pfds[0].revents = 0;
+	for(size_t i=0; i<fds_count; i++)
 	{
-		timeout_s.tv_sec = timeout_ms / 1000;
-		timeout_s.tv_usec = (timeout_ms % 1000) * 1000;
-		timeout = &timeout_s;
+		pfds[i + 1].fd = fds[i].fd;
+		pfds[i + 1].events = fds[i].write ? POLLOUT : POLLIN;
+		pfds[i + 1].revents = 0;
 	}
 
-	int r = select(nfds, &rfds, write ? &wfds : NULL, NULL, timeout);
-
-	if(r < 0)
-		return CHIAKI_ERR_UNKNOWN;
+	int timeout = -1;
+	if(timeout_ms != UINT64_MAX)
+		timeout = timeout_ms > INT_MAX ? INT_MAX : (int)timeout_ms;
 
-	if(FD_ISSET(stop_fd, &rfds))
-		return CHIAKI_ERR_CANCELED;
+	int r = poll(pfds, (nfds_t)(fds_count + 1), timeout);
 
-	if(!CHIAKI_SOCKET_IS_INVALID(fd) && FD_ISSET(fd, write ? &wfds : &rfds))
-		return CHIAKI_ERR_SUCCESS;
+	ChiakiErrorCode err;
+	if(r < 0)
+		err = CHIAKI_ERR_UNKNOWN;
+	else if(pfds[0].revents & POLLIN)
+		err = CHIAKI_ERR_CANCELED;
+	else
+	{
+		err = CHIAKI_ERR_TIMEOUT;
+		for(size_t i=0; i<fds_count; i++)
+		{
+			// errors and hangups count as ready too, like with select(), so the following call reports them
+			if(pfds[i + 1].revents)
+			{
+				fds[i].ready = true;
+				err = CHIAKI_ERR_SUCCESS;
+			}
+		}
+	}
 
-	return CHIAKI_ERR_TIMEOUT;
+	if(pfds != pfds_stack)
+		free(pfds);
+	return err;
 #endif
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_select_single(ChiakiStopPipe *stop_pipe, chiaki_socket_t fd, bool write, uint64_t timeout_ms)
+{
+	ChiakiStopPipeSelectFd select_fd;
+	select_fd.fd = fd;
+	select_fd.write = write;
+	return chiaki_stop_pipe_select(stop_pipe, &select_fd, CHIAKI_SOCKET_IS_INVALID(fd) ? 0 : 1, timeout_ms);
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_connect(ChiakiStopPipe *stop_pipe, chiaki_socket_t fd, struct sockaddr *addr, size_t addrlen)
 {
 	int r = connect(fd, addr, (socklen_t)addrlen);
@@ -265,6 +319,12 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stop_pipe_reset(ChiakiStopPipe *stop_pipe)
 	int r;
 	while((r = read(stop_pipe->fd, &v, sizeof(v))) > 0);
 	return r < 0 ? CHIAKI_ERR_UNKNOWN : CHIAKI_ERR_SUCCESS;
+#elif defined(__linux__)
+	// a single read resets the counter to 0
+	uint64_t v;
+	if(read(stop_pipe->event_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+		return CHIAKI_ERR_UNKNOWN;
+	return CHIAKI_ERR_SUCCESS;
 #else
 	uint8_t v;
 	int r;
@@ -56,6 +56,7 @@ typedef enum {
 } StreamConnectionState;
 
 void chiaki_session_send_event(ChiakiSession *session, ChiakiEvent *event);
+void chiaki_session_startup_mark(ChiakiSession *session, ChiakiStartupPhase phase);
 
 static void stream_connection_takion_cb(ChiakiTakionEvent *event, void *user);
 static void stream_connection_takion_data(ChiakiStreamConnection *stream_connection, ChiakiTakionMessageDataType data_type, uint8_t *buf, size_t buf_size);
@@ -67,6 +68,7 @@ static void stream_connection_takion_data_expect_streaminfo(ChiakiStreamConnecti
 static ChiakiErrorCode stream_connection_send_streaminfo_ack(ChiakiStreamConnection *stream_connection);
 static void stream_connection_takion_av(ChiakiStreamConnection *stream_connection, ChiakiTakionAVPacket *packet);
 static ChiakiErrorCode stream_connection_send_heartbeat(ChiakiStreamConnection *stream_connection);
+static void stream_connection_heartbeat_timer_cb(void *user);
 
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_init(ChiakiStreamConnection *stream_connection, ChiakiSession *session)
@@ -147,6 +149,15 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 
 	takion_info.enable_crypt = true;
 	takion_info.protocol_version = 9;
+	takion_info.reactor = session->reactor;
+	takion_info.timer_service = &session->timer_service;
+	takion_info.net_backend = NULL;
+	takion_info.clock = NULL;
+	takion_info.mem = session->mem;
+	takion_info.pipeline_crypto_workers = session->receive_pipeline_workers;
+	takion_info.socket_tuning = session->socket_tuning;
+	if(takion_info.socket_tuning.rcvbuf_size == CHIAKI_TAKION_RCVBUF_SIZE_AUTO)
+		takion_info.socket_tuning.rcvbuf_size = chiaki_takion_rcvbuf_size_for_bitrate(session->connect_info.video_profile.bitrate);
 
 	takion_info.cb = stream_connection_takion_cb;
 	takion_info.cb_user = stream_connection;
@@ -230,7 +241,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 
 	err = chiaki_mutex_lock(&stream_connection->feedback_sender_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
-	err = chiaki_feedback_sender_init(&stream_connection->feedback_sender, &stream_connection->takion);
+	err = chiaki_feedback_sender_init(&stream_connection->feedback_sender, &stream_connection->takion, &session->timer_service);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		chiaki_mutex_unlock(&stream_connection->feedback_sender_mutex);
@@ -252,18 +263,14 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_stream_connection_run(ChiakiStreamConnectio
 	err = chiaki_mutex_lock(&stream_connection->state_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
 
-	while(true)
-	{
-		err = chiaki_cond_timedwait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, HEARTBEAT_INTERVAL_MS, state_finished_cond_check, stream_connection);
-		if(err != CHIAKI_ERR_TIMEOUT)
-			break;
+	// the heartbeat callback does not touch state_mutex, so it can be canceled while holding it
+	chiaki_timer_init(&stream_connection->heartbeat_timer, stream_connection_heartbeat_timer_cb, stream_connection);
+	chiaki_timer_service_schedule_ms(&session->timer_service, &stream_connection->heartbeat_timer, HEARTBEAT_INTERVAL_MS);
 
-		err = stream_connection_send_heartbeat(stream_connection);
-		if(err != CHIAKI_ERR_SUCCESS)
-			CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to send heartbeat");
-		else
-			CHIAKI_LOGV(stream_connection->log, "StreamConnection sent heartbeat");
-	}
+	err = chiaki_cond_wait_pred(&stream_connection->state_cond, &stream_connection->state_mutex, state_finished_cond_check, stream_connection);
+	assert(err == CHIAKI_ERR_SUCCESS);
+
+	chiaki_timer_service_cancel(&session->timer_service, &stream_connection->heartbeat_timer);
 
 	err = chiaki_mutex_lock(&stream_connection->feedback_sender_mutex);
 	assert(err == CHIAKI_ERR_SUCCESS);
@@ -318,6 +325,8 @@ static void stream_connection_takion_cb(ChiakiTakionEvent *event, void *user)
 			chiaki_mutex_lock(&stream_connection->state_mutex);
 			if(stream_connection->state == STATE_TAKION_CONNECT)
 			{
+				if(event->type == CHIAKI_TAKION_EVENT_TYPE_CONNECTED)
+					chiaki_session_startup_mark(stream_connection->session, CHIAKI_STARTUP_PHASE_TAKION_CONNECT);
 				stream_connection->state_finished = event->type == CHIAKI_TAKION_EVENT_TYPE_CONNECTED;
 				stream_connection->state_failed = event->type == CHIAKI_TAKION_EVENT_TYPE_DISCONNECT;
 				chiaki_cond_signal(&stream_connection->state_cond);
@@ -412,17 +421,19 @@ static ChiakiErrorCode stream_connection_init_crypt(ChiakiStreamConnection *stre
 {
 	ChiakiSession *session = stream_connection->session;
 
-	stream_connection->gkcrypt_local = chiaki_gkcrypt_new(stream_connection->log, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT, 2, session->handshake_key, stream_connection->ecdh_secret);
+	// the local instance only covers low-rate upstream packets, so its key stream is generated on demand
+	stream_connection->gkcrypt_local = chiaki_gkcrypt_new(stream_connection->log, session->mem, 0, 2, session->handshake_key, stream_connection->ecdh_secret);
 	if(!stream_connection->gkcrypt_local)
 	{
 		CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to initialize local GKCrypt with index 2");
 		return CHIAKI_ERR_UNKNOWN;
 	}
-	stream_connection->gkcrypt_remote = chiaki_gkcrypt_new(stream_connection->log, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT, 3, session->handshake_key, stream_connection->ecdh_secret);
+	size_t remote_key_buf_chunks = chiaki_gkcrypt_key_buf_chunks_for_bitrate(session->connect_info.video_profile.bitrate);
+	stream_connection->gkcrypt_remote = chiaki_gkcrypt_new(stream_connection->log, session->mem, remote_key_buf_chunks, 3, session->handshake_key, stream_connection->ecdh_secret);
 	if(!stream_connection->gkcrypt_remote)
 	{
 		CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to initialize remote GKCrypt with index 3");
-		free(stream_connection->gkcrypt_local);
+		chiaki_gkcrypt_free(stream_connection->gkcrypt_local);
 		stream_connection->gkcrypt_local = NULL;
 		return CHIAKI_ERR_UNKNOWN;
 	}
@@ -522,6 +533,8 @@ static void stream_connection_takion_data_expect_bang(ChiakiStreamConnection *st
 		goto error;
 	}
 
+	chiaki_session_startup_mark(stream_connection->session, CHIAKI_STARTUP_PHASE_BANG);
+
 	// stream_connection->state_mutex is expected to be locked by the caller of this function
 	stream_connection->state_finished = true;
 	chiaki_cond_signal(&stream_connection->state_cond);
@@ -555,20 +568,24 @@ static bool pb_decode_resolution(pb_istream_t *stream, const pb_field_t *field,
 		return true;
 	}
 
-	uint8_t *header_buf_padded = realloc(header_buf.buf, header_buf.size + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
-	if(!header_buf_padded)
+	if(ctx->video_profiles_count >= CHIAKI_VIDEO_PROFILES_MAX)
 	{
 		free(header_buf.buf);
-		CHIAKI_LOGE(ctx->stream_connection->session->log, "Failed to realloc video header with padding");
+		CHIAKI_LOGE(ctx->stream_connection->session->log, "Received more resolutions than the maximum");
 		return true;
 	}
-	memset(header_buf_padded + header_buf.size, 0, CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
 
-	if(ctx->video_profiles_count >= CHIAKI_VIDEO_PROFILES_MAX)
+	// copied into the session's account, ownership goes to the ChiakiVideoReceiver
+	uint8_t *header_buf_padded = chiaki_mem_alloc(ctx->stream_connection->session->mem, CHIAKI_MEM_TAG_PROTO, header_buf.size + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	if(!header_buf_padded)
 	{
-		CHIAKI_LOGE(ctx->stream_connection->session->log, "Received more resolutions than the maximum");
+		free(header_buf.buf);
+		CHIAKI_LOGE(ctx->stream_connection->session->log, "Failed to alloc video header with padding");
 		return true;
 	}
+	memcpy(header_buf_padded, header_buf.buf, header_buf.size);
+	memset(header_buf_padded + header_buf.size, 0, CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	free(header_buf.buf);
 
 	ChiakiVideoProfile *profile = &ctx->video_profiles[ctx->video_profiles_count++];
 	profile->width = resolution.width;
@@ -578,6 +595,19 @@ static bool pb_decode_resolution(pb_istream_t *stream, const pb_field_t *field,
 	return true;
 }
 
+/**
+ * Free the headers of the decoded profiles if they are not passed on to the ChiakiVideoReceiver.
+ */
+static void decode_resolutions_context_free_profiles(DecodeResolutionsContext *ctx)
+{
+	for(size_t i=0; i<ctx->video_profiles_count; i++)
+	{
+		ChiakiVideoProfile *profile = &ctx->video_profiles[i];
+		chiaki_mem_free(ctx->stream_connection->session->mem, CHIAKI_MEM_TAG_PROTO, profile->header, profile->header_sz + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	}
+	ctx->video_profiles_count = 0;
+}
+
 
 static void stream_connection_takion_data_expect_streaminfo(ChiakiStreamConnection *stream_connection, uint8_t *buf, size_t buf_size)
 {
@@ -601,11 +631,13 @@ static void stream_connection_takion_data_expect_streaminfo(ChiakiStreamConnecti
 	if(!r)
 	{
 		CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to decode data protobuf");
+		decode_resolutions_context_free_profiles(&decode_resolutions_context);
 		return;
 	}
 
 	if(msg.type != tkproto_TakionMessage_PayloadType_STREAMINFO || !msg.has_stream_info_payload)
 	{
+		decode_resolutions_context_free_profiles(&decode_resolutions_context);
 		if(msg.type == tkproto_TakionMessage_PayloadType_DISCONNECT)
 		{
 			stream_connection_takion_data_handle_disconnect(stream_connection, buf, buf_size);
@@ -638,11 +670,14 @@ static void stream_connection_takion_data_expect_streaminfo(ChiakiStreamConnecti
 
 	stream_connection_send_streaminfo_ack(stream_connection);
 
+	chiaki_session_startup_mark(stream_connection->session, CHIAKI_STARTUP_PHASE_STREAMINFO);
+
 	// stream_connection->state_mutex is expected to be locked by the caller of this function
 	stream_connection->state_finished = true;
 	chiaki_cond_signal(&stream_connection->state_cond);
 	return;
 error:
+	decode_resolutions_context_free_profiles(&decode_resolutions_context);
 	stream_connection->state_failed = true;
 	chiaki_cond_signal(&stream_connection->state_cond);
 }
@@ -806,7 +841,8 @@ static ChiakiErrorCode stream_connection_send_disconnect(ChiakiStreamConnection
 
 static void stream_connection_takion_av(ChiakiStreamConnection *stream_connection, ChiakiTakionAVPacket *packet)
 {
-	chiaki_gkcrypt_decrypt(stream_connection->gkcrypt_remote, packet->key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, packet->data, packet->data_size);
+	if(!packet->decrypted)
+		chiaki_gkcrypt_decrypt(stream_connection->gkcrypt_remote, packet->key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, packet->data, packet->data_size);
 
 	if(packet->is_video)
 		chiaki_video_receiver_av_packet(stream_connection->session->video_receiver, packet);
@@ -833,6 +869,19 @@ static ChiakiErrorCode stream_connection_send_heartbeat(ChiakiStreamConnection *
 	return chiaki_takion_send_message_data(&stream_connection->takion, 1, 1, buf, stream.bytes_written, NULL);
 }
 
+static void stream_connection_heartbeat_timer_cb(void *user)
+{
+	ChiakiStreamConnection *stream_connection = user;
+
+	ChiakiErrorCode err = stream_connection_send_heartbeat(stream_connection);
+	if(err != CHIAKI_ERR_SUCCESS)
+		CHIAKI_LOGE(stream_connection->log, "StreamConnection failed to send heartbeat");
+	else
+		CHIAKI_LOGV(stream_connection->log, "StreamConnection sent heartbeat");
+
+	chiaki_timer_service_schedule_ms(&stream_connection->session->timer_service, &stream_connection->heartbeat_timer, HEARTBEAT_INTERVAL_MS);
+}
+
 CHIAKI_EXPORT ChiakiErrorCode stream_connection_send_corrupt_frame(ChiakiStreamConnection *stream_connection, ChiakiSeqNum16 start, ChiakiSeqNum16 end)
 {
 	tkproto_TakionMessage msg = { 0 };
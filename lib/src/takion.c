@@ -19,12 +19,15 @@
 #include <chiaki/congestioncontrol.h>
 #include <chiaki/random.h>
 
+#include "atomic.h"
+
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
 
 #ifdef _WIN32
 #include <ws2tcpip.h>
@@ -38,12 +41,18 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT 0 // only used with ChiakiReactor, which is not available on these platforms
 #endif
 
 
 // VERY similar to SCTP, see RFC 4960
 
 #define TAKION_A_RWND 0x19000
+#define TAKION_RCVBUF_BURST_MS 250 // see chiaki_takion_rcvbuf_size_for_bitrate()
 #define TAKION_OUTBOUND_STREAMS 0x64
 #define TAKION_INBOUND_STREAMS 0x64
 
@@ -58,6 +67,9 @@
 
 #define TAKION_EXPECT_TIMEOUT_MS 5000
 
+#define TAKION_PIPELINE_RING_SIZE 256 // packets between two stages, per crypto worker
+#define TAKION_PIPELINE_CRYPTO_BATCH 16 // max packets a crypto worker verifies at once
+
 /**
  * Base type of Takion packets. Lower nibble of the first byte in datagrams.
  */
@@ -162,16 +174,40 @@ typedef struct
 	uint16_t channel;
 } TakionDataPacketEntry;
 
+static void takion_data_packet_entry_free(ChiakiTakion *takion, TakionDataPacketEntry *entry)
+{
+	chiaki_mem_uncharge(takion->mem, CHIAKI_MEM_TAG_REORDER, entry->packet_size);
+	free(entry->packet_buf);
+	chiaki_mem_free(takion->mem, CHIAKI_MEM_TAG_REORDER, entry, sizeof(TakionDataPacketEntry));
+}
+
 
 typedef struct chiaki_takion_postponed_packet_t
 {
 	uint8_t *buf;
 	size_t buf_size;
+	uint64_t recv_time_us;
 } ChiakiTakionPostponedPacket;
 
+/**
+ * A datagram on its way through the receive pipeline
+ */
+typedef struct takion_pipeline_packet_t
+{
+	uint8_t *buf; // NULL if dropped by the crypto stage
+	size_t buf_size;
+	uint64_t recv_time_us;
+	bool av_ready; // MAC verified, av parsed and decrypted, only left to be passed to the callback
+	ChiakiTakionAVPacket av;
+} TakionPipelinePacket;
+
 
 static void *takion_thread_func(void *user);
-static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size);
+static void takion_check_crypt_available(ChiakiTakion *takion);
+static void takion_reactor_cb(void *user);
+static void takion_fini_connected(ChiakiTakion *takion);
+static void takion_disconnected(ChiakiTakion *takion);
+static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, uint64_t recv_time_us);
 static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size);
 static void takion_handle_packet_message(ChiakiTakion *takion, uint8_t *buf, size_t buf_size);
 static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *packet_buf, size_t packet_buf_size, uint8_t type_b, uint8_t *payload, size_t payload_size);
@@ -180,10 +216,15 @@ static ChiakiErrorCode takion_parse_message(ChiakiTakion *takion, uint8_t *buf,
 static void takion_write_message_header(uint8_t *buf, uint32_t tag, uint32_t key_pos, uint8_t chunk_type, uint8_t chunk_flags, size_t payload_data_size);
 static ChiakiErrorCode takion_send_message_init(ChiakiTakion *takion, TakionMessagePayloadInit *payload);
 static ChiakiErrorCode takion_send_message_cookie(ChiakiTakion *takion, uint8_t *cookie);
-static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms);
+static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms, uint64_t *recv_time_us);
 static ChiakiErrorCode takion_recv_message_init_ack(ChiakiTakion *takion, TakionMessagePayloadInitAck *payload);
 static ChiakiErrorCode takion_recv_message_cookie_ack(ChiakiTakion *takion);
-static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size);
+static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size, uint64_t recv_time_us);
+static void takion_av_packet_emit(ChiakiTakion *takion, ChiakiTakionAVPacket *packet);
+static void takion_apply_socket_tuning(ChiakiTakion *takion, const ChiakiTakionSocketTuning *tuning);
+static bool takion_pipeline_start(ChiakiTakion *takion);
+static void takion_pipeline_receive(ChiakiTakion *takion);
+static void takion_pipeline_stop(ChiakiTakion *takion);
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, ChiakiTakionConnectInfo *info)
 {
@@ -205,9 +246,6 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 	}
 
 	takion->gkcrypt_local = NULL;
-	ret = chiaki_mutex_init(&takion->gkcrypt_local_mutex, true);
-	if(ret != CHIAKI_ERR_SUCCESS)
-		return ret;
 	takion->key_pos_local = 0;
 	takion->gkcrypt_remote = NULL;
 	takion->cb = info->cb;
@@ -216,9 +254,6 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 
 	takion->tag_local = chiaki_random_32(); // 0x4823
 	takion->seq_num_local = takion->tag_local;
-	ret = chiaki_mutex_init(&takion->seq_num_local_mutex, false);
-	if(ret != CHIAKI_ERR_SUCCESS)
-		goto error_gkcrypt_local_mutex;
 	takion->tag_remote = 0;
 
 	takion->enable_crypt = info->enable_crypt;
@@ -226,16 +261,32 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 	takion->postponed_packets_size = 0;
 	takion->postponed_packets_count = 0;
 
+	takion->timer_service = info->timer_service;
+	takion->net = info->net_backend ? info->net_backend : chiaki_net_backend_system();
+	takion->clock = info->clock ? info->clock : chiaki_clock_system();
+	takion->mem = info->mem;
+
+	// the reactor polls OS sockets only
+	takion->reactor = (takion->net->caps & CHIAKI_NET_BACKEND_CAP_OS_SOCKETS) ? info->reactor : NULL;
+	takion->reactor_active = false;
+	takion->reactor_failed = false;
+
+	takion->pipeline_crypto_workers = info->pipeline_crypto_workers;
+	if(takion->pipeline_crypto_workers > CHIAKI_TAKION_PIPELINE_CRYPTO_WORKERS_MAX)
+		takion->pipeline_crypto_workers = CHIAKI_TAKION_PIPELINE_CRYPTO_WORKERS_MAX;
+	takion->pipeline.workers_count = 0;
+	takion->pipeline.reassembly_running = false;
+
 	CHIAKI_LOGI(takion->log, "Takion connecting (version %u)", (unsigned int)info->protocol_version);
 
 	ChiakiErrorCode err = chiaki_stop_pipe_init(&takion->stop_pipe);
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to create stop pipe");
-		goto error_seq_num_local_mutex;
+		return err;
 	}
 
-	takion->sock = socket(info->sa->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+	takion->sock = takion->net->socket(takion->net, info->sa->sa_family, SOCK_DGRAM, IPPROTO_UDP);
 	if(CHIAKI_SOCKET_IS_INVALID(takion->sock))
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to create socket");
@@ -243,26 +294,41 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 		goto error_pipe;
 	}
 
-	const int rcvbuf_val = takion->a_rwnd;
-	int r = setsockopt(takion->sock, SOL_SOCKET, SO_RCVBUF, (const void *)&rcvbuf_val, sizeof(rcvbuf_val));
+	const ChiakiTakionSocketTuning *tuning = &info->socket_tuning;
+	int rcvbuf_val = takion->a_rwnd;
+	if(tuning->rcvbuf_size && tuning->rcvbuf_size != CHIAKI_TAKION_RCVBUF_SIZE_AUTO)
+		rcvbuf_val = tuning->rcvbuf_size > INT_MAX ? INT_MAX : (int)tuning->rcvbuf_size;
+	int r = takion->net->setsockopt(takion->net, takion->sock, SOL_SOCKET, SO_RCVBUF, (const void *)&rcvbuf_val, sizeof(rcvbuf_val));
 	if(r < 0)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to setsockopt SO_RCVBUF: %s", strerror(errno));
 		ret = CHIAKI_ERR_NETWORK;
 		goto error_sock;
 	}
+	if(takion->net->caps & CHIAKI_NET_BACKEND_CAP_OS_SOCKETS)
+	{
+		// the kernel may clamp the size (net.core.rmem_max) or, like Linux, double it for its bookkeeping
+		int rcvbuf_effective = 0;
+		socklen_t rcvbuf_effective_len = sizeof(rcvbuf_effective);
+		if(getsockopt(takion->sock, SOL_SOCKET, SO_RCVBUF, (char *)&rcvbuf_effective, &rcvbuf_effective_len) == 0)
+			CHIAKI_LOGI(takion->log, "Takion receive buffer is %d bytes, requested %d", rcvbuf_effective, rcvbuf_val);
+		else
+			CHIAKI_LOGW(takion->log, "Takion failed to getsockopt SO_RCVBUF: %s", strerror(errno));
+	}
+
+	takion_apply_socket_tuning(takion, tuning);
 
 	if(info->ip_dontfrag)
 	{
 #if defined(_WIN32)
 		const DWORD dontfragment_val = 1;
-		r = setsockopt(takion->sock, IPPROTO_IP, IP_DONTFRAGMENT, (const void *)&dontfragment_val, sizeof(dontfragment_val));
+		r = takion->net->setsockopt(takion->net, takion->sock, IPPROTO_IP, IP_DONTFRAGMENT, (const void *)&dontfragment_val, sizeof(dontfragment_val));
 #elif defined(__FreeBSD__) || defined(__SWITCH__)
 		const int dontfrag_val = 1;
-		r = setsockopt(takion->sock, IPPROTO_IP, IP_DONTFRAG, (const void *)&dontfrag_val, sizeof(dontfrag_val));
+		r = takion->net->setsockopt(takion->net, takion->sock, IPPROTO_IP, IP_DONTFRAG, (const void *)&dontfrag_val, sizeof(dontfrag_val));
 #elif defined(IP_PMTUDISC_DO)
 		const int mtu_discover_val = IP_PMTUDISC_DO;
-		r = setsockopt(takion->sock, IPPROTO_IP, IP_MTU_DISCOVER, (const void *)&mtu_discover_val, sizeof(mtu_discover_val));
+		r = takion->net->setsockopt(takion->net, takion->sock, IPPROTO_IP, IP_MTU_DISCOVER, (const void *)&mtu_discover_val, sizeof(mtu_discover_val));
 #else
 		// macOS and OpenBSD
 		CHIAKI_LOGW(takion->log, "Don't fragment is not supported on this platform, MTU values may be incorrect.");
@@ -280,7 +346,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 #endif
 	}
 
-	r = connect(takion->sock, info->sa, info->sa_len);
+	r = takion->net->connect(takion->net, takion->sock, info->sa, (socklen_t)info->sa_len);
 	if(r < 0)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to connect: %s", strerror(errno));
@@ -288,7 +354,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 		goto error_sock;
 	}
 
-	err = chiaki_thread_create(&takion->thread, takion_thread_func, takion);
+	err = chiaki_clock_thread_create(takion->clock, &takion->thread, takion_thread_func, takion);
 	if(r != CHIAKI_ERR_SUCCESS)
 	{
 		ret = err;
@@ -300,56 +366,151 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_connect(ChiakiTakion *takion, Chiaki
 	return CHIAKI_ERR_SUCCESS;
 
 error_sock:
-	CHIAKI_SOCKET_CLOSE(takion->sock);
+	takion->net->close(takion->net, takion->sock);
 error_pipe:
 	chiaki_stop_pipe_fini(&takion->stop_pipe);
-error_seq_num_local_mutex:
-	chiaki_mutex_fini(&takion->seq_num_local_mutex);
-error_gkcrypt_local_mutex:
-	chiaki_mutex_fini(&takion->gkcrypt_local_mutex);
 	return ret;
 }
 
+/**
+ * Apply the optional parts of tuning, which only warn if they fail.
+ */
+static void takion_apply_socket_tuning(ChiakiTakion *takion, const ChiakiTakionSocketTuning *tuning)
+{
+	takion->rx_timestamps = false;
+	if(tuning->rx_timestamps)
+	{
+		if(takion->net->enable_rx_timestamps(takion->net, takion->sock) < 0)
+			CHIAKI_LOGW(takion->log, "Takion failed to enable kernel receive timestamps: %s", strerror(errno));
+		else
+		{
+			takion->rx_timestamps = true;
+			CHIAKI_LOGI(takion->log, "Takion enabled kernel receive timestamps");
+		}
+	}
+
+	if(tuning->busy_poll_us)
+	{
+#ifdef SO_BUSY_POLL
+		const int busy_poll_val = tuning->busy_poll_us > INT_MAX ? INT_MAX : (int)tuning->busy_poll_us;
+		if(takion->net->setsockopt(takion->net, takion->sock, SOL_SOCKET, SO_BUSY_POLL, (const void *)&busy_poll_val, sizeof(busy_poll_val)) < 0)
+			CHIAKI_LOGW(takion->log, "Takion failed to setsockopt SO_BUSY_POLL: %s", strerror(errno));
+		else
+			CHIAKI_LOGI(takion->log, "Takion enabled busy polling for %d us", busy_poll_val);
+#else
+		CHIAKI_LOGW(takion->log, "Busy polling is not supported on this platform");
+#endif
+	}
+
+	if(tuning->priority)
+	{
+#ifdef SO_PRIORITY
+		const int priority_val = tuning->priority;
+		if(takion->net->setsockopt(takion->net, takion->sock, SOL_SOCKET, SO_PRIORITY, (const void *)&priority_val, sizeof(priority_val)) < 0)
+			CHIAKI_LOGW(takion->log, "Takion failed to setsockopt SO_PRIORITY: %s", strerror(errno));
+#else
+		CHIAKI_LOGW(takion->log, "Socket priority is not supported on this platform");
+#endif
+	}
+}
+
+CHIAKI_EXPORT size_t chiaki_takion_rcvbuf_size_for_bitrate(unsigned int bitrate_kbps)
+{
+	size_t size = (size_t)bitrate_kbps * TAKION_RCVBUF_BURST_MS / 8;
+	return size < TAKION_A_RWND ? TAKION_A_RWND : size;
+}
+
 CHIAKI_EXPORT void chiaki_takion_close(ChiakiTakion *takion)
 {
 	chiaki_stop_pipe_stop(&takion->stop_pipe);
 	chiaki_thread_join(&takion->thread, NULL);
+	if(takion->reactor_active)
+	{
+		// the thread has only done the handshake, the rest is left to clean up here
+		// unless the reactor callback has already done it after a fatal error
+		chiaki_reactor_remove(&takion->reactor_source);
+		takion->reactor_active = false;
+		if(!takion->reactor_failed)
+		{
+			takion_fini_connected(takion);
+			takion_disconnected(takion);
+		}
+	}
 	chiaki_stop_pipe_fini(&takion->stop_pipe);
-	chiaki_mutex_fini(&takion->seq_num_local_mutex);
-	chiaki_mutex_fini(&takion->gkcrypt_local_mutex);
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_crypt_advance_key_pos(ChiakiTakion *takion, size_t data_size, size_t *key_pos)
 {
-	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
+	if(!takion->gkcrypt_local)
+	{
+		*key_pos = 0;
+		return CHIAKI_ERR_SUCCESS;
+	}
 
-	if(takion->gkcrypt_local)
+	// check before reserving, so an overflowing request leaves the key pos untouched
+	size_t cur = chiaki_atomic_load_size(&takion->key_pos_local);
+	do
 	{
-		size_t cur = takion->key_pos_local;
 		if(SIZE_MAX - cur < data_size)
-		{
-			chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
 			return CHIAKI_ERR_OVERFLOW;
-		}
-
-		*key_pos = cur;
-		takion->key_pos_local = cur + data_size;
-	}
-	else
-		*key_pos = 0;
+	} while(!chiaki_atomic_compare_exchange_size(&takion->key_pos_local, &cur, cur + data_size));
 
-	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
+	*key_pos = cur;
 	return CHIAKI_ERR_SUCCESS;
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw(ChiakiTakion *takion, const uint8_t *buf, size_t buf_size)
 {
-	int r = send(takion->sock, buf, buf_size, 0);
+	int r = takion->net->send(takion->net, takion->sock, buf, buf_size);
+	if(r < 0)
+		return CHIAKI_ERR_NETWORK;
+	return CHIAKI_ERR_SUCCESS;
+}
+
+static ChiakiErrorCode takion_send_raw_concat(ChiakiTakion *takion, const uint8_t *head, size_t head_size, const uint8_t *tail, size_t tail_size)
+{
+	uint8_t *buf = malloc(head_size + tail_size);
+	if(!buf)
+		return CHIAKI_ERR_MEMORY;
+	memcpy(buf, head, head_size);
+	memcpy(buf + head_size, tail, tail_size);
+	ChiakiErrorCode err = chiaki_takion_send_raw(takion, buf, head_size + tail_size);
+	free(buf);
+	return err;
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_raw_split(ChiakiTakion *takion, const uint8_t *head, size_t head_size, const uint8_t *tail, size_t tail_size)
+{
+	if(!(takion->net->caps & CHIAKI_NET_BACKEND_CAP_OS_SOCKETS))
+		return takion_send_raw_concat(takion, head, head_size, tail, tail_size);
+#if defined(_WIN32)
+	WSABUF bufs[2];
+	bufs[0].buf = (char *)head;
+	bufs[0].len = (ULONG)head_size;
+	bufs[1].buf = (char *)tail;
+	bufs[1].len = (ULONG)tail_size;
+	DWORD sent;
+	int r = WSASend(takion->sock, bufs, 2, &sent, 0, NULL, NULL);
+	if(r != 0)
+		return CHIAKI_ERR_NETWORK;
+	return CHIAKI_ERR_SUCCESS;
+#elif defined(__SWITCH__)
+	return takion_send_raw_concat(takion, head, head_size, tail, tail_size);
+#else
+	struct iovec iov[2];
+	iov[0].iov_base = (void *)head;
+	iov[0].iov_len = head_size;
+	iov[1].iov_base = (void *)tail;
+	iov[1].iov_len = tail_size;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	ssize_t r = sendmsg(takion->sock, &msg, 0);
 	if(r < 0)
 		return CHIAKI_ERR_NETWORK;
 	return CHIAKI_ERR_SUCCESS;
+#endif
 }
 
 
@@ -390,14 +551,36 @@ static ChiakiErrorCode chiaki_takion_packet_mac(ChiakiGKCrypt *crypt, uint8_t *b
 	return CHIAKI_ERR_SUCCESS;
 }
 
+/**
+ * Copy the MAC of a received packet to mac_out and zero it inside buf, which is then ready to be passed to the GMAC.
+ * Unlike chiaki_takion_packet_mac(), this does not handle control packets, which also need their key pos zeroed.
+ */
+static ChiakiErrorCode takion_packet_mac_extract(uint8_t *buf, size_t buf_size, uint8_t *mac_out, ChiakiTakionPacketKeyPos *key_pos_out)
+{
+	if(buf_size < 1)
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+
+	TakionPacketType base_type = buf[0] & TAKION_PACKET_BASE_TYPE_MASK;
+	if(base_type == TAKION_PACKET_TYPE_CONTROL)
+		return CHIAKI_ERR_INVALID_DATA;
+	int mac_offset = takion_packet_type_mac_offset(base_type);
+	int key_pos_offset = takion_packet_type_key_pos_offset(base_type);
+	if(mac_offset < 0 || key_pos_offset < 0)
+		return CHIAKI_ERR_INVALID_DATA;
+
+	if(buf_size < mac_offset + CHIAKI_GKCRYPT_GMAC_SIZE || buf_size < key_pos_offset + sizeof(ChiakiTakionPacketKeyPos))
+		return CHIAKI_ERR_BUF_TOO_SMALL;
+
+	memcpy(mac_out, buf + mac_offset, CHIAKI_GKCRYPT_GMAC_SIZE);
+	memset(buf + mac_offset, 0, CHIAKI_GKCRYPT_GMAC_SIZE);
+	*key_pos_out = ntohl(*((ChiakiTakionPacketKeyPos *)(buf + key_pos_offset)));
+	return CHIAKI_ERR_SUCCESS;
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
 {
-	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
 	uint8_t mac[CHIAKI_GKCRYPT_GMAC_SIZE];
-	err = chiaki_takion_packet_mac(takion->gkcrypt_local, buf, buf_size, mac, NULL, NULL);
-	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
+	ChiakiErrorCode err = chiaki_takion_packet_mac(takion->gkcrypt_local, buf, buf_size, mac, NULL, NULL);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
@@ -418,7 +601,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *taki
 		return err;
 
 	size_t packet_size = 1 + TAKION_MESSAGE_HEADER_SIZE + 9 + buf_size;
-	uint8_t *packet_buf = malloc(packet_size);
+	uint8_t *packet_buf = chiaki_mem_alloc(takion->mem, CHIAKI_MEM_TAG_SEND_BUFFER, packet_size);
 	if(!packet_buf)
 		return CHIAKI_ERR_MEMORY;
 	packet_buf[0] = TAKION_PACKET_TYPE_CONTROL;
@@ -427,11 +610,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *taki
 
 	uint8_t *msg_payload = packet_buf + 1 + TAKION_MESSAGE_HEADER_SIZE;
 
-	err = chiaki_mutex_lock(&takion->seq_num_local_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-	ChiakiSeqNum32 seq_num_val = takion->seq_num_local++;
-	chiaki_mutex_unlock(&takion->seq_num_local_mutex);
+	ChiakiSeqNum32 seq_num_val = chiaki_atomic_fetch_add_u32(&takion->seq_num_local, 1);
 
 	*((chiaki_unaligned_uint32_t *)(msg_payload + 0)) = htonl(seq_num_val);
 	*((chiaki_unaligned_uint16_t *)(msg_payload + 4)) = htons(channel);
@@ -443,7 +622,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_message_data(ChiakiTakion *taki
 	if(err != CHIAKI_ERR_SUCCESS)
 	{
 		CHIAKI_LOGE(takion->log, "Takion failed to send data packet: %s", chiaki_error_string(err));
-		free(packet_buf);
+		chiaki_mem_free(takion->mem, CHIAKI_MEM_TAG_SEND_BUFFER, packet_buf, packet_size);
 		return err;
 	}
 
@@ -485,80 +664,73 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_congestion(ChiakiTakion *takion
 	*((chiaki_unaligned_uint16_t *)(buf + 3)) = htons(packet->word_1);
 	*((chiaki_unaligned_uint16_t *)(buf + 5)) = htons(packet->word_2);
 
-	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-	*((chiaki_unaligned_uint32_t *)(buf + 0xb)) = htonl((uint32_t)takion->key_pos_local); // TODO: is this correct? shouldn't key_pos be 0 for mac calculation?
-	err = chiaki_gkcrypt_gmac(takion->gkcrypt_local, takion->key_pos_local, buf, sizeof(buf), buf + 7);
-	takion->key_pos_local += sizeof(buf);
-	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
+	size_t key_pos;
+	ChiakiErrorCode err = chiaki_takion_crypt_advance_key_pos(takion, sizeof(buf), &key_pos);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
+	*((chiaki_unaligned_uint32_t *)(buf + 0xb)) = htonl((uint32_t)key_pos); // TODO: is this correct? shouldn't key_pos be 0 for mac calculation?
+	if(takion->gkcrypt_local)
+	{
+		err = chiaki_gkcrypt_gmac(takion->gkcrypt_local, key_pos, buf, sizeof(buf), buf + 7);
+		if(err != CHIAKI_ERR_SUCCESS)
+			return err;
+	}
 
 	//chiaki_log_hexdump(takion->log, CHIAKI_LOG_DEBUG, buf, sizeof(buf));
 
 	return chiaki_takion_send_raw(takion, buf, sizeof(buf));
 }
 
-static ChiakiErrorCode takion_send_feedback_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+/**
+ * @param header 0xc bytes of feedback packet header, key pos and gmac are filled in here
+ * @param payload encrypted in place
+ */
+static ChiakiErrorCode takion_send_feedback_packet(ChiakiTakion *takion, uint8_t *header, uint8_t *payload, size_t payload_size)
 {
-	assert(buf_size >= 0xc);
-
-	size_t payload_size = buf_size - 0xc;
-
-	ChiakiErrorCode err = chiaki_mutex_lock(&takion->gkcrypt_local_mutex);
-	if(err != CHIAKI_ERR_SUCCESS)
-		return err;
-
 	size_t key_pos;
-	err = chiaki_takion_crypt_advance_key_pos(takion, payload_size + CHIAKI_GKCRYPT_BLOCK_SIZE, &key_pos);
+	ChiakiErrorCode err = chiaki_takion_crypt_advance_key_pos(takion, payload_size + CHIAKI_GKCRYPT_BLOCK_SIZE, &key_pos);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto beach;
+		return err;
 
-	err = chiaki_gkcrypt_encrypt(takion->gkcrypt_local, key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, buf + 0xc, payload_size);
+	// gkcrypt_local is only set once before any feedback is sent, so the key pos and MAC
+	// can be computed without holding any lock.
+	err = chiaki_gkcrypt_encrypt(takion->gkcrypt_local, key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, payload, payload_size);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto beach;
+		return err;
 
-	*((chiaki_unaligned_uint32_t *)(buf + 4)) = htonl((uint32_t)key_pos);
+	*((chiaki_unaligned_uint32_t *)(header + 4)) = htonl((uint32_t)key_pos);
 
-	err = chiaki_gkcrypt_gmac(takion->gkcrypt_local, key_pos, buf, buf_size, buf + 8);
+	err = chiaki_gkcrypt_gmac_split(takion->gkcrypt_local, key_pos, header, 0xc, payload, payload_size, header + 8);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto beach;
-
-	chiaki_takion_send_raw(takion, buf, buf_size);
+		return err;
 
-beach:
-	chiaki_mutex_unlock(&takion->gkcrypt_local_mutex);
+	chiaki_takion_send_raw_split(takion, header, 0xc, payload, payload_size);
 	return err;
 }
 
+static void takion_write_feedback_header(uint8_t *header, uint8_t type, ChiakiSeqNum16 seq_num)
+{
+	header[0] = type;
+	*((chiaki_unaligned_uint16_t *)(header + 1)) = htons(seq_num);
+	header[3] = 0; // TODO
+	*((chiaki_unaligned_uint32_t *)(header + 4)) = 0; // key pos
+	*((chiaki_unaligned_uint32_t *)(header + 8)) = 0; // gmac
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_feedback_state(ChiakiTakion *takion, ChiakiSeqNum16 seq_num, ChiakiFeedbackState *feedback_state)
 {
-	uint8_t buf[0xc + CHIAKI_FEEDBACK_STATE_BUF_SIZE];
-	buf[0] = TAKION_PACKET_TYPE_FEEDBACK_STATE;
-	*((chiaki_unaligned_uint16_t *)(buf + 1)) = htons(seq_num);
-	buf[3] = 0; // TODO
-	*((chiaki_unaligned_uint32_t *)(buf + 4)) = 0; // key pos
-	*((chiaki_unaligned_uint32_t *)(buf + 8)) = 0; // gmac
-	chiaki_feedback_state_format(buf + 0xc, feedback_state);
-	return takion_send_feedback_packet(takion, buf, sizeof(buf));
+	uint8_t header[0xc];
+	uint8_t payload[CHIAKI_FEEDBACK_STATE_BUF_SIZE];
+	takion_write_feedback_header(header, TAKION_PACKET_TYPE_FEEDBACK_STATE, seq_num);
+	chiaki_feedback_state_format(payload, feedback_state);
+	return takion_send_feedback_packet(takion, header, payload, sizeof(payload));
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_feedback_history(ChiakiTakion *takion, ChiakiSeqNum16 seq_num, uint8_t *payload, size_t payload_size)
 {
-	size_t buf_size = 0xc + payload_size;
-	uint8_t *buf = malloc(buf_size);
-	if(!buf)
-		return CHIAKI_ERR_MEMORY;
-	buf[0] = TAKION_PACKET_TYPE_FEEDBACK_HISTORY;
-	*((chiaki_unaligned_uint16_t *)(buf + 1)) = htons(seq_num);
-	buf[3] = 0; // TODO
-	*((chiaki_unaligned_uint32_t *)(buf + 4)) = 0; // key pos
-	*((chiaki_unaligned_uint32_t *)(buf + 8)) = 0; // gmac
-	memcpy(buf + 0xc, payload, payload_size);
-	ChiakiErrorCode err = takion_send_feedback_packet(takion, buf, buf_size);
-	free(buf);
-	return err;
+	uint8_t header[0xc];
+	takion_write_feedback_header(header, TAKION_PACKET_TYPE_FEEDBACK_HISTORY, seq_num);
+	return takion_send_feedback_packet(takion, header, payload, payload_size);
 }
 
 static ChiakiErrorCode takion_handshake(ChiakiTakion *takion, uint32_t *seq_num_remote_initial)
@@ -650,8 +822,7 @@ static void takion_data_drop(uint64_t seq_num, void *elem_user, void *cb_user)
 	ChiakiTakion *takion = cb_user;
 	CHIAKI_LOGE(takion->log, "Takion dropping data with seq num %#llx", (unsigned long long)seq_num);
 	TakionDataPacketEntry *entry = elem_user;
-	free(entry->packet_buf);
-	free(entry);
+	takion_data_packet_entry_free(takion, entry);
 }
 
 static void *takion_thread_func(void *user)
@@ -662,17 +833,17 @@ static void *takion_thread_func(void *user)
 	if(takion_handshake(takion, &seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
 		goto beach;
 
-	if(chiaki_reorder_queue_init_32(&takion->data_queue, TAKION_REORDER_QUEUE_SIZE_EXP, seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
+	if(chiaki_reorder_queue_init_32(&takion->data_queue, takion->mem, TAKION_REORDER_QUEUE_SIZE_EXP, seq_num_remote_initial) != CHIAKI_ERR_SUCCESS)
 		goto beach;
 
 	chiaki_reorder_queue_set_drop_cb(&takion->data_queue, takion_data_drop, takion);
 
 	// The send buffer size MUST be consistent with the acked seqnums array size in takion_handle_packet_message_data_ack()
-	if(chiaki_takion_send_buffer_init(&takion->send_buffer, takion, TAKION_SEND_BUFFER_SIZE) != CHIAKI_ERR_SUCCESS)
+	if(chiaki_takion_send_buffer_init(&takion->send_buffer, takion, takion->timer_service, TAKION_SEND_BUFFER_SIZE) != CHIAKI_ERR_SUCCESS)
 		goto error_reoder_queue;
 
 	// TODO ChiakiCongestionControl congestion_control;
-	// if(chiaki_congestion_control_start(&congestion_control, takion) != CHIAKI_ERR_SUCCESS)
+	// if(chiaki_congestion_control_start(&congestion_control, takion, takion->timer_service) != CHIAKI_ERR_SUCCESS)
 	// 	goto beach;
 
 	if(takion->cb)
@@ -682,90 +853,196 @@ static void *takion_thread_func(void *user)
 		takion->cb(&event, takion->cb_user);
 	}
 
-	bool crypt_available = takion->gkcrypt_remote ? true : false;
+	takion->crypt_available = takion->gkcrypt_remote ? true : false;
 
-	while(true)
+	if(takion->reactor)
+	{
+		ChiakiErrorCode err = chiaki_reactor_add(takion->reactor, &takion->reactor_source, takion->sock, takion_reactor_cb, takion);
+		if(err == CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGI(takion->log, "Takion handed socket to reactor");
+			takion->reactor_active = true;
+			return NULL;
+		}
+		CHIAKI_LOGW(takion->log, "Takion failed to register with reactor, receiving on its own thread");
+	}
+
+	if(takion->pipeline_crypto_workers && takion_pipeline_start(takion))
+	{
+		takion_pipeline_receive(takion);
+		takion_pipeline_stop(takion);
+	}
+	else
 	{
-		if(takion->enable_crypt && !crypt_available && takion->gkcrypt_remote)
+		while(true)
 		{
-			crypt_available = true;
-			CHIAKI_LOGI(takion->log, "Crypt has become available. Re-checking MACs of %llu packets", (unsigned long long)chiaki_reorder_queue_count(&takion->data_queue));
-			for(uint64_t i=0; i<chiaki_reorder_queue_count(&takion->data_queue); i++)
+			takion_check_crypt_available(takion);
+
+			size_t received_size = 1500;
+			uint8_t *buf = malloc(received_size); // TODO: no malloc?
+			if(!buf)
+				break;
+			uint64_t recv_time_us;
+			ChiakiErrorCode err = takion_recv(takion, buf, &received_size, UINT64_MAX, &recv_time_us);
+			if(err != CHIAKI_ERR_SUCCESS)
 			{
-				TakionDataPacketEntry *packet;
-				bool peeked = chiaki_reorder_queue_peek(&takion->data_queue, i, NULL, (void **)&packet);
-				if(!peeked)
-					continue;
-				if(packet->packet_size == 0)
-					continue;
-				uint8_t base_type = (uint8_t)(packet->packet_buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
-				if(takion_handle_packet_mac(takion, base_type, packet->packet_buf, packet->packet_size) != CHIAKI_ERR_SUCCESS)
-				{
-					CHIAKI_LOGW(takion->log, "Found an invalid MAC");
-					chiaki_reorder_queue_drop(&takion->data_queue, i);
-				}
+				free(buf);
+				break;
 			}
-
+			uint8_t *resized_buf = realloc(buf, received_size);
+			if(!resized_buf)
+			{
+				free(buf);
+				continue;
+			}
+			takion_handle_packet(takion, resized_buf, received_size, recv_time_us);
 		}
+	}
+
+	// chiaki_congestion_control_stop(&congestion_control);
+
+	takion_fini_connected(takion);
+	takion_disconnected(takion);
+	return NULL;
+
+error_reoder_queue:
+	chiaki_reorder_queue_fini(&takion->data_queue);
+
+beach:
+	takion_disconnected(takion);
+	return NULL;
+}
+
+static void takion_fini_connected(ChiakiTakion *takion)
+{
+	chiaki_takion_send_buffer_fini(&takion->send_buffer);
+	chiaki_reorder_queue_fini(&takion->data_queue);
 
-		if(takion->postponed_packets && takion->gkcrypt_remote)
+	// crypt never became available for these
+	if(takion->postponed_packets)
+	{
+		for(size_t i=0; i<takion->postponed_packets_count; i++)
 		{
-			// there are some postponed packets that were waiting until crypt is initialized and it is now :-)
+			ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[i];
+			chiaki_mem_uncharge(takion->mem, CHIAKI_MEM_TAG_POSTPONED, packet->buf_size);
+			free(packet->buf);
+		}
+		chiaki_mem_free(takion->mem, CHIAKI_MEM_TAG_POSTPONED, takion->postponed_packets, takion->postponed_packets_size * sizeof(ChiakiTakionPostponedPacket));
+		takion->postponed_packets = NULL;
+		takion->postponed_packets_size = 0;
+		takion->postponed_packets_count = 0;
+	}
+}
 
-			CHIAKI_LOGI(takion->log, "Takion flushing %llu postpone packet(s)", (unsigned long long)takion->postponed_packets_count);
+static void takion_disconnected(ChiakiTakion *takion)
+{
+	if(takion->cb)
+	{
+		ChiakiTakionEvent event = { 0 };
+		event.type = CHIAKI_TAKION_EVENT_TYPE_DISCONNECT;
+		takion->cb(&event, takion->cb_user);
+	}
+	takion->net->close(takion->net, takion->sock);
+}
 
-			for(size_t i=0; i<takion->postponed_packets_count; i++)
+/**
+ * Must be called before handling any received packet.
+ */
+static void takion_check_crypt_available(ChiakiTakion *takion)
+{
+	if(takion->enable_crypt && !takion->crypt_available && takion->gkcrypt_remote)
+	{
+		takion->crypt_available = true;
+		CHIAKI_LOGI(takion->log, "Crypt has become available. Re-checking MACs of %llu packets", (unsigned long long)chiaki_reorder_queue_count(&takion->data_queue));
+		for(uint64_t i=0; i<chiaki_reorder_queue_count(&takion->data_queue); i++)
+		{
+			TakionDataPacketEntry *packet;
+			bool peeked = chiaki_reorder_queue_peek(&takion->data_queue, i, NULL, (void **)&packet);
+			if(!peeked)
+				continue;
+			if(packet->packet_size == 0)
+				continue;
+			uint8_t base_type = (uint8_t)(packet->packet_buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
+			if(takion_handle_packet_mac(takion, base_type, packet->packet_buf, packet->packet_size) != CHIAKI_ERR_SUCCESS)
 			{
-				ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[i];
-				takion_handle_packet(takion, packet->buf, packet->buf_size);
+				CHIAKI_LOGW(takion->log, "Found an invalid MAC");
+				chiaki_reorder_queue_drop(&takion->data_queue, i);
 			}
-			free(takion->postponed_packets);
-			takion->postponed_packets = NULL;
-			takion->postponed_packets_size = 0;
-			takion->postponed_packets_count = 0;
 		}
 
+	}
+
+	if(takion->postponed_packets && takion->gkcrypt_remote)
+	{
+		// there are some postponed packets that were waiting until crypt is initialized and it is now :-)
+
+		CHIAKI_LOGI(takion->log, "Takion flushing %llu postpone packet(s)", (unsigned long long)takion->postponed_packets_count);
+
+		for(size_t i=0; i<takion->postponed_packets_count; i++)
+		{
+			ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[i];
+			chiaki_mem_uncharge(takion->mem, CHIAKI_MEM_TAG_POSTPONED, packet->buf_size);
+			takion_handle_packet(takion, packet->buf, packet->buf_size, packet->recv_time_us);
+		}
+		chiaki_mem_free(takion->mem, CHIAKI_MEM_TAG_POSTPONED, takion->postponed_packets, takion->postponed_packets_size * sizeof(ChiakiTakionPostponedPacket));
+		takion->postponed_packets = NULL;
+		takion->postponed_packets_size = 0;
+		takion->postponed_packets_count = 0;
+	}
+}
+
+static void takion_reactor_cb(void *user)
+{
+	ChiakiTakion *takion = user;
+	while(true)
+	{
+		takion_check_crypt_available(takion);
+
 		size_t received_size = 1500;
-		uint8_t *buf = malloc(received_size); // TODO: no malloc?
+		uint8_t *buf = malloc(received_size);
 		if(!buf)
-			break;
-		ChiakiErrorCode err = takion_recv(takion, buf, &received_size, UINT64_MAX);
-		if(err != CHIAKI_ERR_SUCCESS)
+			return;
+		// the socket stays blocking for sending, only receiving must not block here
+		uint64_t recv_time_us;
+		int received_sz = chiaki_net_system_recv_timestamp(takion->sock, buf, received_size, MSG_DONTWAIT, &recv_time_us);
+		if(received_sz <= 0)
 		{
 			free(buf);
-			break;
+			if(received_sz < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return;
+			if(received_sz < 0 && errno == EINTR)
+				continue;
+			if(received_sz < 0)
+				CHIAKI_LOGE(takion->log, "Takion recv failed: %s", strerror(errno));
+			else
+				CHIAKI_LOGE(takion->log, "Takion recv returned 0");
+			// same as the receive thread: stop receiving and tear down,
+			// chiaki_takion_close() then only releases the reactor source
+			chiaki_reactor_detach(&takion->reactor_source);
+			takion->reactor_failed = true;
+			takion_fini_connected(takion);
+			takion_disconnected(takion);
+			return;
 		}
-		uint8_t *resized_buf = realloc(buf, received_size);
+		uint8_t *resized_buf = realloc(buf, (size_t)received_sz);
 		if(!resized_buf)
 		{
 			free(buf);
 			continue;
 		}
-		takion_handle_packet(takion, resized_buf, received_size);
-	}
-
-	// chiaki_congestion_control_stop(&congestion_control);
-
-	chiaki_takion_send_buffer_fini(&takion->send_buffer);
-
-error_reoder_queue:
-	chiaki_reorder_queue_fini(&takion->data_queue);
-
-beach:
-	if(takion->cb)
-	{
-		ChiakiTakionEvent event = { 0 };
-		event.type = CHIAKI_TAKION_EVENT_TYPE_DISCONNECT;
-		takion->cb(&event, takion->cb_user);
+		if(!recv_time_us)
+			recv_time_us = chiaki_clock_now_us(takion->clock);
+		takion_handle_packet(takion, resized_buf, (size_t)received_sz, recv_time_us);
 	}
-	CHIAKI_SOCKET_CLOSE(takion->sock);
-	return NULL;
 }
 
 
-static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms)
+/**
+ * @param recv_time_us optional, set to when the datagram arrived, see ChiakiTakionAVPacket.recv_time_us
+ */
+static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *buf_size, uint64_t timeout_ms, uint64_t *recv_time_us)
 {
-	ChiakiErrorCode err = chiaki_stop_pipe_select_single(&takion->stop_pipe, takion->sock, false, timeout_ms);
+	ChiakiErrorCode err = chiaki_net_backend_select_single(takion->net, &takion->stop_pipe, takion->sock, false, timeout_ms);
 	if(err == CHIAKI_ERR_TIMEOUT || err == CHIAKI_ERR_CANCELED)
 		return err;
 	if(err != CHIAKI_ERR_SUCCESS)
@@ -774,7 +1051,10 @@ static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *b
 		return err;
 	}
 
-	int received_sz = recv(takion->sock, buf, *buf_size, 0);
+	uint64_t timestamp_us = 0;
+	int received_sz = takion->rx_timestamps
+		? takion->net->recv_timestamp(takion->net, takion->sock, buf, *buf_size, &timestamp_us)
+		: takion->net->recv(takion->net, takion->sock, buf, *buf_size);
 	if(received_sz <= 0)
 	{
 		if(received_sz < 0)
@@ -784,6 +1064,8 @@ static ChiakiErrorCode takion_recv(ChiakiTakion *takion, uint8_t *buf, size_t *b
 		return CHIAKI_ERR_NETWORK;
 	}
 	*buf_size = (size_t)received_sz;
+	if(recv_time_us)
+		*recv_time_us = timestamp_us ? timestamp_us : chiaki_clock_now_us(takion->clock);
 	return CHIAKI_ERR_SUCCESS;
 }
 
@@ -817,11 +1099,11 @@ static ChiakiErrorCode takion_handle_packet_mac(ChiakiTakion *takion, uint8_t ba
 	return CHIAKI_ERR_SUCCESS;
 }
 
-static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, uint64_t recv_time_us)
 {
 	if(!takion->postponed_packets)
 	{
-		takion->postponed_packets = calloc(TAKION_POSTPONE_PACKETS_SIZE, sizeof(ChiakiTakionPostponedPacket));
+		takion->postponed_packets = chiaki_mem_calloc(takion->mem, CHIAKI_MEM_TAG_POSTPONED, TAKION_POSTPONE_PACKETS_SIZE, sizeof(ChiakiTakionPostponedPacket));
 		if(!takion->postponed_packets)
 			return;
 		takion->postponed_packets_size = TAKION_POSTPONE_PACKETS_SIZE;
@@ -838,13 +1120,16 @@ static void takion_postpone_packet(ChiakiTakion *takion, uint8_t *buf, size_t bu
 	ChiakiTakionPostponedPacket *packet = &takion->postponed_packets[takion->postponed_packets_count++];
 	packet->buf = buf;
 	packet->buf_size = buf_size;
+	packet->recv_time_us = recv_time_us;
+	// received buffers come from malloc(), they are only counted while waiting here
+	chiaki_mem_charge(takion->mem, CHIAKI_MEM_TAG_POSTPONED, buf_size);
 }
 
 
 /**
  * @param buf ownership of this buf is taken.
  */
-static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size)
+static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_size, uint64_t recv_time_us)
 {
 	assert(buf_size > 0);
 	uint8_t base_type = (uint8_t)(buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
@@ -863,10 +1148,10 @@ static void takion_handle_packet(ChiakiTakion *takion, uint8_t *buf, size_t buf_
 		case TAKION_PACKET_TYPE_VIDEO:
 		case TAKION_PACKET_TYPE_AUDIO:
 			if(takion->enable_crypt && !takion->gkcrypt_remote)
-				takion_postpone_packet(takion, buf, buf_size);
+				takion_postpone_packet(takion, buf, buf_size, recv_time_us);
 			else
 			{
-				takion_handle_packet_av(takion, base_type, buf, buf_size);
+				takion_handle_packet_av(takion, base_type, buf, buf_size, recv_time_us);
 				free(buf);
 			}
 			break;
@@ -923,8 +1208,7 @@ static void takion_flush_data_queue(ChiakiTakion *takion)
 
 		if(entry->payload_size < 9)
 		{
-			free(entry->packet_buf);
-			free(entry);
+			takion_data_packet_entry_free(takion, entry);
 			continue;
 		}
 
@@ -949,8 +1233,7 @@ static void takion_flush_data_queue(ChiakiTakion *takion)
 			takion->cb(&event, takion->cb_user);
 		}
 
-		free(entry->packet_buf);
-		free(entry);
+		takion_data_packet_entry_free(takion, entry);
 	}
 
 	if(ack)
@@ -968,9 +1251,11 @@ static void takion_handle_packet_message_data(ChiakiTakion *takion, uint8_t *pac
 		return;
 	}
 
-	TakionDataPacketEntry *entry = malloc(sizeof(TakionDataPacketEntry));
+	TakionDataPacketEntry *entry = chiaki_mem_alloc(takion->mem, CHIAKI_MEM_TAG_REORDER, sizeof(TakionDataPacketEntry));
 	if(!entry)
 		return;
+	// the packet buf itself comes from malloc(), count it for as long as the entry is queued
+	chiaki_mem_charge(takion->mem, CHIAKI_MEM_TAG_REORDER, packet_buf_size);
 
 	entry->type_b = type_b;
 	entry->packet_buf = packet_buf;
@@ -1109,7 +1394,7 @@ static ChiakiErrorCode takion_recv_message_init_ack(ChiakiTakion *takion, Takion
 {
 	uint8_t message[1 + TAKION_MESSAGE_HEADER_SIZE + 0x10 + TAKION_COOKIE_SIZE];
 	size_t received_size = sizeof(message);
-	ChiakiErrorCode err = takion_recv(takion, message, &received_size, TAKION_EXPECT_TIMEOUT_MS);
+	ChiakiErrorCode err = takion_recv(takion, message, &received_size, TAKION_EXPECT_TIMEOUT_MS, NULL);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
@@ -1157,7 +1442,7 @@ static ChiakiErrorCode takion_recv_message_cookie_ack(ChiakiTakion *takion)
 {
 	uint8_t message[1 + TAKION_MESSAGE_HEADER_SIZE];
 	size_t received_size = sizeof(message);
-	ChiakiErrorCode err = takion_recv(takion, message, &received_size, TAKION_EXPECT_TIMEOUT_MS);
+	ChiakiErrorCode err = takion_recv(takion, message, &received_size, TAKION_EXPECT_TIMEOUT_MS, NULL);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return err;
 
@@ -1193,7 +1478,7 @@ static ChiakiErrorCode takion_recv_message_cookie_ack(ChiakiTakion *takion)
 }
 
 
-static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size)
+static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uint8_t *buf, size_t buf_size, uint64_t recv_time_us)
 {
 	// HHIxIIx
 
@@ -1207,16 +1492,342 @@ static void takion_handle_packet_av(ChiakiTakion *takion, uint8_t base_type, uin
 			CHIAKI_LOGE(takion->log, "Takion received AV packet that was too small");
 		return;
 	}
+	packet.recv_time_us = recv_time_us;
 
+	takion_av_packet_emit(takion, &packet);
+}
+
+static void takion_av_packet_emit(ChiakiTakion *takion, ChiakiTakionAVPacket *packet)
+{
 	if(takion->cb)
 	{
 		ChiakiTakionEvent event = { 0 };
 		event.type = CHIAKI_TAKION_EVENT_TYPE_AV;
-		event.av = &packet;
+		event.av = packet;
 		takion->cb(&event, takion->cb_user);
 	}
 }
 
+/*
+ * Receive pipeline
+ *
+ * receive stage (Takion thread) -> crypto worker i (round-robin) -> reassembly stage
+ *
+ * The receive stage hands datagram n to worker n % workers_count and the reassembly stage
+ * collects them in the same order, so the callback still sees packets exactly as received.
+ * Everything that depends on Takion state (control messages, postponing until crypt is available)
+ * stays on the reassembly stage, the workers only handle AV packets once crypt_ready is set.
+ */
+
+static void takion_pipeline_packet_drop(TakionPipelinePacket *packet)
+{
+	free(packet->buf);
+	packet->buf = NULL;
+}
+
+/**
+ * Verify the MACs of all AV packets in packets with one call to chiaki_gkcrypt_gmac_verify_batch(),
+ * dropping the ones that don't match.
+ */
+static void takion_pipeline_verify_batch(ChiakiTakion *takion, TakionPipelinePacket **packets, size_t count)
+{
+	ChiakiGKCryptGmacVerify verify[TAKION_PIPELINE_CRYPTO_BATCH];
+	TakionPipelinePacket *verify_packets[TAKION_PIPELINE_CRYPTO_BATCH];
+	size_t verify_count = 0;
+	for(size_t i=0; i<count; i++)
+	{
+		TakionPipelinePacket *packet = packets[i];
+		if(!packet->buf)
+			continue;
+		ChiakiGKCryptGmacVerify *entry = &verify[verify_count];
+		ChiakiTakionPacketKeyPos key_pos;
+		if(takion_packet_mac_extract(packet->buf, packet->buf_size, entry->gmac, &key_pos) != CHIAKI_ERR_SUCCESS)
+		{
+			CHIAKI_LOGE(takion->log, "Takion failed to calculate mac for received packet");
+			takion_pipeline_packet_drop(packet);
+			continue;
+		}
+		entry->key_pos = key_pos;
+		entry->buf = packet->buf;
+		entry->buf_size = packet->buf_size;
+		verify_packets[verify_count++] = packet;
+	}
+
+	if(chiaki_gkcrypt_gmac_verify_batch(takion->gkcrypt_remote, verify, verify_count) != CHIAKI_ERR_SUCCESS)
+	{
+		CHIAKI_LOGE(takion->log, "Takion failed to calculate macs for %llu received packets", (unsigned long long)verify_count);
+		for(size_t i=0; i<verify_count; i++)
+			takion_pipeline_packet_drop(verify_packets[i]);
+		return;
+	}
+
+	for(size_t i=0; i<verify_count; i++)
+	{
+		if(verify[i].valid)
+			continue;
+		TakionPipelinePacket *packet = verify_packets[i];
+		CHIAKI_LOGE(takion->log, "Takion packet MAC mismatch for packet type %#x with key_pos %#llx",
+				(unsigned int)(packet->buf[0] & TAKION_PACKET_BASE_TYPE_MASK), (unsigned long long)verify[i].key_pos);
+		takion_pipeline_packet_drop(packet);
+	}
+}
+
+static void takion_pipeline_crypto(ChiakiTakion *takion, TakionPipelinePacket **packets, size_t count)
+{
+	if(!chiaki_atomic_load_u32(&takion->pipeline.crypt_ready))
+		return;
+
+	// only AV packets are handled here, everything else is passed on untouched
+	TakionPipelinePacket *av_packets[TAKION_PIPELINE_CRYPTO_BATCH];
+	size_t av_count = 0;
+	for(size_t i=0; i<count; i++)
+	{
+		uint8_t base_type = (uint8_t)(packets[i]->buf[0] & TAKION_PACKET_BASE_TYPE_MASK);
+		if(base_type == TAKION_PACKET_TYPE_VIDEO || base_type == TAKION_PACKET_TYPE_AUDIO)
+			av_packets[av_count++] = packets[i];
+	}
+
+	if(takion->gkcrypt_remote)
+		takion_pipeline_verify_batch(takion, av_packets, av_count);
+
+	for(size_t i=0; i<av_count; i++)
+	{
+		TakionPipelinePacket *packet = av_packets[i];
+		if(!packet->buf)
+			continue;
+
+		ChiakiErrorCode err = takion->av_packet_parse(&packet->av, packet->buf, packet->buf_size);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			if(err == CHIAKI_ERR_BUF_TOO_SMALL)
+				CHIAKI_LOGE(takion->log, "Takion received AV packet that was too small");
+			takion_pipeline_packet_drop(packet);
+			continue;
+		}
+		packet->av.recv_time_us = packet->recv_time_us;
+
+		if(takion->gkcrypt_remote)
+		{
+			err = chiaki_gkcrypt_decrypt(takion->gkcrypt_remote, packet->av.key_pos + CHIAKI_GKCRYPT_BLOCK_SIZE, packet->av.data, packet->av.data_size);
+			if(err != CHIAKI_ERR_SUCCESS)
+			{
+				CHIAKI_LOGE(takion->log, "Takion failed to decrypt AV packet");
+				takion_pipeline_packet_drop(packet);
+				continue;
+			}
+			packet->av.decrypted = true;
+		}
+
+		packet->av_ready = true;
+	}
+}
+
+static void *takion_pipeline_crypto_thread_func(void *user)
+{
+	ChiakiTakionPipelineWorker *worker = user;
+	TakionPipelinePacket *packets[TAKION_PIPELINE_CRYPTO_BATCH];
+	void *item;
+	while(chiaki_spsc_ring_pop(&worker->in, &item) == CHIAKI_ERR_SUCCESS)
+	{
+		// take whatever else is already waiting to verify it together
+		size_t count = 0;
+		packets[count++] = item;
+		while(count < TAKION_PIPELINE_CRYPTO_BATCH && chiaki_spsc_ring_try_pop(&worker->in, &item))
+			packets[count++] = item;
+
+		takion_pipeline_crypto(worker->takion, packets, count);
+
+		for(size_t i=0; i<count; i++)
+		{
+			if(chiaki_spsc_ring_push(&worker->out, packets[i]) != CHIAKI_ERR_SUCCESS)
+			{
+				free(packets[i]->buf);
+				free(packets[i]);
+			}
+		}
+	}
+	chiaki_spsc_ring_close(&worker->out);
+	return NULL;
+}
+
+static void *takion_pipeline_reassembly_thread_func(void *user)
+{
+	ChiakiTakion *takion = user;
+	ChiakiTakionPipeline *pipeline = &takion->pipeline;
+	size_t next = 0;
+	while(true)
+	{
+		void *item;
+		// the next packet can only be at this worker, it is closed once the receive stage is done
+		if(chiaki_spsc_ring_pop(&pipeline->workers[next].out, &item) != CHIAKI_ERR_SUCCESS)
+			break;
+		next = (next + 1) % pipeline->workers_count;
+		TakionPipelinePacket *packet = item;
+
+		takion_check_crypt_available(takion);
+		// postponed packets have just been flushed, so packets verified by the workers from now on can't overtake them
+		if(!pipeline->crypt_ready && (!takion->enable_crypt || takion->gkcrypt_remote))
+			chiaki_atomic_store_u32(&pipeline->crypt_ready, 1);
+
+		if(packet->av_ready)
+		{
+			takion_av_packet_emit(takion, &packet->av);
+			free(packet->buf);
+		}
+		else if(packet->buf)
+			takion_handle_packet(takion, packet->buf, packet->buf_size, packet->recv_time_us);
+		free(packet);
+	}
+
+	// drain whatever the other workers still hold
+	for(size_t i=0; i<pipeline->workers_count; i++)
+	{
+		void *item;
+		while(chiaki_spsc_ring_pop(&pipeline->workers[i].out, &item) == CHIAKI_ERR_SUCCESS)
+		{
+			TakionPipelinePacket *packet = item;
+			free(packet->buf);
+			free(packet);
+		}
+	}
+	return NULL;
+}
+
+static bool takion_pipeline_start(ChiakiTakion *takion)
+{
+	ChiakiTakionPipeline *pipeline = &takion->pipeline;
+	pipeline->workers_count = 0;
+	pipeline->reassembly_running = false;
+	chiaki_atomic_store_u32(&pipeline->crypt_ready, 0);
+
+	for(size_t i=0; i<takion->pipeline_crypto_workers; i++)
+	{
+		ChiakiTakionPipelineWorker *worker = &pipeline->workers[i];
+		worker->takion = takion;
+		if(chiaki_spsc_ring_init_clock(&worker->in, TAKION_PIPELINE_RING_SIZE, takion->clock) != CHIAKI_ERR_SUCCESS)
+			goto error;
+		if(chiaki_spsc_ring_init_clock(&worker->out, TAKION_PIPELINE_RING_SIZE, takion->clock) != CHIAKI_ERR_SUCCESS)
+		{
+			chiaki_spsc_ring_fini(&worker->in);
+			goto error;
+		}
+		if(chiaki_clock_thread_create(takion->clock, &worker->thread, takion_pipeline_crypto_thread_func, worker) != CHIAKI_ERR_SUCCESS)
+		{
+			chiaki_spsc_ring_fini(&worker->out);
+			chiaki_spsc_ring_fini(&worker->in);
+			goto error;
+		}
+		chiaki_thread_set_name(&worker->thread, "Chiaki Takion Crypto");
+		pipeline->workers_count++;
+	}
+
+	if(chiaki_clock_thread_create(takion->clock, &pipeline->reassembly_thread, takion_pipeline_reassembly_thread_func, takion) != CHIAKI_ERR_SUCCESS)
+		goto error;
+	chiaki_thread_set_name(&pipeline->reassembly_thread, "Chiaki Takion Reassembly");
+	pipeline->reassembly_running = true;
+
+	CHIAKI_LOGI(takion->log, "Takion receiving with %llu crypto worker(s)", (unsigned long long)pipeline->workers_count);
+	return true;
+
+error:
+	CHIAKI_LOGW(takion->log, "Takion failed to start the receive pipeline, receiving on a single thread");
+	takion_pipeline_stop(takion);
+	return false;
+}
+
+/**
+ * Receive stage, runs on the Takion thread until it is stopped or receiving fails.
+ */
+static void takion_pipeline_receive(ChiakiTakion *takion)
+{
+	ChiakiTakionPipeline *pipeline = &takion->pipeline;
+	size_t next = 0;
+	while(true)
+	{
+		TakionPipelinePacket *packet = malloc(sizeof(TakionPipelinePacket));
+		if(!packet)
+			break;
+		size_t received_size = 1500;
+		packet->buf = malloc(received_size);
+		if(!packet->buf)
+		{
+			free(packet);
+			break;
+		}
+		ChiakiErrorCode err = takion_recv(takion, packet->buf, &received_size, UINT64_MAX, &packet->recv_time_us);
+		if(err != CHIAKI_ERR_SUCCESS)
+		{
+			free(packet->buf);
+			free(packet);
+			break;
+		}
+		uint8_t *resized_buf = realloc(packet->buf, received_size);
+		if(resized_buf)
+			packet->buf = resized_buf;
+		packet->buf_size = received_size;
+		packet->av_ready = false;
+
+		// blocks if the worker is behind, which is counted in its ring's push_waits
+		if(chiaki_spsc_ring_push(&pipeline->workers[next].in, packet) != CHIAKI_ERR_SUCCESS)
+		{
+			free(packet->buf);
+			free(packet);
+			break;
+		}
+		next = (next + 1) % pipeline->workers_count;
+	}
+}
+
+/**
+ * Shut down all stages after the receive stage has stopped, also cleans up after a partial start.
+ */
+static void takion_pipeline_stop(ChiakiTakion *takion)
+{
+	ChiakiTakionPipeline *pipeline = &takion->pipeline;
+
+	// each worker finishes its remaining packets and closes its out ring, which ends the reassembly stage
+	for(size_t i=0; i<pipeline->workers_count; i++)
+		chiaki_spsc_ring_close(&pipeline->workers[i].in);
+	for(size_t i=0; i<pipeline->workers_count; i++)
+		chiaki_thread_join(&pipeline->workers[i].thread, NULL);
+	if(pipeline->reassembly_running)
+	{
+		chiaki_thread_join(&pipeline->reassembly_thread, NULL);
+		pipeline->reassembly_running = false;
+	}
+
+	uint64_t pushed = 0;
+	uint64_t crypto_waits = 0;
+	uint64_t reassembly_waits = 0;
+	uint32_t fill_max = 0;
+	for(size_t i=0; i<pipeline->workers_count; i++)
+	{
+		ChiakiTakionPipelineWorker *worker = &pipeline->workers[i];
+		pushed += worker->in.stats.pushed;
+		crypto_waits += worker->in.stats.push_waits;
+		reassembly_waits += worker->out.stats.push_waits;
+		if(worker->in.stats.fill_max > fill_max)
+			fill_max = worker->in.stats.fill_max;
+		if(worker->out.stats.fill_max > fill_max)
+			fill_max = worker->out.stats.fill_max;
+
+		void *item;
+		while(chiaki_spsc_ring_try_pop(&worker->in, &item))
+		{
+			TakionPipelinePacket *packet = item;
+			free(packet->buf);
+			free(packet);
+		}
+		chiaki_spsc_ring_fini(&worker->out);
+		chiaki_spsc_ring_fini(&worker->in);
+	}
+
+	if(pipeline->workers_count)
+		CHIAKI_LOGI(takion->log, "Takion receive pipeline stopped after %llu packets, waited %llu times for crypto and %llu times for reassembly, max ring fill %u",
+				(unsigned long long)pushed, (unsigned long long)crypto_waits, (unsigned long long)reassembly_waits, (unsigned int)fill_max);
+	pipeline->workers_count = 0;
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_v9_av_packet_parse(ChiakiTakionAVPacket *packet, uint8_t *buf, size_t buf_size)
 {
 	memset(packet, 0, sizeof(ChiakiTakionAVPacket));
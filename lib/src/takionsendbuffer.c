@@ -19,7 +19,7 @@
 
 #include <chiaki/takionsendbuffer.h>
 #include <chiaki/takion.h>
-#include <chiaki/time.h>
+#include <chiaki/clock.h>
 
 #include <string.h>
 #include <assert.h>
@@ -34,69 +34,54 @@ struct chiaki_takion_send_buffer_packet_t
 {
 	ChiakiSeqNum32 seq_num;
 	uint64_t tries;
-	uint64_t last_send_ms; // chiaki_time_now_monotonic_ms()
+	uint64_t last_send_ms; // chiaki_clock_now_ms() of the takion's clock
 	uint8_t *buf;
 	size_t buf_size;
 }; // ChiakiTakionSendBufferPacket
 
 #ifndef CHIAKI_UNIT_TEST
 
-static void *takion_send_buffer_thread_func(void *user);
+static void takion_send_buffer_timer_cb(void *user);
 
-CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, size_t size)
+static uint64_t takion_send_buffer_now_ms(ChiakiTakionSendBuffer *send_buffer)
+{
+	return chiaki_clock_now_ms(send_buffer->takion ? send_buffer->takion->clock : chiaki_clock_system());
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_init(ChiakiTakionSendBuffer *send_buffer, ChiakiTakion *takion, ChiakiTimerService *timer_service, size_t size)
 {
 	send_buffer->takion = takion;
 	send_buffer->log = takion ? takion->log : NULL;
+	send_buffer->mem = takion ? takion->mem : NULL;
+	send_buffer->timer_service = timer_service;
+	chiaki_timer_init(&send_buffer->resend_timer, takion_send_buffer_timer_cb, send_buffer);
 
-	send_buffer->packets = calloc(size, sizeof(ChiakiTakionSendBufferPacket));
+	send_buffer->packets = chiaki_mem_calloc(send_buffer->mem, CHIAKI_MEM_TAG_SEND_BUFFER, size, sizeof(ChiakiTakionSendBufferPacket));
 	if(!send_buffer->packets)
 		return CHIAKI_ERR_MEMORY;
 	send_buffer->packets_size = size;
 	send_buffer->packets_count = 0;
 
-	send_buffer->should_stop = false;
-
 	ChiakiErrorCode err = chiaki_mutex_init(&send_buffer->mutex, false);
 	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_packets;
-
-	err = chiaki_cond_init(&send_buffer->cond);
-	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_mutex;
-
-	err = chiaki_thread_create(&send_buffer->thread, takion_send_buffer_thread_func, send_buffer);
-	if(err != CHIAKI_ERR_SUCCESS)
-		goto error_cond;
-
-	chiaki_thread_set_name(&send_buffer->thread, "Chiaki Takion Send Buffer");
+	{
+		chiaki_mem_free(send_buffer->mem, CHIAKI_MEM_TAG_SEND_BUFFER, send_buffer->packets, size * sizeof(ChiakiTakionSendBufferPacket));
+		return err;
+	}
 
 	return CHIAKI_ERR_SUCCESS;
-error_cond:
-	chiaki_cond_fini(&send_buffer->cond);
-error_mutex:
-	chiaki_mutex_fini(&send_buffer->mutex);
-error_packets:
-	free(send_buffer->packets);
-	return err;
 }
 
 CHIAKI_EXPORT void chiaki_takion_send_buffer_fini(ChiakiTakionSendBuffer *send_buffer)
 {
-	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
-	assert(err == CHIAKI_ERR_SUCCESS);
-	send_buffer->should_stop = true;
-	chiaki_mutex_unlock(&send_buffer->mutex);
-	err = chiaki_cond_signal(&send_buffer->cond);
-	assert(err == CHIAKI_ERR_SUCCESS);
-	err = chiaki_thread_join(&send_buffer->thread, NULL);
-	assert(err == CHIAKI_ERR_SUCCESS);
+	if(send_buffer->timer_service)
+		chiaki_timer_service_cancel(send_buffer->timer_service, &send_buffer->resend_timer);
 
 	for(size_t i=0; i<send_buffer->packets_count; i++)
-		free(send_buffer->packets[i].buf);
+		chiaki_mem_free(send_buffer->mem, CHIAKI_MEM_TAG_SEND_BUFFER, send_buffer->packets[i].buf, send_buffer->packets[i].buf_size);
 
-	chiaki_cond_fini(&send_buffer->cond);
 	chiaki_mutex_fini(&send_buffer->mutex);
-	free(send_buffer->packets);
+	chiaki_mem_free(send_buffer->mem, CHIAKI_MEM_TAG_SEND_BUFFER, send_buffer->packets, send_buffer->packets_size * sizeof(ChiakiTakionSendBufferPacket));
 }
 
 CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuffer *send_buffer, ChiakiSeqNum32 seq_num, uint8_t *buf, size_t buf_size)
@@ -125,21 +110,21 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_push(ChiakiTakionSendBuf
 	ChiakiTakionSendBufferPacket *packet = &send_buffer->packets[send_buffer->packets_count++];
 	packet->seq_num = seq_num;
 	packet->tries = 0;
-	packet->last_send_ms = chiaki_time_now_monotonic_ms();
+	packet->last_send_ms = takion_send_buffer_now_ms(send_buffer);
 	packet->buf = buf;
 	packet->buf_size = buf_size;
 
 	CHIAKI_LOGV(send_buffer->log, "Pushed seq num %#llx into Takion Send Buffer", (unsigned long long)seq_num);
 
-	if(send_buffer->packets_count == 1)
+	if(send_buffer->packets_count == 1 && send_buffer->timer_service)
 	{
-		// buffer was empty before, so it will sleep without timeout => WAKE UP!!
-		chiaki_cond_signal(&send_buffer->cond);
+		// buffer was empty before, so the timer is not running
+		chiaki_timer_service_schedule_ms(send_buffer->timer_service, &send_buffer->resend_timer, TAKION_DATA_RESEND_WAKEUP_TIMEOUT_MS);
 	}
 
 beach:
 	if(err != CHIAKI_ERR_SUCCESS)
-		free(buf);
+		chiaki_mem_free(send_buffer->mem, CHIAKI_MEM_TAG_SEND_BUFFER, buf, buf_size);
 	chiaki_mutex_unlock(&send_buffer->mutex);
 	return err;
 }
@@ -163,7 +148,7 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuff
 			if(acked_seq_nums)
 				acked_seq_nums[(*acked_seq_nums_count)++] = send_buffer->packets[i].seq_num;
 
-			free(send_buffer->packets[i].buf);
+			chiaki_mem_free(send_buffer->mem, CHIAKI_MEM_TAG_SEND_BUFFER, send_buffer->packets[i].buf, send_buffer->packets[i].buf_size);
 			if(shift_start == SIZE_MAX)
 			{
 				// first shift
@@ -208,45 +193,21 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_takion_send_buffer_ack(ChiakiTakionSendBuff
 
 static void takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer);
 
-static bool takion_send_buffer_check_pred_packets(void *user)
-{
-	ChiakiTakionSendBuffer *send_buffer = user;
-	return send_buffer->should_stop;
-}
-
-static bool takion_send_buffer_check_pred_no_packets(void *user)
-{
-	ChiakiTakionSendBuffer *send_buffer = user;
-	return send_buffer->should_stop || send_buffer->packets_count;
-}
-
-static void *takion_send_buffer_thread_func(void *user)
+static void takion_send_buffer_timer_cb(void *user)
 {
 	ChiakiTakionSendBuffer *send_buffer = user;
 
 	ChiakiErrorCode err = chiaki_mutex_lock(&send_buffer->mutex);
 	if(err != CHIAKI_ERR_SUCCESS)
-		return NULL;
-
-	while(true)
-	{
-		if(send_buffer->packets_count) // if there are packets, wait with timeout
-			err = chiaki_cond_timedwait_pred(&send_buffer->cond, &send_buffer->mutex, TAKION_DATA_RESEND_WAKEUP_TIMEOUT_MS, takion_send_buffer_check_pred_packets, send_buffer);
-		else // if not, wait without timeout, but also wakeup if packets become available
-			err = chiaki_cond_wait_pred(&send_buffer->cond, &send_buffer->mutex, takion_send_buffer_check_pred_no_packets, send_buffer);
-
-		if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT)
-			break;
+		return;
 
-		if(send_buffer->should_stop)
-			break;
+	takion_send_buffer_resend(send_buffer);
 
-		takion_send_buffer_resend(send_buffer);
-	}
+	// keep checking as long as there are unacknowledged packets, push() restarts the timer otherwise
+	if(send_buffer->packets_count)
+		chiaki_timer_service_schedule_ms(send_buffer->timer_service, &send_buffer->resend_timer, TAKION_DATA_RESEND_WAKEUP_TIMEOUT_MS);
 
 	chiaki_mutex_unlock(&send_buffer->mutex);
-
-	return NULL;
 }
 
 static void takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer)
@@ -254,7 +215,7 @@ static void takion_send_buffer_resend(ChiakiTakionSendBuffer *send_buffer)
 	if(!send_buffer->takion)
 		return;
 
-	uint64_t now = chiaki_time_now_monotonic_ms();
+	uint64_t now = takion_send_buffer_now_ms(send_buffer);
 
 	for(size_t i=0; i<send_buffer->packets_count; i++)
 	{
@@ -302,6 +302,25 @@ CHIAKI_EXPORT ChiakiErrorCode chiaki_cond_timedwait(ChiakiCond *cond, ChiakiMute
 #endif
 }
 
+CHIAKI_EXPORT ChiakiErrorCode chiaki_cond_timedwait_us(ChiakiCond *cond, ChiakiMutex *mutex, uint64_t timeout_us)
+{
+#if defined(_WIN32) || __APPLE__
+	// round up to never wake up early
+	return chiaki_cond_timedwait(cond, mutex, timeout_us / 1000 + (timeout_us % 1000 ? 1 : 0));
+#else
+	struct timespec timeout;
+	clock_gettime(CLOCK_MONOTONIC, &timeout);
+	timeout.tv_sec += timeout_us / 1000000;
+	timeout.tv_nsec += (timeout_us % 1000000) * 1000;
+	if(timeout.tv_nsec >= 1000000000)
+	{
+		timeout.tv_sec += timeout.tv_nsec / 1000000000;
+		timeout.tv_nsec %= 1000000000;
+	}
+	return chiaki_cond_timedwait_abs(cond, mutex, &timeout);
+#endif
+}
+
 CHIAKI_EXPORT ChiakiErrorCode chiaki_cond_wait_pred(ChiakiCond *cond, ChiakiMutex *mutex, ChiakiCheckPred check_pred, void *check_pred_user)
 {
 	while(!check_pred(check_pred_user))
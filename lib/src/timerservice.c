@@ -0,0 +1,349 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki/timerservice.h>
+
+#include <string.h>
+#include <assert.h>
+
+#define TICK_US ((uint64_t)1 << CHIAKI_TIMER_SERVICE_TICK_SHIFT)
+#define LEVEL_MASK (CHIAKI_TIMER_SERVICE_LEVEL_SLOTS - 1)
+#define LEVEL_SHIFT(level) ((level) * CHIAKI_TIMER_SERVICE_LEVEL_BITS)
+#define TICKS_MAX ((uint64_t)1 << LEVEL_SHIFT(CHIAKI_TIMER_SERVICE_LEVELS))
+
+static void *timer_service_thread_func(void *user);
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_timer_service_init(ChiakiTimerService *service, ChiakiLog *log)
+{
+	return chiaki_timer_service_init_clock(service, chiaki_clock_system(), log);
+}
+
+CHIAKI_EXPORT ChiakiErrorCode chiaki_timer_service_init_clock(ChiakiTimerService *service, ChiakiClock *clock, ChiakiLog *log)
+{
+	service->log = log;
+	service->clock = clock;
+	service->should_stop = false;
+	memset(service->wheel, 0, sizeof(service->wheel));
+	service->tick = chiaki_clock_now_us(clock) >> CHIAKI_TIMER_SERVICE_TICK_SHIFT;
+	service->wakeup_tick = 0;
+	service->expired = NULL;
+	service->running = NULL;
+	memset(&service->stats, 0, sizeof(service->stats));
+
+	ChiakiErrorCode err = chiaki_mutex_init(&service->mutex, false);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return err;
+
+	err = chiaki_cond_init(&service->cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_mutex;
+
+	err = chiaki_cond_init(&service->idle_cond);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_cond;
+
+	err = chiaki_clock_thread_create(service->clock, &service->thread, timer_service_thread_func, service);
+	if(err != CHIAKI_ERR_SUCCESS)
+		goto error_idle_cond;
+
+	chiaki_thread_set_name(&service->thread, "Chiaki Timer Service");
+
+	return CHIAKI_ERR_SUCCESS;
+error_idle_cond:
+	chiaki_cond_fini(&service->idle_cond);
+error_cond:
+	chiaki_cond_fini(&service->cond);
+error_mutex:
+	chiaki_mutex_fini(&service->mutex);
+	return err;
+}
+
+CHIAKI_EXPORT void chiaki_timer_service_fini(ChiakiTimerService *service)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&service->mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	service->should_stop = true;
+	chiaki_clock_cond_signal(service->clock, &service->cond);
+	chiaki_mutex_unlock(&service->mutex);
+
+	chiaki_thread_join(&service->thread, NULL);
+
+	if(service->stats.fired)
+	{
+		CHIAKI_LOGV(service->log, "Timer Service fired %llu timers, lateness mean: %llu us, max: %llu us",
+				(unsigned long long)service->stats.fired,
+				(unsigned long long)(service->stats.lateness_us_sum / service->stats.fired),
+				(unsigned long long)service->stats.lateness_us_max);
+	}
+
+	chiaki_cond_fini(&service->idle_cond);
+	chiaki_cond_fini(&service->cond);
+	chiaki_mutex_fini(&service->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_timer_init(ChiakiTimer *timer, ChiakiTimerCallback cb, void *user)
+{
+	timer->cb = cb;
+	timer->user = user;
+	timer->next = NULL;
+	timer->pprev = NULL;
+	timer->deadline_us = 0;
+	timer->expires_tick = 0;
+	timer->scheduled = false;
+}
+
+static void timer_link(ChiakiTimer **head, ChiakiTimer *timer)
+{
+	timer->next = *head;
+	if(timer->next)
+		timer->next->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+}
+
+static void timer_unlink(ChiakiTimer *timer)
+{
+	*timer->pprev = timer->next;
+	if(timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+/**
+ * Put the timer into the slot of the lowest level that still covers its expiry tick.
+ * service->mutex must be locked.
+ */
+static void timer_service_insert(ChiakiTimerService *service, ChiakiTimer *timer)
+{
+	uint64_t expires = timer->expires_tick;
+	if(expires < service->tick)
+		expires = service->tick;
+	uint64_t delta = expires - service->tick;
+	if(delta >= TICKS_MAX)
+	{
+		// too far in the future, park it in the last slot and re-insert it from there
+		delta = TICKS_MAX - 1;
+		expires = service->tick + delta;
+	}
+
+	unsigned int level = 0;
+	while(level < CHIAKI_TIMER_SERVICE_LEVELS - 1 && delta >= ((uint64_t)1 << LEVEL_SHIFT(level + 1)))
+		level++;
+
+	timer_link(&service->wheel[level][(expires >> LEVEL_SHIFT(level)) & LEVEL_MASK], timer);
+}
+
+/**
+ * @return the earliest tick at which either a timer expires or a slot of a higher level must be cascaded,
+ * UINT64_MAX if no timers are scheduled at all.
+ */
+static uint64_t timer_service_next_tick(ChiakiTimerService *service)
+{
+	uint64_t tick = service->tick;
+	uint64_t next = UINT64_MAX;
+
+	for(uint64_t i=0; i<CHIAKI_TIMER_SERVICE_LEVEL_SLOTS; i++)
+	{
+		if(service->wheel[0][(tick + i) & LEVEL_MASK])
+		{
+			next = tick + i;
+			break;
+		}
+	}
+
+	for(unsigned int level=1; level<CHIAKI_TIMER_SERVICE_LEVELS; level++)
+	{
+		unsigned int shift = LEVEL_SHIFT(level);
+		// if we are inside of a period of this level, its current slot has already been cascaded
+		// and holds timers for one full revolution later.
+		bool inside = (tick & (((uint64_t)1 << shift) - 1)) != 0;
+		uint64_t k_start = inside ? 1 : 0;
+		uint64_t k_end = inside ? CHIAKI_TIMER_SERVICE_LEVEL_SLOTS : CHIAKI_TIMER_SERVICE_LEVEL_SLOTS - 1;
+		for(uint64_t k=k_start; k<=k_end; k++)
+		{
+			uint64_t period = (tick >> shift) + k;
+			if(service->wheel[level][period & LEVEL_MASK])
+			{
+				uint64_t boundary = period << shift;
+				if(boundary < next)
+					next = boundary;
+				break;
+			}
+		}
+	}
+
+	return next;
+}
+
+static void timer_service_cascade(ChiakiTimerService *service, unsigned int level, size_t slot)
+{
+	ChiakiTimer *timer = service->wheel[level][slot];
+	service->wheel[level][slot] = NULL;
+	while(timer)
+	{
+		ChiakiTimer *next = timer->next;
+		timer_service_insert(service, timer);
+		timer = next;
+	}
+}
+
+/**
+ * Process service->tick and move all timers expiring at it to service->expired.
+ */
+static void timer_service_process_tick(ChiakiTimerService *service)
+{
+	uint64_t tick = service->tick;
+
+	for(unsigned int level=1; level<CHIAKI_TIMER_SERVICE_LEVELS; level++)
+	{
+		unsigned int shift = LEVEL_SHIFT(level);
+		if(tick & (((uint64_t)1 << shift) - 1))
+			break;
+		timer_service_cascade(service, level, (tick >> shift) & LEVEL_MASK);
+	}
+
+	ChiakiTimer **slot = &service->wheel[0][tick & LEVEL_MASK];
+	while(*slot)
+	{
+		ChiakiTimer *timer = *slot;
+		timer_unlink(timer);
+		if(timer->expires_tick > tick) // parked because it was too far in the future
+			timer_service_insert(service, timer);
+		else
+			timer_link(&service->expired, timer);
+	}
+
+	service->tick++;
+}
+
+static void timer_service_run_expired(ChiakiTimerService *service)
+{
+	while(service->expired)
+	{
+		ChiakiTimer *timer = service->expired;
+		timer_unlink(timer);
+		timer->scheduled = false;
+
+		uint64_t now_us = chiaki_clock_now_us(service->clock);
+		uint64_t lateness_us = now_us > timer->deadline_us ? now_us - timer->deadline_us : 0;
+		service->stats.fired++;
+		service->stats.lateness_us_sum += lateness_us;
+		if(lateness_us > service->stats.lateness_us_max)
+			service->stats.lateness_us_max = lateness_us;
+
+		service->running = timer;
+		chiaki_mutex_unlock(&service->mutex);
+		timer->cb(timer->user);
+		chiaki_mutex_lock(&service->mutex);
+		service->running = NULL;
+		chiaki_cond_broadcast(&service->idle_cond);
+	}
+}
+
+static void *timer_service_thread_func(void *user)
+{
+	ChiakiTimerService *service = user;
+
+	ChiakiErrorCode err = chiaki_mutex_lock(&service->mutex);
+	if(err != CHIAKI_ERR_SUCCESS)
+		return NULL;
+
+	while(!service->should_stop)
+	{
+		uint64_t now_us = chiaki_clock_now_us(service->clock);
+		uint64_t now_tick = now_us >> CHIAKI_TIMER_SERVICE_TICK_SHIFT;
+		uint64_t next = timer_service_next_tick(service);
+		if(next <= now_tick)
+		{
+			// everything between service->tick and next is empty and can be skipped
+			service->tick = next;
+			timer_service_process_tick(service);
+			timer_service_run_expired(service);
+			continue;
+		}
+
+		if(service->tick < now_tick)
+			service->tick = now_tick;
+
+		service->wakeup_tick = next;
+		err = chiaki_clock_cond_wait_until(service->clock, &service->cond, &service->mutex,
+				next == UINT64_MAX ? UINT64_MAX : next << CHIAKI_TIMER_SERVICE_TICK_SHIFT);
+		service->wakeup_tick = 0;
+		if(err != CHIAKI_ERR_SUCCESS && err != CHIAKI_ERR_TIMEOUT)
+		{
+			CHIAKI_LOGE(service->log, "Timer Service failed to wait on cond");
+			break;
+		}
+	}
+
+	chiaki_mutex_unlock(&service->mutex);
+	return NULL;
+}
+
+CHIAKI_EXPORT void chiaki_timer_service_schedule(ChiakiTimerService *service, ChiakiTimer *timer, uint64_t deadline_us)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&service->mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+
+	if(timer->scheduled)
+		timer_unlink(timer);
+
+	timer->deadline_us = deadline_us;
+	// round up so the callback is never called early
+	timer->expires_tick = deadline_us > UINT64_MAX - TICK_US
+		? UINT64_MAX >> CHIAKI_TIMER_SERVICE_TICK_SHIFT
+		: (deadline_us + TICK_US - 1) >> CHIAKI_TIMER_SERVICE_TICK_SHIFT;
+	timer->scheduled = true;
+	timer_service_insert(service, timer);
+
+	if(timer->expires_tick < service->wakeup_tick)
+		chiaki_clock_cond_signal(service->clock, &service->cond);
+
+	chiaki_mutex_unlock(&service->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_timer_service_schedule_ms(ChiakiTimerService *service, ChiakiTimer *timer, uint64_t timeout_ms)
+{
+	chiaki_timer_service_schedule(service, timer, chiaki_clock_now_us(service->clock) + timeout_ms * 1000);
+}
+
+CHIAKI_EXPORT void chiaki_timer_service_cancel(ChiakiTimerService *service, ChiakiTimer *timer)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&service->mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+
+	// the callback may re-schedule the timer, so only unlink after it has finished
+	while(service->running == timer)
+		chiaki_cond_wait(&service->idle_cond, &service->mutex);
+
+	if(timer->scheduled)
+	{
+		timer_unlink(timer);
+		timer->scheduled = false;
+	}
+
+	chiaki_mutex_unlock(&service->mutex);
+}
+
+CHIAKI_EXPORT void chiaki_timer_service_get_stats(ChiakiTimerService *service, ChiakiTimerServiceStats *stats)
+{
+	ChiakiErrorCode err = chiaki_mutex_lock(&service->mutex);
+	assert(err == CHIAKI_ERR_SUCCESS);
+	*stats = service->stats;
+	chiaki_mutex_unlock(&service->mutex);
+}
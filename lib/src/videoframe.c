@@ -0,0 +1,145 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chiaki/videoframe.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "atomic.h"
+
+CHIAKI_EXPORT ChiakiVideoFramePool *chiaki_video_frame_pool_new(ChiakiMemAccount *mem, size_t frames_free_max)
+{
+	ChiakiVideoFramePool *pool = CHIAKI_NEW(ChiakiVideoFramePool);
+	if(!pool)
+		return NULL;
+	if(chiaki_mutex_init(&pool->mutex, false) != CHIAKI_ERR_SUCCESS)
+	{
+		free(pool);
+		return NULL;
+	}
+	pool->frames_free = NULL;
+	pool->frames_free_count = 0;
+	pool->frames_free_max = frames_free_max;
+	pool->mem = chiaki_mem_account_ref(mem);
+	pool->refs = 1;
+	return pool;
+}
+
+static void video_frame_buf_free(ChiakiVideoFramePool *pool, ChiakiVideoFrame *frame)
+{
+	if(frame->buf)
+		chiaki_mem_free(pool->mem, CHIAKI_MEM_TAG_FRAME, frame->buf, frame->buf_capacity + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	frame->buf = NULL;
+	frame->buf_capacity = 0;
+}
+
+static void video_frame_free(ChiakiVideoFramePool *pool, ChiakiVideoFrame *frame)
+{
+	video_frame_buf_free(pool, frame);
+	chiaki_mem_free(pool->mem, CHIAKI_MEM_TAG_FRAME, frame, sizeof(ChiakiVideoFrame));
+}
+
+CHIAKI_EXPORT void chiaki_video_frame_pool_unref(ChiakiVideoFramePool *pool)
+{
+	if(chiaki_atomic_fetch_add_u32(&pool->refs, (uint32_t)-1) != 1)
+		return;
+
+	while(pool->frames_free)
+	{
+		ChiakiVideoFrame *frame = pool->frames_free;
+		pool->frames_free = frame->next_free;
+		video_frame_free(pool, frame);
+	}
+	chiaki_mutex_fini(&pool->mutex);
+	chiaki_mem_account_unref(pool->mem);
+	free(pool);
+}
+
+CHIAKI_EXPORT ChiakiVideoFrame *chiaki_video_frame_pool_acquire(ChiakiVideoFramePool *pool, size_t buf_capacity)
+{
+	chiaki_mutex_lock(&pool->mutex);
+	ChiakiVideoFrame *frame = pool->frames_free;
+	if(frame)
+	{
+		pool->frames_free = frame->next_free;
+		pool->frames_free_count--;
+	}
+	chiaki_mutex_unlock(&pool->mutex);
+
+	if(!frame)
+	{
+		frame = chiaki_mem_alloc(pool->mem, CHIAKI_MEM_TAG_FRAME, sizeof(ChiakiVideoFrame));
+		if(!frame)
+			return NULL;
+		frame->buf = NULL;
+		frame->buf_capacity = 0;
+	}
+
+	if(frame->buf_capacity < buf_capacity)
+	{
+		video_frame_buf_free(pool, frame);
+		frame->buf = chiaki_mem_alloc(pool->mem, CHIAKI_MEM_TAG_FRAME, buf_capacity + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+		if(!frame->buf)
+		{
+			video_frame_free(pool, frame);
+			return NULL;
+		}
+		frame->buf_capacity = buf_capacity;
+	}
+	memset(frame->buf, 0, buf_capacity + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+
+	frame->buf_size = 0;
+	frame->header = false;
+	frame->frame_index = 0;
+	frame->profile_index = 0;
+	frame->status = CHIAKI_VIDEO_FRAME_STATUS_COMPLETE;
+	frame->first_unit_us = 0;
+	frame->complete_us = 0;
+	frame->pool = pool;
+	frame->refs = 1;
+	frame->next_free = NULL;
+	chiaki_atomic_fetch_add_u32(&pool->refs, 1);
+	return frame;
+}
+
+CHIAKI_EXPORT void chiaki_video_frame_ref(ChiakiVideoFrame *frame)
+{
+	chiaki_atomic_fetch_add_u32(&frame->refs, 1);
+}
+
+CHIAKI_EXPORT void chiaki_video_frame_unref(ChiakiVideoFrame *frame)
+{
+	if(chiaki_atomic_fetch_add_u32(&frame->refs, (uint32_t)-1) != 1)
+		return;
+
+	ChiakiVideoFramePool *pool = frame->pool;
+	chiaki_mutex_lock(&pool->mutex);
+	if(pool->frames_free_count < pool->frames_free_max)
+	{
+		frame->next_free = pool->frames_free;
+		pool->frames_free = frame;
+		pool->frames_free_count++;
+		frame = NULL;
+	}
+	chiaki_mutex_unlock(&pool->mutex);
+
+	if(frame)
+		video_frame_free(pool, frame);
+
+	chiaki_video_frame_pool_unref(pool);
+}
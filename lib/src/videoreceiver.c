@@ -17,10 +17,18 @@
 
 #include <chiaki/videoreceiver.h>
 #include <chiaki/session.h>
+#include <chiaki/time.h>
 
 #include <string.h>
 
+#include "atomic.h"
+
 static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver);
+static void chiaki_video_receiver_send_header(ChiakiVideoReceiver *video_receiver);
+static void chiaki_video_receiver_frame_arrived(ChiakiVideoReceiver *video_receiver, ChiakiSeqNum16 frame_index, uint64_t recv_time_us);
+
+void chiaki_session_send_event(ChiakiSession *session, ChiakiEvent *event);
+void chiaki_session_startup_mark(ChiakiSession *session, ChiakiStartupPhase phase);
 
 CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receiver, struct chiaki_session_t *session)
 {
@@ -33,13 +41,19 @@ CHIAKI_EXPORT void chiaki_video_receiver_init(ChiakiVideoReceiver *video_receive
 	video_receiver->frame_index_cur = -1;
 	video_receiver->frame_index_prev = -1;
 
-	chiaki_frame_processor_init(&video_receiver->frame_processor, video_receiver->log);
+	chiaki_video_frame_timing_init(&video_receiver->frame_timing);
+
+	chiaki_frame_processor_init(&video_receiver->frame_processor, video_receiver->log, session->mem);
+	chiaki_frame_processor_set_fec_pool(&video_receiver->frame_processor, session->fec_pool);
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_fini(ChiakiVideoReceiver *video_receiver)
 {
 	for(size_t i=0; i<video_receiver->profiles_count; i++)
-		free(video_receiver->profiles[i].header);
+	{
+		ChiakiVideoProfile *profile = &video_receiver->profiles[i];
+		chiaki_mem_free(video_receiver->session->mem, CHIAKI_MEM_TAG_PROTO, profile->header, profile->header_sz + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+	}
 	chiaki_frame_processor_fini(&video_receiver->frame_processor);
 }
 
@@ -48,6 +62,8 @@ CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_
 	if(video_receiver->profiles_count > 0)
 	{
 		CHIAKI_LOGE(video_receiver->log, "Video Receiver profiles already set");
+		for(size_t i=0; i<profiles_count; i++)
+			chiaki_mem_free(video_receiver->session->mem, CHIAKI_MEM_TAG_PROTO, profiles[i].header, profiles[i].header_sz + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
 		return;
 	}
 
@@ -61,6 +77,13 @@ CHIAKI_EXPORT void chiaki_video_receiver_stream_info(ChiakiVideoReceiver *video_
 		CHIAKI_LOGI(video_receiver->log, "  %zu: %ux%u", i, profile->width, profile->height);
 		//chiaki_log_hexdump(video_receiver->log, CHIAKI_LOG_DEBUG, profile->header, profile->header_sz);
 	}
+
+	// lets decoders configure themselves for every profile before the first frame arrives
+	ChiakiEvent event = { 0 };
+	event.type = CHIAKI_EVENT_VIDEO_PROFILES;
+	event.video_profiles.profiles = video_receiver->profiles;
+	event.video_profiles.profiles_count = video_receiver->profiles_count;
+	chiaki_session_send_event(video_receiver->session, &event);
 }
 
 CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_receiver, ChiakiTakionAVPacket *packet)
@@ -84,12 +107,23 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 					(unsigned int)video_receiver->profiles_count);
 			return;
 		}
+
+		// the last frame of the previous profile must still go to the previous decoder
+		if(video_receiver->frame_index_cur >= 0 && video_receiver->frame_index_prev != video_receiver->frame_index_cur
+			&& chiaki_seq_num_16_gt(frame_index, (ChiakiSeqNum16)video_receiver->frame_index_cur))
+			chiaki_video_receiver_flush_frame(video_receiver);
+
 		video_receiver->profile_cur = packet->adaptive_stream_index;
 
 		ChiakiVideoProfile *profile = video_receiver->profiles + video_receiver->profile_cur;
 		CHIAKI_LOGI(video_receiver->log, "Switched to profile %d, resolution: %ux%u", video_receiver->profile_cur, profile->width, profile->height);
-		if(video_receiver->session->video_sample_cb)
-			video_receiver->session->video_sample_cb(profile->header, profile->header_sz, video_receiver->session->video_sample_cb_user);
+
+		ChiakiEvent event = { 0 };
+		event.type = CHIAKI_EVENT_VIDEO_PROFILE_SWITCH;
+		event.video_profile_switch.profile_index = (size_t)video_receiver->profile_cur;
+		chiaki_session_send_event(video_receiver->session, &event);
+
+		chiaki_video_receiver_send_header(video_receiver);
 	}
 
 	// next frame?
@@ -105,12 +139,16 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 			&& !(frame_index == 1 && video_receiver->frame_index_cur < 0)) // ok for frame 1
 		{
 			CHIAKI_LOGW(video_receiver->log, "Detected missing or corrupt frame(s) from %d to %d", next_frame_expected, (int)frame_index);
+			chiaki_atomic_fetch_add_u64(&video_receiver->session->stream_stats.video_frames_lost, (ChiakiSeqNum16)(frame_index - next_frame_expected));
 			stream_connection_send_corrupt_frame(&video_receiver->session->stream_connection, next_frame_expected, frame_index - 1);
 		}
 
+		chiaki_video_receiver_frame_arrived(video_receiver, frame_index, packet->recv_time_us);
 		video_receiver->frame_index_cur = frame_index;
 		chiaki_frame_processor_alloc_frame(&video_receiver->frame_processor, packet);
 	}
+	else
+		chiaki_video_frame_timing_packet(&video_receiver->frame_timing, packet->recv_time_us);
 
 	// if we are currently building up a frame
 	if(video_receiver->frame_index_cur != video_receiver->frame_index_prev)
@@ -127,9 +165,8 @@ CHIAKI_EXPORT void chiaki_video_receiver_av_packet(ChiakiVideoReceiver *video_re
 
 static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *video_receiver)
 {
-	uint8_t *frame;
-	size_t frame_size;
-	ChiakiFrameProcessorFlushResult flush_result = chiaki_frame_processor_flush(&video_receiver->frame_processor, &frame, &frame_size);
+	ChiakiVideoFrame *frame;
+	ChiakiFrameProcessorFlushResult flush_result = chiaki_frame_processor_flush(&video_receiver->frame_processor, &frame);
 
 	if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FAILED
 #ifndef FLUSH_CORRUPT_FRAMES
@@ -145,20 +182,112 @@ static ChiakiErrorCode chiaki_video_receiver_flush_frame(ChiakiVideoReceiver *vi
 
 	bool succ = flush_result != CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_FAILED;
 
-	if(video_receiver->session->video_sample_cb)
+	ChiakiSession *session = video_receiver->session;
+	bool has_cb = session->video_frame_cb || session->video_sample_cb;
+	if(has_cb)
 	{
-		bool cb_succ = video_receiver->session->video_sample_cb(frame, frame_size, video_receiver->session->video_sample_cb_user);
+		bool cb_succ = session->video_frame_cb
+			? session->video_frame_cb(frame, session->video_frame_cb_user)
+			: session->video_sample_cb(frame->buf, frame->buf_size, session->video_sample_cb_user);
 		if(!cb_succ)
 		{
 			succ = false;
 			CHIAKI_LOGW(video_receiver->log, "Video callback did not process frame successfully.");
 		}
+		else if(!session->startup_report.phase_end_us[CHIAKI_STARTUP_PHASE_FIRST_FRAME])
+		{
+			chiaki_session_startup_mark(session, CHIAKI_STARTUP_PHASE_FIRST_FRAME);
+			chiaki_startup_report_log(&session->startup_report, video_receiver->log);
+			ChiakiEvent event = { 0 };
+			event.type = CHIAKI_EVENT_STARTUP_REPORT;
+			event.startup_report = session->startup_report;
+			chiaki_session_send_event(session, &event);
+		}
 	}
 
 	video_receiver->frame_index_prev = video_receiver->frame_index_cur;
 
+	if(has_cb)
+	{
+		chiaki_atomic_fetch_add_u64(&session->stream_stats.video_frames, 1);
+		chiaki_atomic_fetch_add_u64(&session->stream_stats.video_bytes, frame->buf_size);
+	}
+	if(flush_result == CHIAKI_FRAME_PROCESSOR_FLUSH_RESULT_FEC_SUCCESS)
+		chiaki_atomic_fetch_add_u64(&session->stream_stats.video_frames_fec_recovered, 1);
+
 	if(succ)
 		video_receiver->frame_index_prev_complete = video_receiver->frame_index_cur;
 
 	return CHIAKI_ERR_SUCCESS;
-}
\ No newline at end of file
+}
+
+/**
+ * Update the timing stats with the first packet of a new frame.
+ */
+static void chiaki_video_receiver_frame_arrived(ChiakiVideoReceiver *video_receiver, ChiakiSeqNum16 frame_index, uint64_t recv_time_us)
+{
+	ChiakiSession *session = video_receiver->session;
+	ChiakiVideoFrameTiming *timing = &video_receiver->frame_timing;
+	chiaki_video_frame_timing_frame(timing, frame_index, recv_time_us, session->connect_info.video_profile.max_fps);
+	chiaki_atomic_store_u64(&session->stream_stats.video_frame_spread_us, chiaki_video_frame_timing_spread_us(timing));
+	chiaki_atomic_store_u64(&session->stream_stats.video_frame_jitter_us, chiaki_video_frame_timing_jitter_us(timing));
+}
+
+CHIAKI_EXPORT void chiaki_video_frame_timing_init(ChiakiVideoFrameTiming *timing)
+{
+	timing->frame_index = -1;
+	timing->first_recv_us = 0;
+	timing->last_recv_us = 0;
+	timing->jitter_x16_us = 0;
+	timing->spread_x16_us = 0;
+}
+
+CHIAKI_EXPORT void chiaki_video_frame_timing_frame(ChiakiVideoFrameTiming *timing, ChiakiSeqNum16 frame_index, uint64_t recv_time_us, unsigned int fps)
+{
+	if(timing->frame_index >= 0 && timing->first_recv_us)
+	{
+		uint64_t spread_us = timing->last_recv_us - timing->first_recv_us;
+		timing->spread_x16_us += spread_us - (timing->spread_x16_us >> 4);
+
+		if(fps)
+		{
+			// frames in between may have been lost entirely
+			uint16_t frames = (uint16_t)(frame_index - (ChiakiSeqNum16)timing->frame_index);
+			int64_t expected_us = (int64_t)frames * 1000000 / fps;
+			int64_t d = (int64_t)(recv_time_us - timing->first_recv_us) - expected_us;
+			uint64_t d_abs = (uint64_t)(d < 0 ? -d : d);
+			timing->jitter_x16_us += d_abs - (timing->jitter_x16_us >> 4);
+		}
+	}
+
+	timing->frame_index = frame_index;
+	timing->first_recv_us = recv_time_us;
+	timing->last_recv_us = recv_time_us;
+}
+
+static void chiaki_video_receiver_send_header(ChiakiVideoReceiver *video_receiver)
+{
+	ChiakiSession *session = video_receiver->session;
+	ChiakiVideoProfile *profile = video_receiver->profiles + video_receiver->profile_cur;
+
+	if(!session->video_frame_cb)
+	{
+		if(session->video_sample_cb)
+			session->video_sample_cb(profile->header, profile->header_sz, session->video_sample_cb_user);
+		return;
+	}
+
+	ChiakiVideoFrame *frame = chiaki_frame_processor_acquire_frame(&video_receiver->frame_processor, profile->header_sz);
+	if(!frame)
+	{
+		CHIAKI_LOGE(video_receiver->log, "Video Receiver failed to alloc frame for header");
+		return;
+	}
+	memcpy(frame->buf, profile->header, profile->header_sz);
+	frame->buf_size = profile->header_sz;
+	frame->header = true;
+	frame->profile_index = (size_t)video_receiver->profile_cur;
+	frame->first_unit_us = frame->complete_us = chiaki_time_now_monotonic_us();
+	session->video_frame_cb(frame, session->video_frame_cb_user);
+	chiaki_video_frame_unref(frame);
+}
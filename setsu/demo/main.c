@@ -23,6 +23,7 @@
 #include <string.h>
 #include <assert.h>
 #include <signal.h>
+#include <poll.h>
 
 Setsu *setsu;
 
@@ -133,6 +134,8 @@ void event(SetsuEvent *event, void *user)
 			LOG("Button for %s: %llu %s\n", setsu_device_get_path(event->dev),
 					(unsigned long long)event->button, event->type == SETSU_EVENT_BUTTON_DOWN ? "down" : "up");
 			break;
+		case SETSU_EVENT_SYNC:
+			break;
 	}
 }
 
@@ -174,7 +177,10 @@ int main(int argc, const char *argv[])
 		if(dirty && !log_mode)
 			print_state();
 		dirty = false;
-		setsu_poll(setsu, event, NULL);
+		struct pollfd pfd = { setsu_get_fd(setsu), POLLIN, 0 };
+		if(poll(&pfd, 1, -1) < 0)
+			continue; // probably interrupted by SIGINT
+		setsu_dispatch(setsu, event, NULL);
 	}
 	setsu_free(setsu);
 	printf("\nさよなら!\n");
@@ -56,7 +56,12 @@ typedef enum {
 	SETSU_EVENT_BUTTON_DOWN,
 
 	/* Event will have dev and button set. */
-	SETSU_EVENT_BUTTON_UP
+	SETSU_EVENT_BUTTON_UP,
+
+	/* All events of a single report from the device
+	 * (everything up to an evdev SYN_REPORT) have been sent.
+	 * Event will have dev set. */
+	SETSU_EVENT_SYNC
 } SetsuEventType;
 
 #define SETSU_BUTTON_0 (1u << 0)
@@ -66,6 +71,12 @@ typedef uint64_t SetsuButton;
 typedef struct setsu_event_t
 {
 	SetsuEventType type;
+
+	/* For events with dev set, the kernel timestamp of the report the event
+	 * belongs to, otherwise the time the event was generated.
+	 * In microseconds, from CLOCK_MONOTONIC. */
+	uint64_t timestamp_us;
+
 	union
 	{
 		const char *path;
@@ -89,7 +100,19 @@ typedef void (*SetsuEventCb)(SetsuEvent *event, void *user);
 
 Setsu *setsu_new();
 void setsu_free(Setsu *setsu);
+
+/* Read and handle the input of all devices without blocking. */
 void setsu_poll(Setsu *setsu, SetsuEventCb cb, void *user);
+
+/* File descriptor that becomes readable whenever setsu_dispatch() has something to do,
+ * i.e. on input from a connected device or on device addition/removal.
+ * Meant to be waited on with poll(), select(), epoll, etc. */
+int setsu_get_fd(Setsu *setsu);
+
+/* Handle only the devices that have pending input without blocking.
+ * Call this whenever the fd from setsu_get_fd() is readable. */
+void setsu_dispatch(Setsu *setsu, SetsuEventCb cb, void *user);
+
 SetsuDevice *setsu_connect(Setsu *setsu, const char *path);
 void setsu_disconnect(Setsu *setsu, SetsuDevice *dev);
 const char *setsu_device_get_path(SetsuDevice *dev);
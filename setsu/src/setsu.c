@@ -26,6 +26,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <stdio.h>
 
@@ -47,11 +50,19 @@ typedef struct setsu_avail_device_t
 
 #define SLOTS_COUNT 16
 
+#define DISPATCH_EVENTS_MAX 16
+
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
 typedef struct setsu_device_t
 {
 	struct setsu_device_t *next;
 	char *path;
 	int fd;
+	bool hung_up; // fd was removed from epoll because the device is gone, waiting for udev to remove it
 	struct libevdev *evdev;
 	int min_x, min_y, max_x, max_y;
 
@@ -80,6 +91,12 @@ struct setsu_t
 	struct udev_monitor *udev_mon;
 	SetsuAvailDevice *avail_dev;
 	SetsuDevice *dev;
+
+	/* contains udev_mon's fd, pending_fd and the fds of all connected devices */
+	int epoll_fd;
+
+	/* eventfd signaled when avail_dev has events that have not been sent yet */
+	int pending_fd;
 };
 
 bool get_dev_ids(const char *path, uint32_t *vendor_id, uint32_t *model_id);
@@ -87,9 +104,37 @@ static void scan_udev(Setsu *setsu);
 static void update_udev_device(Setsu *setsu, struct udev_device *dev);
 static SetsuDevice *connect(Setsu *setsu, const char *path);
 static void disconnect(Setsu *setsu, SetsuDevice *dev);
-static void poll_device(Setsu *setsu, SetsuDevice *dev, SetsuEventCb cb, void *user);
+static bool poll_device(Setsu *setsu, SetsuDevice *dev, SetsuEventCb cb, void *user);
 static void device_event(Setsu *setsu, SetsuDevice *dev, struct input_event *ev, SetsuEventCb cb, void *user);
-static void device_drain(Setsu *setsu, SetsuDevice *dev, SetsuEventCb cb, void *user);
+static void device_drain(Setsu *setsu, SetsuDevice *dev, uint64_t timestamp_us, SetsuEventCb cb, void *user);
+static void device_hang_up(Setsu *setsu, SetsuDevice *dev);
+
+static uint64_t now_us()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+static bool epoll_add(Setsu *setsu, int fd, void *ptr)
+{
+	struct epoll_event ev = { 0 };
+	ev.events = EPOLLIN;
+	ev.data.ptr = ptr;
+	if(epoll_ctl(setsu->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+	{
+		SETSU_LOG("Failed to add fd to epoll\n");
+		return false;
+	}
+	return true;
+}
+
+static void signal_pending(Setsu *setsu)
+{
+	uint64_t v = 1;
+	if(write(setsu->pending_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+		SETSU_LOG("Failed to signal pending events\n");
+}
 
 Setsu *setsu_new()
 {
@@ -97,18 +142,26 @@ Setsu *setsu_new()
 	if(!setsu)
 		return NULL;
 
+	setsu->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(setsu->epoll_fd < 0)
+		goto error_setsu;
+
+	setsu->pending_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(setsu->pending_fd < 0)
+		goto error_epoll;
+	if(!epoll_add(setsu, setsu->pending_fd, NULL))
+		goto error_pending;
+
 	setsu->udev = udev_new();
 	if(!setsu->udev)
-	{
-		free(setsu);
-		return NULL;
-	}
+		goto error_pending;
 
 	setsu->udev_mon = udev_monitor_new_from_netlink(setsu->udev, "udev");
 	if(setsu->udev_mon)
 	{
 		udev_monitor_filter_add_match_subsystem_devtype(setsu->udev_mon, "input", NULL);
 		udev_monitor_enable_receiving(setsu->udev_mon);
+		epoll_add(setsu, udev_monitor_get_fd(setsu->udev_mon), setsu);
 	}
 	else
 		SETSU_LOG("Failed to create udev monitor\n");
@@ -116,6 +169,13 @@ Setsu *setsu_new()
 	scan_udev(setsu);
 
 	return setsu;
+error_pending:
+	close(setsu->pending_fd);
+error_epoll:
+	close(setsu->epoll_fd);
+error_setsu:
+	free(setsu);
+	return NULL;
 }
 
 void setsu_free(Setsu *setsu)
@@ -134,6 +194,8 @@ void setsu_free(Setsu *setsu)
 		free(adev->path);
 		free(adev);
 	}
+	close(setsu->pending_fd);
+	close(setsu->epoll_fd);
 	free(setsu);
 }
 
@@ -230,6 +292,7 @@ static void update_udev_device(Setsu *setsu, struct udev_device *dev)
 				return; // already added, do nothing
 			// disconnected
 			adev->disconnect_dirty = true;
+			signal_pending(setsu);
 			return;
 		}
 	}
@@ -250,6 +313,7 @@ static void update_udev_device(Setsu *setsu, struct udev_device *dev)
 	adev->next = setsu->avail_dev;
 	setsu->avail_dev = adev;
 	adev->connect_dirty = true;
+	signal_pending(setsu);
 }
 
 static void poll_udev_monitor(Setsu *setsu)
@@ -306,6 +370,13 @@ SetsuDevice *setsu_connect(Setsu *setsu, const char *path)
 		goto error;
 	}
 
+	// same clock as now_us() for the event timestamps
+	if(libevdev_set_clock_id(dev->evdev, CLOCK_MONOTONIC) < 0)
+		SETSU_LOG("Failed to set evdev clock to monotonic\n");
+
+	if(!epoll_add(setsu, dev->fd, dev))
+		goto error;
+
 	dev->min_x = libevdev_get_abs_minimum(dev->evdev, ABS_X);
 	dev->min_y = libevdev_get_abs_minimum(dev->evdev, ABS_Y);
 	dev->max_x = libevdev_get_abs_maximum(dev->evdev, ABS_X);
@@ -345,6 +416,8 @@ void setsu_disconnect(Setsu *setsu, SetsuDevice *dev)
 			}
 		}
 	}
+	if(!dev->hung_up)
+		epoll_ctl(setsu->epoll_fd, EPOLL_CTL_DEL, dev->fd, NULL);
 	libevdev_free(dev->evdev);
 	close(dev->fd);
 	free(dev->path);
@@ -397,16 +470,15 @@ void kill_avail_device(Setsu *setsu, SetsuAvailDevice *adev)
 	free(adev);
 }
 
-void setsu_poll(Setsu *setsu, SetsuEventCb cb, void *user)
+static void dispatch_avail_devices(Setsu *setsu, SetsuEventCb cb, void *user)
 {
-	poll_udev_monitor(setsu);
-
 	for(SetsuAvailDevice *adev = setsu->avail_dev; adev;)
 	{
 		if(adev->connect_dirty)
 		{
 			SetsuEvent event = { 0 };
 			event.type = SETSU_EVENT_DEVICE_ADDED;
+			event.timestamp_us = now_us();
 			event.path = adev->path;
 			cb(&event, user);
 			adev->connect_dirty = false;
@@ -415,6 +487,7 @@ void setsu_poll(Setsu *setsu, SetsuEventCb cb, void *user)
 		{
 			SetsuEvent event = { 0 };
 			event.type = SETSU_EVENT_DEVICE_REMOVED;
+			event.timestamp_us = now_us();
 			event.path = adev->path;
 			cb(&event, user);
 			// kill the device only after sending the event
@@ -425,12 +498,95 @@ void setsu_poll(Setsu *setsu, SetsuEventCb cb, void *user)
 		}
 		adev = adev->next;
 	}
+}
+
+void setsu_poll(Setsu *setsu, SetsuEventCb cb, void *user)
+{
+	poll_udev_monitor(setsu);
+	dispatch_avail_devices(setsu, cb, user);
 
 	for(SetsuDevice *dev = setsu->dev; dev; dev = dev->next)
-		poll_device(setsu, dev, cb, user);
+	{
+		if(!dev->hung_up)
+			poll_device(setsu, dev, cb, user);
+	}
+}
+
+int setsu_get_fd(Setsu *setsu)
+{
+	return setsu->epoll_fd;
+}
+
+static bool device_connected(Setsu *setsu, SetsuDevice *dev)
+{
+	for(SetsuDevice *d = setsu->dev; d; d = d->next)
+	{
+		if(d == dev)
+			return true;
+	}
+	return false;
+}
+
+void setsu_dispatch(Setsu *setsu, SetsuEventCb cb, void *user)
+{
+	struct epoll_event events[DISPATCH_EVENTS_MAX];
+	int count = epoll_wait(setsu->epoll_fd, events, DISPATCH_EVENTS_MAX, 0);
+	if(count < 0)
+	{
+		if(errno != EINTR)
+			SETSU_LOG("epoll_wait failed\n");
+		return;
+	}
+
+	// device additions and removals first, removals may disconnect devices that are also in events
+	bool avail_dirty = false;
+	for(int i=0; i<count; i++)
+	{
+		if(events[i].data.ptr == NULL)
+		{
+			uint64_t v;
+			if(read(setsu->pending_fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+				SETSU_LOG("Failed to read pending events\n");
+			avail_dirty = true;
+		}
+		else if(events[i].data.ptr == setsu)
+		{
+			poll_udev_monitor(setsu);
+			avail_dirty = true;
+		}
+	}
+	if(avail_dirty)
+		dispatch_avail_devices(setsu, cb, user);
+
+	for(int i=0; i<count; i++)
+	{
+		SetsuDevice *dev = events[i].data.ptr;
+		if(!dev || (void *)dev == setsu)
+			continue;
+		// the callback may have disconnected it
+		if(!device_connected(setsu, dev) || dev->hung_up)
+			continue;
+		// read what is left first, EPOLLHUP may come together with the last events
+		bool alive = poll_device(setsu, dev, cb, user);
+		if(!alive || (events[i].events & (EPOLLHUP | EPOLLERR)))
+			device_hang_up(setsu, dev);
+	}
 }
 
-static void poll_device(Setsu *setsu, SetsuDevice *dev, SetsuEventCb cb, void *user)
+/**
+ * The fd stays readable (level-triggered) once the device is gone,
+ * so it has to leave epoll until udev reports the removal and the device is disconnected.
+ */
+static void device_hang_up(Setsu *setsu, SetsuDevice *dev)
+{
+	epoll_ctl(setsu->epoll_fd, EPOLL_CTL_DEL, dev->fd, NULL);
+	dev->hung_up = true;
+}
+
+/**
+ * @return false if the device is gone
+ */
+static bool poll_device(Setsu *setsu, SetsuDevice *dev, SetsuEventCb cb, void *user)
 {
 	bool sync = false;
 	while(true)
@@ -450,7 +606,7 @@ static void poll_device(Setsu *setsu, SetsuDevice *dev, SetsuEventCb cb, void *u
 			device_event(setsu, dev, &ev, cb, user);
 		else if(r == LIBEVDEV_READ_STATUS_SYNC)
 			sync = true;
-		else if(r == -ENODEV) { break; } // device probably disconnected, udev remove event should follow soon
+		else if(r == -ENODEV) { return false; } // device probably disconnected, udev remove event should follow soon
 		else
 		{
 			char buf[256];
@@ -459,6 +615,7 @@ static void poll_device(Setsu *setsu, SetsuDevice *dev, SetsuEventCb cb, void *u
 			break;
 		}
 	}
+	return true;
 }
 
 static uint64_t button_from_evdev(int key)
@@ -529,16 +686,16 @@ static void device_event(Setsu *setsu, SetsuDevice *dev, struct input_event *ev,
 		}
 		case EV_SYN:
 			if(ev->code == SYN_REPORT)
-				device_drain(setsu, dev, cb, user);
+				device_drain(setsu, dev, (uint64_t)ev->input_event_sec * 1000000 + (uint64_t)ev->input_event_usec, cb, user);
 			break;
 	}
 #undef S
 }
 
-static void device_drain(Setsu *setsu, SetsuDevice *dev, SetsuEventCb cb, void *user)
+static void device_drain(Setsu *setsu, SetsuDevice *dev, uint64_t timestamp_us, SetsuEventCb cb, void *user)
 {
 	SetsuEvent event;
-#define BEGIN_EVENT(tp) do { memset(&event, 0, sizeof(event)); event.dev = dev; event.type = tp; } while(0)
+#define BEGIN_EVENT(tp) do { memset(&event, 0, sizeof(event)); event.dev = dev; event.type = tp; event.timestamp_us = timestamp_us; } while(0)
 #define SEND_EVENT() do { cb(&event, user); } while (0)
 	for(size_t i=0; i<SLOTS_COUNT; i++)
 	{
@@ -582,6 +739,9 @@ static void device_drain(Setsu *setsu, SetsuDevice *dev, SetsuEventCb cb, void *
 			break;
 	}
 	dev->buttons_prev = dev->buttons_cur;
+
+	BEGIN_EVENT(SETSU_EVENT_SYNC);
+	SEND_EVENT();
 #undef BEGIN_EVENT
 #undef SEND_EVENT
 }
@@ -0,0 +1,161 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/audioresampler.h>
+
+#include <math.h>
+#include <stdlib.h>
+
+#define CHANNELS 2
+#define CHUNK_FRAMES 480
+
+static MunitResult test_unity(const MunitParameter params[], void *user)
+{
+	ChiakiAudioResampler resampler;
+	ChiakiErrorCode err = chiaki_audio_resampler_init(&resampler, CHANNELS);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	int16_t in[CHUNK_FRAMES * CHANNELS];
+	size_t out_max = chiaki_audio_resampler_out_frames_max(&resampler, CHUNK_FRAMES);
+	int16_t *out = malloc(sizeof(int16_t) * CHANNELS * out_max);
+	munit_assert_not_null(out);
+
+	size_t in_total = 0;
+	size_t out_total = 0;
+	for(size_t chunk=0; chunk<100; chunk++)
+	{
+		for(size_t i=0; i<CHUNK_FRAMES; i++)
+		{
+			int16_t v = (int16_t)(10000.0 * sin(2.0 * 3.14159265358979 * 440.0 * (double)(in_total + i) / 48000.0));
+			in[i * CHANNELS] = v;
+			in[i * CHANNELS + 1] = -v;
+		}
+		size_t out_frames;
+		err = chiaki_audio_resampler_process(&resampler, in, CHUNK_FRAMES, out, out_max, &out_frames);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+		// with a ratio of 1, output is the input delayed by the filter
+		for(size_t i=0; i<out_frames; i++)
+		{
+			size_t t = out_total + i;
+			int16_t expected = (int16_t)(10000.0 * sin(2.0 * 3.14159265358979 * 440.0 * (double)t / 48000.0));
+			munit_assert_int(abs(out[i * CHANNELS] - expected), <, 100);
+			munit_assert_int(abs(out[i * CHANNELS + 1] + expected), <, 100);
+		}
+
+		in_total += CHUNK_FRAMES;
+		out_total += out_frames;
+	}
+
+	munit_assert_size(in_total - out_total, <=, CHIAKI_AUDIO_RESAMPLER_TAPS);
+
+	free(out);
+	chiaki_audio_resampler_fini(&resampler);
+	return MUNIT_OK;
+}
+
+static MunitResult test_ratio(const MunitParameter params[], void *user)
+{
+	ChiakiAudioResampler resampler;
+	ChiakiErrorCode err = chiaki_audio_resampler_init(&resampler, CHANNELS);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	chiaki_audio_resampler_set_ratio(&resampler, 1.004);
+
+	int16_t in[CHUNK_FRAMES * CHANNELS] = { 0 };
+	size_t out_max = chiaki_audio_resampler_out_frames_max(&resampler, CHUNK_FRAMES);
+	int16_t *out = malloc(sizeof(int16_t) * CHANNELS * out_max);
+	munit_assert_not_null(out);
+
+	size_t in_total = 0;
+	size_t out_total = 0;
+	for(size_t chunk=0; chunk<100; chunk++)
+	{
+		size_t out_frames;
+		err = chiaki_audio_resampler_process(&resampler, in, CHUNK_FRAMES, out, out_max, &out_frames);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_size(out_frames, <=, out_max);
+		in_total += CHUNK_FRAMES;
+		out_total += out_frames;
+	}
+
+	double expected = (double)in_total * 1.004;
+	munit_assert_double(fabs((double)out_total - expected), <, CHIAKI_AUDIO_RESAMPLER_TAPS + 2);
+
+	free(out);
+	chiaki_audio_resampler_fini(&resampler);
+	return MUNIT_OK;
+}
+
+static MunitResult test_drift(const MunitParameter params[], void *user)
+{
+	ChiakiAudioResampler resampler;
+	ChiakiErrorCode err = chiaki_audio_resampler_init(&resampler, CHANNELS);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// output buffer filling up => produce fewer frames
+	for(size_t i=0; i<100; i++)
+		chiaki_audio_resampler_update_fill(&resampler, 3000, 2000);
+	munit_assert_double(chiaki_audio_resampler_get_ratio(&resampler), <, 1.0);
+	munit_assert_double(chiaki_audio_resampler_get_ratio(&resampler), >=, 1.0 - CHIAKI_AUDIO_RESAMPLER_RATIO_DEVIATION_MAX);
+
+	chiaki_audio_resampler_reset(&resampler);
+
+	// output buffer draining => produce more frames
+	for(size_t i=0; i<100; i++)
+		chiaki_audio_resampler_update_fill(&resampler, 500, 2000);
+	munit_assert_double(chiaki_audio_resampler_get_ratio(&resampler), >, 1.0);
+
+	// never deviate more than the maximum, however bad it gets
+	for(size_t i=0; i<100000; i++)
+		chiaki_audio_resampler_update_fill(&resampler, 0, 2000);
+	munit_assert_double(chiaki_audio_resampler_get_ratio(&resampler), <=, 1.0 + CHIAKI_AUDIO_RESAMPLER_RATIO_DEVIATION_MAX);
+
+	chiaki_audio_resampler_fini(&resampler);
+	return MUNIT_OK;
+}
+
+
+MunitTest tests_audio_resampler[] = {
+	{
+		"/unity",
+		test_unity,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/ratio",
+		test_ratio,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/drift",
+		test_drift,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,318 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/discoveryservice.h>
+#include <chiaki/stoppipe.h>
+#include <chiaki/thread.h>
+#include <chiaki/time.h>
+
+#include "test_log.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+static MunitResult test_targets(const MunitParameter params[], void *user)
+{
+	ChiakiDiscoveryServiceTarget target;
+	ChiakiErrorCode err = chiaki_discovery_service_target_parse(&target, "192.168.1.0/24");
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_uint32(target.addr, ==, 0xc0a80100);
+	munit_assert_uint8(target.prefix_len, ==, 24);
+	munit_assert_uint16(target.port, ==, 0);
+	munit_assert_uint64(chiaki_discovery_service_target_addrs_count(&target), ==, 254);
+
+	err = chiaki_discovery_service_target_parse(&target, "10.0.0.42");
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_uint32(target.addr, ==, 0x0a00002a);
+	munit_assert_uint8(target.prefix_len, ==, 32);
+	munit_assert_uint64(chiaki_discovery_service_target_addrs_count(&target), ==, 1);
+
+	err = chiaki_discovery_service_target_parse(&target, "10.0.0.0/31");
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_uint64(chiaki_discovery_service_target_addrs_count(&target), ==, 2);
+
+	err = chiaki_discovery_service_target_parse(&target, "10.0.0.0/16");
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_uint64(chiaki_discovery_service_target_addrs_count(&target), ==, 65534);
+
+	err = chiaki_discovery_service_target_parse(&target, "10.0.0.0/33");
+	munit_assert_int(err, ==, CHIAKI_ERR_PARSE_ADDR);
+	err = chiaki_discovery_service_target_parse(&target, "10.0.0.0/");
+	munit_assert_int(err, ==, CHIAKI_ERR_PARSE_ADDR);
+	err = chiaki_discovery_service_target_parse(&target, "10.0.0/24");
+	munit_assert_int(err, ==, CHIAKI_ERR_PARSE_ADDR);
+	err = chiaki_discovery_service_target_parse(&target, "fe80::1");
+	munit_assert_int(err, ==, CHIAKI_ERR_PARSE_ADDR);
+
+	return MUNIT_OK;
+}
+
+#ifdef __linux__
+
+#define FLEET_SIZE 200
+
+typedef struct fleet_t
+{
+	int fds[FLEET_SIZE];
+	ChiakiDiscoveryHostState states[FLEET_SIZE];
+	bool silent[FLEET_SIZE];
+	uint16_t port;
+	ChiakiStopPipe stop_pipe;
+	ChiakiThread thread;
+
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	size_t hosts_count;
+	size_t added;
+	size_t changed;
+	size_t removed;
+	size_t standby;
+} Fleet;
+
+static void *fleet_thread_func(void *user)
+{
+	Fleet *fleet = user;
+	ChiakiStopPipeSelectFd select_fds[FLEET_SIZE];
+	for(size_t i=0; i<FLEET_SIZE; i++)
+	{
+		select_fds[i].fd = fleet->fds[i];
+		select_fds[i].write = false;
+	}
+
+	while(chiaki_stop_pipe_select(&fleet->stop_pipe, select_fds, FLEET_SIZE, UINT64_MAX) == CHIAKI_ERR_SUCCESS)
+	{
+		for(size_t i=0; i<FLEET_SIZE; i++)
+		{
+			if(!select_fds[i].ready)
+				continue;
+			char buf[512];
+			struct sockaddr_in client_addr;
+			socklen_t client_addr_size = sizeof(client_addr);
+			ssize_t n = recvfrom(fleet->fds[i], buf, sizeof(buf), 0, (struct sockaddr *)&client_addr, &client_addr_size);
+			if(n <= 0)
+				continue;
+
+			chiaki_mutex_lock(&fleet->mutex);
+			bool silent = fleet->silent[i];
+			bool standby = fleet->states[i] == CHIAKI_DISCOVERY_HOST_STATE_STANDBY;
+			chiaki_mutex_unlock(&fleet->mutex);
+			if(silent)
+				continue;
+
+			int len = snprintf(buf, sizeof(buf),
+					"HTTP/1.1 %s\n"
+					"host-id:F0%010zX\n"
+					"host-type:PS4\n"
+					"host-name:Fleet%zu\n"
+					"host-request-port:997\n",
+					standby ? "620 Server Standby" : "200 Ok", i, i);
+			sendto(fleet->fds[i], buf, len, 0, (struct sockaddr *)&client_addr, client_addr_size);
+		}
+	}
+	return NULL;
+}
+
+static void fleet_host_cb(ChiakiDiscoveryServiceHostEvent event, ChiakiDiscoveryHost *host, void *user)
+{
+	Fleet *fleet = user;
+	chiaki_mutex_lock(&fleet->mutex);
+	switch(event)
+	{
+		case CHIAKI_DISCOVERY_SERVICE_HOST_ADDED:
+			fleet->added++;
+			fleet->hosts_count++;
+			break;
+		case CHIAKI_DISCOVERY_SERVICE_HOST_CHANGED:
+			fleet->changed++;
+			if(host->state == CHIAKI_DISCOVERY_HOST_STATE_STANDBY)
+				fleet->standby++;
+			break;
+		case CHIAKI_DISCOVERY_SERVICE_HOST_REMOVED:
+			fleet->removed++;
+			fleet->hosts_count--;
+			break;
+	}
+	chiaki_cond_signal(&fleet->cond);
+	chiaki_mutex_unlock(&fleet->mutex);
+}
+
+static bool fleet_all_added(void *user)
+{
+	Fleet *fleet = user;
+	return fleet->added >= FLEET_SIZE;
+}
+
+static bool fleet_changed(void *user)
+{
+	Fleet *fleet = user;
+	return fleet->standby >= FLEET_SIZE / 4 && fleet->removed >= FLEET_SIZE / 4;
+}
+
+static MunitResult loopback_fleet_run(ChiakiReactor *reactor)
+{
+	ChiakiLog *log = get_test_log();
+	static Fleet fleet;
+	memset(&fleet, 0, sizeof(fleet));
+
+	for(size_t i=0; i<FLEET_SIZE; i++)
+	{
+		fleet.fds[i] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+		munit_assert_int(fleet.fds[i], >=, 0);
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(0x7f000101 + (uint32_t)i); // 127.0.1.1 ...
+		addr.sin_port = htons(fleet.port);
+		if(bind(fleet.fds[i], (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		{
+			for(size_t j=0; j<=i; j++)
+				close(fleet.fds[j]);
+			return MUNIT_SKIP; // 127.0.0.0/8 not routed to lo
+		}
+		if(!fleet.port)
+		{
+			socklen_t addr_size = sizeof(addr);
+			getsockname(fleet.fds[i], (struct sockaddr *)&addr, &addr_size);
+			fleet.port = ntohs(addr.sin_port);
+		}
+		fleet.states[i] = CHIAKI_DISCOVERY_HOST_STATE_READY;
+	}
+
+	ChiakiErrorCode err = chiaki_mutex_init(&fleet.mutex, false);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_cond_init(&fleet.cond);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_stop_pipe_init(&fleet.stop_pipe);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_thread_create(&fleet.thread, fleet_thread_func, &fleet);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiDiscoveryServiceTarget target;
+	err = chiaki_discovery_service_target_parse(&target, "127.0.1.0/24");
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	target.port = fleet.port;
+
+	ChiakiDiscoveryServiceOptions options = { 0 };
+	options.hosts_max = FLEET_SIZE;
+	options.host_drop_pings = 3;
+	options.ping_ms = 100;
+	options.targets = &target;
+	options.targets_count = 1;
+	options.sends_per_tick = 32;
+	options.send_tick_us = 1000;
+	options.host_cb = fleet_host_cb;
+	options.cb_user = &fleet;
+	options.reactor = reactor;
+
+	uint64_t start_us = chiaki_time_now_monotonic_us();
+	ChiakiDiscoveryService service;
+	err = chiaki_discovery_service_init(&service, &options, log);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	chiaki_mutex_lock(&fleet.mutex);
+	err = chiaki_cond_timedwait_pred(&fleet.cond, &fleet.mutex, 5000, fleet_all_added, &fleet);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	uint64_t all_us = chiaki_time_now_monotonic_us() - start_us;
+	munit_assert_size(fleet.hosts_count, ==, FLEET_SIZE);
+	munit_assert_size(fleet.removed, ==, 0);
+	CHIAKI_LOGI(log, "Discovered %d hosts in %llu us", FLEET_SIZE, (unsigned long long)all_us);
+
+	// a quarter goes to standby, another quarter stops answering
+	for(size_t i=0; i<FLEET_SIZE / 4; i++)
+	{
+		fleet.states[i] = CHIAKI_DISCOVERY_HOST_STATE_STANDBY;
+		fleet.silent[FLEET_SIZE - 1 - i] = true;
+	}
+	err = chiaki_cond_timedwait_pred(&fleet.cond, &fleet.mutex, 5000, fleet_changed, &fleet);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_mutex_unlock(&fleet.mutex);
+
+	if(reactor)
+		munit_assert_true(service.reactor_active);
+	chiaki_discovery_service_fini(&service);
+
+	munit_assert_size(fleet.added, ==, FLEET_SIZE);
+	munit_assert_size(fleet.standby, ==, FLEET_SIZE / 4);
+	munit_assert_size(fleet.removed, ==, FLEET_SIZE / 4);
+	munit_assert_size(fleet.hosts_count, ==, FLEET_SIZE - FLEET_SIZE / 4);
+
+	chiaki_stop_pipe_stop(&fleet.stop_pipe);
+	chiaki_thread_join(&fleet.thread, NULL);
+	chiaki_stop_pipe_fini(&fleet.stop_pipe);
+	chiaki_cond_fini(&fleet.cond);
+	chiaki_mutex_fini(&fleet.mutex);
+	for(size_t i=0; i<FLEET_SIZE; i++)
+		close(fleet.fds[i]);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_loopback_fleet(const MunitParameter params[], void *user)
+{
+	return loopback_fleet_run(NULL);
+}
+
+static MunitResult test_loopback_fleet_reactor(const MunitParameter params[], void *user)
+{
+	ChiakiReactor reactor;
+	ChiakiErrorCode err = chiaki_reactor_init(&reactor, get_test_log(), 2);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	MunitResult r = loopback_fleet_run(&reactor);
+	chiaki_reactor_fini(&reactor);
+	return r;
+}
+
+#endif
+
+MunitTest tests_discovery_service[] = {
+	{
+		"/targets",
+		test_targets,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+#ifdef __linux__
+	{
+		"/loopback_fleet",
+		test_loopback_fleet,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/loopback_fleet_reactor",
+		test_loopback_fleet_reactor,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+#endif
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
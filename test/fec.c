@@ -20,6 +20,8 @@
 #include <chiaki/fec.h>
 #include <chiaki/base64.h>
 
+#include "test_log.h"
+
 typedef struct fec_test_case_t
 {
 	unsigned int k;
@@ -67,6 +69,69 @@ static MunitResult test_fec_case(FECTestCase *test_case)
 	return MUNIT_OK;
 }
 
+static bool test_case_is_erased(FECTestCase *test_case, unsigned int index)
+{
+	for(const int *e = test_case->erasures; *e >= 0; e++)
+	{
+		if((unsigned int)*e == index)
+			return true;
+	}
+	return false;
+}
+
+static void test_fec_progressive_put(ChiakiFecDecoder *decoder, FECTestCase *test_case, uint8_t *frame_buffer, const uint8_t *frame_buffer_ref, unsigned int index)
+{
+	if(test_case_is_erased(test_case, index))
+		return;
+	memcpy(frame_buffer + test_case->unit_size * index, frame_buffer_ref + test_case->unit_size * index, test_case->unit_size);
+	ChiakiErrorCode err = chiaki_fec_decoder_put_unit(decoder, index);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+}
+
+static MunitResult test_fec_progressive_case(FECTestCase *test_case, bool reordered, ChiakiFecPool *pool)
+{
+	size_t b64len = strlen(test_case->frame_buffer_b64);
+	size_t frame_buffer_size = b64len;
+
+	uint8_t *frame_buffer_ref = malloc(frame_buffer_size);
+	munit_assert_not_null(frame_buffer_ref);
+	ChiakiErrorCode err = chiaki_base64_decode(test_case->frame_buffer_b64, b64len, frame_buffer_ref, &frame_buffer_size);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(frame_buffer_size, ==, test_case->unit_size * (test_case->k + test_case->m));
+	uint8_t *frame_buffer = calloc(1, frame_buffer_size);
+	munit_assert_not_null(frame_buffer);
+
+	ChiakiFecDecoder decoder;
+	chiaki_fec_decoder_init(&decoder);
+	decoder.pool = pool;
+	err = chiaki_fec_decoder_reset(&decoder, frame_buffer, test_case->unit_size, test_case->k, test_case->m);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	unsigned int units_count = test_case->k + test_case->m;
+	if(reordered)
+	{
+		// every second unit first, so the others arrive late, some of them after parity
+		for(unsigned int i=0; i<units_count; i+=2)
+			test_fec_progressive_put(&decoder, test_case, frame_buffer, frame_buffer_ref, i);
+		for(unsigned int i=1; i<units_count; i+=2)
+			test_fec_progressive_put(&decoder, test_case, frame_buffer, frame_buffer_ref, i);
+	}
+	else
+	{
+		for(unsigned int i=0; i<units_count; i++)
+			test_fec_progressive_put(&decoder, test_case, frame_buffer, frame_buffer_ref, i);
+	}
+
+	err = chiaki_fec_decoder_finish(&decoder);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_memory_equal(test_case->k * test_case->unit_size, frame_buffer, frame_buffer_ref);
+
+	chiaki_fec_decoder_fini(&decoder);
+	free(frame_buffer);
+	free(frame_buffer_ref);
+	return MUNIT_OK;
+}
+
 static MunitParameterEnum fec_params[] = {
 	{ "test_case", fec_test_case_ids },
 	{ NULL, NULL },
@@ -78,6 +143,146 @@ static MunitResult test_fec(const MunitParameter params[], void *test_user)
 	return test_fec_case(&fec_test_cases[test_case_id]);
 }
 
+static MunitResult test_fec_progressive(const MunitParameter params[], void *test_user)
+{
+	unsigned long test_case_id = strtoul(params[0].value, NULL, 0);
+	MunitResult r = test_fec_progressive_case(&fec_test_cases[test_case_id], false, NULL);
+	if(r != MUNIT_OK)
+		return r;
+	return test_fec_progressive_case(&fec_test_cases[test_case_id], true, NULL);
+}
+
+static MunitResult test_fec_progressive_pool(const MunitParameter params[], void *test_user)
+{
+	unsigned long test_case_id = strtoul(params[0].value, NULL, 0);
+
+	ChiakiFecPool pool;
+	ChiakiErrorCode err = chiaki_fec_pool_init(&pool, 3, get_test_log());
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	// split even the small units of the test cases into as many stripes as possible
+	pool.work_min = 0;
+	pool.stripe_size_min = CHIAKI_FEC_POOL_STRIPE_ALIGN;
+
+	MunitResult r = test_fec_progressive_case(&fec_test_cases[test_case_id], false, &pool);
+	if(r == MUNIT_OK)
+		r = test_fec_progressive_case(&fec_test_cases[test_case_id], true, &pool);
+
+	chiaki_fec_pool_fini(&pool);
+	return r;
+}
+
+static MunitResult test_fec_progressive_insufficient(const MunitParameter params[], void *test_user)
+{
+	const unsigned int k = 8, m = 2;
+	const size_t unit_size = 0x20;
+	uint8_t *frame_buffer = calloc(k + m, unit_size);
+	munit_assert_not_null(frame_buffer);
+
+	ChiakiFecDecoder decoder;
+	chiaki_fec_decoder_init(&decoder);
+	ChiakiErrorCode err = chiaki_fec_decoder_reset(&decoder, frame_buffer, unit_size, k, m);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// 3 source units lost, only 2 parity units
+	for(unsigned int i=0; i<k + m; i++)
+	{
+		if(i == 1 || i == 4 || i == 5)
+			continue;
+		memset(frame_buffer + i * unit_size, (int)i, unit_size);
+		err = chiaki_fec_decoder_put_unit(&decoder, i);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+	munit_assert_int(chiaki_fec_decoder_put_unit(&decoder, k + m), ==, CHIAKI_ERR_INVALID_DATA);
+
+	err = chiaki_fec_decoder_finish(&decoder);
+	munit_assert_int(err, ==, CHIAKI_ERR_FEC_FAILED);
+
+	chiaki_fec_decoder_fini(&decoder);
+	free(frame_buffer);
+	return MUNIT_OK;
+}
+
+static MunitResult test_fec_progressive_no_parity(const MunitParameter params[], void *test_user)
+{
+	const unsigned int k = 4;
+	const size_t unit_size = 0x20;
+	uint8_t *frame_buffer = calloc(k, unit_size);
+	munit_assert_not_null(frame_buffer);
+
+	ChiakiFecDecoder decoder;
+	chiaki_fec_decoder_init(&decoder);
+
+	// all units arrived, nothing to recover
+	ChiakiErrorCode err = chiaki_fec_decoder_reset(&decoder, frame_buffer, unit_size, k, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	for(unsigned int i=0; i<k; i++)
+	{
+		err = chiaki_fec_decoder_put_unit(&decoder, i);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+	munit_assert_int(chiaki_fec_decoder_put_unit(&decoder, k), ==, CHIAKI_ERR_INVALID_DATA);
+	err = chiaki_fec_decoder_finish(&decoder);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// one lost, no way to recover it
+	err = chiaki_fec_decoder_reset(&decoder, frame_buffer, unit_size, k, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	for(unsigned int i=1; i<k; i++)
+	{
+		err = chiaki_fec_decoder_put_unit(&decoder, i);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+	err = chiaki_fec_decoder_finish(&decoder);
+	munit_assert_int(err, ==, CHIAKI_ERR_FEC_FAILED);
+
+	chiaki_fec_decoder_fini(&decoder);
+	free(frame_buffer);
+	return MUNIT_OK;
+}
+
+static MunitResult test_fec_progressive_rows(const MunitParameter params[], void *test_user)
+{
+	const unsigned int k = 8, m = 4;
+	const size_t unit_size = 0x20;
+	uint8_t *frame_buffer = calloc(k + m, unit_size);
+	munit_assert_not_null(frame_buffer);
+
+	ChiakiFecDecoder decoder;
+	chiaki_fec_decoder_init(&decoder);
+	ChiakiErrorCode err = chiaki_fec_decoder_reset(&decoder, frame_buffer, unit_size, k, m);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// parity of row 2 overtakes the source units, so rows 0 and 1 are most likely lost
+	err = chiaki_fec_decoder_put_unit(&decoder, k + 2);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_uint(decoder.rows_active, ==, 1);
+	munit_assert(decoder.row_active[2]);
+
+	// the second skipped unit needs a second row, which must be one whose parity can still arrive
+	for(unsigned int i=0; i<k; i++)
+	{
+		if(i == 1 || i == 4)
+			continue;
+		err = chiaki_fec_decoder_put_unit(&decoder, i);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+	munit_assert_uint(decoder.rows_active, ==, 2);
+	munit_assert(!decoder.row_active[0]);
+	munit_assert(!decoder.row_active[1]);
+	munit_assert(decoder.row_active[3]);
+
+	err = chiaki_fec_decoder_put_unit(&decoder, k + 3);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_uint(decoder.rows_active, ==, 2);
+
+	err = chiaki_fec_decoder_finish(&decoder);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	chiaki_fec_decoder_fini(&decoder);
+	free(frame_buffer);
+	return MUNIT_OK;
+}
+
 MunitTest tests_fec[] = {
 	{
 		"/fec",
@@ -87,5 +292,45 @@ MunitTest tests_fec[] = {
 		MUNIT_TEST_OPTION_NONE,
 		fec_params
 	},
+	{
+		"/fec_progressive",
+		test_fec_progressive,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		fec_params
+	},
+	{
+		"/fec_progressive_pool",
+		test_fec_progressive_pool,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		fec_params
+	},
+	{
+		"/fec_progressive_insufficient",
+		test_fec_progressive_insufficient,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/fec_progressive_no_parity",
+		test_fec_progressive_no_parity,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/fec_progressive_rows",
+		test_fec_progressive_rows,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
\ No newline at end of file
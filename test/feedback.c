@@ -0,0 +1,172 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/feedback.h>
+
+#include <string.h>
+
+static MunitResult test_history_diff_chord(const MunitParameter params[], void *user)
+{
+	ChiakiControllerState prev;
+	chiaki_controller_state_set_idle(&prev);
+	ChiakiControllerState now = prev;
+	now.buttons = CHIAKI_CONTROLLER_BUTTON_CROSS | CHIAKI_CONTROLLER_BUTTON_MOON | CHIAKI_CONTROLLER_BUTTON_L1 | CHIAKI_CONTROLLER_BUTTON_R1;
+	now.l2_state = 0x42;
+
+	ChiakiFeedbackHistoryEvent events[CHIAKI_FEEDBACK_HISTORY_EVENTS_DIFF_MAX];
+	size_t count = chiaki_feedback_history_events_diff(NULL, events, &prev, &now);
+	munit_assert_size(count, ==, 5);
+
+	ChiakiFeedbackHistoryEvent expected;
+	ChiakiErrorCode err = chiaki_feedback_history_event_set_button(&expected, CHIAKI_CONTROLLER_BUTTON_CROSS, 0xff);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(events[0].len, ==, expected.len);
+	munit_assert_memory_equal(expected.len, events[0].buf, expected.buf);
+
+	err = chiaki_feedback_history_event_set_button(&expected, CHIAKI_CONTROLLER_ANALOG_BUTTON_L2, 0x42);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_size(events[4].len, ==, expected.len);
+	munit_assert_memory_equal(expected.len, events[4].buf, expected.buf);
+
+	// releasing produces the same number of events
+	count = chiaki_feedback_history_events_diff(NULL, events, &now, &prev);
+	munit_assert_size(count, ==, 5);
+
+	// nothing changed
+	count = chiaki_feedback_history_events_diff(NULL, events, &now, &now);
+	munit_assert_size(count, ==, 0);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_history_diff_touch(const MunitParameter params[], void *user)
+{
+	ChiakiControllerState prev;
+	chiaki_controller_state_set_idle(&prev);
+	ChiakiControllerState now = prev;
+	int8_t id_a = chiaki_controller_state_start_touch(&now, 100, 200);
+	int8_t id_b = chiaki_controller_state_start_touch(&now, 300, 400);
+	munit_assert_int(id_a, >=, 0);
+	munit_assert_int(id_b, >=, 0);
+
+	ChiakiFeedbackHistoryEvent events[CHIAKI_FEEDBACK_HISTORY_EVENTS_DIFF_MAX];
+	size_t count = chiaki_feedback_history_events_diff(NULL, events, &prev, &now);
+	munit_assert_size(count, ==, 2);
+	munit_assert_uint8(events[0].buf[0], ==, 0xd0);
+	munit_assert_uint8(events[1].buf[0], ==, 0xd0);
+
+	prev = now;
+	chiaki_controller_state_stop_touch(&now, (uint8_t)id_a);
+	count = chiaki_feedback_history_events_diff(NULL, events, &prev, &now);
+	munit_assert_size(count, ==, 1);
+	munit_assert_uint8(events[0].buf[0], ==, 0xc0);
+
+	return MUNIT_OK;
+}
+
+#define HISTORY_BUFFER_SIZE 0x10
+
+/**
+ * Pushes a chord of 4 buttons and its release repeatedly, as chiaki_feedback_sender_set_controller_state() does,
+ * and checks that the formatted history always holds the newest events, newest first.
+ */
+static MunitResult test_history_packet(const MunitParameter params[], void *user)
+{
+	ChiakiFeedbackHistoryBuffer history_buf;
+	ChiakiErrorCode err = chiaki_feedback_history_buffer_init(&history_buf, HISTORY_BUFFER_SIZE);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiControllerState states[2];
+	chiaki_controller_state_set_idle(&states[0]);
+	states[1] = states[0];
+	states[1].buttons = CHIAKI_CONTROLLER_BUTTON_CROSS | CHIAKI_CONTROLLER_BUTTON_BOX | CHIAKI_CONTROLLER_BUTTON_L1 | CHIAKI_CONTROLLER_BUTTON_R1;
+
+	// every event ever pushed, oldest first
+	ChiakiFeedbackHistoryEvent pushed[3 * HISTORY_BUFFER_SIZE];
+	size_t pushed_count = 0;
+
+	for(size_t i=0; i<sizeof(pushed) / sizeof(pushed[0]) / 4; i++)
+	{
+		ChiakiControllerState *prev = &states[i % 2];
+		ChiakiControllerState *now = &states[(i + 1) % 2];
+
+		ChiakiFeedbackHistoryEvent events[CHIAKI_FEEDBACK_HISTORY_EVENTS_DIFF_MAX];
+		size_t count = chiaki_feedback_history_events_diff(NULL, events, prev, now);
+		munit_assert_size(count, ==, 4);
+		for(size_t j=0; j<count; j++)
+		{
+			chiaki_feedback_history_buffer_push(&history_buf, &events[j]);
+			pushed[pushed_count++] = events[j];
+		}
+
+		uint8_t buf[0x300];
+		size_t buf_size = sizeof(buf);
+		err = chiaki_feedback_history_buffer_format(&history_buf, buf, &buf_size);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+		uint8_t expected[0x300];
+		size_t expected_size = 0;
+		size_t expected_count = pushed_count < HISTORY_BUFFER_SIZE ? pushed_count : HISTORY_BUFFER_SIZE;
+		for(size_t j=0; j<expected_count; j++)
+		{
+			ChiakiFeedbackHistoryEvent *event = &pushed[pushed_count - 1 - j];
+			memcpy(expected + expected_size, event->buf, event->len);
+			expected_size += event->len;
+		}
+		munit_assert_size(buf_size, ==, expected_size);
+		munit_assert_memory_equal(expected_size, buf, expected);
+
+		// a buffer that cannot hold the whole history is rejected
+		buf_size = expected_size - 1;
+		err = chiaki_feedback_history_buffer_format(&history_buf, buf, &buf_size);
+		munit_assert_int(err, ==, CHIAKI_ERR_BUF_TOO_SMALL);
+	}
+
+	chiaki_feedback_history_buffer_fini(&history_buf);
+	return MUNIT_OK;
+}
+
+
+MunitTest tests_feedback[] = {
+	{
+		"/history_diff_chord",
+		test_history_diff_chord,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/history_diff_touch",
+		test_history_diff_touch,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/history_packet",
+		test_history_packet,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
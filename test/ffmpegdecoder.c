@@ -0,0 +1,304 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/config.h>
+
+#if CHIAKI_LIB_ENABLE_FFMPEG
+
+#include <chiaki/ffmpegdecoder.h>
+#include <chiaki/time.h>
+
+#include <libavutil/frame.h>
+
+#include <string.h>
+
+#include "test_log.h"
+
+/**
+ * One complete 16x16 baseline IDR frame: SPS, PPS and a slice with a single I_PCM macroblock.
+ */
+#define IDR_PCM_SAMPLE_SIZE (10 + 8 + 9 + 384 + 1)
+
+static void idr_pcm_sample(uint8_t *buf)
+{
+	static const uint8_t headers[] = {
+		0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0xc0, 0x0a, 0xdd, 0xe4, // SPS
+		0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x38, 0x80, // PPS
+		0x00, 0x00, 0x00, 0x01, 0x65, 0x88, 0x84, 0x86, 0x80 // IDR slice header, mb_type I_PCM
+	};
+	memcpy(buf, headers, sizeof(headers));
+	memset(buf + sizeof(headers), 0x80, 384); // samples
+	buf[sizeof(headers) + 384] = 0x80; // rbsp trailing bits
+}
+
+typedef struct ffmpeg_test_ctx_t
+{
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	ChiakiFfmpegFrame *frames[8];
+	size_t frames_count;
+	bool block; // hold the decode thread inside the frame callback
+	bool blocked;
+} FfmpegTestCtx;
+
+static void ffmpeg_test_frame_cb(ChiakiFfmpegFrame *frame, void *user)
+{
+	FfmpegTestCtx *ctx = user;
+	chiaki_mutex_lock(&ctx->mutex);
+	munit_assert_size(ctx->frames_count, <, sizeof(ctx->frames) / sizeof(ctx->frames[0]));
+	ctx->frames[ctx->frames_count++] = frame;
+	ctx->blocked = ctx->block;
+	chiaki_cond_broadcast(&ctx->cond);
+	while(ctx->block)
+		chiaki_cond_wait(&ctx->cond, &ctx->mutex);
+	ctx->blocked = false;
+	chiaki_mutex_unlock(&ctx->mutex);
+}
+
+static bool ffmpeg_test_blocked(void *user)
+{
+	FfmpegTestCtx *ctx = user;
+	return ctx->blocked;
+}
+
+static void ffmpeg_test_ctx_init(FfmpegTestCtx *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	chiaki_mutex_init(&ctx->mutex, false);
+	chiaki_cond_init(&ctx->cond);
+}
+
+static void ffmpeg_test_ctx_fini(FfmpegTestCtx *ctx)
+{
+	chiaki_cond_fini(&ctx->cond);
+	chiaki_mutex_fini(&ctx->mutex);
+}
+
+/**
+ * Wait until the decode thread has either output or dropped this many frames in total.
+ */
+static void ffmpeg_test_wait_frames(ChiakiFfmpegDecoder *decoder, FfmpegTestCtx *ctx, uint64_t count)
+{
+	uint64_t deadline_us = chiaki_time_now_monotonic_us() + 5000000;
+	chiaki_mutex_lock(&ctx->mutex);
+	while(true)
+	{
+		ChiakiFfmpegDecoderStats stats;
+		chiaki_ffmpeg_decoder_get_stats(decoder, &stats);
+		if(stats.frames + stats.frames_dropped >= count)
+			break;
+		munit_assert_uint64(chiaki_time_now_monotonic_us(), <, deadline_us);
+		chiaki_cond_timedwait(&ctx->cond, &ctx->mutex, 1);
+	}
+	chiaki_mutex_unlock(&ctx->mutex);
+}
+
+static MunitResult test_options(const MunitParameter params[], void *user)
+{
+	ChiakiFfmpegDecoderOptions options;
+	chiaki_ffmpeg_decoder_options_default(&options);
+	munit_assert(options.low_delay);
+	options.threading = CHIAKI_FFMPEG_DECODER_THREADING_FRAME;
+
+	ChiakiFfmpegDecoder decoder;
+	ChiakiErrorCode err = chiaki_ffmpeg_decoder_init(&decoder, &options, NULL, NULL, get_test_log());
+	if(err == CHIAKI_ERR_UNKNOWN)
+		return MUNIT_SKIP; // no H.264 decoder in this FFmpeg build
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert(!decoder.options.low_delay);
+	chiaki_ffmpeg_decoder_fini(&decoder);
+
+	options.queue_size = 0;
+	err = chiaki_ffmpeg_decoder_init(&decoder, &options, NULL, NULL, get_test_log());
+	munit_assert_int(err, ==, CHIAKI_ERR_INVALID_DATA);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_pool(const MunitParameter params[], void *user)
+{
+	FfmpegTestCtx ctx;
+	ffmpeg_test_ctx_init(&ctx);
+
+	ChiakiFfmpegDecoderOptions options;
+	chiaki_ffmpeg_decoder_options_default(&options);
+	options.threading = CHIAKI_FFMPEG_DECODER_THREADING_NONE;
+	options.frames_count = 2;
+
+	ChiakiFfmpegDecoder decoder;
+	ChiakiErrorCode err = chiaki_ffmpeg_decoder_init(&decoder, &options, ffmpeg_test_frame_cb, &ctx, get_test_log());
+	if(err == CHIAKI_ERR_UNKNOWN)
+	{
+		ffmpeg_test_ctx_fini(&ctx);
+		return MUNIT_SKIP;
+	}
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint8_t sample[IDR_PCM_SAMPLE_SIZE];
+	idr_pcm_sample(sample);
+
+	// the callback keeps every frame it gets, so only as many as the pool holds come out
+	for(uint64_t i=0; i<4; i++)
+	{
+		munit_assert(chiaki_ffmpeg_decoder_video_sample_cb(sample, sizeof(sample), &decoder));
+		ffmpeg_test_wait_frames(&decoder, &ctx, i + 1);
+	}
+
+	ChiakiFfmpegDecoderStats stats;
+	chiaki_ffmpeg_decoder_get_stats(&decoder, &stats);
+	munit_assert_uint64(stats.samples, ==, 4);
+	munit_assert_uint64(stats.frames, ==, 2);
+	munit_assert_uint64(stats.frames_dropped, ==, 2);
+	munit_assert_uint64(stats.decode_errors, ==, 0);
+	munit_assert_size(ctx.frames_count, ==, 2);
+	munit_assert_ptr_not_equal(ctx.frames[0], ctx.frames[1]);
+	munit_assert_int(ctx.frames[0]->frame->width, ==, 16);
+	munit_assert_int(ctx.frames[0]->frame->height, ==, 16);
+
+	// an extra reference keeps the frame out of the pool
+	chiaki_ffmpeg_frame_ref(ctx.frames[0]);
+	chiaki_ffmpeg_frame_unref(ctx.frames[0]);
+	munit_assert(chiaki_ffmpeg_decoder_video_sample_cb(sample, sizeof(sample), &decoder));
+	ffmpeg_test_wait_frames(&decoder, &ctx, 5);
+	chiaki_ffmpeg_decoder_get_stats(&decoder, &stats);
+	munit_assert_uint64(stats.frames_dropped, ==, 3);
+
+	// the last reference returns it
+	ChiakiFfmpegFrame *returned = ctx.frames[0];
+	chiaki_ffmpeg_frame_unref(returned);
+	munit_assert(chiaki_ffmpeg_decoder_video_sample_cb(sample, sizeof(sample), &decoder));
+	ffmpeg_test_wait_frames(&decoder, &ctx, 6);
+	chiaki_ffmpeg_decoder_get_stats(&decoder, &stats);
+	munit_assert_uint64(stats.frames, ==, 3);
+	munit_assert_size(ctx.frames_count, ==, 3);
+	munit_assert_ptr_equal(ctx.frames[2], returned);
+
+	chiaki_ffmpeg_frame_unref(ctx.frames[1]);
+	chiaki_ffmpeg_frame_unref(ctx.frames[2]);
+	chiaki_ffmpeg_decoder_fini(&decoder);
+	ffmpeg_test_ctx_fini(&ctx);
+	return MUNIT_OK;
+}
+
+static MunitResult test_queue_full(const MunitParameter params[], void *user)
+{
+	FfmpegTestCtx ctx;
+	ffmpeg_test_ctx_init(&ctx);
+	ctx.block = true;
+
+	ChiakiFfmpegDecoderOptions options;
+	chiaki_ffmpeg_decoder_options_default(&options);
+	options.threading = CHIAKI_FFMPEG_DECODER_THREADING_NONE;
+	options.queue_size = 2;
+
+	ChiakiFfmpegDecoder decoder;
+	ChiakiErrorCode err = chiaki_ffmpeg_decoder_init(&decoder, &options, ffmpeg_test_frame_cb, &ctx, get_test_log());
+	if(err == CHIAKI_ERR_UNKNOWN)
+	{
+		ffmpeg_test_ctx_fini(&ctx);
+		return MUNIT_SKIP;
+	}
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint8_t sample[IDR_PCM_SAMPLE_SIZE];
+	idr_pcm_sample(sample);
+
+	// the decode thread is held in the callback with the first frame
+	munit_assert(chiaki_ffmpeg_decoder_video_sample_cb(sample, sizeof(sample), &decoder));
+	chiaki_mutex_lock(&ctx.mutex);
+	err = chiaki_cond_timedwait_pred(&ctx.cond, &ctx.mutex, 5000, ffmpeg_test_blocked, &ctx);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_mutex_unlock(&ctx.mutex);
+
+	munit_assert(chiaki_ffmpeg_decoder_video_sample_cb(sample, sizeof(sample), &decoder));
+	munit_assert(chiaki_ffmpeg_decoder_video_sample_cb(sample, sizeof(sample), &decoder));
+
+	// a full queue is discarded together with the new sample
+	munit_assert(!chiaki_ffmpeg_decoder_video_sample_cb(sample, sizeof(sample), &decoder));
+	ChiakiFfmpegDecoderStats stats;
+	chiaki_ffmpeg_decoder_get_stats(&decoder, &stats);
+	munit_assert_uint64(stats.samples, ==, 3);
+	munit_assert_uint64(stats.samples_dropped, ==, 3);
+
+	// and the next sample starts over
+	munit_assert(chiaki_ffmpeg_decoder_video_sample_cb(sample, sizeof(sample), &decoder));
+
+	chiaki_mutex_lock(&ctx.mutex);
+	ctx.block = false;
+	chiaki_cond_broadcast(&ctx.cond);
+	chiaki_mutex_unlock(&ctx.mutex);
+
+	ffmpeg_test_wait_frames(&decoder, &ctx, 2);
+	chiaki_ffmpeg_decoder_get_stats(&decoder, &stats);
+	munit_assert_uint64(stats.samples, ==, 4);
+	munit_assert_uint64(stats.frames, ==, 2);
+
+	for(size_t i=0; i<ctx.frames_count; i++)
+		chiaki_ffmpeg_frame_unref(ctx.frames[i]);
+	chiaki_ffmpeg_decoder_fini(&decoder);
+	ffmpeg_test_ctx_fini(&ctx);
+	return MUNIT_OK;
+}
+
+#else
+
+static MunitResult test_options(const MunitParameter params[], void *user)
+{
+	return MUNIT_SKIP;
+}
+
+static MunitResult test_pool(const MunitParameter params[], void *user)
+{
+	return MUNIT_SKIP;
+}
+
+static MunitResult test_queue_full(const MunitParameter params[], void *user)
+{
+	return MUNIT_SKIP;
+}
+
+#endif
+
+MunitTest tests_ffmpeg_decoder[] = {
+	{
+		"/options",
+		test_options,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/pool",
+		test_pool,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/queue_full",
+		test_queue_full,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
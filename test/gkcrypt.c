@@ -20,6 +20,8 @@
 #include <chiaki/ecdh.h>
 #include <chiaki/gkcrypt.h>
 
+#include "test_log.h"
+
 static MunitResult test_ecdh(const MunitParameter params[], void *user)
 {
 	static const uint8_t handshake_key[] = { 0xfc, 0x5d, 0x4b, 0xa0, 0x3a, 0x35, 0x3a, 0xbb, 0x6a, 0x7f, 0xac, 0x79, 0x1b, 0x17, 0xbb, 0x34 };
@@ -77,7 +79,7 @@ static MunitResult test_key_stream(const MunitParameter params[], void *user)
 	ChiakiLog log;
 
 	ChiakiGKCrypt gkcrypt;
-	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, 0, 42, handshake_key, ecdh_secret);
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, NULL, 0, 42, handshake_key, ecdh_secret);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return MUNIT_ERROR;
 
@@ -111,7 +113,7 @@ static MunitResult test_endecrypt(const MunitParameter params[], void *user)
 	ChiakiLog log;
 
 	ChiakiGKCrypt gkcrypt;
-	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, 0, 42, handshake_key, ecdh_secret);
+	ChiakiErrorCode err = chiaki_gkcrypt_init(&gkcrypt, &log, NULL, 0, 42, handshake_key, ecdh_secret);
 	if(err != CHIAKI_ERR_SUCCESS)
 		return MUNIT_ERROR;
 
@@ -310,7 +312,7 @@ static MunitResult test_gmac_multiple_of_key_refresh(const MunitParameter params
 
 	ChiakiLog log;
 	ChiakiGKCrypt gkcrypt;
-	chiaki_gkcrypt_init(&gkcrypt, &log, 0, crypt_index, handshake_key, ecdh_secret);
+	chiaki_gkcrypt_init(&gkcrypt, &log, NULL, 0, crypt_index, handshake_key, ecdh_secret);
 
 	uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
 	ChiakiErrorCode err = chiaki_gkcrypt_gmac(&gkcrypt, key_pos, data, sizeof(data), gmac);
@@ -324,6 +326,284 @@ static MunitResult test_gmac_multiple_of_key_refresh(const MunitParameter params
 	return MUNIT_OK;
 }
 
+static MunitResult test_gmac_head_tail(const MunitParameter params[], void *user)
+{
+	static const uint8_t handshake_key[] = { 0x70, 0x58, 0x37, 0x50, 0x91, 0xea, 0xd1, 0x37, 0x71, 0x58, 0xec, 0xb3, 0xb, 0xea, 0x23, 0x87 };
+	static const uint8_t ecdh_secret[] = { 0x3c, 0x3a, 0xf0, 0xec, 0xd6, 0x33, 0x1b, 0xb1, 0x6d, 0x24, 0x4f, 0x48, 0x19, 0xde, 0x6, 0x3d,
+										0xc7, 0xe, 0xac, 0x95, 0x70, 0xac, 0x24, 0x92, 0x86, 0xa7, 0x24, 0xd0, 0x7a, 0x37, 0x55, 0x52 };
+	// crossing gmac key refreshes forwards and backwards
+	static const size_t key_positions[] = { 0x10, 0x6b1de0, 0xafc8, 0xafd0, 0x6b1df0, 0x20 };
+
+	uint8_t data[0x53];
+	for(size_t i=0; i<sizeof(data); i++)
+		data[i] = (uint8_t)(i * 7 + 3);
+
+	ChiakiLog log;
+	ChiakiGKCrypt gkcrypt_a;
+	ChiakiGKCrypt gkcrypt_b;
+	if(chiaki_gkcrypt_init(&gkcrypt_a, &log, NULL, 0, 3, handshake_key, ecdh_secret) != CHIAKI_ERR_SUCCESS)
+		return MUNIT_ERROR;
+	if(chiaki_gkcrypt_init(&gkcrypt_b, &log, NULL, 0, 3, handshake_key, ecdh_secret) != CHIAKI_ERR_SUCCESS)
+		return MUNIT_ERROR;
+
+	for(size_t k=0; k<sizeof(key_positions) / sizeof(key_positions[0]); k++)
+	{
+		// b sees the key positions in reverse, so its cached gmac key differs from a's
+		size_t key_pos = key_positions[k];
+		size_t key_pos_rev = key_positions[sizeof(key_positions) / sizeof(key_positions[0]) - 1 - k];
+
+		uint8_t gmac_expected[CHIAKI_GKCRYPT_GMAC_SIZE];
+		uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
+		munit_assert_int(chiaki_gkcrypt_gmac(&gkcrypt_a, key_pos, data, sizeof(data), gmac_expected), ==, CHIAKI_ERR_SUCCESS);
+
+		for(size_t split=0; split<=sizeof(data); split += 0xc)
+		{
+			munit_assert_int(chiaki_gkcrypt_gmac_split(&gkcrypt_b, key_pos, data, split, data + split, sizeof(data) - split, gmac), ==, CHIAKI_ERR_SUCCESS);
+			munit_assert_memory_equal(sizeof(gmac), gmac, gmac_expected);
+		}
+
+		munit_assert_int(chiaki_gkcrypt_gmac(&gkcrypt_b, key_pos_rev, data, sizeof(data), gmac), ==, CHIAKI_ERR_SUCCESS);
+	}
+
+	chiaki_gkcrypt_fini(&gkcrypt_a);
+	chiaki_gkcrypt_fini(&gkcrypt_b);
+
+	return MUNIT_OK;
+}
+
+#define GMAC_CONCURRENT_THREADS 4
+#define GMAC_CONCURRENT_KEY_INDICES 0x20
+#define GMAC_CONCURRENT_ROUNDS 8
+
+typedef struct gmac_concurrent_t
+{
+	ChiakiGKCrypt *gkcrypt;
+	const uint8_t *data;
+	size_t data_size;
+	uint8_t (*expected)[CHIAKI_GKCRYPT_GMAC_SIZE];
+	bool reverse;
+	size_t mismatches;
+} GmacConcurrent;
+
+static void *gmac_concurrent_thread_func(void *user)
+{
+	GmacConcurrent *gc = user;
+	for(size_t round=0; round<GMAC_CONCURRENT_ROUNDS; round++)
+	{
+		for(size_t i=0; i<GMAC_CONCURRENT_KEY_INDICES; i++)
+		{
+			size_t key_index = gc->reverse ? GMAC_CONCURRENT_KEY_INDICES - 1 - i : i;
+			size_t key_pos = key_index * CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS + 0x10;
+			uint8_t gmac[CHIAKI_GKCRYPT_GMAC_SIZE];
+			if(chiaki_gkcrypt_gmac(gc->gkcrypt, key_pos, gc->data, gc->data_size, gmac) != CHIAKI_ERR_SUCCESS
+				|| memcmp(gmac, gc->expected[key_index], sizeof(gmac)))
+				gc->mismatches++;
+		}
+	}
+	return NULL;
+}
+
+static MunitResult test_gmac_concurrent(const MunitParameter params[], void *user)
+{
+	static const uint8_t handshake_key[] = { 0x70, 0x58, 0x37, 0x50, 0x91, 0xea, 0xd1, 0x37, 0x71, 0x58, 0xec, 0xb3, 0xb, 0xea, 0x23, 0x87 };
+	static const uint8_t ecdh_secret[] = { 0x3c, 0x3a, 0xf0, 0xec, 0xd6, 0x33, 0x1b, 0xb1, 0x6d, 0x24, 0x4f, 0x48, 0x19, 0xde, 0x6, 0x3d,
+										0xc7, 0xe, 0xac, 0x95, 0x70, 0xac, 0x24, 0x92, 0x86, 0xa7, 0x24, 0xd0, 0x7a, 0x37, 0x55, 0x52 };
+
+	uint8_t data[0x40];
+	for(size_t i=0; i<sizeof(data); i++)
+		data[i] = (uint8_t)(i * 13 + 1);
+
+	ChiakiLog log;
+	ChiakiGKCrypt gkcrypt_ref;
+	ChiakiGKCrypt gkcrypt;
+	if(chiaki_gkcrypt_init(&gkcrypt_ref, &log, NULL, 0, 3, handshake_key, ecdh_secret) != CHIAKI_ERR_SUCCESS)
+		return MUNIT_ERROR;
+	if(chiaki_gkcrypt_init(&gkcrypt, &log, NULL, 0, 3, handshake_key, ecdh_secret) != CHIAKI_ERR_SUCCESS)
+	{
+		chiaki_gkcrypt_fini(&gkcrypt_ref);
+		return MUNIT_ERROR;
+	}
+
+	uint8_t expected[GMAC_CONCURRENT_KEY_INDICES][CHIAKI_GKCRYPT_GMAC_SIZE];
+	for(size_t i=0; i<GMAC_CONCURRENT_KEY_INDICES; i++)
+	{
+		size_t key_pos = i * CHIAKI_GKCRYPT_GMAC_KEY_REFRESH_KEY_POS + 0x10;
+		munit_assert_int(chiaki_gkcrypt_gmac(&gkcrypt_ref, key_pos, data, sizeof(data), expected[i]), ==, CHIAKI_ERR_SUCCESS);
+	}
+
+	// threads walking the key indices in opposite directions keep replacing the cached key
+	// while others read it
+	GmacConcurrent gc[GMAC_CONCURRENT_THREADS];
+	ChiakiThread threads[GMAC_CONCURRENT_THREADS];
+	for(size_t i=0; i<GMAC_CONCURRENT_THREADS; i++)
+	{
+		gc[i].gkcrypt = &gkcrypt;
+		gc[i].data = data;
+		gc[i].data_size = sizeof(data);
+		gc[i].expected = expected;
+		gc[i].reverse = i % 2;
+		gc[i].mismatches = 0;
+		munit_assert_int(chiaki_thread_create(&threads[i], gmac_concurrent_thread_func, &gc[i]), ==, CHIAKI_ERR_SUCCESS);
+	}
+
+	for(size_t i=0; i<GMAC_CONCURRENT_THREADS; i++)
+	{
+		chiaki_thread_join(&threads[i], NULL);
+		munit_assert_size(gc[i].mismatches, ==, 0);
+	}
+
+	chiaki_gkcrypt_fini(&gkcrypt);
+	chiaki_gkcrypt_fini(&gkcrypt_ref);
+
+	return MUNIT_OK;
+}
+
+static MunitResult test_gmac_verify_batch(const MunitParameter params[], void *user)
+{
+	static const uint8_t handshake_key[] = { 0x70, 0x58, 0x37, 0x50, 0x91, 0xea, 0xd1, 0x37, 0x71, 0x58, 0xec, 0xb3, 0xb, 0xea, 0x23, 0x87 };
+	static const uint8_t ecdh_secret[] = { 0x3c, 0x3a, 0xf0, 0xec, 0xd6, 0x33, 0x1b, 0xb1, 0x6d, 0x24, 0x4f, 0x48, 0x19, 0xde, 0x6, 0x3d,
+										0xc7, 0xe, 0xac, 0x95, 0x70, 0xac, 0x24, 0x92, 0x86, 0xa7, 0x24, 0xd0, 0x7a, 0x37, 0x55, 0x52 };
+	// consecutive packets crossing a gmac key refresh, then jumping back
+	static const size_t key_positions[] = { 0x10, 0xaf00, 0xafc0, 0xafc8, 0xafd0, 0xb5a0, 0x20, 0x6b1de0 };
+	static const size_t corrupted = 3;
+#define BATCH_COUNT (sizeof(key_positions) / sizeof(key_positions[0]))
+
+	uint8_t data[BATCH_COUNT][0x53];
+	for(size_t k=0; k<BATCH_COUNT; k++)
+	{
+		for(size_t i=0; i<sizeof(data[k]); i++)
+			data[k][i] = (uint8_t)(i * 7 + k);
+	}
+
+	ChiakiLog log;
+	ChiakiGKCrypt gkcrypt;
+	if(chiaki_gkcrypt_init(&gkcrypt, &log, NULL, 0, 3, handshake_key, ecdh_secret) != CHIAKI_ERR_SUCCESS)
+		return MUNIT_ERROR;
+
+	ChiakiGKCryptGmacVerify verify[BATCH_COUNT];
+	for(size_t k=0; k<BATCH_COUNT; k++)
+	{
+		verify[k].key_pos = key_positions[k];
+		verify[k].buf = data[k];
+		verify[k].buf_size = sizeof(data[k]);
+		verify[k].valid = false;
+		munit_assert_int(chiaki_gkcrypt_gmac(&gkcrypt, key_positions[k], data[k], sizeof(data[k]), verify[k].gmac), ==, CHIAKI_ERR_SUCCESS);
+	}
+	verify[corrupted].gmac[1] ^= 0x40;
+
+	munit_assert_int(chiaki_gkcrypt_gmac_verify_batch(&gkcrypt, verify, BATCH_COUNT), ==, CHIAKI_ERR_SUCCESS);
+	for(size_t k=0; k<BATCH_COUNT; k++)
+		munit_assert(verify[k].valid == (k != corrupted));
+
+	munit_assert_int(chiaki_gkcrypt_gmac_verify_batch(&gkcrypt, verify, 0), ==, CHIAKI_ERR_SUCCESS);
+
+#undef BATCH_COUNT
+	chiaki_gkcrypt_fini(&gkcrypt);
+
+	return MUNIT_OK;
+}
+
+/**
+ * Request key stream at key_pos, which must be beyond what gkcrypt_buf has buffered,
+ * and wait for its generator to skip ahead to it.
+ */
+static void key_buf_overrun(ChiakiGKCrypt *gkcrypt_buf, ChiakiGKCrypt *gkcrypt, ChiakiBoolPredCond *sleep_cond, size_t key_pos)
+{
+	uint8_t a[0x400], b[0x400];
+	munit_assert_int(chiaki_gkcrypt_get_key_stream(gkcrypt_buf, key_pos, a, sizeof(a)), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_int(chiaki_gkcrypt_gen_key_stream(gkcrypt, key_pos, b, sizeof(b)), ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_memory_equal(sizeof(a), a, b);
+
+	while(true)
+	{
+		chiaki_mutex_lock(&gkcrypt_buf->key_buf_mutex);
+		bool skipped = gkcrypt_buf->key_buf_key_pos_min >= key_pos;
+		chiaki_mutex_unlock(&gkcrypt_buf->key_buf_mutex);
+		if(skipped)
+			break;
+		chiaki_bool_pred_cond_timedwait(sleep_cond, 1);
+	}
+}
+
+static size_t key_buf_size(ChiakiGKCrypt *gkcrypt)
+{
+	chiaki_mutex_lock(&gkcrypt->key_buf_mutex);
+	size_t size = gkcrypt->key_buf_size;
+	chiaki_mutex_unlock(&gkcrypt->key_buf_mutex);
+	return size;
+}
+
+static MunitResult test_key_buf_grow(const MunitParameter params[], void *user)
+{
+	static const uint8_t handshake_key[] = { 0x70, 0x58, 0x37, 0x50, 0x91, 0xea, 0xd1, 0x37, 0x71, 0x58, 0xec, 0xb3, 0xb, 0xea, 0x23, 0x87 };
+	static const uint8_t ecdh_secret[] = { 0x3c, 0x3a, 0xf0, 0xec, 0xd6, 0x33, 0x1b, 0xb1, 0x6d, 0x24, 0x4f, 0x48, 0x19, 0xde, 0x6, 0x3d,
+										0xc7, 0xe, 0xac, 0x95, 0x70, 0xac, 0x24, 0x92, 0x86, 0xa7, 0x24, 0xd0, 0x7a, 0x37, 0x55, 0x52 };
+
+	munit_assert_size(chiaki_gkcrypt_key_buf_chunks_for_bitrate(0), ==, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_DEFAULT);
+	munit_assert_size(chiaki_gkcrypt_key_buf_chunks_for_bitrate(1), ==, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_MIN);
+	munit_assert_size(chiaki_gkcrypt_key_buf_chunks_for_bitrate(15000), ==, 46);
+	munit_assert_size(chiaki_gkcrypt_key_buf_chunks_for_bitrate(1000000), ==, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_MAX);
+
+	ChiakiLog *log = get_test_log();
+	ChiakiGKCrypt gkcrypt_buf;
+	if(chiaki_gkcrypt_init(&gkcrypt_buf, log, NULL, CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_MIN, 3, handshake_key, ecdh_secret) != CHIAKI_ERR_SUCCESS)
+		return MUNIT_ERROR;
+	ChiakiGKCrypt gkcrypt;
+	if(chiaki_gkcrypt_init(&gkcrypt, log, NULL, 0, 3, handshake_key, ecdh_secret) != CHIAKI_ERR_SUCCESS)
+	{
+		chiaki_gkcrypt_fini(&gkcrypt_buf);
+		return MUNIT_ERROR;
+	}
+	munit_assert_null(gkcrypt.key_buf);
+
+	ChiakiBoolPredCond sleep_cond;
+	chiaki_bool_pred_cond_init(&sleep_cond);
+	chiaki_bool_pred_cond_lock(&sleep_cond);
+
+	const size_t size_initial = CHIAKI_GKCRYPT_KEY_BUF_BLOCKS_MIN * CHIAKI_GKCRYPT_KEY_BUF_CHUNK_SIZE;
+	munit_assert_size(key_buf_size(&gkcrypt_buf), ==, size_initial);
+
+	// occasional jumps far ahead, e.g. after losing packets, are no reason to grow
+	size_t key_pos = 0;
+	for(size_t i=0; i<0x10; i++)
+	{
+		key_pos += size_initial * 0x40;
+		key_buf_overrun(&gkcrypt_buf, &gkcrypt, &sleep_cond, key_pos);
+		munit_assert_size(key_buf_size(&gkcrypt_buf), ==, size_initial);
+	}
+
+	// requests overtaking the generator again and again are
+	size_t overruns = 0;
+	while(key_buf_size(&gkcrypt_buf) == size_initial)
+	{
+		munit_assert_size(overruns, <, 0x10);
+		key_pos += size_initial * 2;
+		key_buf_overrun(&gkcrypt_buf, &gkcrypt, &sleep_cond, key_pos);
+		overruns++;
+	}
+	munit_assert_size(overruns, >, 1);
+	munit_assert_size(key_buf_size(&gkcrypt_buf), ==, size_initial * 2);
+
+	// the grown buffer must still produce the right key stream, whether it comes from the buffer or not
+	for(size_t i=0; i<0x100; i++)
+	{
+		uint8_t a[0x200], b[0x200];
+		munit_assert_int(chiaki_gkcrypt_get_key_stream(&gkcrypt_buf, key_pos, a, sizeof(a)), ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_int(chiaki_gkcrypt_gen_key_stream(&gkcrypt, key_pos, b, sizeof(b)), ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_memory_equal(sizeof(a), a, b);
+		key_pos += sizeof(a);
+		if(i % 0x10 == 0)
+			chiaki_bool_pred_cond_timedwait(&sleep_cond, 1);
+	}
+
+	chiaki_bool_pred_cond_unlock(&sleep_cond);
+	chiaki_bool_pred_cond_fini(&sleep_cond);
+	chiaki_gkcrypt_fini(&gkcrypt);
+	chiaki_gkcrypt_fini(&gkcrypt_buf);
+
+	return MUNIT_OK;
+}
+
 
 MunitTest tests_gkcrypt[] = {
 	{
@@ -382,5 +662,37 @@ MunitTest tests_gkcrypt[] = {
 		MUNIT_TEST_OPTION_NONE,
 		NULL
 	},
+	{
+		"/gmac_head_tail",
+		test_gmac_head_tail,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/gmac_concurrent",
+		test_gmac_concurrent,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/gmac_verify_batch",
+		test_gmac_verify_batch,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/key_buf_grow",
+		test_key_buf_grow,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
 	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
 };
\ No newline at end of file
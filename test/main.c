@@ -26,6 +26,20 @@ extern MunitTest tests_gkcrypt[];
 extern MunitTest tests_takion[];
 extern MunitTest tests_fec[];
 extern MunitTest tests_regist[];
+extern MunitTest tests_audio_resampler[];
+extern MunitTest tests_feedback[];
+extern MunitTest tests_reactor[];
+extern MunitTest tests_timer_service[];
+extern MunitTest tests_stop_pipe[];
+extern MunitTest tests_discovery_service[];
+extern MunitTest tests_video_frame[];
+extern MunitTest tests_net_impair[];
+extern MunitTest tests_sim_net[];
+extern MunitTest tests_spsc_ring[];
+extern MunitTest tests_mem_account[];
+extern MunitTest tests_ffmpeg_decoder[];
+extern MunitTest tests_net_backend[];
+extern MunitTest tests_video_receiver[];
 
 static MunitSuite suites[] = {
 	{
@@ -91,6 +105,104 @@ static MunitSuite suites[] = {
 		1,
 		MUNIT_SUITE_OPTION_NONE
 	},
+	{
+		"/audio_resampler",
+		tests_audio_resampler,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/feedback",
+		tests_feedback,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/reactor",
+		tests_reactor,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/timer_service",
+		tests_timer_service,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/stop_pipe",
+		tests_stop_pipe,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/discovery_service",
+		tests_discovery_service,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/video_frame",
+		tests_video_frame,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/net_impair",
+		tests_net_impair,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/sim_net",
+		tests_sim_net,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/spsc_ring",
+		tests_spsc_ring,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/mem_account",
+		tests_mem_account,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/ffmpeg_decoder",
+		tests_ffmpeg_decoder,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/net_backend",
+		tests_net_backend,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
+	{
+		"/video_receiver",
+		tests_video_receiver,
+		NULL,
+		1,
+		MUNIT_SUITE_OPTION_NONE
+	},
 	{ NULL, NULL, NULL, 0, MUNIT_SUITE_OPTION_NONE }
 };
 
@@ -0,0 +1,178 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/memaccount.h>
+#include <chiaki/videoframe.h>
+
+#include <string.h>
+
+typedef struct test_allocator_t
+{
+	size_t allocs;
+	size_t frees;
+	size_t bytes;
+} TestAllocator;
+
+static void *test_alloc(size_t size, size_t alignment, ChiakiMemTag tag, void *user)
+{
+	TestAllocator *allocator = user;
+	allocator->allocs++;
+	allocator->bytes += size;
+	return alignment ? chiaki_aligned_alloc(alignment, size) : malloc(size);
+}
+
+static void test_free(void *ptr, size_t size, size_t alignment, ChiakiMemTag tag, void *user)
+{
+	TestAllocator *allocator = user;
+	allocator->frees++;
+	allocator->bytes -= size;
+	if(alignment)
+		chiaki_aligned_free(ptr);
+	else
+		free(ptr);
+}
+
+static MunitResult test_counters(const MunitParameter params[], void *user)
+{
+	ChiakiMemAccount *account = chiaki_mem_account_new(NULL);
+	munit_assert_not_null(account);
+
+	uint8_t *a = chiaki_mem_alloc(account, CHIAKI_MEM_TAG_FRAME, 100);
+	uint8_t *b = chiaki_mem_calloc(account, CHIAKI_MEM_TAG_REORDER, 4, 50);
+	munit_assert_not_null(a);
+	munit_assert_not_null(b);
+	for(size_t i=0; i<200; i++)
+		munit_assert_uint8(b[i], ==, 0);
+	memset(a, 0x42, 100);
+
+	a = chiaki_mem_realloc(account, CHIAKI_MEM_TAG_FRAME, a, 100, 300);
+	munit_assert_not_null(a);
+	munit_assert_uint8(a[99], ==, 0x42);
+
+	ChiakiMemStats stats;
+	chiaki_mem_account_get_stats(account, &stats);
+	munit_assert_uint64(stats.current[CHIAKI_MEM_TAG_FRAME], ==, 300);
+	munit_assert_uint64(stats.current[CHIAKI_MEM_TAG_REORDER], ==, 200);
+	munit_assert_uint64(stats.total_current, ==, 500);
+
+	chiaki_mem_free(account, CHIAKI_MEM_TAG_FRAME, a, 300);
+	void *c = chiaki_mem_aligned_alloc(account, CHIAKI_MEM_TAG_GKCRYPT, 0x1000, 0x2000);
+	munit_assert_not_null(c);
+	munit_assert_uint64((uintptr_t)c & 0xfff, ==, 0);
+	chiaki_mem_aligned_free(account, CHIAKI_MEM_TAG_GKCRYPT, c, 0x1000, 0x2000);
+	chiaki_mem_free(account, CHIAKI_MEM_TAG_REORDER, b, 200);
+
+	chiaki_mem_charge(account, CHIAKI_MEM_TAG_POSTPONED, 1500);
+	chiaki_mem_uncharge(account, CHIAKI_MEM_TAG_POSTPONED, 1500);
+
+	chiaki_mem_account_get_stats(account, &stats);
+	for(size_t i=0; i<CHIAKI_MEM_TAG_COUNT; i++)
+		munit_assert_uint64(stats.current[i], ==, 0);
+	munit_assert_uint64(stats.total_current, ==, 0);
+	munit_assert_uint64(stats.peak[CHIAKI_MEM_TAG_FRAME], ==, 300);
+	munit_assert_uint64(stats.peak[CHIAKI_MEM_TAG_REORDER], ==, 200);
+	munit_assert_uint64(stats.peak[CHIAKI_MEM_TAG_GKCRYPT], ==, 0x2000);
+	munit_assert_uint64(stats.peak[CHIAKI_MEM_TAG_POSTPONED], ==, 1500);
+	// the key buf and the reorder slots were alive at the same time
+	munit_assert_uint64(stats.total_peak, ==, 0x2000 + 200);
+
+	chiaki_mem_account_unref(account);
+	return MUNIT_OK;
+}
+
+static MunitResult test_allocator(const MunitParameter params[], void *user)
+{
+	TestAllocator counts = { 0 };
+	ChiakiAllocator allocator = { test_alloc, test_free, &counts };
+	ChiakiMemAccount *account = chiaki_mem_account_new(&allocator);
+	munit_assert_not_null(account);
+
+	uint8_t *a = chiaki_mem_alloc(account, CHIAKI_MEM_TAG_PROTO, 16);
+	munit_assert_not_null(a);
+	memset(a, 0x13, 16);
+	a = chiaki_mem_realloc(account, CHIAKI_MEM_TAG_PROTO, a, 16, 64);
+	munit_assert_not_null(a);
+	munit_assert_uint8(a[15], ==, 0x13);
+	munit_assert_size(counts.allocs, ==, 2);
+	munit_assert_size(counts.frees, ==, 1);
+	munit_assert_size(counts.bytes, ==, 64);
+
+	chiaki_mem_free(account, CHIAKI_MEM_TAG_PROTO, a, 64);
+	munit_assert_size(counts.frees, ==, 2);
+	munit_assert_size(counts.bytes, ==, 0);
+
+	chiaki_mem_account_unref(account);
+	return MUNIT_OK;
+}
+
+static MunitResult test_frame_pool(const MunitParameter params[], void *user)
+{
+	TestAllocator counts = { 0 };
+	ChiakiAllocator allocator = { test_alloc, test_free, &counts };
+	ChiakiMemAccount *account = chiaki_mem_account_new(&allocator);
+	munit_assert_not_null(account);
+
+	ChiakiVideoFramePool *pool = chiaki_video_frame_pool_new(account, 1);
+	munit_assert_not_null(pool);
+	ChiakiVideoFrame *frame = chiaki_video_frame_pool_acquire(pool, 1000);
+	munit_assert_not_null(frame);
+
+	ChiakiMemStats stats;
+	chiaki_mem_account_get_stats(account, &stats);
+	munit_assert_uint64(stats.current[CHIAKI_MEM_TAG_FRAME], ==, sizeof(ChiakiVideoFrame) + 1000 + CHIAKI_VIDEO_BUFFER_PADDING_SIZE);
+
+	// the application may hold on to a frame after its session and pool are gone
+	chiaki_mem_account_unref(account);
+	chiaki_video_frame_pool_unref(pool);
+	munit_assert_size(counts.frees, ==, 0);
+	chiaki_video_frame_unref(frame);
+
+	munit_assert_size(counts.allocs, ==, 2);
+	munit_assert_size(counts.frees, ==, 2);
+	munit_assert_size(counts.bytes, ==, 0);
+	return MUNIT_OK;
+}
+
+MunitTest tests_mem_account[] = {
+	{
+		"/counters",
+		test_counters,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/allocator",
+		test_allocator,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/frame_pool",
+		test_frame_pool,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
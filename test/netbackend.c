@@ -0,0 +1,111 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/netbackend.h>
+#include <chiaki/time.h>
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+
+static chiaki_socket_t loopback_socket(ChiakiNetBackend *net, struct sockaddr_in *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(0);
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	chiaki_socket_t sock = net->socket(net, AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	munit_assert_false(CHIAKI_SOCKET_IS_INVALID(sock));
+	munit_assert_int(net->bind(net, sock, (struct sockaddr *)addr, sizeof(*addr)), ==, 0);
+	socklen_t addr_len = sizeof(*addr);
+	munit_assert_int(getsockname(sock, (struct sockaddr *)addr, &addr_len), ==, 0);
+	return sock;
+}
+
+static MunitResult test_system_recv_timestamp(const MunitParameter params[], void *user)
+{
+	ChiakiNetBackend *net = chiaki_net_backend_system();
+
+	struct sockaddr_in server_addr;
+	chiaki_socket_t server = loopback_socket(net, &server_addr);
+	munit_assert_int(net->enable_rx_timestamps(net, server), ==, 0);
+	struct sockaddr_in plain_addr;
+	chiaki_socket_t plain = loopback_socket(net, &plain_addr);
+
+	chiaki_socket_t client = net->socket(net, AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	munit_assert_false(CHIAKI_SOCKET_IS_INVALID(client));
+
+	static const uint8_t ping[] = { 'p', 'i', 'n', 'g' };
+	uint64_t sent_us = chiaki_time_now_monotonic_us();
+	munit_assert_int(net->sendto(net, client, ping, sizeof(ping), (struct sockaddr *)&server_addr, sizeof(server_addr)), ==, sizeof(ping));
+	munit_assert_int(net->sendto(net, client, ping, sizeof(ping), (struct sockaddr *)&plain_addr, sizeof(plain_addr)), ==, sizeof(ping));
+
+	// pick it up well after it arrived
+	usleep(50 * 1000);
+
+	uint8_t buf[16];
+	uint64_t timestamp_us = 1;
+	munit_assert_int(chiaki_net_system_recv_timestamp(server, buf, sizeof(buf), 0, &timestamp_us), ==, sizeof(ping));
+	uint64_t picked_up_us = chiaki_time_now_monotonic_us();
+	munit_assert_memory_equal(sizeof(ping), buf, ping);
+	// translated from the wall clock, allow a little for the two clocks being read at slightly different times
+	munit_assert_uint64(timestamp_us + 1000, >=, sent_us);
+	munit_assert_uint64(timestamp_us + 40 * 1000, <=, picked_up_us);
+
+	// no timestamps requested for this one
+	timestamp_us = 1;
+	munit_assert_int(chiaki_net_system_recv_timestamp(plain, buf, sizeof(buf), 0, &timestamp_us), ==, sizeof(ping));
+	munit_assert_uint64(timestamp_us, ==, 0);
+
+	timestamp_us = 1;
+	munit_assert_int(chiaki_net_system_recv_timestamp(server, buf, sizeof(buf), MSG_DONTWAIT, &timestamp_us), <, 0);
+	munit_assert_uint64(timestamp_us, ==, 0);
+
+	net->close(net, client);
+	net->close(net, plain);
+	net->close(net, server);
+	return MUNIT_OK;
+}
+
+#else
+
+static MunitResult test_system_recv_timestamp(const MunitParameter params[], void *user)
+{
+	return MUNIT_SKIP;
+}
+
+#endif
+
+MunitTest tests_net_backend[] = {
+	{
+		"/system_recv_timestamp",
+		test_system_recv_timestamp,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
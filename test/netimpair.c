@@ -0,0 +1,380 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/netimpair.h>
+#include <chiaki/time.h>
+
+#include "test_log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#define PACKETS_COUNT 100000
+
+static void push_index(ChiakiNetImpair *impair, uint32_t index, size_t size, uint64_t now_us)
+{
+	uint8_t buf[1500];
+	munit_assert_size(size, <=, sizeof(buf));
+	memset(buf, 0, size);
+	memcpy(buf, &index, sizeof(index));
+	ChiakiErrorCode err = chiaki_net_impair_push(impair, buf, size, now_us);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+}
+
+static bool pop_index(ChiakiNetImpair *impair, uint64_t now_us, uint32_t *index)
+{
+	uint8_t *buf;
+	size_t size;
+	if(!chiaki_net_impair_pop(impair, now_us, &buf, &size))
+		return false;
+	munit_assert_size(size, >=, sizeof(*index));
+	memcpy(index, buf, sizeof(*index));
+	free(buf);
+	return true;
+}
+
+static MunitResult test_deterministic(const MunitParameter params[], void *user)
+{
+	ChiakiNetImpairParams impair_params;
+	chiaki_net_impair_params_default(&impair_params);
+	impair_params.loss = 0.05;
+	impair_params.burst_enter = 0.01;
+	impair_params.burst_leave = 0.3;
+	impair_params.burst_loss = 0.8;
+	impair_params.jitter_ms = 3;
+	impair_params.reorder = 0.02;
+	impair_params.reorder_ms = 5;
+	impair_params.duplicate = 0.01;
+
+	ChiakiNetImpair a, b, c;
+	chiaki_net_impair_init(&a, &impair_params, 1337);
+	chiaki_net_impair_init(&b, &impair_params, 1337);
+	chiaki_net_impair_init(&c, &impair_params, 1338);
+
+	bool differs = false;
+	for(uint32_t i=0; i<10000; i++)
+	{
+		uint64_t now_us = (uint64_t)i * 1000;
+		push_index(&a, i, 100, now_us);
+		push_index(&b, i, 100, now_us);
+		push_index(&c, i, 100, now_us);
+		uint32_t index_a, index_b, index_c;
+		while(pop_index(&a, now_us, &index_a))
+		{
+			munit_assert_true(pop_index(&b, now_us, &index_b));
+			munit_assert_uint32(index_a, ==, index_b);
+			if(!pop_index(&c, now_us, &index_c) || index_c != index_a)
+				differs = true;
+		}
+		munit_assert_false(pop_index(&b, now_us, &index_b));
+	}
+	munit_assert_true(differs);
+	munit_assert_memory_equal(sizeof(a.stats), &a.stats, &b.stats);
+
+	chiaki_net_impair_fini(&a);
+	chiaki_net_impair_fini(&b);
+	chiaki_net_impair_fini(&c);
+	return MUNIT_OK;
+}
+
+static MunitResult test_loss(const MunitParameter params[], void *user)
+{
+	ChiakiNetImpairParams impair_params;
+	chiaki_net_impair_params_default(&impair_params);
+	impair_params.loss = 0.1;
+
+	ChiakiNetImpair impair;
+	chiaki_net_impair_init(&impair, &impair_params, 42);
+	for(uint32_t i=0; i<PACKETS_COUNT; i++)
+	{
+		push_index(&impair, i, 4, 0);
+		uint32_t index;
+		if(pop_index(&impair, 0, &index))
+			munit_assert_uint32(index, ==, i);
+	}
+	munit_assert_uint64(impair.stats.packets_in, ==, PACKETS_COUNT);
+	munit_assert_uint64(impair.stats.packets_lost, >, PACKETS_COUNT * 9 / 100);
+	munit_assert_uint64(impair.stats.packets_lost, <, PACKETS_COUNT * 11 / 100);
+	munit_assert_uint64(impair.stats.packets_lost + impair.stats.packets_out, ==, PACKETS_COUNT);
+	munit_assert_uint64(impair.stats.packets_lost_burst, ==, 0);
+	chiaki_net_impair_fini(&impair);
+	return MUNIT_OK;
+}
+
+static MunitResult test_burst(const MunitParameter params[], void *user)
+{
+	ChiakiNetImpairParams impair_params;
+	chiaki_net_impair_params_default(&impair_params);
+	impair_params.burst_enter = 0.01;
+	impair_params.burst_leave = 0.25;
+	impair_params.burst_loss = 1.0;
+
+	ChiakiNetImpair impair;
+	chiaki_net_impair_init(&impair, &impair_params, 42);
+	uint64_t bursts = 0;
+	bool lost_prev = false;
+	for(uint32_t i=0; i<PACKETS_COUNT; i++)
+	{
+		push_index(&impair, i, 4, 0);
+		uint32_t index;
+		bool lost = !pop_index(&impair, 0, &index);
+		if(lost && !lost_prev)
+			bursts++;
+		lost_prev = lost;
+	}
+
+	// stationary loss is enter / (enter + leave) ~ 3.8%, mean burst length is 1 / leave = 4
+	munit_assert_uint64(impair.stats.packets_lost, ==, impair.stats.packets_lost_burst);
+	munit_assert_uint64(impair.stats.packets_lost, >, PACKETS_COUNT * 3 / 100);
+	munit_assert_uint64(impair.stats.packets_lost, <, PACKETS_COUNT * 5 / 100);
+	munit_assert_uint64(bursts, >, 0);
+	double burst_len = (double)impair.stats.packets_lost / bursts;
+	munit_assert_double(burst_len, >, 3.0);
+	munit_assert_double(burst_len, <, 5.0);
+	chiaki_net_impair_fini(&impair);
+	return MUNIT_OK;
+}
+
+static MunitResult test_delay_jitter(const MunitParameter params[], void *user)
+{
+	ChiakiNetImpairParams impair_params;
+	chiaki_net_impair_params_default(&impair_params);
+	impair_params.delay_ms = 10;
+	impair_params.jitter_ms = 5;
+
+	ChiakiNetImpair impair;
+	chiaki_net_impair_init(&impair, &impair_params, 42);
+	for(uint32_t i=0; i<1000; i++)
+		push_index(&impair, i, 4, (uint64_t)i * 1000);
+
+	uint32_t expect = 0;
+	uint64_t now_us = 0;
+	while(expect < 1000)
+	{
+		uint64_t next_us = chiaki_net_impair_next_us(&impair);
+		munit_assert_uint64(next_us, !=, UINT64_MAX);
+		munit_assert_false(pop_index(&impair, next_us - 1, &(uint32_t){ 0 }));
+		now_us = next_us;
+		uint32_t index;
+		munit_assert_true(pop_index(&impair, now_us, &index));
+		// jitter never reorders
+		munit_assert_uint32(index, ==, expect);
+		munit_assert_uint64(now_us, >=, (uint64_t)index * 1000 + 10000);
+		expect++;
+	}
+	munit_assert_uint64(chiaki_net_impair_next_us(&impair), ==, UINT64_MAX);
+	chiaki_net_impair_fini(&impair);
+	return MUNIT_OK;
+}
+
+static MunitResult test_reorder_duplicate(const MunitParameter params[], void *user)
+{
+	ChiakiNetImpairParams impair_params;
+	chiaki_net_impair_params_default(&impair_params);
+	impair_params.reorder = 0.1;
+	impair_params.reorder_ms = 5;
+	impair_params.duplicate = 0.1;
+
+	ChiakiNetImpair impair;
+	chiaki_net_impair_init(&impair, &impair_params, 42);
+	for(uint32_t i=0; i<10000; i++)
+		push_index(&impair, i, 4, (uint64_t)i * 1000);
+
+	uint64_t out_of_order = 0;
+	uint32_t index_max = 0;
+	uint32_t index;
+	while(pop_index(&impair, UINT64_MAX - 1, &index))
+	{
+		if(index < index_max)
+			out_of_order++;
+		else
+			index_max = index;
+	}
+	munit_assert_uint64(impair.stats.packets_reordered, >, 0);
+	munit_assert_uint64(out_of_order, >, 0);
+	munit_assert_uint64(impair.stats.packets_duplicated, >, 500);
+	munit_assert_uint64(impair.stats.packets_out, ==, 10000 + impair.stats.packets_duplicated);
+	chiaki_net_impair_fini(&impair);
+	return MUNIT_OK;
+}
+
+static MunitResult test_rate(const MunitParameter params[], void *user)
+{
+	ChiakiNetImpairParams impair_params;
+	chiaki_net_impair_params_default(&impair_params);
+	impair_params.rate_kbps = 8000; // 1 byte per us
+	impair_params.queue_bytes_max = 5000;
+
+	ChiakiNetImpair impair;
+	chiaki_net_impair_init(&impair, &impair_params, 42);
+	for(uint32_t i=0; i<10; i++)
+		push_index(&impair, i, 1000, 0);
+	munit_assert_uint64(impair.stats.packets_dropped_queue, ==, 5);
+
+	for(uint32_t i=0; i<5; i++)
+	{
+		munit_assert_uint64(chiaki_net_impair_next_us(&impair), ==, (uint64_t)(i + 1) * 1000);
+		uint32_t index;
+		munit_assert_true(pop_index(&impair, (uint64_t)(i + 1) * 1000, &index));
+		munit_assert_uint32(index, ==, i);
+	}
+
+	// the link is idle again
+	push_index(&impair, 10, 1000, 100000);
+	munit_assert_uint64(chiaki_net_impair_next_us(&impair), ==, 101000);
+	chiaki_net_impair_fini(&impair);
+	return MUNIT_OK;
+}
+
+#ifdef __linux__
+
+static MunitResult test_proxy(const MunitParameter params[], void *user)
+{
+	ChiakiLog *log = get_test_log();
+
+	// upstream that echoes everything back
+	int echo_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	munit_assert_int(echo_sock, >=, 0);
+	struct sockaddr_in echo_addr = { 0 };
+	echo_addr.sin_family = AF_INET;
+	echo_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(echo_addr);
+	munit_assert_int(bind(echo_sock, (struct sockaddr *)&echo_addr, sizeof(echo_addr)), ==, 0);
+	munit_assert_int(getsockname(echo_sock, (struct sockaddr *)&echo_addr, &addr_len), ==, 0);
+
+	ChiakiNetImpairParams params_up, params_down;
+	chiaki_net_impair_params_default(&params_up);
+	chiaki_net_impair_params_default(&params_down);
+	params_up.delay_ms = 20;
+	params_down.duplicate = 1.0;
+
+	struct sockaddr_in listen_addr = { 0 };
+	listen_addr.sin_family = AF_INET;
+	listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	ChiakiNetImpairProxy proxy;
+	ChiakiErrorCode err = chiaki_net_impair_proxy_init(&proxy,
+			(struct sockaddr *)&listen_addr, sizeof(listen_addr),
+			(struct sockaddr *)&echo_addr, sizeof(echo_addr),
+			&params_up, &params_down, 42, log);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	addr_len = sizeof(listen_addr);
+	err = chiaki_net_impair_proxy_get_listen_addr(&proxy, (struct sockaddr *)&listen_addr, &addr_len);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	int client_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	munit_assert_int(client_sock, >=, 0);
+	munit_assert_int(connect(client_sock, (struct sockaddr *)&listen_addr, sizeof(listen_addr)), ==, 0);
+
+	uint64_t sent_us = chiaki_time_now_monotonic_us();
+	munit_assert_int(send(client_sock, "ping", 4, 0), ==, 4);
+
+	char buf[16];
+	struct sockaddr_in from;
+	socklen_t from_len = sizeof(from);
+	munit_assert_int(recvfrom(echo_sock, buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len), ==, 4);
+	munit_assert_uint64(chiaki_time_now_monotonic_us() - sent_us, >=, 20000);
+	munit_assert_int(sendto(echo_sock, buf, 4, 0, (struct sockaddr *)&from, from_len), ==, 4);
+
+	for(int i=0; i<2; i++)
+	{
+		munit_assert_int(recv(client_sock, buf, sizeof(buf), 0), ==, 4);
+		munit_assert_memory_equal(4, buf, "ping");
+	}
+
+	ChiakiNetImpairStats stats;
+	chiaki_net_impair_proxy_get_stats(&proxy, CHIAKI_NET_IMPAIR_DIR_DOWN, &stats);
+	munit_assert_uint64(stats.packets_in, ==, 1);
+	munit_assert_uint64(stats.packets_duplicated, ==, 1);
+
+	chiaki_net_impair_proxy_fini(&proxy);
+	close(client_sock);
+	close(echo_sock);
+	return MUNIT_OK;
+}
+
+#endif
+
+MunitTest tests_net_impair[] = {
+	{
+		"/deterministic",
+		test_deterministic,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/loss",
+		test_loss,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/burst",
+		test_burst,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/delay_jitter",
+		test_delay_jitter,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/reorder_duplicate",
+		test_reorder_duplicate,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/rate",
+		test_rate,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+#ifdef __linux__
+	{
+		"/proxy",
+		test_proxy,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+#endif
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
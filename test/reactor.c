@@ -0,0 +1,261 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/reactor.h>
+
+#include "test_log.h"
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#define DATAGRAMS_COUNT 64
+
+typedef struct reactor_test_source_t
+{
+	int fd;
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	unsigned int received;
+	bool inside;
+	bool overlapped;
+} ReactorTestSource;
+
+#ifdef __linux__
+
+static void reactor_test_cb(void *user)
+{
+	ReactorTestSource *source = user;
+	chiaki_mutex_lock(&source->mutex);
+	if(source->inside)
+		source->overlapped = true;
+	source->inside = true;
+	chiaki_mutex_unlock(&source->mutex);
+
+	uint8_t buf[16];
+	unsigned int received = 0;
+	while(recv(source->fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		received++;
+
+	chiaki_mutex_lock(&source->mutex);
+	source->inside = false;
+	source->received += received;
+	chiaki_mutex_unlock(&source->mutex);
+	chiaki_cond_signal(&source->cond);
+}
+
+static bool reactor_test_received_all(void *user)
+{
+	ReactorTestSource *source = user;
+	return source->received >= DATAGRAMS_COUNT;
+}
+
+static void reactor_test_source_init(ReactorTestSource *source, int fd)
+{
+	source->fd = fd;
+	source->received = 0;
+	source->inside = false;
+	source->overlapped = false;
+	chiaki_mutex_init(&source->mutex, false);
+	chiaki_cond_init(&source->cond);
+}
+
+static void reactor_test_source_fini(ReactorTestSource *source)
+{
+	chiaki_cond_fini(&source->cond);
+	chiaki_mutex_fini(&source->mutex);
+}
+
+static MunitResult test_datagrams(const MunitParameter params[], void *test_user)
+{
+	ChiakiReactor reactor;
+	ChiakiErrorCode err = chiaki_reactor_init(&reactor, get_test_log(), 3);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	int fds[2][2];
+	ReactorTestSource sources[2];
+	ChiakiReactorSource reactor_sources[2];
+	for(size_t i=0; i<2; i++)
+	{
+		munit_assert_int(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds[i]), ==, 0);
+		reactor_test_source_init(&sources[i], fds[i][0]);
+		err = chiaki_reactor_add(&reactor, &reactor_sources[i], fds[i][0], reactor_test_cb, &sources[i]);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	}
+
+	uint8_t datagram[8] = { 0 };
+	for(size_t j=0; j<DATAGRAMS_COUNT; j++)
+	{
+		for(size_t i=0; i<2; i++)
+			munit_assert_int(send(fds[i][1], datagram, sizeof(datagram), 0), ==, sizeof(datagram));
+	}
+
+	for(size_t i=0; i<2; i++)
+	{
+		chiaki_mutex_lock(&sources[i].mutex);
+		err = chiaki_cond_timedwait_pred(&sources[i].cond, &sources[i].mutex, 5000, reactor_test_received_all, &sources[i]);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_uint(sources[i].received, ==, DATAGRAMS_COUNT);
+		munit_assert(!sources[i].overlapped);
+		chiaki_mutex_unlock(&sources[i].mutex);
+	}
+
+	for(size_t i=0; i<2; i++)
+	{
+		chiaki_reactor_remove(&reactor_sources[i]);
+
+		// nothing may be delivered after removal
+		munit_assert_int(send(fds[i][1], datagram, sizeof(datagram), 0), ==, sizeof(datagram));
+	}
+
+	// re-adding reuses the slot, the stale datagrams are only picked up by the new registration
+	ReactorTestSource readded;
+	reactor_test_source_init(&readded, fds[0][0]);
+	readded.received = DATAGRAMS_COUNT - 1;
+	err = chiaki_reactor_add(&reactor, &reactor_sources[0], fds[0][0], reactor_test_cb, &readded);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_mutex_lock(&readded.mutex);
+	err = chiaki_cond_timedwait_pred(&readded.cond, &readded.mutex, 5000, reactor_test_received_all, &readded);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_mutex_unlock(&readded.mutex);
+	chiaki_reactor_remove(&reactor_sources[0]);
+
+	chiaki_reactor_fini(&reactor);
+
+	for(size_t i=0; i<2; i++)
+	{
+		munit_assert_uint(sources[i].received, ==, DATAGRAMS_COUNT);
+		reactor_test_source_fini(&sources[i]);
+		close(fds[i][0]);
+		close(fds[i][1]);
+	}
+	reactor_test_source_fini(&readded);
+
+	return MUNIT_OK;
+}
+
+typedef struct reactor_test_detach_t
+{
+	ReactorTestSource source;
+	ChiakiReactorSource *reactor_source;
+	unsigned int calls;
+} ReactorTestDetach;
+
+static void reactor_test_detach_cb(void *user)
+{
+	ReactorTestDetach *detach = user;
+	// leave the datagram unread, as a persistent error would
+	chiaki_reactor_detach(detach->reactor_source);
+	chiaki_mutex_lock(&detach->source.mutex);
+	detach->calls++;
+	chiaki_mutex_unlock(&detach->source.mutex);
+	chiaki_cond_signal(&detach->source.cond);
+}
+
+static bool reactor_test_detach_called(void *user)
+{
+	ReactorTestDetach *detach = user;
+	return detach->calls > 0;
+}
+
+static bool reactor_test_detach_called_again(void *user)
+{
+	ReactorTestDetach *detach = user;
+	return detach->calls > 1;
+}
+
+static MunitResult test_detach(const MunitParameter params[], void *test_user)
+{
+	ChiakiReactor reactor;
+	ChiakiErrorCode err = chiaki_reactor_init(&reactor, get_test_log(), 2);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	int fds[2];
+	munit_assert_int(socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), ==, 0);
+
+	ChiakiReactorSource reactor_source;
+	ReactorTestDetach detach;
+	reactor_test_source_init(&detach.source, fds[0]);
+	detach.reactor_source = &reactor_source;
+	detach.calls = 0;
+	err = chiaki_reactor_add(&reactor, &reactor_source, fds[0], reactor_test_detach_cb, &detach);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint8_t datagram[8] = { 0 };
+	munit_assert_int(send(fds[1], datagram, sizeof(datagram), 0), ==, sizeof(datagram));
+
+	chiaki_mutex_lock(&detach.source.mutex);
+	err = chiaki_cond_timedwait_pred(&detach.source.cond, &detach.source.mutex, 5000, reactor_test_detach_called, &detach);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_mutex_unlock(&detach.source.mutex);
+
+	// the socket is still readable, but a detached source must not be called again
+	munit_assert_int(send(fds[1], datagram, sizeof(datagram), 0), ==, sizeof(datagram));
+	chiaki_mutex_lock(&detach.source.mutex);
+	err = chiaki_cond_timedwait_pred(&detach.source.cond, &detach.source.mutex, 100, reactor_test_detach_called_again, &detach);
+	munit_assert_int(err, ==, CHIAKI_ERR_TIMEOUT);
+	munit_assert_uint(detach.calls, ==, 1);
+	chiaki_mutex_unlock(&detach.source.mutex);
+
+	// detaching allows closing the fd before removing the source
+	close(fds[0]);
+	chiaki_reactor_remove(&reactor_source);
+	chiaki_reactor_fini(&reactor);
+
+	munit_assert_uint(detach.calls, ==, 1);
+	reactor_test_source_fini(&detach.source);
+	close(fds[1]);
+
+	return MUNIT_OK;
+}
+
+#else
+
+static MunitResult test_datagrams(const MunitParameter params[], void *test_user)
+{
+	return MUNIT_SKIP;
+}
+
+static MunitResult test_detach(const MunitParameter params[], void *test_user)
+{
+	return MUNIT_SKIP;
+}
+
+#endif
+
+MunitTest tests_reactor[] = {
+	{
+		"/datagrams",
+		test_datagrams,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/detach",
+		test_detach,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -44,7 +44,7 @@ static void drop(uint64_t seq_num, void *elem_user, void *cb_user)
 static MunitResult test_reorder_queue_16(const MunitParameter params[], void *test_user)
 {
 	ChiakiReorderQueue queue;
-	ChiakiErrorCode err = chiaki_reorder_queue_init_16(&queue, 2, 42);
+	ChiakiErrorCode err = chiaki_reorder_queue_init_16(&queue, NULL, 2, 42);
 	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
 	munit_assert_size(chiaki_reorder_queue_size(&queue), ==, 4);
 	munit_assert_uint64(chiaki_reorder_queue_count(&queue), ==, 0);
@@ -0,0 +1,638 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/memaccount.h>
+#include <chiaki/simnet.h>
+#include <chiaki/timerservice.h>
+#include <chiaki/takion.h>
+#include <chiaki/time.h>
+
+#include "test_log.h"
+
+#include <string.h>
+
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#define VIRTUAL_HOUR_US (3600ull * 1000 * 1000)
+
+typedef struct fire_record_t
+{
+	ChiakiSimNet *sim;
+	uint64_t fired_us;
+	unsigned int count;
+} FireRecord;
+
+static void fire_cb(void *user)
+{
+	FireRecord *record = user;
+	record->fired_us = chiaki_sim_net_now_us(record->sim);
+	record->count++;
+}
+
+static MunitResult test_timer_virtual_time(const MunitParameter params[], void *user)
+{
+	ChiakiSimNet sim;
+	ChiakiErrorCode err = chiaki_sim_net_init(&sim, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiTimerService service;
+	err = chiaki_timer_service_init_clock(&service, chiaki_sim_net_clock(&sim), get_test_log());
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uint64_t start_us = chiaki_sim_net_now_us(&sim);
+	munit_assert_uint64(start_us, ==, CHIAKI_SIM_NET_TIME_START_US);
+
+	FireRecord soon = { &sim, 0, 0 };
+	FireRecord late = { &sim, 0, 0 };
+	ChiakiTimer timer_soon, timer_late;
+	chiaki_timer_init(&timer_soon, fire_cb, &soon);
+	chiaki_timer_init(&timer_late, fire_cb, &late);
+	chiaki_timer_service_schedule(&service, &timer_soon, start_us + 100 * 1000);
+	chiaki_timer_service_schedule(&service, &timer_late, start_us + VIRTUAL_HOUR_US);
+
+	uint64_t real_start_ms = chiaki_time_now_monotonic_ms();
+
+	chiaki_sim_net_run(&sim, start_us + 99 * 1000);
+	munit_assert_uint(soon.count, ==, 0);
+
+	chiaki_sim_net_run(&sim, start_us + 2 * VIRTUAL_HOUR_US);
+	munit_assert_uint(soon.count, ==, 1);
+	munit_assert_uint(late.count, ==, 1);
+	// never early, and late by at most a tick of the timer wheel
+	munit_assert_uint64(soon.fired_us, >=, start_us + 100 * 1000);
+	munit_assert_uint64(soon.fired_us, <, start_us + 100 * 1000 + (2 << CHIAKI_TIMER_SERVICE_TICK_SHIFT));
+	munit_assert_uint64(late.fired_us, >=, start_us + VIRTUAL_HOUR_US);
+	munit_assert_uint64(late.fired_us, <, start_us + VIRTUAL_HOUR_US + (2 << CHIAKI_TIMER_SERVICE_TICK_SHIFT));
+	munit_assert_uint64(chiaki_sim_net_now_us(&sim), ==, start_us + 2 * VIRTUAL_HOUR_US);
+
+	// two virtual hours must not take anywhere near that long
+	munit_assert_uint64(chiaki_time_now_monotonic_ms() - real_start_ms, <, 10000);
+
+	chiaki_timer_service_fini(&service);
+	chiaki_sim_net_fini(&sim);
+	return MUNIT_OK;
+}
+
+static void sockaddr_local(struct sockaddr_in *addr, uint16_t port)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(port);
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+static MunitResult test_udp_delay(const MunitParameter params[], void *user)
+{
+	ChiakiSimNet sim;
+	ChiakiErrorCode err = chiaki_sim_net_init(&sim, 1234);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	ChiakiNetBackend *net = chiaki_sim_net_backend(&sim);
+
+	ChiakiNetImpairParams impair;
+	chiaki_net_impair_params_default(&impair);
+	impair.delay_ms = 50;
+	chiaki_sim_net_set_impair_default(&sim, &impair);
+
+	struct sockaddr_in server_addr;
+	sockaddr_local(&server_addr, 9296);
+	chiaki_socket_t server = net->socket(net, AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	munit_assert_false(CHIAKI_SOCKET_IS_INVALID(server));
+	munit_assert_int(net->bind(net, server, (struct sockaddr *)&server_addr, sizeof(server_addr)), ==, 0);
+	chiaki_socket_t duplicate = net->socket(net, AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	munit_assert_false(CHIAKI_SOCKET_IS_INVALID(duplicate));
+	munit_assert_int(net->bind(net, duplicate, (struct sockaddr *)&server_addr, sizeof(server_addr)), <, 0);
+	munit_assert_int(net->close(net, duplicate), ==, 0);
+
+	chiaki_socket_t client = net->socket(net, AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	munit_assert_false(CHIAKI_SOCKET_IS_INVALID(client));
+	munit_assert_int(net->connect(net, client, (struct sockaddr *)&server_addr, sizeof(server_addr)), ==, 0);
+
+	uint64_t start_us = chiaki_sim_net_now_us(&sim);
+	static const uint8_t ping[] = { 'p', 'i', 'n', 'g' };
+	munit_assert_int(net->send(net, client, ping, sizeof(ping)), ==, sizeof(ping));
+
+	uint8_t buf[16];
+	munit_assert_int(net->recv(net, server, buf, sizeof(buf)), <, 0);
+	err = chiaki_net_backend_select_single(net, NULL, server, false, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_TIMEOUT);
+
+	chiaki_sim_net_run(&sim, start_us + 49 * 1000);
+	munit_assert_int(net->recv(net, server, buf, sizeof(buf)), <, 0);
+
+	chiaki_sim_net_run(&sim, start_us + 50 * 1000);
+	struct sockaddr_in from;
+	socklen_t from_len = sizeof(from);
+	munit_assert_int(net->recvfrom(net, server, buf, sizeof(buf), (struct sockaddr *)&from, &from_len), ==, sizeof(ping));
+	munit_assert_memory_equal(sizeof(ping), buf, ping);
+
+	// answer to the ephemeral port the client was bound to
+	static const uint8_t pong[] = { 'p', 'o', 'n', 'g' };
+	munit_assert_int(net->sendto(net, server, pong, sizeof(pong), (struct sockaddr *)&from, from_len), ==, sizeof(pong));
+	chiaki_sim_net_run(&sim, start_us + 120 * 1000);
+	uint64_t arrived_us;
+	munit_assert_int(net->enable_rx_timestamps(net, client), ==, 0);
+	munit_assert_int(net->recv_timestamp(net, client, buf, sizeof(buf), &arrived_us), ==, sizeof(pong));
+	munit_assert_memory_equal(sizeof(pong), buf, pong);
+	// when it arrived, not when it was picked up
+	munit_assert_uint64(arrived_us, ==, start_us + 100 * 1000);
+
+	ChiakiNetImpairStats stats;
+	err = chiaki_sim_net_get_impair_stats(&sim, (struct sockaddr *)&server_addr, sizeof(server_addr), &stats);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_uint64(stats.packets_in, ==, 1);
+	munit_assert_uint64(stats.packets_out, ==, 1);
+
+	chiaki_sim_net_fini(&sim);
+	return MUNIT_OK;
+}
+
+typedef struct takion_record_t
+{
+	ChiakiSimNet *sim;
+	ChiakiMutex mutex;
+	bool disconnected;
+	uint64_t disconnected_us;
+} TakionRecord;
+
+static void takion_cb(ChiakiTakionEvent *event, void *user)
+{
+	TakionRecord *record = user;
+	if(event->type != CHIAKI_TAKION_EVENT_TYPE_DISCONNECT)
+		return;
+	chiaki_mutex_lock(&record->mutex);
+	record->disconnected = true;
+	record->disconnected_us = chiaki_sim_net_now_us(record->sim);
+	chiaki_mutex_unlock(&record->mutex);
+}
+
+static MunitResult test_takion_handshake_timeout(const MunitParameter params[], void *user)
+{
+	ChiakiSimNet sim;
+	ChiakiErrorCode err = chiaki_sim_net_init(&sim, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiTimerService service;
+	err = chiaki_timer_service_init_clock(&service, chiaki_sim_net_clock(&sim), get_test_log());
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// a console that never answers
+	struct sockaddr_in console_addr;
+	sockaddr_local(&console_addr, 9296);
+	ChiakiNetBackend *net = chiaki_sim_net_backend(&sim);
+	chiaki_socket_t console = net->socket(net, AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	munit_assert_int(net->bind(net, console, (struct sockaddr *)&console_addr, sizeof(console_addr)), ==, 0);
+
+	TakionRecord record = { 0 };
+	record.sim = &sim;
+	chiaki_mutex_init(&record.mutex, false);
+
+	ChiakiTakionConnectInfo info = { 0 };
+	info.log = get_test_log();
+	info.sa = (struct sockaddr *)&console_addr;
+	info.sa_len = sizeof(console_addr);
+	info.cb = takion_cb;
+	info.cb_user = &record;
+	info.protocol_version = 9;
+	info.timer_service = &service;
+	info.net_backend = net;
+	info.clock = chiaki_sim_net_clock(&sim);
+
+	uint64_t start_us = chiaki_sim_net_now_us(&sim);
+	ChiakiTakion takion;
+	err = chiaki_takion_connect(&takion, &info);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	chiaki_sim_net_run(&sim, start_us + 4900 * 1000);
+	chiaki_mutex_lock(&record.mutex);
+	munit_assert_false(record.disconnected);
+	chiaki_mutex_unlock(&record.mutex);
+
+	// the init packet has arrived, but there is no reply within the 5s the handshake waits
+	uint8_t buf[1500];
+	munit_assert_int(net->recv(net, console, buf, sizeof(buf)), >, 0);
+
+	chiaki_sim_net_run(&sim, start_us + 6000 * 1000);
+	chiaki_mutex_lock(&record.mutex);
+	munit_assert_true(record.disconnected);
+	munit_assert_uint64(record.disconnected_us, ==, start_us + 5000 * 1000);
+	chiaki_mutex_unlock(&record.mutex);
+
+	chiaki_takion_close(&takion);
+	net->close(net, console);
+	chiaki_mutex_fini(&record.mutex);
+	chiaki_timer_service_fini(&service);
+	chiaki_sim_net_fini(&sim);
+	return MUNIT_OK;
+}
+
+#define PIPELINE_DATA_COUNT 64
+#define PIPELINE_AV_COUNT 300
+
+typedef struct takion_pipeline_record_t
+{
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	bool connected;
+	uint8_t data[PIPELINE_DATA_COUNT * 2];
+	size_t data_count;
+	uint16_t av[PIPELINE_AV_COUNT * 2];
+	size_t av_count;
+} TakionPipelineRecord;
+
+static void takion_pipeline_cb(ChiakiTakionEvent *event, void *user)
+{
+	TakionPipelineRecord *record = user;
+	chiaki_mutex_lock(&record->mutex);
+	switch(event->type)
+	{
+		case CHIAKI_TAKION_EVENT_TYPE_CONNECTED:
+			record->connected = true;
+			break;
+		case CHIAKI_TAKION_EVENT_TYPE_DATA:
+			if(event->data.buf_size == 1 && record->data_count < sizeof(record->data))
+				record->data[record->data_count++] = event->data.buf[0];
+			break;
+		case CHIAKI_TAKION_EVENT_TYPE_AV:
+			if(record->av_count < sizeof(record->av) / sizeof(record->av[0]))
+				record->av[record->av_count++] = event->av->packet_index;
+			break;
+		default:
+			break;
+	}
+	chiaki_cond_signal(&record->cond);
+	chiaki_mutex_unlock(&record->mutex);
+}
+
+/**
+ * Wait for the callback to have seen count_expected events, which have all arrived already.
+ */
+static void takion_pipeline_wait(TakionPipelineRecord *record, size_t *count, size_t count_expected)
+{
+	uint64_t start_ms = chiaki_time_now_monotonic_ms();
+	chiaki_mutex_lock(&record->mutex);
+	while(*count < count_expected)
+	{
+		munit_assert_uint64(chiaki_time_now_monotonic_ms() - start_ms, <, 10000);
+		chiaki_cond_timedwait(&record->cond, &record->mutex, 100);
+	}
+	chiaki_mutex_unlock(&record->mutex);
+}
+
+/**
+ * Let virtual time pass until the handshake is done.
+ */
+static void takion_pipeline_wait_connected(ChiakiSimNet *sim, TakionPipelineRecord *record)
+{
+	while(true)
+	{
+		chiaki_mutex_lock(&record->mutex);
+		bool connected = record->connected;
+		chiaki_mutex_unlock(&record->mutex);
+		if(connected)
+			break;
+		chiaki_sim_net_run(sim, chiaki_sim_net_now_us(sim) + 1000);
+	}
+}
+
+static size_t console_recv(ChiakiSimNet *sim, chiaki_socket_t console, uint8_t *buf, size_t buf_size, struct sockaddr_in *from)
+{
+	ChiakiNetBackend *net = chiaki_sim_net_backend(sim);
+	for(unsigned int i=0; ; i++)
+	{
+		socklen_t from_len = sizeof(*from);
+		int received = net->recvfrom(net, console, buf, buf_size, (struct sockaddr *)from, &from_len);
+		if(received > 0)
+			return (size_t)received;
+		munit_assert_uint(i, <, 1000);
+		chiaki_sim_net_run(sim, chiaki_sim_net_now_us(sim) + 1000);
+	}
+}
+
+static void console_write_message_header(uint8_t *buf, uint32_t tag, uint8_t chunk_type, uint8_t chunk_flags, size_t payload_data_size)
+{
+	memset(buf, 0, 0x10);
+	*((chiaki_unaligned_uint32_t *)(buf + 0)) = htonl(tag);
+	buf[0xc] = chunk_type;
+	buf[0xd] = chunk_flags;
+	*((chiaki_unaligned_uint16_t *)(buf + 0xe)) = htons((uint16_t)(payload_data_size + 4));
+}
+
+/**
+ * Answer the handshake of a connecting Takion as the console.
+ *
+ * @param takion_addr set to the address of the Takion
+ * @return the tag of the Takion
+ */
+static uint32_t console_handshake(ChiakiSimNet *sim, chiaki_socket_t console, uint32_t console_tag, struct sockaddr_in *takion_addr)
+{
+	ChiakiNetBackend *net = chiaki_sim_net_backend(sim);
+
+	// INIT ->
+	uint8_t buf[1500];
+	size_t received = console_recv(sim, console, buf, sizeof(buf), takion_addr);
+	munit_assert_size(received, ==, 1 + 0x10 + 0x10);
+	munit_assert_uint8(buf[0], ==, 0);
+	munit_assert_uint8(buf[1 + 0xc], ==, 1);
+	uint32_t tag = ntohl(*((chiaki_unaligned_uint32_t *)(buf + 1 + 0x10)));
+
+	// INIT_ACK <-
+	uint8_t init_ack[1 + 0x10 + 0x10 + 0x20] = { 0 };
+	console_write_message_header(init_ack + 1, tag, 2, 0, 0x10 + 0x20);
+	uint8_t *pl = init_ack + 1 + 0x10;
+	*((chiaki_unaligned_uint32_t *)(pl + 0)) = htonl(console_tag);
+	*((chiaki_unaligned_uint32_t *)(pl + 4)) = htonl(0x19000);
+	*((chiaki_unaligned_uint16_t *)(pl + 8)) = htons(0x64);
+	*((chiaki_unaligned_uint16_t *)(pl + 0xa)) = htons(0x64);
+	*((chiaki_unaligned_uint32_t *)(pl + 0xc)) = htonl(console_tag);
+	munit_assert_int(net->sendto(net, console, init_ack, sizeof(init_ack), (struct sockaddr *)takion_addr, sizeof(*takion_addr)), ==, sizeof(init_ack));
+
+	// COOKIE ->
+	received = console_recv(sim, console, buf, sizeof(buf), takion_addr);
+	munit_assert_size(received, ==, 1 + 0x10 + 0x20);
+	munit_assert_uint8(buf[1 + 0xc], ==, 0xa);
+
+	// COOKIE_ACK <-
+	uint8_t cookie_ack[1 + 0x10] = { 0 };
+	console_write_message_header(cookie_ack + 1, tag, 0xb, 0, 0);
+	munit_assert_int(net->sendto(net, console, cookie_ack, sizeof(cookie_ack), (struct sockaddr *)takion_addr, sizeof(*takion_addr)), ==, sizeof(cookie_ack));
+
+	return tag;
+}
+
+static void console_send_av(ChiakiSimNet *sim, chiaki_socket_t console, struct sockaddr_in *takion_addr, uint16_t packet_index)
+{
+	ChiakiNetBackend *net = chiaki_sim_net_backend(sim);
+	uint8_t av[1 + CHIAKI_TAKION_V9_AV_HEADER_SIZE_VIDEO + 8] = { 0 };
+	av[0] = 2; // video
+	*((chiaki_unaligned_uint16_t *)(av + 1 + 0)) = htons(packet_index);
+	*((chiaki_unaligned_uint16_t *)(av + 1 + 2)) = htons(packet_index / 10);
+	uint32_t dword_2 = ((uint32_t)(packet_index % 10) << 0x15) | (9 << 0xa);
+	*((chiaki_unaligned_uint32_t *)(av + 1 + 4)) = htonl(dword_2);
+	munit_assert_int(net->sendto(net, console, av, sizeof(av), (struct sockaddr *)takion_addr, sizeof(*takion_addr)), ==, sizeof(av));
+}
+
+/**
+ * Connect a Takion with the given number of crypto workers to a console on sim, then send it data messages while
+ * reordering and AV packets while losing, reordering and duplicating them.
+ */
+static void takion_pipeline_run(size_t workers, TakionPipelineRecord *record)
+{
+	ChiakiSimNet sim;
+	ChiakiErrorCode err = chiaki_sim_net_init(&sim, 1337);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	ChiakiNetBackend *net = chiaki_sim_net_backend(&sim);
+
+	ChiakiTimerService service;
+	err = chiaki_timer_service_init_clock(&service, chiaki_sim_net_clock(&sim), get_test_log());
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	struct sockaddr_in console_addr;
+	sockaddr_local(&console_addr, 9296);
+	chiaki_socket_t console = net->socket(net, AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	munit_assert_int(net->bind(net, console, (struct sockaddr *)&console_addr, sizeof(console_addr)), ==, 0);
+
+	memset(record, 0, sizeof(*record));
+	chiaki_mutex_init(&record->mutex, false);
+	chiaki_cond_init(&record->cond);
+
+	ChiakiTakionConnectInfo info = { 0 };
+	info.log = get_test_log();
+	info.sa = (struct sockaddr *)&console_addr;
+	info.sa_len = sizeof(console_addr);
+	info.cb = takion_pipeline_cb;
+	info.cb_user = record;
+	info.enable_crypt = false;
+	info.protocol_version = 9;
+	info.timer_service = &service;
+	info.net_backend = net;
+	info.clock = chiaki_sim_net_clock(&sim);
+	info.pipeline_crypto_workers = workers;
+
+	ChiakiTakion takion;
+	err = chiaki_takion_connect(&takion, &info);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	struct sockaddr_in takion_addr;
+	const uint32_t console_tag = 0x1000;
+	uint32_t tag = console_handshake(&sim, console, console_tag, &takion_addr);
+
+	takion_pipeline_wait_connected(&sim, record);
+
+	// reliable data is only reordered, the reorder queue must put it back in sequence
+	ChiakiNetImpairParams impair;
+	chiaki_net_impair_params_default(&impair);
+	impair.reorder = 0.3;
+	impair.reorder_ms = 3;
+	err = chiaki_sim_net_set_impair(&sim, (struct sockaddr *)&takion_addr, sizeof(takion_addr), &impair);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	for(uint8_t i=0; i<PIPELINE_DATA_COUNT; i++)
+	{
+		uint8_t data[1 + 0x10 + 9 + 1] = { 0 };
+		console_write_message_header(data + 1, tag, 0, 1, 9 + 1);
+		*((chiaki_unaligned_uint32_t *)(data + 1 + 0x10)) = htonl(console_tag + i);
+		data[1 + 0x10 + 8] = CHIAKI_TAKION_MESSAGE_DATA_TYPE_PROTOBUF;
+		data[1 + 0x10 + 9] = i;
+		munit_assert_int(net->sendto(net, console, data, sizeof(data), (struct sockaddr *)&takion_addr, sizeof(takion_addr)), ==, sizeof(data));
+		chiaki_sim_net_run(&sim, chiaki_sim_net_now_us(&sim) + 1000);
+	}
+	chiaki_sim_net_run(&sim, chiaki_sim_net_now_us(&sim) + 10 * 1000);
+	takion_pipeline_wait(record, &record->data_count, PIPELINE_DATA_COUNT);
+
+	ChiakiNetImpairStats stats_data;
+	err = chiaki_sim_net_get_impair_stats(&sim, (struct sockaddr *)&takion_addr, sizeof(takion_addr), &stats_data);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_uint64(stats_data.packets_reordered, >, 0);
+
+	// AV packets are passed on exactly as they arrive, lost ones just never show up
+	impair.loss = 0.1;
+	impair.reorder = 0.2;
+	impair.reorder_ms = 5;
+	impair.duplicate = 0.05;
+	err = chiaki_sim_net_set_impair(&sim, (struct sockaddr *)&takion_addr, sizeof(takion_addr), &impair);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	for(uint16_t i=0; i<PIPELINE_AV_COUNT; i++)
+	{
+		console_send_av(&sim, console, &takion_addr, i);
+		chiaki_sim_net_run(&sim, chiaki_sim_net_now_us(&sim) + 1000);
+	}
+	chiaki_sim_net_run(&sim, chiaki_sim_net_now_us(&sim) + 10 * 1000);
+
+	ChiakiNetImpairStats stats;
+	err = chiaki_sim_net_get_impair_stats(&sim, (struct sockaddr *)&takion_addr, sizeof(takion_addr), &stats);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_uint64(stats.packets_in - stats_data.packets_in, ==, PIPELINE_AV_COUNT);
+	munit_assert_uint64(stats.packets_lost, >, stats_data.packets_lost);
+	munit_assert_uint64(stats.packets_reordered, >, stats_data.packets_reordered);
+	munit_assert_uint64(stats.packets_duplicated, >, stats_data.packets_duplicated);
+	size_t av_expected = (size_t)(stats.packets_out - stats_data.packets_out);
+	takion_pipeline_wait(record, &record->av_count, av_expected);
+
+	chiaki_takion_close(&takion);
+	net->close(net, console);
+	chiaki_timer_service_fini(&service);
+	chiaki_sim_net_fini(&sim);
+
+	munit_assert_size(record->data_count, ==, PIPELINE_DATA_COUNT);
+	for(size_t i=0; i<PIPELINE_DATA_COUNT; i++)
+		munit_assert_uint8(record->data[i], ==, i);
+	munit_assert_size(record->av_count, ==, av_expected);
+
+	chiaki_cond_fini(&record->cond);
+	chiaki_mutex_fini(&record->mutex);
+}
+
+static MunitResult test_takion_pipeline_order(const MunitParameter params[], void *user)
+{
+	static TakionPipelineRecord single, pipelined;
+	takion_pipeline_run(0, &single);
+	takion_pipeline_run(3, &pipelined);
+
+	// the impairment only depends on the seed, so both saw the same packets in the same order
+	munit_assert_size(pipelined.av_count, ==, single.av_count);
+	munit_assert_memory_equal(pipelined.av_count * sizeof(uint16_t), pipelined.av, single.av);
+
+	bool overtaken = false;
+	for(size_t i=1; i<pipelined.av_count; i++)
+	{
+		if(pipelined.av[i] < pipelined.av[i-1])
+			overtaken = true;
+	}
+	munit_assert_true(overtaken);
+	return MUNIT_OK;
+}
+
+static MunitResult test_takion_postponed_close(const MunitParameter params[], void *user)
+{
+	ChiakiSimNet sim;
+	ChiakiErrorCode err = chiaki_sim_net_init(&sim, 0);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	ChiakiNetBackend *net = chiaki_sim_net_backend(&sim);
+
+	ChiakiTimerService service;
+	err = chiaki_timer_service_init_clock(&service, chiaki_sim_net_clock(&sim), get_test_log());
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiMemAccount *mem = chiaki_mem_account_new(NULL);
+	munit_assert_not_null(mem);
+
+	struct sockaddr_in console_addr;
+	sockaddr_local(&console_addr, 9296);
+	chiaki_socket_t console = net->socket(net, AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	munit_assert_int(net->bind(net, console, (struct sockaddr *)&console_addr, sizeof(console_addr)), ==, 0);
+
+	TakionPipelineRecord record = { 0 };
+	chiaki_mutex_init(&record.mutex, false);
+	chiaki_cond_init(&record.cond);
+
+	// crypt is enabled, but no key is ever set, so all AV packets are held back
+	ChiakiTakionConnectInfo info = { 0 };
+	info.log = get_test_log();
+	info.mem = mem;
+	info.sa = (struct sockaddr *)&console_addr;
+	info.sa_len = sizeof(console_addr);
+	info.cb = takion_pipeline_cb;
+	info.cb_user = &record;
+	info.enable_crypt = true;
+	info.protocol_version = 9;
+	info.timer_service = &service;
+	info.net_backend = net;
+	info.clock = chiaki_sim_net_clock(&sim);
+
+	ChiakiTakion takion;
+	err = chiaki_takion_connect(&takion, &info);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	struct sockaddr_in takion_addr;
+	console_handshake(&sim, console, 0x1000, &takion_addr);
+	takion_pipeline_wait_connected(&sim, &record);
+
+	for(uint16_t i=0; i<3; i++)
+		console_send_av(&sim, console, &takion_addr, i);
+	ChiakiMemStats stats;
+	while(true)
+	{
+		chiaki_sim_net_run(&sim, chiaki_sim_net_now_us(&sim) + 1000);
+		chiaki_mem_account_get_stats(mem, &stats);
+		// the array of postponed packets and all three packets
+		if(stats.current[CHIAKI_MEM_TAG_POSTPONED] > 3 * (1 + CHIAKI_TAKION_V9_AV_HEADER_SIZE_VIDEO + 8))
+			break;
+	}
+
+	chiaki_takion_close(&takion);
+	chiaki_mem_account_get_stats(mem, &stats);
+	munit_assert_uint64(stats.current[CHIAKI_MEM_TAG_POSTPONED], ==, 0);
+	munit_assert_size(record.av_count, ==, 0);
+
+	net->close(net, console);
+	chiaki_cond_fini(&record.cond);
+	chiaki_mutex_fini(&record.mutex);
+	chiaki_mem_account_unref(mem);
+	chiaki_timer_service_fini(&service);
+	chiaki_sim_net_fini(&sim);
+	return MUNIT_OK;
+}
+
+MunitTest tests_sim_net[] = {
+	{
+		"/timer_virtual_time",
+		test_timer_virtual_time,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/udp_delay",
+		test_udp_delay,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/takion_handshake_timeout",
+		test_takion_handshake_timeout,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/takion_pipeline_order",
+		test_takion_pipeline_order,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/takion_postponed_close",
+		test_takion_postponed_close,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
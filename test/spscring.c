@@ -0,0 +1,117 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/spscring.h>
+
+#define ITEMS_COUNT 200000
+
+static MunitResult test_try(const MunitParameter params[], void *user)
+{
+	ChiakiSpscRing ring;
+	ChiakiErrorCode err = chiaki_spsc_ring_init(&ring, 3);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	// rounded up to 4
+	for(uintptr_t i=1; i<=4; i++)
+		munit_assert_true(chiaki_spsc_ring_try_push(&ring, (void *)i));
+	munit_assert_false(chiaki_spsc_ring_try_push(&ring, (void *)5));
+
+	void *item;
+	munit_assert_true(chiaki_spsc_ring_try_pop(&ring, &item));
+	munit_assert_ptr_equal(item, (void *)1);
+	munit_assert_true(chiaki_spsc_ring_try_push(&ring, (void *)5));
+
+	chiaki_spsc_ring_close(&ring);
+	munit_assert_int(chiaki_spsc_ring_push(&ring, (void *)6), ==, CHIAKI_ERR_CANCELED);
+
+	// everything pushed before closing is still delivered, in order
+	for(uintptr_t i=2; i<=5; i++)
+	{
+		err = chiaki_spsc_ring_pop(&ring, &item);
+		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+		munit_assert_ptr_equal(item, (void *)i);
+	}
+	munit_assert_int(chiaki_spsc_ring_pop(&ring, &item), ==, CHIAKI_ERR_CANCELED);
+
+	munit_assert_uint64(ring.stats.pushed, ==, 5);
+	munit_assert_uint32(ring.stats.fill_max, ==, 4);
+
+	chiaki_spsc_ring_fini(&ring);
+	return MUNIT_OK;
+}
+
+static void *producer_thread_func(void *user)
+{
+	ChiakiSpscRing *ring = user;
+	for(uintptr_t i=1; i<=ITEMS_COUNT; i++)
+	{
+		if(chiaki_spsc_ring_push(ring, (void *)i) != CHIAKI_ERR_SUCCESS)
+			break;
+	}
+	chiaki_spsc_ring_close(ring);
+	return NULL;
+}
+
+static MunitResult test_threads(const MunitParameter params[], void *user)
+{
+	ChiakiSpscRing ring;
+	// small, so both sides have to wait for each other a lot
+	ChiakiErrorCode err = chiaki_spsc_ring_init(&ring, 8);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiThread producer;
+	err = chiaki_thread_create(&producer, producer_thread_func, &ring);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	uintptr_t expected = 1;
+	void *item;
+	while(chiaki_spsc_ring_pop(&ring, &item) == CHIAKI_ERR_SUCCESS)
+	{
+		munit_assert_ptr_equal(item, (void *)expected);
+		expected++;
+	}
+	munit_assert_uint64(expected, ==, ITEMS_COUNT + 1);
+
+	chiaki_thread_join(&producer, NULL);
+	munit_assert_uint64(ring.stats.pushed, ==, ITEMS_COUNT);
+	munit_assert_uint32(ring.stats.fill_max, <=, 8);
+
+	chiaki_spsc_ring_fini(&ring);
+	return MUNIT_OK;
+}
+
+MunitTest tests_spsc_ring[] = {
+	{
+		"/try",
+		test_try,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/threads",
+		test_threads,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,109 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/stoppipe.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+
+static MunitResult test_select_multi(const MunitParameter params[], void *test_user)
+{
+	int fds[2][2];
+	for(size_t i=0; i<2; i++)
+	{
+		int r = socketpair(AF_UNIX, SOCK_DGRAM, 0, fds[i]);
+		munit_assert_int(r, ==, 0);
+	}
+
+	ChiakiStopPipe stop_pipe;
+	ChiakiErrorCode err = chiaki_stop_pipe_init(&stop_pipe);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	ChiakiStopPipeSelectFd select_fds[3];
+	select_fds[0].fd = fds[0][0];
+	select_fds[0].write = false;
+	select_fds[1].fd = fds[1][0];
+	select_fds[1].write = false;
+	select_fds[2].fd = fds[0][1];
+	select_fds[2].write = true;
+
+	// nothing readable yet
+	err = chiaki_stop_pipe_select(&stop_pipe, select_fds, 2, 10);
+	munit_assert_int(err, ==, CHIAKI_ERR_TIMEOUT);
+	munit_assert_false(select_fds[0].ready);
+	munit_assert_false(select_fds[1].ready);
+
+	send(fds[1][1], "x", 1, 0);
+	err = chiaki_stop_pipe_select(&stop_pipe, select_fds, 3, UINT64_MAX);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	munit_assert_false(select_fds[0].ready);
+	munit_assert_true(select_fds[1].ready);
+	munit_assert_true(select_fds[2].ready);
+
+	// stop takes precedence over ready fds and stays until reset
+	chiaki_stop_pipe_stop(&stop_pipe);
+	chiaki_stop_pipe_stop(&stop_pipe);
+	for(size_t i=0; i<2; i++)
+	{
+		err = chiaki_stop_pipe_select(&stop_pipe, select_fds, 2, UINT64_MAX);
+		munit_assert_int(err, ==, CHIAKI_ERR_CANCELED);
+	}
+
+	err = chiaki_stop_pipe_reset(&stop_pipe);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	err = chiaki_stop_pipe_sleep(&stop_pipe, 10);
+	munit_assert_int(err, ==, CHIAKI_ERR_TIMEOUT);
+
+	err = chiaki_stop_pipe_select_single(&stop_pipe, fds[1][0], false, UINT64_MAX);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	chiaki_stop_pipe_fini(&stop_pipe);
+	for(size_t i=0; i<2; i++)
+	{
+		close(fds[i][0]);
+		close(fds[i][1]);
+	}
+
+	return MUNIT_OK;
+}
+
+#else
+
+static MunitResult test_select_multi(const MunitParameter params[], void *test_user)
+{
+	return MUNIT_SKIP;
+}
+
+#endif
+
+MunitTest tests_stop_pipe[] = {
+	{
+		"/select_multi",
+		test_select_multi,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
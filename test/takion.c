@@ -139,8 +139,11 @@ static void seqnums_ack(ChiakiSeqNum32 *nums, size_t *nums_count, ChiakiSeqNum32
 static MunitResult test_takion_send_buffer(const MunitParameter params[], void *user)
 {
 #define nums_count 0x30
+	ChiakiMemStats mem_stats_before;
+	chiaki_mem_account_get_stats(NULL, &mem_stats_before);
+
 	ChiakiTakionSendBuffer send_buffer;
-	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, nums_count);
+	ChiakiErrorCode err = chiaki_takion_send_buffer_init(&send_buffer, NULL, NULL, nums_count);
 	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
 	send_buffer.log = get_test_log();
 
@@ -149,11 +152,11 @@ static MunitResult test_takion_send_buffer(const MunitParameter params[], void *
 
 	for(size_t i=0; i<nums_count; i++)
 	{
-		err = chiaki_takion_send_buffer_push(&send_buffer, nums_expected[i], malloc(8), 8);
+		err = chiaki_takion_send_buffer_push(&send_buffer, nums_expected[i], chiaki_mem_alloc(NULL, CHIAKI_MEM_TAG_SEND_BUFFER, 8), 8);
 		munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
 	}
 
-	err = chiaki_takion_send_buffer_push(&send_buffer, nums_expected[nums_count], malloc(8), 8);
+	err = chiaki_takion_send_buffer_push(&send_buffer, nums_expected[nums_count], chiaki_mem_alloc(NULL, CHIAKI_MEM_TAG_SEND_BUFFER, 8), 8);
 	munit_assert_int(err, ==, CHIAKI_ERR_OVERFLOW);
 
 	size_t nums_count_cur = nums_count;
@@ -168,6 +171,11 @@ static MunitResult test_takion_send_buffer(const MunitParameter params[], void *
 	}
 
 	chiaki_takion_send_buffer_fini(&send_buffer);
+
+	// all packets, including the one that overflowed, and the slots are returned
+	ChiakiMemStats mem_stats;
+	chiaki_mem_account_get_stats(NULL, &mem_stats);
+	munit_assert_uint64(mem_stats.current[CHIAKI_MEM_TAG_SEND_BUFFER], ==, mem_stats_before.current[CHIAKI_MEM_TAG_SEND_BUFFER]);
 	return MUNIT_OK;
 #undef nums_count
 }
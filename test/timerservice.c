@@ -0,0 +1,201 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/timerservice.h>
+#include <chiaki/time.h>
+
+#include "test_log.h"
+
+#define TIMERS_COUNT 6
+#define PERIODIC_COUNT 5
+
+typedef struct timer_test_t
+{
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	ChiakiTimerService *service;
+	ChiakiTimer timers[TIMERS_COUNT];
+	uint64_t deadlines_us[TIMERS_COUNT];
+	uint64_t fired_us[TIMERS_COUNT];
+	size_t order[TIMERS_COUNT];
+	size_t fired_count;
+} TimerTest;
+
+typedef struct timer_test_fire_t
+{
+	TimerTest *test;
+	size_t index;
+} TimerTestFire;
+
+static void timer_test_cb(void *user)
+{
+	TimerTestFire *fire = user;
+	TimerTest *test = fire->test;
+	uint64_t now = chiaki_time_now_monotonic_us();
+	chiaki_mutex_lock(&test->mutex);
+	test->fired_us[fire->index] = now;
+	test->order[test->fired_count++] = fire->index;
+	chiaki_mutex_unlock(&test->mutex);
+	chiaki_cond_signal(&test->cond);
+}
+
+static bool timer_test_fired_all_but_one(void *user)
+{
+	TimerTest *test = user;
+	return test->fired_count >= TIMERS_COUNT - 1;
+}
+
+static MunitResult test_order(const MunitParameter params[], void *test_user)
+{
+	// covers level 0 as well as timers that have to be cascaded down from higher levels
+	static const uint64_t timeouts_us[TIMERS_COUNT] = { 50000, 5000, 20000, 300, 35000, 10000 };
+	static const size_t expected_order[TIMERS_COUNT - 1] = { 3, 1, 2, 4, 0 };
+	const size_t canceled = 5;
+
+	ChiakiTimerService service;
+	ChiakiErrorCode err = chiaki_timer_service_init(&service, get_test_log());
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	TimerTest test;
+	test.service = &service;
+	test.fired_count = 0;
+	chiaki_mutex_init(&test.mutex, false);
+	chiaki_cond_init(&test.cond);
+
+	TimerTestFire fires[TIMERS_COUNT];
+	uint64_t now = chiaki_time_now_monotonic_us();
+	for(size_t i=0; i<TIMERS_COUNT; i++)
+	{
+		fires[i].test = &test;
+		fires[i].index = i;
+		test.fired_us[i] = 0;
+		test.deadlines_us[i] = now + timeouts_us[i];
+		chiaki_timer_init(&test.timers[i], timer_test_cb, &fires[i]);
+		chiaki_timer_service_schedule(&service, &test.timers[i], test.deadlines_us[i]);
+	}
+	chiaki_timer_service_cancel(&service, &test.timers[canceled]);
+
+	chiaki_mutex_lock(&test.mutex);
+	err = chiaki_cond_timedwait_pred(&test.cond, &test.mutex, 5000, timer_test_fired_all_but_one, &test);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_mutex_unlock(&test.mutex);
+
+	for(size_t i=0; i<TIMERS_COUNT; i++)
+		chiaki_timer_service_cancel(&service, &test.timers[i]);
+
+	munit_assert_size(test.fired_count, ==, TIMERS_COUNT - 1);
+	munit_assert_memory_equal(sizeof(expected_order), test.order, expected_order);
+	munit_assert_uint64(test.fired_us[canceled], ==, 0);
+	for(size_t i=0; i<TIMERS_COUNT; i++)
+	{
+		if(i == canceled)
+			continue;
+		munit_assert_uint64(test.fired_us[i], >=, test.deadlines_us[i]);
+	}
+
+	ChiakiTimerServiceStats stats;
+	chiaki_timer_service_get_stats(&service, &stats);
+	munit_assert_uint64(stats.fired, ==, TIMERS_COUNT - 1);
+
+	chiaki_timer_service_fini(&service);
+	chiaki_cond_fini(&test.cond);
+	chiaki_mutex_fini(&test.mutex);
+
+	return MUNIT_OK;
+}
+
+typedef struct timer_test_periodic_t
+{
+	ChiakiMutex mutex;
+	ChiakiCond cond;
+	ChiakiTimerService *service;
+	ChiakiTimer timer;
+	unsigned int count;
+} TimerTestPeriodic;
+
+static void timer_test_periodic_cb(void *user)
+{
+	TimerTestPeriodic *periodic = user;
+	chiaki_mutex_lock(&periodic->mutex);
+	periodic->count++;
+	chiaki_mutex_unlock(&periodic->mutex);
+	chiaki_cond_signal(&periodic->cond);
+	chiaki_timer_service_schedule_ms(periodic->service, &periodic->timer, 2);
+}
+
+static bool timer_test_periodic_done(void *user)
+{
+	TimerTestPeriodic *periodic = user;
+	return periodic->count >= PERIODIC_COUNT;
+}
+
+static MunitResult test_periodic_cancel(const MunitParameter params[], void *test_user)
+{
+	ChiakiTimerService service;
+	ChiakiErrorCode err = chiaki_timer_service_init(&service, get_test_log());
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+
+	TimerTestPeriodic periodic;
+	periodic.service = &service;
+	periodic.count = 0;
+	chiaki_mutex_init(&periodic.mutex, false);
+	chiaki_cond_init(&periodic.cond);
+	chiaki_timer_init(&periodic.timer, timer_test_periodic_cb, &periodic);
+	chiaki_timer_service_schedule(&service, &periodic.timer, chiaki_time_now_monotonic_us());
+
+	chiaki_mutex_lock(&periodic.mutex);
+	err = chiaki_cond_timedwait_pred(&periodic.cond, &periodic.mutex, 5000, timer_test_periodic_done, &periodic);
+	munit_assert_int(err, ==, CHIAKI_ERR_SUCCESS);
+	chiaki_mutex_unlock(&periodic.mutex);
+
+	// the callback re-schedules itself, cancel must still stop it for good
+	chiaki_timer_service_cancel(&service, &periodic.timer);
+	chiaki_mutex_lock(&periodic.mutex);
+	unsigned int count = periodic.count;
+	err = chiaki_cond_timedwait(&periodic.cond, &periodic.mutex, 20);
+	munit_assert_int(err, ==, CHIAKI_ERR_TIMEOUT);
+	munit_assert_uint(periodic.count, ==, count);
+	chiaki_mutex_unlock(&periodic.mutex);
+
+	chiaki_timer_service_fini(&service);
+	chiaki_cond_fini(&periodic.cond);
+	chiaki_mutex_fini(&periodic.mutex);
+
+	return MUNIT_OK;
+}
+
+MunitTest tests_timer_service[] = {
+	{
+		"/order",
+		test_order,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/periodic_cancel",
+		test_periodic_cancel,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,106 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/videoframe.h>
+#include <chiaki/frameprocessor.h>
+
+#include <string.h>
+
+static MunitResult test_pool(const MunitParameter params[], void *user)
+{
+	ChiakiVideoFramePool *pool = chiaki_video_frame_pool_new(NULL, 1);
+	munit_assert_not_null(pool);
+
+	ChiakiVideoFrame *a = chiaki_video_frame_pool_acquire(pool, 100);
+	munit_assert_not_null(a);
+	munit_assert_uint32(a->refs, ==, 1);
+	munit_assert_size(a->buf_capacity, >=, 100);
+	for(size_t i=0; i<100 + CHIAKI_VIDEO_BUFFER_PADDING_SIZE; i++)
+		munit_assert_uint8(a->buf[i], ==, 0);
+	memset(a->buf, 0x42, 100);
+	a->buf_size = 100;
+	a->header = true;
+
+	ChiakiVideoFrame *b = chiaki_video_frame_pool_acquire(pool, 50);
+	munit_assert_not_null(b);
+	munit_assert_ptr_not_equal(a, b);
+
+	// a reference keeps the data valid
+	chiaki_video_frame_ref(a);
+	chiaki_video_frame_unref(a);
+	munit_assert_uint32(a->refs, ==, 1);
+	munit_assert_uint8(a->buf[99], ==, 0x42);
+
+	// returned frames are recycled and reset
+	chiaki_video_frame_unref(a);
+	munit_assert_size(pool->frames_free_count, ==, 1);
+	ChiakiVideoFrame *c = chiaki_video_frame_pool_acquire(pool, 80);
+	munit_assert_ptr_equal(c, a);
+	munit_assert_false(c->header);
+	munit_assert_size(c->buf_size, ==, 0);
+	for(size_t i=0; i<80 + CHIAKI_VIDEO_BUFFER_PADDING_SIZE; i++)
+		munit_assert_uint8(c->buf[i], ==, 0);
+
+	// no more than frames_free_max are kept
+	chiaki_video_frame_unref(b);
+	chiaki_video_frame_unref(c);
+	munit_assert_size(pool->frames_free_count, ==, 1);
+
+	chiaki_video_frame_pool_unref(pool);
+	return MUNIT_OK;
+}
+
+static MunitResult test_outlive_owner(const MunitParameter params[], void *user)
+{
+	ChiakiFrameProcessor fp;
+	chiaki_frame_processor_init(&fp, NULL, NULL);
+
+	ChiakiVideoFrame *frame = chiaki_frame_processor_acquire_frame(&fp, 1000);
+	munit_assert_not_null(frame);
+	memset(frame->buf, 0x13, 1000);
+	frame->buf_size = 1000;
+
+	// the frame and its pool must stay valid after the frame processor is gone
+	chiaki_frame_processor_fini(&fp);
+	munit_assert_uint8(frame->buf[999], ==, 0x13);
+	munit_assert_uint8(frame->buf[1000], ==, 0);
+	chiaki_video_frame_unref(frame);
+
+	return MUNIT_OK;
+}
+
+MunitTest tests_video_frame[] = {
+	{
+		"/pool",
+		test_pool,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{
+		"/outlive_owner",
+		test_outlive_owner,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};
@@ -0,0 +1,96 @@
+/*
+ * This file is part of Chiaki.
+ *
+ * Chiaki is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Chiaki is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Chiaki.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <munit.h>
+
+#include <chiaki/videoreceiver.h>
+
+#define FPS 50
+#define FRAME_US (1000000 / FPS)
+
+static MunitResult test_frame_timing(const MunitParameter params[], void *user)
+{
+	ChiakiVideoFrameTiming timing;
+	chiaki_video_frame_timing_init(&timing);
+
+	// the first frame has nothing to compare to yet
+	uint64_t t = 1000000;
+	chiaki_video_frame_timing_frame(&timing, 1, t, FPS);
+	chiaki_video_frame_timing_packet(&timing, t + 2000);
+	chiaki_video_frame_timing_packet(&timing, t + 1000); // reordered, doesn't shorten the spread
+	munit_assert_uint64(chiaki_video_frame_timing_spread_us(&timing), ==, 0);
+	munit_assert_uint64(chiaki_video_frame_timing_jitter_us(&timing), ==, 0);
+
+	// exactly on time, the spread of frame 1 is complete
+	t += FRAME_US;
+	chiaki_video_frame_timing_frame(&timing, 2, t, FPS);
+	munit_assert_uint64(timing.spread_x16_us, ==, 2000);
+	munit_assert_uint64(chiaki_video_frame_timing_spread_us(&timing), ==, 2000 / 16);
+	munit_assert_uint64(timing.jitter_x16_us, ==, 0);
+
+	// 1.6ms late, frame 2 was a single packet
+	t += FRAME_US + 1600;
+	chiaki_video_frame_timing_frame(&timing, 3, t, FPS);
+	munit_assert_uint64(timing.spread_x16_us, ==, 2000 - 2000 / 16);
+	munit_assert_uint64(timing.jitter_x16_us, ==, 1600);
+	munit_assert_uint64(chiaki_video_frame_timing_jitter_us(&timing), ==, 100);
+
+	// frames 4 and 5 were lost, 6 comes 0.8ms early for three frame intervals
+	t += 3 * FRAME_US - 800;
+	chiaki_video_frame_timing_frame(&timing, 6, t, FPS);
+	munit_assert_uint64(timing.jitter_x16_us, ==, 1600 - 100 + 800);
+
+	// without a frame rate only the spread is measured
+	uint64_t jitter_x16_us = timing.jitter_x16_us;
+	chiaki_video_frame_timing_packet(&timing, t + 3200);
+	t += 5 * FRAME_US;
+	chiaki_video_frame_timing_frame(&timing, 7, t, 0);
+	munit_assert_uint64(timing.jitter_x16_us, ==, jitter_x16_us);
+	uint64_t spread_x16_us = 2000 - 2000 / 16;
+	spread_x16_us -= spread_x16_us / 16; // frame 3
+	spread_x16_us += 3200 - spread_x16_us / 16;
+	munit_assert_uint64(timing.spread_x16_us, ==, spread_x16_us);
+
+	// frame indices wrap around
+	chiaki_video_frame_timing_init(&timing);
+	t = 1000000;
+	chiaki_video_frame_timing_frame(&timing, 0xffff, t, FPS);
+	t += 2 * FRAME_US + 320;
+	chiaki_video_frame_timing_frame(&timing, 1, t, FPS);
+	munit_assert_uint64(timing.jitter_x16_us, ==, 320);
+
+	// packets without a timestamp are not measured
+	chiaki_video_frame_timing_init(&timing);
+	chiaki_video_frame_timing_frame(&timing, 1, 0, FPS);
+	chiaki_video_frame_timing_frame(&timing, 2, 1000000, FPS);
+	munit_assert_uint64(timing.jitter_x16_us, ==, 0);
+	munit_assert_uint64(timing.spread_x16_us, ==, 0);
+
+	return MUNIT_OK;
+}
+
+MunitTest tests_video_receiver[] = {
+	{
+		"/frame_timing",
+		test_frame_timing,
+		NULL,
+		NULL,
+		MUNIT_TEST_OPTION_NONE,
+		NULL
+	},
+	{ NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL }
+};